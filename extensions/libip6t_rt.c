@@ -47,14 +47,14 @@ static const struct xt_option_entry rt_opts[] = {
 static const char *
 addr_to_numeric(const struct in6_addr *addrp)
 {
-	static char buf[50+1];
+	static __thread char buf[50+1];
 	return inet_ntop(AF_INET6, addrp, buf, sizeof(buf));
 }
 
 static struct in6_addr *
 numeric_to_addr(const char *num)
 {
-	static struct in6_addr ap;
+	static __thread struct in6_addr ap;
 	int err;
 
 	if ((err=inet_pton(AF_INET6, num, &ap)) == 1)
@@ -132,7 +132,7 @@ static const char *hashmode2str(enum clusterip_hashmode mode)
 
 static const char *mac2str(const uint8_t mac[ETH_ALEN])
 {
-	static char buf[ETH_ALEN*3];
+	static __thread char buf[ETH_ALEN*3];
 	sprintf(buf, "%02X:%02X:%02X:%02X:%02X:%02X",
 		mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 	return buf;
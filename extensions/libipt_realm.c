@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #if defined(__GLIBC__) && __GLIBC__ == 2
 #include <net/ethernet.h>
 #else
@@ -31,14 +32,23 @@ static const struct xt_option_entry realm_opts[] = {
 /* array of realms from /etc/iproute2/rt_realms */
 static struct xtables_lmap *realms;
 
-static void realm_init(struct xt_entry_match *m)
+static pthread_once_t realms_once = PTHREAD_ONCE_INIT;
+
+static void realm_load(void)
 {
 	const char file[] = "/etc/iproute2/rt_realms";
+
 	realms = xtables_lmap_init(file);
 	if (realms == NULL && errno != ENOENT)
 		fprintf(stderr, "Warning: %s: %s\n", file, strerror(errno));
 }
 
+static void realm_init(struct xt_entry_match *m)
+{
+	/* called for every rule using the match, maybe by several threads */
+	pthread_once(&realms_once, realm_load);
+}
+
 static void realm_parse(struct xt_option_call *cb)
 {
 	struct ipt_realm_info *realminfo = cb->data;
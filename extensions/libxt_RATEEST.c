@@ -11,9 +11,9 @@
 #include <linux/netfilter/xt_RATEEST.h>
 
 /* hack to pass raw values to final_check */
-static struct xt_rateest_target_info *RATEEST_info;
-static unsigned int interval;
-static unsigned int ewma_log;
+static __thread struct xt_rateest_target_info *RATEEST_info;
+static __thread unsigned int interval;
+static __thread unsigned int ewma_log;
 
 static void
 RATEEST_help(void)
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <xtables.h>
 #include <linux/netfilter/xt_devgroup.h>
 
@@ -34,14 +35,23 @@ static const struct xt_option_entry devgroup_opts[] = {
 /* array of devgroups from /etc/iproute2/group_map */
 static struct xtables_lmap *devgroups;
 
-static void devgroup_init(struct xt_entry_match *match)
+static pthread_once_t devgroups_once = PTHREAD_ONCE_INIT;
+
+static void devgroup_load(void)
 {
 	const char file[] = "/etc/iproute2/group_map";
+
 	devgroups = xtables_lmap_init(file);
 	if (devgroups == NULL && errno != ENOENT)
 		fprintf(stderr, "Warning: %s: %s\n", file, strerror(errno));
 }
 
+static void devgroup_init(struct xt_entry_match *match)
+{
+	/* called for every rule using the match, maybe by several threads */
+	pthread_once(&devgroups_once, devgroup_load);
+}
+
 static void devgroup_parse(struct xt_option_call *cb)
 {
 	struct xt_devgroup_info *info = cb->data;
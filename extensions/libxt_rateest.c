@@ -9,7 +9,7 @@
 #include <linux/netfilter/xt_rateest.h>
 
 /* Ugly hack to pass info to final_check function. We should fix the API */
-static struct xt_rateest_match_info *rateest_info;
+static __thread struct xt_rateest_match_info *rateest_info;
 
 static void rateest_help(void)
 {
@@ -9,11 +9,18 @@
 /* Your shared library should call one of these. */
 extern int do_command6(int argc, char *argv[], char **table,
 		       struct ip6tc_handle **handle);
+/*
+ * If set, do_command6() asks it for the handle of the table the command
+ * turned out to be for, instead of using the one it was passed.
+ */
+extern __thread struct ip6tc_handle **(*ip6tables_table_handle)(const char *table);
 
 extern int for_each_chain6(int (*fn)(const ip6t_chainlabel, int, struct ip6tc_handle *), int verbose, int builtinstoo, struct ip6tc_handle *handle);
 extern int flush_entries6(const ip6t_chainlabel chain, int verbose, struct ip6tc_handle *handle);
 extern int delete_chain6(const ip6t_chainlabel chain, int verbose, struct ip6tc_handle *handle);
 void print_rule6(const struct ip6t_entry *e, struct ip6tc_handle *h, const char *chain, int counters);
+void json_rule6(const struct ip6t_entry *e, struct ip6tc_handle *h, unsigned int num);
+void json_chain6(const char *chain, unsigned int first, unsigned int last, struct ip6tc_handle *h);
 
 extern struct xtables_globals ip6tables_globals;
 
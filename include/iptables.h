@@ -9,6 +9,11 @@
 /* Your shared library should call one of these. */
 extern int do_command4(int argc, char *argv[], char **table,
 		      struct iptc_handle **handle);
+/*
+ * If set, do_command4() asks it for the handle of the table the command
+ * turned out to be for, instead of using the one it was passed.
+ */
+extern __thread struct iptc_handle **(*iptables_table_handle)(const char *table);
 extern int delete_chain4(const ipt_chainlabel chain, int verbose,
 			struct iptc_handle *handle);
 extern int flush_entries4(const ipt_chainlabel chain, int verbose, 
@@ -17,6 +22,10 @@ extern int for_each_chain4(int (*fn)(const ipt_chainlabel, int, struct iptc_hand
 		int verbose, int builtinstoo, struct iptc_handle *handle);
 extern void print_rule4(const struct ipt_entry *e,
 		struct iptc_handle *handle, const char *chain, int counters);
+extern void json_rule4(const struct ipt_entry *e,
+		struct iptc_handle *handle, unsigned int num);
+extern void json_chain4(const char *chain, unsigned int first,
+		unsigned int last, struct iptc_handle *handle);
 
 /* kernel revision handling */
 extern int kernel_version;
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
@@ -34,7 +35,6 @@
 typedef unsigned long ipq_id_t;
 
 #ifdef DEBUG_LIBIPQ
-#include <stdio.h>
 #define LDEBUG(x...) fprintf(stderr, ## x)
 #else
 #define LDEBUG(x...)
@@ -45,12 +45,37 @@ typedef unsigned long ipq_id_t;
 #define MSG_TRUNC 0x20
 #endif
 
+struct ipq_stats_priv;
+
 struct ipq_handle
 {
 	int fd;
 	u_int8_t blocking;
 	struct sockaddr_nl local;
 	struct sockaddr_nl peer;
+	struct ipq_stats_priv *stats;
+};
+
+/*
+ * Latency from receiving a packet to sending its verdict, in usec:
+ * latency[i] counts values 0-3 for i < 4, and beyond that each power of
+ * two is split into four buckets.
+ */
+#define IPQ_STATS_BUCKETS 128
+
+struct ipq_stats
+{
+	u_int64_t packets;
+	u_int64_t verdicts;
+	u_int64_t rx_bytes;
+	u_int64_t tx_bytes;
+	u_int64_t recv_calls;
+	u_int64_t send_calls;
+	u_int64_t recv_errors;
+	u_int64_t send_errors;
+	u_int64_t truncated;
+	u_int64_t timeouts;
+	u_int64_t latency[IPQ_STATS_BUCKETS];
 };
 
 struct ipq_handle *ipq_create_handle(u_int32_t flags, u_int32_t protocol);
@@ -60,6 +85,51 @@ int ipq_destroy_handle(struct ipq_handle *h);
 ssize_t ipq_read(const struct ipq_handle *h,
                 unsigned char *buf, size_t len, int timeout);
 
+struct ipq_batch;
+
+struct ipq_batch *ipq_batch_create(unsigned int count, size_t bufsize);
+
+void ipq_batch_destroy(struct ipq_batch *b);
+
+ssize_t ipq_read_batch(const struct ipq_handle *h, struct ipq_batch *b,
+                       int timeout);
+
+unsigned char *ipq_batch_next(struct ipq_batch *b);
+
+typedef int (*ipq_msg_fn)(const struct ipq_handle *h, unsigned char *buf,
+                          void *data);
+
+int ipq_drain(const struct ipq_handle *h, struct ipq_batch *b,
+              ipq_msg_fn fn, void *data);
+
+int ipq_get_fd(const struct ipq_handle *h);
+
+struct ipq_loop;
+
+struct ipq_loop *ipq_loop_create(size_t bufsize);
+
+void ipq_loop_destroy(struct ipq_loop *l);
+
+int ipq_loop_get_fd(const struct ipq_loop *l);
+
+int ipq_loop_add(struct ipq_loop *l, const struct ipq_handle *h,
+                 ipq_msg_fn fn, void *data);
+
+int ipq_loop_del(struct ipq_loop *l, const struct ipq_handle *h);
+
+int ipq_loop_run(struct ipq_loop *l, int timeout);
+
+struct ipq_pool;
+
+struct ipq_pool *ipq_pool_create(unsigned int count, size_t bufsize);
+
+void ipq_pool_destroy(struct ipq_pool *p);
+
+ssize_t ipq_read_pool(const struct ipq_handle *h, struct ipq_pool *p,
+                      unsigned char **bufs, unsigned int n, int timeout);
+
+void ipq_pool_release(struct ipq_pool *p, unsigned char *buf);
+
 int ipq_set_mode(const struct ipq_handle *h, u_int8_t mode, size_t len);
 
 ipq_packet_msg_t *ipq_get_packet(const unsigned char *buf);
@@ -74,6 +144,43 @@ int ipq_set_verdict(const struct ipq_handle *h,
                     size_t data_len,
                     unsigned char *buf);
 
+struct ipq_verdict_batch;
+
+struct ipq_verdict_batch *ipq_verdict_batch_create(const struct ipq_handle *h,
+                                                   unsigned int count,
+                                                   int usec);
+
+int ipq_verdict_batch_destroy(struct ipq_verdict_batch *vb);
+
+int ipq_verdict_batch_add(struct ipq_verdict_batch *vb,
+                          ipq_id_t id,
+                          unsigned int verdict,
+                          size_t data_len,
+                          unsigned char *buf);
+
+int ipq_verdict_batch_flush(struct ipq_verdict_batch *vb);
+
+struct ipq_dispatch;
+
+typedef unsigned int (*ipq_dispatch_fn)(ipq_packet_msg_t *m,
+                                        size_t *data_len, void *data);
+
+struct ipq_dispatch *ipq_dispatch_create(const struct ipq_handle *h,
+                                         unsigned int workers,
+                                         size_t bufsize,
+                                         ipq_dispatch_fn fn,
+                                         void *data);
+
+int ipq_dispatch_wait(struct ipq_dispatch *d);
+
+int ipq_dispatch_destroy(struct ipq_dispatch *d);
+
+int ipq_stats_enable(struct ipq_handle *h, FILE *dump, unsigned int interval);
+
+int ipq_get_stats(const struct ipq_handle *h, struct ipq_stats *st);
+
+void ipq_dump_stats(const struct ipq_handle *h, FILE *f);
+
 int ipq_ctl(const struct ipq_handle *h, int request, ...);
 
 char *ipq_errstr(void);
@@ -12,6 +12,7 @@
 #include <linux/netfilter_ipv6/ip6_tables.h>
 
 struct ip6tc_handle;
+struct ip6tc_snapshot;
 
 typedef char ip6t_chainlabel[32];
 
@@ -87,6 +88,31 @@ int ip6tc_delete_entry(const ip6t_chainlabel chain,
 		       unsigned char *matchmask,
 		       struct ip6tc_handle *handle);
 
+/* Batch versions of the above for `n' entries laid out one after another
+   at `e' (each e->next_offset bytes long), e.g. the expansion of -s/-d
+   address lists.  The chain, and the target while it stays the same, are
+   looked up only once.  Insertion and appending add all entries or none;
+   the first entry inserted ends up at position `rulenum'. */
+int ip6tc_insert_entries(const ip6t_chainlabel chain,
+		         const struct ip6t_entry *e,
+		         unsigned int n,
+		         unsigned int rulenum,
+		         struct ip6tc_handle *handle);
+int ip6tc_append_entries(const ip6t_chainlabel chain,
+		         const struct ip6t_entry *e,
+		         unsigned int n,
+		         struct ip6tc_handle *handle);
+int ip6tc_check_entries(const ip6t_chainlabel chain,
+		        const struct ip6t_entry *origfw,
+		        unsigned int n,
+		        unsigned char *matchmask,
+		        struct ip6tc_handle *handle);
+int ip6tc_delete_entries(const ip6t_chainlabel chain,
+		         const struct ip6t_entry *origfw,
+		         unsigned int n,
+		         unsigned char *matchmask,
+		         struct ip6tc_handle *handle);
+
 /* Delete the rule in position `rulenum' in `chain'. */
 int ip6tc_delete_num_entry(const ip6t_chainlabel chain,
 			   unsigned int rulenum,
@@ -148,6 +174,33 @@ int ip6tc_set_counter(const ip6t_chainlabel chain,
 /* Makes the actual changes. */
 int ip6tc_commit(struct ip6tc_handle *handle);
 
+/* Called for every rule by ip6tc_walk_counters(); rulenum is 0 for the
+   policy of a built-in chain.  Return non-zero to stop the walk. */
+typedef int (*ip6tc_counter_fn)(const char *chain, unsigned int rulenum,
+				const struct ip6t_counters *counters,
+				void *data);
+
+/* Read the counters of table `tablename' straight from the kernel,
+   without taking a full snapshot. */
+int ip6tc_walk_counters(const char *tablename, ip6tc_counter_fn fn,
+			void *data);
+
+/* Copy the table as it was read by ip6tc_init(), to be put back
+   later with ip6tc_restore_snapshot().  Returns NULL on error. */
+struct ip6tc_snapshot *ip6tc_snapshot(struct ip6tc_handle *const handle);
+
+/* Record in the snapshot what ip6tc_commit() of `handle' put into the
+   kernel. */
+void ip6tc_snapshot_committed(struct ip6tc_snapshot *const snap,
+			      struct ip6tc_handle *const handle);
+
+/* Replace the table in the kernel with the snapshot, unless it is no
+   longer the table the recorded commit left behind. */
+int ip6tc_restore_snapshot(struct ip6tc_snapshot *const snap);
+
+/* Cleanup after ip6tc_snapshot(). */
+void ip6tc_free_snapshot(struct ip6tc_snapshot *snap);
+
 /* Get raw socket. */
 int ip6tc_get_raw_socket(void);
 
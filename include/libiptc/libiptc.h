@@ -16,6 +16,7 @@ extern "C" {
 #endif
 
 struct iptc_handle;
+struct iptc_snapshot;
 
 typedef char ipt_chainlabel[32];
 
@@ -92,6 +93,31 @@ int iptc_delete_entry(const ipt_chainlabel chain,
 		      unsigned char *matchmask,
 		      struct iptc_handle *handle);
 
+/* Batch versions of the above for `n' entries laid out one after another
+   at `e' (each e->next_offset bytes long), e.g. the expansion of -s/-d
+   address lists.  The chain, and the target while it stays the same, are
+   looked up only once.  Insertion and appending add all entries or none;
+   the first entry inserted ends up at position `rulenum'. */
+int iptc_insert_entries(const ipt_chainlabel chain,
+		        const struct ipt_entry *e,
+		        unsigned int n,
+		        unsigned int rulenum,
+		        struct iptc_handle *handle);
+int iptc_append_entries(const ipt_chainlabel chain,
+		        const struct ipt_entry *e,
+		        unsigned int n,
+		        struct iptc_handle *handle);
+int iptc_check_entries(const ipt_chainlabel chain,
+		       const struct ipt_entry *origfw,
+		       unsigned int n,
+		       unsigned char *matchmask,
+		       struct iptc_handle *handle);
+int iptc_delete_entries(const ipt_chainlabel chain,
+		        const struct ipt_entry *origfw,
+		        unsigned int n,
+		        unsigned char *matchmask,
+		        struct iptc_handle *handle);
+
 /* Delete the rule in position `rulenum' in `chain'. */
 int iptc_delete_num_entry(const ipt_chainlabel chain,
 			  unsigned int rulenum,
@@ -154,6 +180,33 @@ int iptc_set_counter(const ipt_chainlabel chain,
 /* Makes the actual changes. */
 int iptc_commit(struct iptc_handle *handle);
 
+/* Called for every rule by iptc_walk_counters(); rulenum is 0 for the
+   policy of a built-in chain.  Return non-zero to stop the walk. */
+typedef int (*iptc_counter_fn)(const char *chain, unsigned int rulenum,
+			       const struct ipt_counters *counters,
+			       void *data);
+
+/* Read the counters of table `tablename' straight from the kernel,
+   without taking a full snapshot. */
+int iptc_walk_counters(const char *tablename, iptc_counter_fn fn,
+		       void *data);
+
+/* Copy the table as it was read by iptc_init(), to be put back
+   later with iptc_restore_snapshot().  Returns NULL on error. */
+struct iptc_snapshot *iptc_snapshot(struct iptc_handle *const handle);
+
+/* Record in the snapshot what iptc_commit() of `handle' put into the
+   kernel. */
+void iptc_snapshot_committed(struct iptc_snapshot *const snap,
+			     struct iptc_handle *const handle);
+
+/* Replace the table in the kernel with the snapshot, unless it is no
+   longer the table the recorded commit left behind. */
+int iptc_restore_snapshot(struct iptc_snapshot *const snap);
+
+/* Cleanup after iptc_snapshot(). */
+void iptc_free_snapshot(struct iptc_snapshot *snap);
+
 /* Get raw socket. */
 int iptc_get_raw_socket(void);
 
@@ -31,8 +31,8 @@
 #define IPPROTO_UDPLITE	136
 #endif
 
-#define XTABLES_VERSION "libxtables.so.6"
-#define XTABLES_VERSION_CODE 6
+#define XTABLES_VERSION "libxtables.so.7"
+#define XTABLES_VERSION_CODE 7
 
 struct in_addr;
 
@@ -188,13 +188,16 @@ struct xt_fcheck_call {
 };
 
 /**
- * A "linear"/linked-list based name<->id map, for files similar to
- * /etc/iproute2/.
+ * A linked-list based name<->id map, for files similar to /etc/iproute2/.
+ * The first entry also carries lookup tables, so that
+ * xtables_lmap_name2id and xtables_lmap_id2name need not walk the list;
+ * a list whose first @index is NULL is walked.
  */
 struct xtables_lmap {
 	char *name;
 	int id;
 	struct xtables_lmap *next;
+	struct xt_lmap_index *index;
 };
 
 /* Include file for additions: new matches and targets. */
@@ -374,13 +377,43 @@ struct xtables_globals
 
 #define XT_GETOPT_TABLEEND {.name = NULL, .has_arg = false}
 
+/**
+ * @params:	what xtables_set_params was given
+ * @af:		family-specific details (see xtables_set_nfproto)
+ * @matches:	matches registered in this context
+ * @targets:	targets registered in this context
+ * @priv:	bookkeeping private to libxtables
+ *
+ * Everything libxtables remembers between calls on behalf of one user.
+ * Each thread has a current context, which is the process-wide default
+ * one unless it chose another with xtables_context_use; xt_params,
+ * xtables_matches and xtables_targets refer to the current context.
+ * Extensions are loaded only once per process, but every context works
+ * on its own copies of them, so that threads with separate contexts can
+ * parse and print rules at the same time. That holds only as long as the
+ * extensions keep no state of their own outside the rule, or keep it per
+ * thread as RATEEST and rateest do between parse and final_check.
+ */
+struct xtables_context {
+	struct xtables_globals *params;
+	const struct xtables_afinfo *af;
+	struct xtables_match *matches;
+	struct xtables_target *targets;
+	struct xt_context_priv *priv;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern const char *xtables_modprobe_program;
-extern struct xtables_match *xtables_matches;
-extern struct xtables_target *xtables_targets;
+extern __thread struct xtables_context *xtables_ctx;
+#define xtables_matches (xtables_ctx->matches)
+#define xtables_targets (xtables_ctx->targets)
+
+extern struct xtables_context *xtables_context_new(void);
+extern void xtables_context_free(struct xtables_context *);
+extern struct xtables_context *xtables_context_use(struct xtables_context *);
 
 extern void xtables_init(void);
 extern void xtables_set_nfproto(uint8_t);
@@ -422,13 +455,14 @@ xtables_parse_interface(const char *arg, char *vianame, unsigned char *mask);
 
 int xtables_check_inverse(const char option[], int *invert,
 	int *my_optind, int argc, char **argv);
-extern struct xtables_globals *xt_params;
+#define xt_params (xtables_ctx->params)
 #define xtables_error (xt_params->exit_err)
 
 extern void xtables_param_act(unsigned int, const char *, ...);
 
 extern const char *xtables_ipaddr_to_numeric(const struct in_addr *);
 extern const char *xtables_ipaddr_to_anyname(const struct in_addr *);
+extern void xtables_ipaddr_prefetch(const struct in_addr *);
 extern const char *xtables_ipmask_to_numeric(const struct in_addr *);
 extern struct in_addr *xtables_numeric_to_ipaddr(const char *);
 extern struct in_addr *xtables_numeric_to_ipmask(const char *);
@@ -440,6 +474,7 @@ extern void xtables_ipparse_multiple(const char *, struct in_addr **,
 extern struct in6_addr *xtables_numeric_to_ip6addr(const char *);
 extern const char *xtables_ip6addr_to_numeric(const struct in6_addr *);
 extern const char *xtables_ip6addr_to_anyname(const struct in6_addr *);
+extern void xtables_ip6addr_prefetch(const struct in6_addr *);
 extern const char *xtables_ip6mask_to_numeric(const struct in6_addr *);
 extern void xtables_ip6parse_any(const char *, struct in6_addr **,
 	struct in6_addr *, unsigned int *);
@@ -498,6 +533,29 @@ extern const char *xtables_lmap_id2name(const struct xtables_lmap *, int);
 
 extern void _init(void);
 
+/**
+ * Extension linked into the program, initialised on first use.
+ * @name:	what the extension would be loaded by (lib*_<name>.so)
+ * @init:	its _init function
+ */
+struct xtables_bundle_entry {
+	const char *name;
+	void (*init)(void);
+};
+
+/* Generated by --enable-bundle builds, sorted by name */
+extern const struct xtables_bundle_entry xtables_bundle[];
+extern const struct xtables_bundle_entry xtables_bundle4[];
+extern const struct xtables_bundle_entry xtables_bundle6[];
+extern void xtables_set_bundle(const struct xtables_bundle_entry *,
+	const struct xtables_bundle_entry *);
+
+/* Library internals shared between xtables.c and xtoptions.c */
+extern struct option *xtables_opts_reserve(struct option *, struct option *,
+					   unsigned int, struct option **);
+extern bool xtables_parse_dotted_quad(const char *, struct in_addr *);
+extern bool xtables_parse_prefix(const char *, unsigned int *, unsigned int);
+
 #endif
 
 #ifdef __cplusplus
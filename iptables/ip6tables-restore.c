@@ -9,6 +9,7 @@
  */
 
 #include <getopt.h>
+#include <sys/time.h>
 #include <sys/errno.h>
 #include <stdbool.h>
 #include <string.h>
@@ -18,6 +19,7 @@
 #include "xtables.h"
 #include "libiptc/libip6tc.h"
 #include "ip6tables-multi.h"
+#include "xshared.h"
 
 #ifdef DEBUG
 #define DEBUGP(x, args...) fprintf(stderr, x, ## args)
@@ -76,6 +78,52 @@ static struct ip6tc_handle *create_handle(const char *tablename)
 	return handle;
 }
 
+/*
+ * Snapshots of the tables committed so far. Should iptables-restore fail
+ * afterwards, they are put back, so that a restore is all-or-nothing.
+ */
+static struct ip6tc_snapshot **committed;
+static unsigned int num_committed;
+static bool restore_done;
+
+static void save_committed(struct ip6tc_snapshot *snap)
+{
+	struct ip6tc_snapshot **tmp;
+
+	tmp = realloc(committed, (num_committed + 1) * sizeof(*committed));
+	if (tmp == NULL)
+		xtables_error(OTHER_PROBLEM, "realloc: %s\n", strerror(errno));
+	committed = tmp;
+	committed[num_committed++] = snap;
+}
+
+static void rollback_committed(void)
+{
+	struct timeval start, end;
+	unsigned int num = 0;
+
+	if (restore_done || num_committed == 0)
+		return;
+
+	gettimeofday(&start, NULL);
+	while (num_committed > 0) {
+		struct ip6tc_snapshot *snap = committed[--num_committed];
+
+		if (ip6tc_restore_snapshot(snap))
+			++num;
+		else
+			fprintf(stderr, "%s: rollback failed: %s\n",
+				ip6tables_globals.program_name, ip6tc_strerror(errno));
+		ip6tc_free_snapshot(snap);
+	}
+	gettimeofday(&end, NULL);
+
+	fprintf(stderr, "%s: rolled back %u table commit(s) in %lu ms\n",
+		ip6tables_globals.program_name, num,
+		(end.tv_sec - start.tv_sec) * 1000UL +
+		(end.tv_usec - start.tv_usec) / 1000L);
+}
+
 static int parse_counters(char *string, struct ip6t_counters *ctr)
 {
 	unsigned long long pcnt, bcnt;
@@ -120,6 +168,7 @@ int main(int argc, char *argv[])
 #endif
 {
 	struct ip6tc_handle *handle = NULL;
+	struct ip6tc_snapshot *snap = NULL;
 	char buffer[10240];
 	int c;
 	char curtable[IP6T_TABLE_MAXNAMELEN + 1];
@@ -139,6 +188,8 @@ int main(int argc, char *argv[])
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
 	init_extensions();
 	init_extensions6();
+#elif defined(XTABLES_BUNDLE)
+	xtables_set_bundle(xtables_bundle, xtables_bundle6);
 #endif
 
 	while ((c = getopt_long(argc, argv, "bcvthnM:", options, NULL)) != -1) {
@@ -182,10 +233,17 @@ int main(int argc, char *argv[])
 	}
 	else in = stdin;
 
+	atexit(rollback_committed);
+
 	/* Grab standard input. */
 	while (fgets(buffer, sizeof(buffer), in)) {
+		size_t len = strlen(buffer);
 		int ret = 0;
 
+		/* The last line may come without its newline */
+		if (len > 0 && buffer[len - 1] != '\n' &&
+		    len + 1 < sizeof(buffer))
+			strcpy(buffer + len, "\n");
 		line++;
 		if (buffer[0] == '\n')
 			continue;
@@ -197,8 +255,13 @@ int main(int argc, char *argv[])
 			if (!testing) {
 				DEBUGP("Calling commit\n");
 				ret = ip6tc_commit(handle);
+				ip6tc_snapshot_committed(snap, handle);
 				ip6tc_free(handle);
 				handle = NULL;
+				/* A failed commit may have replaced the
+				 * table already, so undo it as well. */
+				save_committed(snap);
+				snap = NULL;
 			} else {
 				DEBUGP("Not calling commit, testing\n");
 				ret = 1;
@@ -224,6 +287,16 @@ int main(int argc, char *argv[])
 				ip6tc_free(handle);
 
 			handle = create_handle(table);
+			if (!testing) {
+				if (snap != NULL)
+					ip6tc_free_snapshot(snap);
+				snap = ip6tc_snapshot(handle);
+				if (snap == NULL)
+					xtables_error(OTHER_PROBLEM,
+						"%s: cannot snapshot table "
+						"'%s': %s\n", ip6tables_globals.program_name,
+						table, ip6tc_strerror(errno));
+			}
 			if (noflush == 0) {
 				DEBUGP("Cleaning all chains of table '%s'\n",
 					table);
@@ -325,10 +398,8 @@ int main(int argc, char *argv[])
 			char *bcnt = NULL;
 			char *parsestart;
 
-			/* the parser */
-			char *curchar;
-			int quote_open, escaped;
-			size_t param_len;
+			char *words[ARRAY_SIZE(newargv)];
+			int nwords;
 
 			/* reset the newargv */
 			newargc = 0;
@@ -370,68 +441,22 @@ int main(int argc, char *argv[])
 				add_argv((char *) bcnt);
 			}
 
-			/* After fighting with strtok enough, here's now
-			 * a 'real' parser. According to Rusty I'm now no
-			 * longer a real hacker, but I can live with that */
-
-			quote_open = 0;
-			escaped = 0;
-			param_len = 0;
-
-			for (curchar = parsestart; *curchar; curchar++) {
-				char param_buffer[1024];
-
-				if (quote_open) {
-					if (escaped) {
-						param_buffer[param_len++] = *curchar;
-						escaped = 0;
-						continue;
-					} else if (*curchar == '\\') {
-						escaped = 1;
-						continue;
-					} else if (*curchar == '"') {
-						quote_open = 0;
-						*curchar = ' ';
-					} else {
-						param_buffer[param_len++] = *curchar;
-						continue;
-					}
-				} else {
-					if (*curchar == '"') {
-						quote_open = 1;
-						continue;
-					}
-				}
-
-				if (*curchar == ' '
-				    || *curchar == '\t'
-				    || * curchar == '\n') {
-					if (!param_len) {
-						/* two spaces? */
-						continue;
-					}
-
-					param_buffer[param_len] = '\0';
-
-					/* check if table name specified */
-					if (!strncmp(param_buffer, "-t", 2)
-                                            || !strncmp(param_buffer, "--table", 8)) {
-						xtables_error(PARAMETER_PROBLEM,
-						   "Line %u seems to have a "
-						   "-t table option.\n", line);
-						exit(1);
-					}
-
-					add_argv(param_buffer);
-					param_len = 0;
-				} else {
-					/* regular character, copy to buffer */
-					param_buffer[param_len++] = *curchar;
-
-					if (param_len >= sizeof(param_buffer))
-						xtables_error(PARAMETER_PROBLEM,
-						   "Parameter too long!");
+			nwords = split_words(parsestart, words,
+					     ARRAY_SIZE(words));
+			if (nwords < 0)
+				xtables_error(PARAMETER_PROBLEM,
+					   "Line %u has too many arguments.\n",
+					   line);
+			for (a = 0; a < nwords; a++) {
+				/* check if table name specified */
+				if (!strncmp(words[a], "-t", 2)
+				    || !strncmp(words[a], "--table", 8)) {
+					xtables_error(PARAMETER_PROBLEM,
+					   "Line %u seems to have a "
+					   "-t table option.\n", line);
+					exit(1);
 				}
+				add_argv(words[a]);
 			}
 
 			DEBUGP("calling do_command6(%u, argv, &%s, handle):\n",
@@ -462,5 +487,10 @@ int main(int argc, char *argv[])
 
 	if (in != NULL)
 		fclose(in);
+
+	restore_done = true;
+	while (num_committed > 0)
+		ip6tc_free_snapshot(committed[--num_committed]);
+	free(committed);
 	return 0;
 }
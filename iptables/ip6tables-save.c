@@ -5,7 +5,9 @@
  *          Harald Welte <laforge@gnumonks.org>
  * This code is distributed under the terms of GNU GPL v2
  */
+#include <fnmatch.h>
 #include <getopt.h>
+#include <limits.h>
 #include <sys/errno.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -13,16 +15,45 @@
 #include <string.h>
 #include <time.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <arpa/inet.h>
 #include "libiptc/libip6tc.h"
 #include "ip6tables.h"
 #include "ip6tables-multi.h"
+#include "xshared.h"
 
 #ifndef NO_SHARED_LIBS
 #include <dlfcn.h>
 #endif
 
-static int show_binary = 0, show_counters = 0;
+static int show_binary = 0, show_counters = 0, counters_only = 0;
+static int show_json = 0;
+static unsigned int jobs = 1;
+
+/* Output selection, see --chain, --rules and --changed-since */
+static const char *chain_pattern;
+static unsigned int rule_first = 1, rule_last = UINT_MAX;
+static FILE *snapshot_out;
+
+/*
+ * Per-chain counter totals, as written by --snapshot and read back by
+ * --changed-since. Kept sorted by table and chain for lookup.
+ */
+struct chain_sum {
+	char table[IP6T_TABLE_MAXNAMELEN+1];
+	ip6t_chainlabel chain;
+	uint64_t pcnt, bcnt;
+};
+
+static struct chain_sum *snapshot;
+static unsigned int snapshot_num;
+
+/*
+ * Rules are emitted piecewise, so give stdout a buffer large enough that
+ * big rulesets go out in a few large write()s rather than many small ones.
+ */
+static char save_outbuf[1 << 16];
 
 static const struct option options[] = {
 	{.name = "binary",   .has_arg = false, .val = 'b'},
@@ -30,16 +61,151 @@ static const struct option options[] = {
 	{.name = "dump",     .has_arg = false, .val = 'd'},
 	{.name = "table",    .has_arg = true,  .val = 't'},
 	{.name = "modprobe", .has_arg = true,  .val = 'M'},
+	{.name = "chain",    .has_arg = true,  .val = 'C'},
+	{.name = "rules",    .has_arg = true,  .val = 'R'},
+	{.name = "changed-since", .has_arg = true, .val = 'S'},
+	{.name = "snapshot", .has_arg = true,  .val = 'W'},
+	{.name = "counters-only", .has_arg = false, .val = 'O'},
+	{.name = "json",     .has_arg = false, .val = 'J'},
+	{.name = "jobs",     .has_arg = true,  .val = 'j'},
 	{NULL},
 };
 
 
-/* Debugging prototype. */
-static int for_each_table(int (*func)(const char *tablename))
+static int chain_sum_cmp(const void *a, const void *b)
+{
+	const struct chain_sum *x = a, *y = b;
+	int ret = strcmp(x->table, y->table);
+
+	return ret != 0 ? ret : strcmp(x->chain, y->chain);
+}
+
+static void load_snapshot(const char *file)
+{
+	struct chain_sum *sum;
+	unsigned long long pcnt, bcnt;
+	char buf[256];
+	unsigned int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(file, "re");
+	if (fp == NULL)
+		xtables_error(OTHER_PROBLEM, "Cannot open %s: %s\n",
+			   file, strerror(errno));
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		++lineno;
+		sum = realloc(snapshot, (snapshot_num + 1) * sizeof(*sum));
+		if (sum == NULL)
+			xtables_error(OTHER_PROBLEM, "realloc: %s\n",
+				   strerror(errno));
+		snapshot = sum;
+		sum = &snapshot[snapshot_num];
+		if (sscanf(buf, "%31s %31s %llu %llu", sum->table, sum->chain,
+			   &pcnt, &bcnt) != 4)
+			xtables_error(OTHER_PROBLEM,
+				   "%s: line %u: malformed snapshot entry\n",
+				   file, lineno);
+		sum->pcnt = pcnt;
+		sum->bcnt = bcnt;
+		++snapshot_num;
+	}
+	fclose(fp);
+	qsort(snapshot, snapshot_num, sizeof(*snapshot), chain_sum_cmp);
+}
+
+static void parse_rule_range(const char *arg)
+{
+	char *end;
+
+	if (!xtables_strtoui(arg, &end, &rule_first, 1, UINT_MAX))
+		goto bad;
+	rule_last = rule_first;
+	if (*end == ':') {
+		rule_last = UINT_MAX;
+		if (end[1] != '\0' &&
+		    !xtables_strtoui(end + 1, NULL, &rule_last,
+				     rule_first, UINT_MAX))
+			goto bad;
+	} else if (*end != '\0') {
+		goto bad;
+	}
+	return;
+ bad:
+	xtables_error(PARAMETER_PROBLEM, "Invalid rule range `%s'\n", arg);
+}
+
+/*
+ * Decide whether @chain is part of the output. Counter totals are only
+ * gathered when a snapshot is read or written.
+ */
+static bool chain_wanted(const char *tablename, const char *chain,
+			 struct ip6tc_handle *h)
+{
+	struct chain_sum key, *old;
+	const struct ip6t_entry *e;
+	struct ip6t_counters count;
+
+	if (chain_pattern != NULL && fnmatch(chain_pattern, chain, 0) != 0)
+		return false;
+	if (snapshot == NULL && snapshot_out == NULL)
+		return true;
+
+	strcpy(key.table, tablename);
+	strcpy(key.chain, chain);
+	key.pcnt = key.bcnt = 0;
+	if (ip6tc_get_policy(chain, &count, h) != NULL) {
+		key.pcnt = count.pcnt;
+		key.bcnt = count.bcnt;
+	}
+	for (e = ip6tc_first_rule(chain, h); e; e = ip6tc_next_rule(e, h)) {
+		key.pcnt += e->counters.pcnt;
+		key.bcnt += e->counters.bcnt;
+	}
+
+	if (snapshot_out != NULL)
+		fprintf(snapshot_out, "%s %s %llu %llu\n", tablename, chain,
+			(unsigned long long)key.pcnt,
+			(unsigned long long)key.bcnt);
+	if (snapshot == NULL)
+		return true;
+
+	old = bsearch(&key, snapshot, snapshot_num, sizeof(*snapshot),
+		      chain_sum_cmp);
+	return old == NULL || old->pcnt != key.pcnt || old->bcnt != key.bcnt;
+}
+
+/*
+ * Tables are independent of each other, so pull all of them out of the
+ * kernel concurrently while the first one is being printed.
+ */
+struct table_dump {
+	char name[IP6T_TABLE_MAXNAMELEN+1];
+	struct ip6tc_handle *handle;
+	pthread_t thread;
+	bool fetching;
+};
+
+static void *fetch_table(void *arg)
+{
+	struct table_dump *t = arg;
+
+	t->handle = ip6tc_init(t->name);
+	return NULL;
+}
+
+static int dump_table(const char *tablename, struct ip6tc_handle *h);
+static int dump_counters(const char *tablename, struct ip6tc_handle *h);
+
+static int for_each_table(int (*func)(const char *tablename,
+				      struct ip6tc_handle *h),
+			  bool prefetch)
 {
 	int ret = 1;
 	FILE *procfile = NULL;
 	char tablename[IP6T_TABLE_MAXNAMELEN+1];
+	struct table_dump *tables = NULL, *t;
+	unsigned int i, num = 0;
 
 	procfile = fopen("/proc/net/ip6_tables_names", "re");
 	if (!procfile)
@@ -51,23 +217,173 @@ static int for_each_table(int (*func)(const char *tablename))
 				   "Badly formed tablename `%s'\n",
 				   tablename);
 		tablename[strlen(tablename) - 1] = '\0';
-		ret &= func(tablename);
-	}
 
+		t = realloc(tables, (num + 1) * sizeof(*tables));
+		if (t == NULL)
+			xtables_error(OTHER_PROBLEM, "realloc: %s\n",
+				   strerror(errno));
+		tables = t;
+		t = &tables[num++];
+		strcpy(t->name, tablename);
+		t->handle = NULL;
+		t->fetching = false;
+	}
 	fclose(procfile);
+
+	for (i = 0; prefetch && i < num; ++i) {
+		t = &tables[i];
+		/* Without a thread, dump_table() fetches it itself. */
+		t->fetching = pthread_create(&t->thread, NULL,
+					     fetch_table, t) == 0;
+	}
+
+	/*
+	 * --jobs forks while printing, which is only safe once no other
+	 * thread is running; the fetches still overlap with each other.
+	 */
+	for (i = 0; jobs > 1 && i < num; ++i) {
+		t = &tables[i];
+		if (t->fetching)
+			pthread_join(t->thread, NULL);
+		t->fetching = false;
+	}
+
+	/* Print in /proc order, so the output does not change. */
+	for (i = 0; i < num; ++i) {
+		t = &tables[i];
+		if (t->fetching)
+			pthread_join(t->thread, NULL);
+		ret &= func(t->name, t->handle);
+	}
+
+	free(tables);
 	return ret;
 }
 
-
 static int do_output(const char *tablename)
 {
-	struct ip6tc_handle *h;
-	const char *chain = NULL;
+	int ret;
+
+	if (counters_only)
+		return tablename ? dump_counters(tablename, NULL) :
+		       for_each_table(dump_counters, false);
 
+	if (show_json) {
+		json_begin('{');
+		json_key("tables");
+		json_begin('[');
+	}
 	if (!tablename)
-		return for_each_table(&do_output);
+		ret = for_each_table(dump_table, true);
+	else
+		ret = dump_table(tablename, NULL);
+	if (show_json) {
+		json_end(']');
+		json_end('}');
+	}
+	return ret;
+}
+
+/*
+ * Counters-only output: one "table,chain,rule,packets,bytes" line per
+ * rule, or with --binary, fixed-size records of table[32], chain[32],
+ * u32 rule, u64 packets, u64 bytes in host byte order. Rule 0 is the
+ * policy of a built-in chain. --chain and --rules select lines as they
+ * do rules; the policy is left out when --rules is given.
+ */
+static const char *counter_chain;
+static bool counter_chain_wanted;
+
+static int print_counter(const char *chain, unsigned int rulenum,
+			 const struct ip6t_counters *count, void *data)
+{
+	const char *tablename = data;
+
+	/* The walk passes the same pointer for every rule of a chain. */
+	if (chain != counter_chain) {
+		counter_chain = chain;
+		counter_chain_wanted = chain_pattern == NULL ||
+				       fnmatch(chain_pattern, chain, 0) == 0;
+	}
+	if (!counter_chain_wanted)
+		return 0;
+	if (rulenum == 0 ? rule_first != 1 || rule_last != UINT_MAX :
+	    rulenum < rule_first || rulenum > rule_last)
+		return 0;
+
+	if (show_binary) {
+		char name[IP6T_TABLE_MAXNAMELEN];
+		uint32_t num = rulenum;
+		uint64_t pcnt = count->pcnt, bcnt = count->bcnt;
+
+		memset(name, 0, sizeof(name));
+		strncpy(name, tablename, sizeof(name) - 1);
+		fwrite(name, sizeof(name), 1, stdout);
+		memset(name, 0, sizeof(name));
+		strncpy(name, chain, sizeof(name) - 1);
+		fwrite(name, sizeof(name), 1, stdout);
+		fwrite(&num, sizeof(num), 1, stdout);
+		fwrite(&pcnt, sizeof(pcnt), 1, stdout);
+		fwrite(&bcnt, sizeof(bcnt), 1, stdout);
+		return 0;
+	}
+
+	fputs(tablename, stdout);
+	putchar(',');
+	fputs(chain, stdout);
+	putchar(',');
+	save_u64(rulenum);
+	putchar(',');
+	save_u64(count->pcnt);
+	putchar(',');
+	save_u64(count->bcnt);
+	putchar('\n');
+	return 0;
+}
+
+static int dump_counters(const char *tablename, struct ip6tc_handle *h)
+{
+	counter_chain = NULL;
+	if (ip6tc_walk_counters(tablename, print_counter, (void *)tablename))
+		return 1;
+
+	xtables_load_ko(xtables_modprobe_program, false);
+	if (!ip6tc_walk_counters(tablename, print_counter, (void *)tablename))
+		xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
+			   ip6tc_strerror(errno));
+	return 1;
+}
+
+/* The chains of a table whose rules are printed, see save_parallel() */
+struct rule_range {
+	struct ip6tc_handle *h;
+	const char **chains;
+};
+
+static void dump_rules(unsigned int first, unsigned int last, void *data)
+{
+	const struct rule_range *r = data;
+	const struct ip6t_entry *e;
+	unsigned int i, rulenum;
+
+	for (i = first; i < last; ++i) {
+		e = ip6tc_first_rule(r->chains[i], r->h);
+		for (rulenum = 1; e && rulenum < rule_first; ++rulenum)
+			e = ip6tc_next_rule(e, r->h);
+		for (; e && rulenum <= rule_last; ++rulenum) {
+			print_rule6(e, r->h, r->chains[i], show_counters);
+			e = ip6tc_next_rule(e, r->h);
+		}
+	}
+}
 
-	h = ip6tc_init(tablename);
+static int dump_table(const char *tablename, struct ip6tc_handle *h)
+{
+	const char *chain = NULL;
+	unsigned int *weight = NULL, num = 0;
+
+	if (h == NULL)
+		h = ip6tc_init(tablename);
 	if (h == NULL) {
 		xtables_load_ko(xtables_modprobe_program, false);
 		h = ip6tc_init(tablename);
@@ -76,7 +392,21 @@ static int do_output(const char *tablename)
 		xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
 			   ip6tc_strerror(errno));
 
-	if (!show_binary) {
+	if (show_json) {
+		json_begin('{');
+		json_key("name");
+		json_str(tablename);
+		json_key("chains");
+		json_begin('[');
+		for (chain = ip6tc_first_chain(h);
+		     chain;
+		     chain = ip6tc_next_chain(h))
+			if (chain_wanted(tablename, chain, h))
+				json_chain6(chain, rule_first, rule_last, h);
+		json_end(']');
+		json_end('}');
+	} else if (!show_binary) {
+		struct rule_range r = {.h = h};
 		time_t now = time(NULL);
 
 		printf("# Generated by ip6tables-save v%s on %s",
@@ -88,32 +418,52 @@ static int do_output(const char *tablename)
 		for (chain = ip6tc_first_chain(h);
 		     chain;
 		     chain = ip6tc_next_chain(h)) {
+			struct ip6t_counters count;
+			const struct ip6t_entry *e;
+			const char *pol;
 
-			printf(":%s ", chain);
-			if (ip6tc_builtin(chain, h)) {
-				struct ip6t_counters count;
-				printf("%s ",
-				       ip6tc_get_policy(chain, &count, h));
-				printf("[%llu:%llu]\n", (unsigned long long)count.pcnt, (unsigned long long)count.bcnt);
-			} else {
-				printf("- [0:0]\n");
+			if (!chain_wanted(tablename, chain, h))
+				continue;
+			if ((num % 64) == 0) {
+				r.chains = realloc(r.chains, (num + 64) *
+						   sizeof(*r.chains));
+				if (jobs > 1)
+					weight = realloc(weight, (num + 64) *
+							 sizeof(*weight));
+				if (r.chains == NULL ||
+				    (jobs > 1 && weight == NULL))
+					xtables_error(OTHER_PROBLEM,
+						   "realloc: %s\n",
+						   strerror(errno));
 			}
-		}
-
-
-		for (chain = ip6tc_first_chain(h);
-		     chain;
-		     chain = ip6tc_next_chain(h)) {
-			const struct ip6t_entry *e;
+			r.chains[num] = chain;
+			/* Only --jobs needs the size of each chain */
+			if (weight != NULL) {
+				weight[num] = 0;
+				for (e = ip6tc_first_rule(chain, h); e;
+				     e = ip6tc_next_rule(e, h))
+					++weight[num];
+			}
+			++num;
 
-			/* Dump out rules */
-			e = ip6tc_first_rule(chain, h);
-			while(e) {
-				print_rule6(e, h, chain, show_counters);
-				e = ip6tc_next_rule(e, h);
+			pol = ip6tc_get_policy(chain, &count, h);
+			putchar(':');
+			fputs(chain, stdout);
+			if (pol != NULL) {
+				putchar(' ');
+				fputs(pol, stdout);
+				putchar(' ');
+				save_counters(count.pcnt, count.bcnt);
+				putchar('\n');
+			} else {
+				fputs(" - [0:0]\n", stdout);
 			}
 		}
 
+		save_parallel(jobs, num, weight, dump_rules, &r);
+		free(r.chains);
+		free(weight);
+
 		now = time(NULL);
 		printf("COMMIT\n");
 		printf("# Completed on %s", ctime(&now));
@@ -137,7 +487,7 @@ int ip6tables_save_main(int argc, char *argv[])
 int main(int argc, char *argv[])
 #endif
 {
-	const char *tablename = NULL;
+	const char *tablename = NULL, *snapshot_file = NULL;
 	int c;
 
 	ip6tables_globals.program_name = "ip6tables-save";
@@ -151,8 +501,12 @@ int main(int argc, char *argv[])
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
 	init_extensions();
 	init_extensions6();
+#elif defined(XTABLES_BUNDLE)
+	xtables_set_bundle(xtables_bundle, xtables_bundle6);
 #endif
 
+	setvbuf(stdout, save_outbuf, _IOFBF, sizeof(save_outbuf));
+
 	while ((c = getopt_long(argc, argv, "bcdt:", options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
@@ -170,6 +524,31 @@ int main(int argc, char *argv[])
 		case 'M':
 			xtables_modprobe_program = optarg;
 			break;
+		case 'C':
+			chain_pattern = optarg;
+			break;
+		case 'R':
+			parse_rule_range(optarg);
+			break;
+		case 'S':
+			load_snapshot(optarg);
+			break;
+		case 'W':
+			snapshot_file = optarg;
+			break;
+		case 'O':
+			counters_only = 1;
+			break;
+		case 'J':
+			json_init();
+			show_json = 1;
+			break;
+		case 'j':
+			if (!xtables_strtoui(optarg, NULL, &jobs, 1, 64))
+				xtables_error(PARAMETER_PROBLEM,
+					   "Invalid number of jobs `%s'\n",
+					   optarg);
+			break;
 		case 'd':
 			do_output(tablename);
 			exit(0);
@@ -180,6 +559,24 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Unknown arguments found on commandline\n");
 		exit(1);
 	}
+	if (show_json && counters_only)
+		xtables_error(PARAMETER_PROBLEM,
+			   "--json cannot be combined with --counters-only\n");
+	if (counters_only && (snapshot != NULL || snapshot_file != NULL))
+		xtables_error(PARAMETER_PROBLEM, "--changed-since and "
+			   "--snapshot cannot be combined with "
+			   "--counters-only\n");
+
+	/* Opened late, so that it can also be the --changed-since input */
+	if (snapshot_file != NULL) {
+		snapshot_out = fopen(snapshot_file, "we");
+		if (snapshot_out == NULL)
+			xtables_error(OTHER_PROBLEM, "Cannot open %s: %s\n",
+				   snapshot_file, strerror(errno));
+	}
 
-	return !do_output(tablename);
+	c = !do_output(tablename);
+	if (snapshot_out != NULL)
+		fclose(snapshot_out);
+	return c;
 }
@@ -126,6 +126,7 @@ static struct option original_opts[] = {
 	{.name = "goto",          .has_arg = 1, .val = 'g'},
 	{.name = "ipv4",          .has_arg = 0, .val = '4'},
 	{.name = "ipv6",          .has_arg = 0, .val = '6'},
+	{.name = "json",          .has_arg = 0, .val = 'J'},
 	{NULL},
 };
 
@@ -182,7 +183,7 @@ static const unsigned int inverse_for_options[NUMBER_OF_OPT] =
 /* -c */ 0,
 };
 
-#define opts ip6tables_globals.opts
+#define opts xt_params->opts
 #define prog_name ip6tables_globals.program_name
 #define prog_vers ip6tables_globals.program_version
 /* A few hardcoded protocols for 'all' and in case the user has no
@@ -211,15 +212,17 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "       %s -I chain [rulenum] rule-specification [options]\n"
 "       %s -R chain rulenum rule-specification [options]\n"
 "       %s -D chain rulenum [options]\n"
-"       %s -[LS] [chain [rulenum]] [options]\n"
+"       %s -[LS] [chain [rulenum[:[last]]]] [options]\n"
 "       %s -[FZ] [chain] [options]\n"
 "       %s -[NX] chain\n"
 "       %s -E old-chain-name new-chain-name\n"
 "       %s -P chain target [options]\n"
+"       %s --batch [file] (commands from file or stdin, one per line)\n"
 "       %s -h (print this help information)\n\n",
 	       prog_name, prog_vers, prog_name, prog_name,
 	       prog_name, prog_name, prog_name, prog_name,
-	       prog_name, prog_name, prog_name, prog_name);
+	       prog_name, prog_name, prog_name, prog_name,
+	       prog_name);
 
 	printf(
 "Commands:\n"
@@ -233,9 +236,9 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "				Insert in chain as rulenum (default 1=first)\n"
 "  --replace -R chain rulenum\n"
 "				Replace rule rulenum (1 = first) in chain\n"
-"  --list    -L [chain [rulenum]]\n"
+"  --list    -L [chain [rulenum[:[last]]]]\n"
 "				List the rules in a chain or all chains\n"
-"  --list-rules -S [chain [rulenum]]\n"
+"  --list-rules -S [chain [rulenum[:[last]]]]\n"
 "				Print the rules in a chain or all chains\n"
 "  --flush   -F [chain]		Delete all rules in  chain or all chains\n"
 "  --zero    -Z [chain [rulenum]]\n"
@@ -273,6 +276,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "  --table	-t table	table to manipulate (default: `filter')\n"
 "  --verbose	-v		verbose mode\n"
 "  --line-numbers		print line numbers when listing\n"
+"  --json			list (-L, -S) in JSON format\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 /*"[!] --fragment	-f		match second or further fragments only\n"*/
 "  --modprobe=<command>		try to insert modules using this command\n"
@@ -400,6 +404,31 @@ parse_rulenumber(const char *rule)
 	return rulenum;
 }
 
+/* FIRST[:[LAST]] for -L and -S; a plain number selects just that rule. */
+static unsigned int
+parse_rulerange(const char *rule, unsigned int *last)
+{
+	unsigned int rulenum;
+	char *end;
+	bool ok;
+
+	ok = xtables_strtoui(rule, &end, &rulenum, 1, INT_MAX);
+	*last = rulenum;
+	if (ok && *end == ':') {
+		*last = UINT_MAX;
+		if (end[1] != '\0')
+			ok = xtables_strtoui(end + 1, NULL, last,
+					     rulenum, UINT_MAX);
+	} else if (ok && *end != '\0') {
+		ok = false;
+	}
+	if (!ok)
+		xtables_error(PARAMETER_PROBLEM,
+			   "Invalid rule range `%s'", rule);
+
+	return rulenum;
+}
+
 static const char *
 parse_target(const char *targetname)
 {
@@ -445,26 +474,23 @@ set_option(unsigned int *options, unsigned int option, uint8_t *invflg,
 static void
 print_num(uint64_t number, unsigned int format)
 {
+	static const char suffix[] = "KMGT";
+	unsigned int i = 0;
+
 	if (format & FMT_KILOMEGAGIGA) {
 		if (number > 99999) {
 			number = (number + 500) / 1000;
-			if (number > 9999) {
+			while (number > 9999 && i < sizeof(suffix) - 2) {
 				number = (number + 500) / 1000;
-				if (number > 9999) {
-					number = (number + 500) / 1000;
-					if (number > 9999) {
-						number = (number + 500) / 1000;
-						printf(FMT("%4lluT ","%lluT "), (unsigned long long)number);
-					}
-					else printf(FMT("%4lluG ","%lluG "), (unsigned long long)number);
-				}
-				else printf(FMT("%4lluM ","%lluM "), (unsigned long long)number);
-			} else
-				printf(FMT("%4lluK ","%lluK "), (unsigned long long)number);
+				i++;
+			}
+			list_u64(number, FMT(4, 0));
+			fputc(suffix[i], stdout);
 		} else
-			printf(FMT("%5llu ","%llu "), (unsigned long long)number);
+			list_u64(number, FMT(5, 0));
 	} else
-		printf(FMT("%8llu ","%llu "), (unsigned long long)number);
+		list_u64(number, FMT(8, 0));
+	fputc(' ', stdout);
 }
 
 
@@ -549,6 +575,7 @@ print_firewall(const struct ip6t_entry *fw,
 {
 	const struct xtables_target *target = NULL;
 	const struct ip6t_entry_target *t;
+	const char *addr;
 	char buf[BUFSIZ];
 
 	if (!ip6tc_is_chain(targname, handle))
@@ -559,24 +586,30 @@ print_firewall(const struct ip6t_entry *fw,
 
 	t = ip6t_get_target((struct ip6t_entry *)fw);
 
-	if (format & FMT_LINENUMBERS)
-		printf(FMT("%-4u ", "%u "), num);
+	if (format & FMT_LINENUMBERS) {
+		list_u64(num, FMT(-4, 0));
+		fputc(' ', stdout);
+	}
 
 	if (!(format & FMT_NOCOUNTS)) {
 		print_num(fw->counters.pcnt, format);
 		print_num(fw->counters.bcnt, format);
 	}
 
-	if (!(format & FMT_NOTARGET))
-		printf(FMT("%-9s ", "%s "), targname);
+	if (!(format & FMT_NOTARGET)) {
+		list_field(targname, FMT(-9, 0));
+		fputc(' ', stdout);
+	}
 
 	fputc(fw->ipv6.invflags & IP6T_INV_PROTO ? '!' : ' ', stdout);
 	{
 		const char *pname = proto_to_name(fw->ipv6.proto, format&FMT_NUMERIC);
 		if (pname)
-			printf(FMT("%-5s", "%s "), pname);
+			list_field(pname, FMT(-5, 0));
 		else
-			printf(FMT("%-5hu", "%hu "), fw->ipv6.proto);
+			list_u64(fw->ipv6.proto, FMT(-5, 0));
+		if (format & FMT_NOTABLE)
+			fputc(' ', stdout);
 	}
 
 	if (format & FMT_OPTIONS) {
@@ -601,7 +634,9 @@ print_firewall(const struct ip6t_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT(" %-6s ","in %s "), iface);
+		fputs(FMT(" ", "in "), stdout);
+		list_field(iface, FMT(-6, 0));
+		fputc(' ', stdout);
 
 		if (fw->ipv6.invflags & IP6T_INV_VIA_OUT) {
 			iface[0] = '!';
@@ -614,34 +649,44 @@ print_firewall(const struct ip6t_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT("%-6s ","out %s "), iface);
+		if (format & FMT_NOTABLE)
+			fputs("out ", stdout);
+		list_field(iface, FMT(-6, 0));
+		fputc(' ', stdout);
 	}
 
 	fputc(fw->ipv6.invflags & IP6T_INV_SRCIP ? '!' : ' ', stdout);
 	if (!memcmp(&fw->ipv6.smsk, &in6addr_any, sizeof in6addr_any)
 	    && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","%s "), "anywhere");
+		addr = "anywhere";
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ip6addr_to_numeric(&fw->ipv6.src));
 		else
 			strcpy(buf, xtables_ip6addr_to_anyname(&fw->ipv6.src));
 		strcat(buf, xtables_ip6mask_to_numeric(&fw->ipv6.smsk));
-		printf(FMT("%-19s ","%s "), buf);
+		addr = buf;
 	}
+	list_field(addr, FMT(-19, 0));
+	fputc(' ', stdout);
 
 	fputc(fw->ipv6.invflags & IP6T_INV_DSTIP ? '!' : ' ', stdout);
 	if (!memcmp(&fw->ipv6.dmsk, &in6addr_any, sizeof in6addr_any)
 	    && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","-> %s"), "anywhere");
+		addr = "anywhere";
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ip6addr_to_numeric(&fw->ipv6.dst));
 		else
 			strcpy(buf, xtables_ip6addr_to_anyname(&fw->ipv6.dst));
 		strcat(buf, xtables_ip6mask_to_numeric(&fw->ipv6.dmsk));
-		printf(FMT("%-19s ","-> %s"), buf);
+		addr = buf;
 	}
+	if (format & FMT_NOTABLE)
+		fputs("-> ", stdout);
+	list_field(addr, FMT(-19, 0));
+	if (!(format & FMT_NOTABLE))
+		fputc(' ', stdout);
 
 	if (format & FMT_NOTABLE)
 		fputs("  ", stdout);
@@ -675,6 +720,41 @@ print_firewall_line(const struct ip6t_entry *fw,
 	print_firewall(fw, t->u.user.name, 0, FMT_PRINT_RULE, h);
 }
 
+/*
+ * Lay out one copy of @fw per source/destination pair, one after the other,
+ * for the batch calls of libiptc. The pairs are in the order in which they
+ * are to end up in the chain, i.e. reversed if each was to be inserted at
+ * the same position in turn.
+ */
+static struct ip6t_entry *
+expand_entries(const struct ip6t_entry *fw,
+	       unsigned int nsaddrs, const struct in6_addr saddrs[],
+	       const struct in6_addr smasks[],
+	       unsigned int ndaddrs, const struct in6_addr daddrs[],
+	       const struct in6_addr dmasks[],
+	       bool reverse, int verbose, struct ip6tc_handle *handle)
+{
+	unsigned int i, j, k, n = nsaddrs * ndaddrs;
+	struct ip6t_entry *entries, *e;
+
+	entries = xtables_malloc(n * fw->next_offset);
+	for (i = 0, k = 0; i < nsaddrs; i++) {
+		for (j = 0; j < ndaddrs; j++, k++) {
+			e = (void *)entries +
+			    (reverse ? n - 1 - k : k) * fw->next_offset;
+			memcpy(e, fw, fw->next_offset);
+			e->ipv6.src = saddrs[i];
+			e->ipv6.smsk = smasks[i];
+			e->ipv6.dst = daddrs[j];
+			e->ipv6.dmsk = dmasks[j];
+			if (verbose)
+				print_firewall_line(e, handle);
+		}
+	}
+
+	return entries;
+}
+
 static int
 append_entry(const ip6t_chainlabel chain,
 	     struct ip6t_entry *fw,
@@ -687,20 +767,15 @@ append_entry(const ip6t_chainlabel chain,
 	     int verbose,
 	     struct ip6tc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
+	struct ip6t_entry *entries;
+	int ret;
 
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ipv6.src = saddrs[i];
-		fw->ipv6.smsk = smasks[i];
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ipv6.dst = daddrs[j];
-			fw->ipv6.dmsk = dmasks[j];
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= ip6tc_append_entry(chain, fw, handle);
-		}
-	}
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, false,
+				 verbose, handle);
+	ret = ip6tc_append_entries(chain, entries,
+				  nsaddrs * ndaddrs, handle);
+	free(entries);
 
 	return ret;
 }
@@ -737,20 +812,15 @@ insert_entry(const ip6t_chainlabel chain,
 	     int verbose,
 	     struct ip6tc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
+	struct ip6t_entry *entries;
+	int ret;
 
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ipv6.src = saddrs[i];
-		fw->ipv6.smsk = smasks[i];
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ipv6.dst = daddrs[j];
-			fw->ipv6.dmsk = dmasks[j];
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= ip6tc_insert_entry(chain, fw, rulenum, handle);
-		}
-	}
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, true,
+				 verbose, handle);
+	ret = ip6tc_insert_entries(chain, entries,
+				  nsaddrs * ndaddrs, rulenum, handle);
+	free(entries);
 
 	return ret;
 }
@@ -803,22 +873,17 @@ delete_entry(const ip6t_chainlabel chain,
 	     struct xtables_rule_match *matches,
 	     const struct xtables_target *target)
 {
-	unsigned int i, j;
-	int ret = 1;
+	struct ip6t_entry *entries;
+	int ret;
 	unsigned char *mask;
 
 	mask = make_delete_mask(matches, target);
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ipv6.src = saddrs[i];
-		fw->ipv6.smsk = smasks[i];
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ipv6.dst = daddrs[j];
-			fw->ipv6.dmsk = dmasks[j];
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= ip6tc_delete_entry(chain, fw, mask, handle);
-		}
-	}
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, false,
+				 verbose, handle);
+	ret = ip6tc_delete_entries(chain, entries,
+				  nsaddrs * ndaddrs, mask, handle);
+	free(entries);
 	free(mask);
 
 	return ret;
@@ -833,22 +898,17 @@ check_entry(const ip6t_chainlabel chain, struct ip6t_entry *fw,
 	    struct xtables_rule_match *matches,
 	    const struct xtables_target *target)
 {
-	unsigned int i, j;
-	int ret = 1;
+	struct ip6t_entry *entries;
+	int ret;
 	unsigned char *mask;
 
 	mask = make_delete_mask(matches, target);
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ipv6.src = saddrs[i];
-		fw->ipv6.smsk = smasks[i];
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ipv6.dst = daddrs[j];
-			fw->ipv6.dmsk = dmasks[j];
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= ip6tc_check_entry(chain, fw, mask, handle);
-		}
-	}
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, false,
+				 verbose, handle);
+	ret = ip6tc_check_entries(chain, entries,
+				 nsaddrs * ndaddrs, mask, handle);
+	free(entries);
 
 	free(mask);
 	return ret;
@@ -926,14 +986,86 @@ delete_chain6(const ip6t_chainlabel chain, int verbose,
 	return ip6tc_delete_chain(chain, handle);
 }
 
+/* Get the names of all addresses to be listed resolving in parallel */
+static void
+prefetch_chain(const char *chain, unsigned int rulenum, unsigned int rulelast,
+	       struct ip6tc_handle *handle)
+{
+	const struct ip6t_entry *i;
+	unsigned int num = 0;
+
+	for (i = ip6tc_first_rule(chain, handle); i;
+	     i = ip6tc_next_rule(i, handle)) {
+		if (++num < rulenum)
+			continue;
+		if (num > rulelast)
+			break;
+		if (memcmp(&i->ipv6.smsk, &in6addr_any,
+		    sizeof(in6addr_any)) != 0)
+			xtables_ip6addr_prefetch(&i->ipv6.src);
+		if (memcmp(&i->ipv6.dmsk, &in6addr_any,
+		    sizeof(in6addr_any)) != 0)
+			xtables_ip6addr_prefetch(&i->ipv6.dst);
+	}
+}
+
+static void
+prefetch_names(const ip6t_chainlabel chain, unsigned int rulenum,
+	       unsigned int rulelast, struct ip6tc_handle *handle)
+{
+	const char *this;
+
+	if (chain) {
+		prefetch_chain(chain, rulenum, rulelast, handle);
+		return;
+	}
+
+	for (this = ip6tc_first_chain(handle);
+	     this;
+	     this = ip6tc_next_chain(handle))
+		prefetch_chain(this, rulenum, rulelast, handle);
+}
+
+static void
+list_chain(const char *chain, unsigned int rulenum, unsigned int rulelast,
+	   unsigned int format, struct ip6tc_handle *handle)
+{
+	const struct ip6t_entry *i;
+	unsigned int num = 0;
+
+	if (!rulenum)
+		print_header(format, chain, handle);
+
+	for (i = ip6tc_first_rule(chain, handle); i;
+	     i = ip6tc_next_rule(i, handle)) {
+		if (++num < rulenum)
+			continue;
+		if (num > rulelast)
+			break;
+		print_firewall(i, ip6tc_get_target(i, handle), num, format,
+			       handle);
+	}
+}
+
+/*
+ * List @chain, or all chains if it is NULL. A non-zero @rulenum restricts
+ * the output to rules @rulenum through @rulelast, without chain headers.
+ */
 static int
-list_entries(const ip6t_chainlabel chain, int rulenum, int verbose, int numeric,
-	     int expanded, int linenumbers, struct ip6tc_handle *handle)
+list_entries(const ip6t_chainlabel chain, unsigned int rulenum,
+	     unsigned int rulelast, int verbose, int numeric, int expanded,
+	     int linenumbers, struct ip6tc_handle *handle)
 {
 	int found = 0;
 	unsigned int format;
 	const char *this;
 
+	/* A named chain is looked up directly, not searched for. */
+	if (chain && !ip6tc_is_chain(chain, handle)) {
+		errno = ENOENT;
+		return 0;
+	}
+
 	format = FMT_OPTIONS;
 	if (!verbose)
 		format |= FMT_NOCOUNTS;
@@ -942,6 +1074,8 @@ list_entries(const ip6t_chainlabel chain, int rulenum, int verbose, int numeric,
 
 	if (numeric)
 		format |= FMT_NUMERIC;
+	else
+		prefetch_names(chain, rulenum, rulelast, handle);
 
 	if (!expanded)
 		format |= FMT_KILOMEGAGIGA;
@@ -949,32 +1083,16 @@ list_entries(const ip6t_chainlabel chain, int rulenum, int verbose, int numeric,
 	if (linenumbers)
 		format |= FMT_LINENUMBERS;
 
+	if (chain) {
+		list_chain(chain, rulenum, rulelast, format, handle);
+		return 1;
+	}
+
 	for (this = ip6tc_first_chain(handle);
 	     this;
 	     this = ip6tc_next_chain(handle)) {
-		const struct ip6t_entry *i;
-		unsigned int num;
-
-		if (chain && strcmp(chain, this) != 0)
-			continue;
-
 		if (found) printf("\n");
-
-		if (!rulenum)
-		    print_header(format, this, handle);
-		i = ip6tc_first_rule(this, handle);
-
-		num = 0;
-		while (i) {
-			num++;
-			if (!rulenum || num == rulenum)
-				print_firewall(i,
-					       ip6tc_get_target(i, handle),
-					       num,
-					       format,
-					       handle);
-			i = ip6tc_next_rule(i, handle);
-		}
+		list_chain(this, rulenum, rulelast, format, handle);
 		found = 1;
 	}
 
@@ -982,54 +1100,18 @@ list_entries(const ip6t_chainlabel chain, int rulenum, int verbose, int numeric,
 	return found;
 }
 
-/* This assumes that mask is contiguous, and byte-bounded. */
-static void
-print_iface(char letter, const char *iface, const unsigned char *mask,
-	    int invert)
-{
-	unsigned int i;
-
-	if (mask[0] == 0)
-		return;
-
-	printf("%s -%c ", invert ? " !" : "", letter);
-
-	for (i = 0; i < IFNAMSIZ; i++) {
-		if (mask[i] != 0) {
-			if (iface[i] != '\0')
-				printf("%c", iface[i]);
-		} else {
-			/* we can access iface[i-1] here, because
-			 * a few lines above we make sure that mask[0] != 0 */
-			if (iface[i-1] != '\0')
-				printf("+");
-			break;
-		}
-	}
-}
-
 /* The ip6tables looks up the /etc/protocols. */
 static void print_proto(uint16_t proto, int invert)
 {
 	if (proto) {
-		unsigned int i;
-		const char *invertstr = invert ? " !" : "";
-
-		const struct protoent *pent = getprotobynumber(proto);
-		if (pent) {
-			printf("%s -p %s",
-			       invertstr, pent->p_name);
-			return;
-		}
-
-		for (i = 0; xtables_chain_protos[i].name != NULL; ++i)
-			if (xtables_chain_protos[i].num == proto) {
-				printf("%s -p %s",
-				       invertstr, xtables_chain_protos[i].name);
-				return;
-			}
+		const char *pname = proto <= UINT8_MAX ?
+				    proto_to_name(proto, 0) : NULL;
 
-		printf("%s -p %u", invertstr, proto);
+		fputs(invert ? " ! -p " : " -p ", stdout);
+		if (pname != NULL)
+			fputs(pname, stdout);
+		else
+			save_u64(proto);
 	}
 }
 
@@ -1066,15 +1148,16 @@ static void print_ip(const char *prefix, const struct in6_addr *ip,
 	if (l == 0 && !invert)
 		return;
 
-	printf("%s %s %s",
-		invert ? " !" : "",
-		prefix,
-		inet_ntop(AF_INET6, ip, buf, sizeof buf));
+	fputs(invert ? " ! " : " ", stdout);
+	fputs(prefix, stdout);
+	putchar(' ');
+	fputs(inet_ntop(AF_INET6, ip, buf, sizeof buf), stdout);
 
+	putchar('/');
 	if (l == -1)
-		printf("/%s", inet_ntop(AF_INET6, mask, buf, sizeof buf));
+		fputs(inet_ntop(AF_INET6, mask, buf, sizeof buf), stdout);
 	else
-		printf("/%d", l);
+		save_u64(l);
 }
 
 /* We want this to be readable, so only print out neccessary fields.
@@ -1086,11 +1169,14 @@ void print_rule6(const struct ip6t_entry *e,
 	const char *target_name;
 
 	/* print counters for iptables-save */
-	if (counters > 0)
-		printf("[%llu:%llu] ", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters > 0) {
+		save_counters(e->counters.pcnt, e->counters.bcnt);
+		putchar(' ');
+	}
 
 	/* print chain name */
-	printf("-A %s", chain);
+	fputs("-A ", stdout);
+	fputs(chain, stdout);
 
 	/* Print IP part. */
 	print_ip("-s", &(e->ipv6.src), &(e->ipv6.smsk),
@@ -1099,10 +1185,10 @@ void print_rule6(const struct ip6t_entry *e,
 	print_ip("-d", &(e->ipv6.dst), &(e->ipv6.dmsk),
 			e->ipv6.invflags & IP6T_INV_DSTIP);
 
-	print_iface('i', e->ipv6.iniface, e->ipv6.iniface_mask,
+	save_iface('i', e->ipv6.iniface, e->ipv6.iniface_mask,
 		    e->ipv6.invflags & IP6T_INV_VIA_IN);
 
-	print_iface('o', e->ipv6.outiface, e->ipv6.outiface_mask,
+	save_iface('o', e->ipv6.outiface, e->ipv6.outiface_mask,
 		    e->ipv6.invflags & IP6T_INV_VIA_OUT);
 
 	print_proto(e->ipv6.proto, e->ipv6.invflags & IP6T_INV_PROTO);
@@ -1126,17 +1212,23 @@ void print_rule6(const struct ip6t_entry *e,
 	}
 
 	/* print counters for iptables -R */
-	if (counters < 0)
-		printf(" -c %llu %llu", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters < 0) {
+		fputs(" -c ", stdout);
+		save_u64(e->counters.pcnt);
+		putchar(' ');
+		save_u64(e->counters.bcnt);
+	}
 
 	/* Print target name */
 	target_name = ip6tc_get_target(e, h);
-	if (target_name && (*target_name != '\0'))
+	if (target_name && (*target_name != '\0')) {
 #ifdef IP6T_F_GOTO
-		printf(" -%c %s", e->ipv6.flags & IP6T_F_GOTO ? 'g' : 'j', target_name);
+		fputs(e->ipv6.flags & IP6T_F_GOTO ? " -g " : " -j ", stdout);
 #else
-		printf(" -j %s", target_name);
+		fputs(" -j ", stdout);
 #endif
+		fputs(target_name, stdout);
+	}
 
 	/* Print targinfo part */
 	t = ip6t_get_target((struct ip6t_entry *)e);
@@ -1165,12 +1257,220 @@ void print_rule6(const struct ip6t_entry *e,
 			}
 		}
 	}
-	printf("\n");
+	putchar('\n');
+}
+
+static void
+print_chain_decl(const char *chain, int counters, struct ip6tc_handle *handle)
+{
+	if (ip6tc_builtin(chain, handle)) {
+		struct ip6t_counters count;
+		printf("-P %s %s", chain, ip6tc_get_policy(chain, &count, handle));
+		if (counters)
+		    printf(" -c %llu %llu", (unsigned long long)count.pcnt, (unsigned long long)count.bcnt);
+		printf("\n");
+	} else {
+		printf("-N %s\n", chain);
+	}
+}
+
+static void
+list_chain_rules(const char *chain, unsigned int rulenum,
+		 unsigned int rulelast, int counters,
+		 struct ip6tc_handle *handle)
+{
+	const struct ip6t_entry *e;
+	unsigned int num = 0;
+
+	for (e = ip6tc_first_rule(chain, handle); e;
+	     e = ip6tc_next_rule(e, handle)) {
+		if (++num < rulenum)
+			continue;
+		if (num > rulelast)
+			break;
+		print_rule6(e, handle, chain, counters);
+	}
+}
+
+static void json_ip(const char *key, const struct in6_addr *ip,
+		    const struct in6_addr *mask, int invert)
+{
+	char buf[2 * INET6_ADDRSTRLEN];
+	int l = ipv6_prefix_length(mask);
+	size_t len;
+
+	if (l == 0 && !invert)
+		return;
+
+	inet_ntop(AF_INET6, ip, buf, INET6_ADDRSTRLEN);
+	len = strlen(buf);
+	buf[len++] = '/';
+	if (l == -1)
+		inet_ntop(AF_INET6, mask, buf + len, INET6_ADDRSTRLEN);
+	else
+		snprintf(buf + len, sizeof(buf) - len, "%d", l);
+	json_key(key);
+	json_str(buf);
+}
+
+static int json_match(const struct ip6t_entry_match *m,
+		      const struct ip6t_ip6 *ip)
+{
+	const struct xtables_match *match =
+		xtables_find_match(m->u.user.name, XTF_TRY_LOAD, NULL);
+
+	json_begin('{');
+	json_key("name");
+	json_str(m->u.user.name);
+	if (match && match->save) {
+		json_key("args");
+		json_args_begin();
+		match->save(ip, m);
+		json_args_end();
+	}
+	json_end('}');
+	return 0;
+}
+
+/*
+ * The JSON counterpart of print_rule6(). Options the kernel has not been
+ * given are left out, extension options are kept as the words that
+ * iptables-save would print for them.
+ */
+void json_rule6(const struct ip6t_entry *e, struct ip6tc_handle *h,
+		unsigned int num)
+{
+	static const struct {
+		uint8_t flag;
+		const char *name;
+	} inv[] = {
+		{IP6T_INV_SRCIP, "src"},
+		{IP6T_INV_DSTIP, "dst"},
+		{IP6T_INV_VIA_IN, "in"},
+		{IP6T_INV_VIA_OUT, "out"},
+		{IP6T_INV_PROTO, "proto"},
+		{IP6T_INV_TOS, "tos"},
+	};
+	const struct xtables_target *target;
+	const struct ip6t_entry_target *t;
+	const char *target_name;
+	unsigned int i;
+
+	json_begin('{');
+	json_key("num");
+	json_u64(num);
+	json_key("packets");
+	json_u64(e->counters.pcnt);
+	json_key("bytes");
+	json_u64(e->counters.bcnt);
+
+	json_ip("src", &e->ipv6.src, &e->ipv6.smsk,
+		e->ipv6.invflags & IP6T_INV_SRCIP);
+	json_ip("dst", &e->ipv6.dst, &e->ipv6.dmsk,
+		e->ipv6.invflags & IP6T_INV_DSTIP);
+	json_iface("in", e->ipv6.iniface, e->ipv6.iniface_mask);
+	json_iface("out", e->ipv6.outiface, e->ipv6.outiface_mask);
+
+	if (e->ipv6.proto) {
+		const char *pname = proto_to_name(e->ipv6.proto, 0);
+		char buf[6];
+
+		if (pname == NULL) {
+			snprintf(buf, sizeof(buf), "%u", e->ipv6.proto);
+			pname = buf;
+		}
+		json_key("proto");
+		json_str(pname);
+	}
+
+	if (e->ipv6.flags & IP6T_F_TOS) {
+		json_key("tos");
+		json_u64(e->ipv6.tos);
+	}
+
+	if (e->ipv6.invflags) {
+		json_key("invert");
+		json_begin('[');
+		for (i = 0; i < ARRAY_SIZE(inv); ++i)
+			if (e->ipv6.invflags & inv[i].flag)
+				json_str(inv[i].name);
+		json_end(']');
+	}
+
+	if (e->target_offset > sizeof(*e)) {
+		json_key("matches");
+		json_begin('[');
+		IP6T_MATCH_ITERATE(e, json_match, &e->ipv6);
+		json_end(']');
+	}
+
+	target_name = ip6tc_get_target(e, h);
+	if (target_name && *target_name != '\0') {
+		json_key("target");
+		json_begin('{');
+		json_key("name");
+		json_str(target_name);
+#ifdef IP6T_F_GOTO
+		if (e->ipv6.flags & IP6T_F_GOTO) {
+			json_key("goto");
+			json_bool(true);
+		}
+#endif
+		t = ip6t_get_target((struct ip6t_entry *)e);
+		target = t->u.user.name[0] == '\0' ? NULL :
+			 xtables_find_target(t->u.user.name, XTF_TRY_LOAD);
+		if (target && target->save) {
+			json_key("args");
+			json_args_begin();
+			target->save(&e->ipv6, t);
+			json_args_end();
+		}
+		json_end('}');
+	}
+	json_end('}');
+}
+
+/* A chain with rules @first through @last, counting from 1, as JSON. */
+void json_chain6(const char *chain, unsigned int first, unsigned int last,
+		 struct ip6tc_handle *h)
+{
+	const struct ip6t_entry *e;
+	struct ip6t_counters count;
+	unsigned int num = 0, refs;
+	const char *pol;
+
+	json_begin('{');
+	json_key("name");
+	json_str(chain);
+	pol = ip6tc_get_policy(chain, &count, h);
+	if (pol) {
+		json_key("policy");
+		json_str(pol);
+		json_key("packets");
+		json_u64(count.pcnt);
+		json_key("bytes");
+		json_u64(count.bcnt);
+	} else if (ip6tc_get_references(&refs, chain, h)) {
+		json_key("references");
+		json_u64(refs);
+	}
+
+	json_key("rules");
+	json_begin('[');
+	for (e = ip6tc_first_rule(chain, h); e; e = ip6tc_next_rule(e, h)) {
+		if (++num < first)
+			continue;
+		if (num > last)
+			break;
+		json_rule6(e, h, num);
+	}
+	json_end(']');
+	json_end('}');
 }
 
 static int
-list_rules(const ip6t_chainlabel chain, int rulenum, int counters,
-	     struct ip6tc_handle *handle)
+list_rules(const ip6t_chainlabel chain, unsigned int rulenum,
+	   unsigned int rulelast, int counters, struct ip6tc_handle *handle)
 {
 	const char *this = NULL;
 	int found = 0;
@@ -1178,42 +1478,28 @@ list_rules(const ip6t_chainlabel chain, int rulenum, int counters,
 	if (counters)
 	    counters = -1;		/* iptables -c format */
 
+	if (chain) {
+		if (!ip6tc_is_chain(chain, handle)) {
+			errno = ENOENT;
+			return 0;
+		}
+		if (!rulenum)
+			print_chain_decl(chain, counters, handle);
+		list_chain_rules(chain, rulenum, rulelast, counters, handle);
+		return 1;
+	}
+
 	/* Dump out chain names first,
 	 * thereby preventing dependency conflicts */
 	if (!rulenum) for (this = ip6tc_first_chain(handle);
 	     this;
-	     this = ip6tc_next_chain(handle)) {
-		if (chain && strcmp(this, chain) != 0)
-			continue;
-
-		if (ip6tc_builtin(this, handle)) {
-			struct ip6t_counters count;
-			printf("-P %s %s", this, ip6tc_get_policy(this, &count, handle));
-			if (counters)
-			    printf(" -c %llu %llu", (unsigned long long)count.pcnt, (unsigned long long)count.bcnt);
-			printf("\n");
-		} else {
-			printf("-N %s\n", this);
-		}
-	}
+	     this = ip6tc_next_chain(handle))
+		print_chain_decl(this, counters, handle);
 
 	for (this = ip6tc_first_chain(handle);
 	     this;
 	     this = ip6tc_next_chain(handle)) {
-		const struct ip6t_entry *e;
-		int num = 0;
-
-		if (chain && strcmp(this, chain) != 0)
-			continue;
-
-		/* Dump out rules */
-		e = ip6tc_first_rule(this, handle);
-		while(e) {
-			num++;
-			if (!rulenum || num == rulenum)
-			    print_rule6(e, handle, this, counters);
-			e = ip6tc_next_rule(e, handle);
-		}
+		list_chain_rules(this, rulenum, rulelast, counters, handle);
 		found = 1;
 	}
 
@@ -1221,6 +1507,41 @@ list_rules(const ip6t_chainlabel chain, int rulenum, int counters,
 	return found;
 }
 
+/* -L and -S with --json: one table, in the layout of ip6tables-save --json. */
+static int
+list_json(const char *table, const ip6t_chainlabel chain,
+	  unsigned int rulenum, unsigned int rulelast,
+	  struct ip6tc_handle *handle)
+{
+	const char *this;
+
+	if (chain && !ip6tc_is_chain(chain, handle)) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	json_begin('{');
+	json_key("tables");
+	json_begin('[');
+	json_begin('{');
+	json_key("name");
+	json_str(table);
+	json_key("chains");
+	json_begin('[');
+	if (chain)
+		json_chain6(chain, rulenum, rulelast, handle);
+	else
+		for (this = ip6tc_first_chain(handle);
+		     this;
+		     this = ip6tc_next_chain(handle))
+			json_chain6(this, rulenum, rulelast, handle);
+	json_end(']');
+	json_end('}');
+	json_end(']');
+	json_end('}');
+	return 1;
+}
+
 static struct ip6t_entry *
 generate_entry(const struct ip6t_entry *fw,
 	       struct xtables_rule_match *matches,
@@ -1291,11 +1612,11 @@ static void command_jump(struct iptables_command_state *cs)
 	if (cs->target->init != NULL)
 		cs->target->init(cs->target->t);
 	if (cs->target->x6_options != NULL)
-		opts = xtables_options_xfrm(ip6tables_globals.orig_opts, opts,
+		opts = xtables_options_xfrm(xt_params->orig_opts, opts,
 					    cs->target->x6_options,
 					    &cs->target->option_offset);
 	else
-		opts = xtables_merge_options(ip6tables_globals.orig_opts, opts,
+		opts = xtables_merge_options(xt_params->orig_opts, opts,
 					     cs->target->extra_opts,
 					     &cs->target->option_offset);
 	if (opts == NULL)
@@ -1323,13 +1644,15 @@ static void command_match(struct iptables_command_state *cs)
 		return;
 	/* Merge options for non-cloned matches */
 	if (m->x6_options != NULL)
-		opts = xtables_options_xfrm(ip6tables_globals.orig_opts, opts,
+		opts = xtables_options_xfrm(xt_params->orig_opts, opts,
 					    m->x6_options, &m->option_offset);
 	else if (m->extra_opts != NULL)
-		opts = xtables_merge_options(ip6tables_globals.orig_opts, opts,
+		opts = xtables_merge_options(xt_params->orig_opts, opts,
 					     m->extra_opts, &m->option_offset);
 }
 
+__thread struct ip6tc_handle **(*ip6tables_table_handle)(const char *table);
+
 int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **handle)
 {
 	struct iptables_command_state cs;
@@ -1342,9 +1665,9 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 	const char *chain = NULL;
 	const char *shostnetworkmask = NULL, *dhostnetworkmask = NULL;
 	const char *policy = NULL, *newname = NULL;
-	unsigned int rulenum = 0, command = 0;
+	unsigned int rulenum = 0, rulelast = UINT_MAX, command = 0;
 	const char *pcnt = NULL, *bcnt = NULL;
-	int ret = 1;
+	int ret = 1, json = 0;
 	struct xtables_match *m;
 	struct xtables_rule_match *matchp;
 	struct xtables_target *t;
@@ -1356,6 +1679,7 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 
 	/* re-set optind to 0 in case do_command6 gets called
 	 * a second time */
+	getopt_lock();
 	optind = 0;
 
 	/* clear mflags in case do_command6 gets called a second time
@@ -1435,7 +1759,8 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 				chain = argv[optind++];
 			if (optind < argc && argv[optind][0] != '-'
 			    && argv[optind][0] != '!')
-				rulenum = parse_rulenumber(argv[optind++]);
+				rulenum = parse_rulerange(argv[optind++],
+							  &rulelast);
 			break;
 
 		case 'S':
@@ -1447,7 +1772,8 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 				chain = argv[optind++];
 			if (optind < argc && argv[optind][0] != '-'
 			    && argv[optind][0] != '!')
-				rulenum = parse_rulenumber(argv[optind++]);
+				rulenum = parse_rulerange(argv[optind++],
+							  &rulelast);
 			break;
 
 		case 'F':
@@ -1469,6 +1795,7 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 			if (optind < argc && argv[optind][0] != '-'
 				&& argv[optind][0] != '!') {
 				rulenum = parse_rulenumber(argv[optind++]);
+				rulelast = rulenum;
 				command = CMD_ZERO_NUM;
 			}
 			break;
@@ -1662,6 +1989,11 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 			xtables_modprobe_program = optarg;
 			break;
 
+		case 'J':
+			json_init();
+			json = 1;
+			break;
+
 		case 'c':
 
 			set_option(&cs.options, OPT_COUNTERS, &cs.fw6.ipv6.invflags,
@@ -1693,8 +2025,10 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 
 		case '4':
 			/* This is not the IPv4 iptables */
-			if (line != -1)
+			if (line != -1) {
+				getopt_unlock();
 				return 1; /* success: line ignored */
+			}
 			fprintf(stderr, "This is the IPv6 version of ip6tables.\n");
 			exit_tryhelp(2);
 
@@ -1716,7 +2050,7 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 			exit_tryhelp(2);
 
 		default:
-			if (command_default(&cs, &ip6tables_globals) == 1)
+			if (command_default(&cs, xt_params) == 1)
 				/*
 				 * If new options were loaded, we must retry
 				 * getopt immediately and not allow
@@ -1738,11 +2072,15 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 	if (optind < argc)
 		xtables_error(PARAMETER_PROBLEM,
 			   "unknown arguments found on commandline");
+	getopt_unlock();
 	if (!command)
 		xtables_error(PARAMETER_PROBLEM, "no command specified");
 	if (cs.invert)
 		xtables_error(PARAMETER_PROBLEM,
 			   "nothing appropriate following !");
+	if (json && !(command & (CMD_LIST | CMD_LIST_RULES)))
+		xtables_error(PARAMETER_PROBLEM,
+			   "--json is only allowed with -L and -S");
 
 	if (command & (CMD_REPLACE | CMD_INSERT | CMD_DELETE | CMD_APPEND | CMD_CHECK)) {
 		if (!(cs.options & OPT_DESTINATION))
@@ -1775,6 +2113,9 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 			   "chain name `%s' too long (must be under %u chars)",
 			   chain, XT_EXTENSION_MAXNAMELEN);
 
+	if (ip6tables_table_handle != NULL)
+		handle = ip6tables_table_handle(*table);
+
 	/* only allocate handle if we weren't called with a handle */
 	if (!*handle)
 		*handle = ip6tc_init(*table);
@@ -1910,13 +2251,18 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 	case CMD_LIST:
 	case CMD_LIST|CMD_ZERO:
 	case CMD_LIST|CMD_ZERO_NUM:
-		ret = list_entries(chain,
-				   rulenum,
-				   cs.options&OPT_VERBOSE,
-				   cs.options&OPT_NUMERIC,
-				   cs.options&OPT_EXPANDED,
-				   cs.options&OPT_LINENUMBERS,
-				   *handle);
+		if (json)
+			ret = list_json(*table, chain, rulenum, rulelast,
+					*handle);
+		else
+			ret = list_entries(chain,
+					   rulenum,
+					   rulelast,
+					   cs.options&OPT_VERBOSE,
+					   cs.options&OPT_NUMERIC,
+					   cs.options&OPT_EXPANDED,
+					   cs.options&OPT_LINENUMBERS,
+					   *handle);
 		if (ret && (command & CMD_ZERO))
 			ret = zero_entries(chain,
 					   cs.options&OPT_VERBOSE, *handle);
@@ -1926,10 +2272,15 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 	case CMD_LIST_RULES:
 	case CMD_LIST_RULES|CMD_ZERO:
 	case CMD_LIST_RULES|CMD_ZERO_NUM:
-		ret = list_rules(chain,
-				   rulenum,
-				   cs.options&OPT_VERBOSE,
-				   *handle);
+		if (json)
+			ret = list_json(*table, chain, rulenum, rulelast,
+					*handle);
+		else
+			ret = list_rules(chain,
+					   rulenum,
+					   rulelast,
+					   cs.options&OPT_VERBOSE,
+					   *handle);
 		if (ret && (command & CMD_ZERO))
 			ret = zero_entries(chain,
 					   cs.options&OPT_VERBOSE, *handle);
@@ -6,6 +6,7 @@
  */
 
 #include <getopt.h>
+#include <sys/time.h>
 #include <sys/errno.h>
 #include <stdbool.h>
 #include <string.h>
@@ -15,6 +16,7 @@
 #include "xtables.h"
 #include "libiptc/libiptc.h"
 #include "iptables-multi.h"
+#include "xshared.h"
 
 #ifdef DEBUG
 #define DEBUGP(x, args...) fprintf(stderr, x, ## args)
@@ -76,6 +78,52 @@ static struct iptc_handle *create_handle(const char *tablename)
 	return handle;
 }
 
+/*
+ * Snapshots of the tables committed so far. Should iptables-restore fail
+ * afterwards, they are put back, so that a restore is all-or-nothing.
+ */
+static struct iptc_snapshot **committed;
+static unsigned int num_committed;
+static bool restore_done;
+
+static void save_committed(struct iptc_snapshot *snap)
+{
+	struct iptc_snapshot **tmp;
+
+	tmp = realloc(committed, (num_committed + 1) * sizeof(*committed));
+	if (tmp == NULL)
+		xtables_error(OTHER_PROBLEM, "realloc: %s\n", strerror(errno));
+	committed = tmp;
+	committed[num_committed++] = snap;
+}
+
+static void rollback_committed(void)
+{
+	struct timeval start, end;
+	unsigned int num = 0;
+
+	if (restore_done || num_committed == 0)
+		return;
+
+	gettimeofday(&start, NULL);
+	while (num_committed > 0) {
+		struct iptc_snapshot *snap = committed[--num_committed];
+
+		if (iptc_restore_snapshot(snap))
+			++num;
+		else
+			fprintf(stderr, "%s: rollback failed: %s\n",
+				prog_name, iptc_strerror(errno));
+		iptc_free_snapshot(snap);
+	}
+	gettimeofday(&end, NULL);
+
+	fprintf(stderr, "%s: rolled back %u table commit(s) in %lu ms\n",
+		prog_name, num,
+		(end.tv_sec - start.tv_sec) * 1000UL +
+		(end.tv_usec - start.tv_usec) / 1000L);
+}
+
 static int parse_counters(char *string, struct ipt_counters *ctr)
 {
 	unsigned long long pcnt, bcnt;
@@ -122,6 +170,7 @@ main(int argc, char *argv[])
 #endif
 {
 	struct iptc_handle *handle = NULL;
+	struct iptc_snapshot *snap = NULL;
 	char buffer[10240];
 	int c;
 	char curtable[IPT_TABLE_MAXNAMELEN + 1];
@@ -142,6 +191,8 @@ main(int argc, char *argv[])
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
 	init_extensions();
 	init_extensions4();
+#elif defined(XTABLES_BUNDLE)
+	xtables_set_bundle(xtables_bundle, xtables_bundle4);
 #endif
 
 	while ((c = getopt_long(argc, argv, "bcvthnM:T:", options, NULL)) != -1) {
@@ -188,10 +239,17 @@ main(int argc, char *argv[])
 	}
 	else in = stdin;
 
+	atexit(rollback_committed);
+
 	/* Grab standard input. */
 	while (fgets(buffer, sizeof(buffer), in)) {
+		size_t len = strlen(buffer);
 		int ret = 0;
 
+		/* The last line may come without its newline */
+		if (len > 0 && buffer[len - 1] != '\n' &&
+		    len + 1 < sizeof(buffer))
+			strcpy(buffer + len, "\n");
 		line++;
 		if (buffer[0] == '\n')
 			continue;
@@ -203,8 +261,13 @@ main(int argc, char *argv[])
 			if (!testing) {
 				DEBUGP("Calling commit\n");
 				ret = iptc_commit(handle);
+				iptc_snapshot_committed(snap, handle);
 				iptc_free(handle);
 				handle = NULL;
+				/* A failed commit may have replaced the
+				 * table already, so undo it as well. */
+				save_committed(snap);
+				snap = NULL;
 			} else {
 				DEBUGP("Not calling commit, testing\n");
 				ret = 1;
@@ -231,6 +294,16 @@ main(int argc, char *argv[])
 				iptc_free(handle);
 
 			handle = create_handle(table);
+			if (!testing) {
+				if (snap != NULL)
+					iptc_free_snapshot(snap);
+				snap = iptc_snapshot(handle);
+				if (snap == NULL)
+					xtables_error(OTHER_PROBLEM,
+						"%s: cannot snapshot table "
+						"'%s': %s\n", prog_name,
+						table, iptc_strerror(errno));
+			}
 			if (noflush == 0) {
 				DEBUGP("Cleaning all chains of table '%s'\n",
 					table);
@@ -330,10 +403,8 @@ main(int argc, char *argv[])
 			char *bcnt = NULL;
 			char *parsestart;
 
-			/* the parser */
-			char *curchar;
-			int quote_open, escaped;
-			size_t param_len;
+			char *words[ARRAY_SIZE(newargv)];
+			int nwords;
 
 			/* reset the newargv */
 			newargc = 0;
@@ -375,68 +446,22 @@ main(int argc, char *argv[])
 				add_argv((char *) bcnt);
 			}
 
-			/* After fighting with strtok enough, here's now
-			 * a 'real' parser. According to Rusty I'm now no
-			 * longer a real hacker, but I can live with that */
-
-			quote_open = 0;
-			escaped = 0;
-			param_len = 0;
-
-			for (curchar = parsestart; *curchar; curchar++) {
-				char param_buffer[1024];
-
-				if (quote_open) {
-					if (escaped) {
-						param_buffer[param_len++] = *curchar;
-						escaped = 0;
-						continue;
-					} else if (*curchar == '\\') {
-						escaped = 1;
-						continue;
-					} else if (*curchar == '"') {
-						quote_open = 0;
-						*curchar = ' ';
-					} else {
-						param_buffer[param_len++] = *curchar;
-						continue;
-					}
-				} else {
-					if (*curchar == '"') {
-						quote_open = 1;
-						continue;
-					}
-				}
-
-				if (*curchar == ' '
-				    || *curchar == '\t'
-				    || * curchar == '\n') {
-					if (!param_len) {
-						/* two spaces? */
-						continue;
-					}
-
-					param_buffer[param_len] = '\0';
-
-					/* check if table name specified */
-					if (!strncmp(param_buffer, "-t", 2)
-					    || !strncmp(param_buffer, "--table", 8)) {
-						xtables_error(PARAMETER_PROBLEM,
-						   "Line %u seems to have a "
-						   "-t table option.\n", line);
-						exit(1);
-					}
-
-					add_argv(param_buffer);
-					param_len = 0;
-				} else {
-					/* regular character, copy to buffer */
-					param_buffer[param_len++] = *curchar;
-
-					if (param_len >= sizeof(param_buffer))
-						xtables_error(PARAMETER_PROBLEM,
-						   "Parameter too long!");
+			nwords = split_words(parsestart, words,
+					     ARRAY_SIZE(words));
+			if (nwords < 0)
+				xtables_error(PARAMETER_PROBLEM,
+					   "Line %u has too many arguments.\n",
+					   line);
+			for (a = 0; a < nwords; a++) {
+				/* check if table name specified */
+				if (!strncmp(words[a], "-t", 2)
+				    || !strncmp(words[a], "--table", 8)) {
+					xtables_error(PARAMETER_PROBLEM,
+					   "Line %u seems to have a "
+					   "-t table option.\n", line);
+					exit(1);
 				}
+				add_argv(words[a]);
 			}
 
 			DEBUGP("calling do_command4(%u, argv, &%s, handle):\n",
@@ -467,5 +492,10 @@ main(int argc, char *argv[])
 
 	if (in != NULL)
 		fclose(in);
+
+	restore_done = true;
+	while (num_committed > 0)
+		iptc_free_snapshot(committed[--num_committed]);
+	free(committed);
 	return 0;
 }
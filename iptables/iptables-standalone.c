@@ -36,8 +36,131 @@
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
+#include <unistd.h>
 #include <iptables.h>
 #include "iptables-multi.h"
+#include "xshared.h"
+
+/*
+ * Listing a large chain emits many small pieces per rule; when the output
+ * goes to a file or pipe, let them leave in a few large write()s.
+ */
+static char list_outbuf[1 << 16];
+
+/*
+ * --batch: run many commands, one per line, on libiptc handles kept open
+ * per table, and commit every table that was touched once at the end (or
+ * at a COMMIT line) instead of after each command.
+ */
+struct batch_table {
+	char name[IPT_TABLE_MAXNAMELEN];
+	struct iptc_handle *handle;
+};
+
+static struct batch_table batch_tables[8];
+static unsigned int batch_ntables;
+
+static struct batch_table *batch_lookup(const char *table)
+{
+	struct batch_table *t;
+	unsigned int i;
+
+	for (i = 0; i < batch_ntables; ++i)
+		if (strcmp(batch_tables[i].name, table) == 0)
+			return &batch_tables[i];
+
+	if (strlen(table) >= sizeof(t->name))
+		xtables_error(PARAMETER_PROBLEM,
+			   "table name `%s' too long", table);
+	if (batch_ntables == ARRAY_SIZE(batch_tables))
+		xtables_error(PARAMETER_PROBLEM, "too many tables");
+	t = &batch_tables[batch_ntables++];
+	strcpy(t->name, table);
+	t->handle = NULL;
+	return t;
+}
+
+/* Handles are taken once do_command4() knows the table of a line */
+static struct iptc_handle **batch_handle(const char *table)
+{
+	return &batch_lookup(table)->handle;
+}
+
+static int batch_commit(void)
+{
+	unsigned int i;
+	int ret = 1, err = 0;
+
+	for (i = 0; i < batch_ntables; ++i) {
+		struct batch_table *t = &batch_tables[i];
+
+		if (t->handle == NULL)
+			continue;
+		if (ret && !iptc_commit(t->handle)) {
+			ret = 0;
+			err = errno;
+		}
+		iptc_free(t->handle);
+		t->handle = NULL;
+	}
+	if (!ret)
+		errno = err;
+	return ret;
+}
+
+static int do_batch(const char *file)
+{
+	char buffer[10240], *argv[255], **args, *table;
+	struct iptc_handle *handle;
+	FILE *fp = stdin;
+	int argc, ret = 1;
+
+	if (strcmp(file, "-") != 0) {
+		fp = fopen(file, "re");
+		if (fp == NULL)
+			xtables_error(OTHER_PROBLEM, "Can't open %s: %s",
+				   file, strerror(errno));
+	}
+
+	iptables_table_handle = batch_handle;
+	line = 0;
+	while (ret && fgets(buffer, sizeof(buffer), fp) != NULL) {
+		++line;
+		if (strchr(buffer, '\n') == NULL && !feof(fp))
+			xtables_error(PARAMETER_PROBLEM, "line too long");
+
+		args = argv;
+		args[0] = "iptables";
+		argc = split_words(buffer, args + 1, ARRAY_SIZE(argv) - 1);
+		if (argc < 0)
+			xtables_error(PARAMETER_PROBLEM, "too many arguments");
+		if (argc == 0 || args[1][0] == '#')
+			continue;
+		if (argc == 1 && strcmp(args[1], "COMMIT") == 0) {
+			ret = batch_commit();
+			continue;
+		}
+		/* As copied from a shell script */
+		if (strcmp(args[1], "iptables") == 0) {
+			++args;
+			--argc;
+		}
+		++argc;
+
+		table = "filter";
+		handle = NULL;
+		ret = do_command4(argc, args, &table, &handle);
+	}
+
+	iptables_table_handle = NULL;
+	if (fp != stdin)
+		fclose(fp);
+	if (ret) {
+		line = -1;
+		ret = batch_commit();
+	}
+	return ret;
+}
 
 #ifdef IPTABLES_MULTI
 int
@@ -52,6 +175,8 @@ main(int argc, char *argv[])
 	struct iptc_handle *handle = NULL;
 
 	signal(SIGPIPE, SIG_IGN);
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, list_outbuf, _IOFBF, sizeof(list_outbuf));
 
 	iptables_globals.program_name = "iptables";
 	ret = xtables_init_all(&iptables_globals, NFPROTO_IPV4);
@@ -64,12 +189,21 @@ main(int argc, char *argv[])
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
 	init_extensions();
 	init_extensions4();
+#elif defined(XTABLES_BUNDLE)
+	xtables_set_bundle(xtables_bundle, xtables_bundle4);
 #endif
 
-	ret = do_command4(argc, argv, &table, &handle);
-	if (ret) {
-		ret = iptc_commit(handle);
-		iptc_free(handle);
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+		if (argc > 3)
+			xtables_error(PARAMETER_PROBLEM,
+				   "--batch takes at most one file");
+		ret = do_batch(argc == 3 ? argv[2] : "-");
+	} else {
+		ret = do_command4(argc, argv, &table, &handle);
+		if (ret) {
+			ret = iptc_commit(handle);
+			iptc_free(handle);
+		}
 	}
 
 	if (!ret) {
@@ -81,6 +215,8 @@ main(int argc, char *argv[])
 			fprintf(stderr, "iptables: %s.\n",
 				iptc_strerror(errno));
 		}
+		if (line != -1)
+			fprintf(stderr, "Error occurred at line: %d\n", line);
 		if (errno == EAGAIN) {
 			exit(RESOURCE_PROBLEM);
 		}
@@ -125,6 +125,7 @@ static struct option original_opts[] = {
 	{.name = "goto",          .has_arg = 1, .val = 'g'},
 	{.name = "ipv4",          .has_arg = 0, .val = '4'},
 	{.name = "ipv6",          .has_arg = 0, .val = '6'},
+	{.name = "json",          .has_arg = 0, .val = 'J'},
 	{NULL},
 };
 
@@ -183,7 +184,7 @@ static const int inverse_for_options[NUMBER_OF_OPT] =
 /* -c */ 0,
 };
 
-#define opts iptables_globals.opts
+#define opts xt_params->opts
 #define prog_name iptables_globals.program_name
 #define prog_vers iptables_globals.program_version
 
@@ -224,15 +225,17 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "       %s -I chain [rulenum] rule-specification [options]\n"
 "       %s -R chain rulenum rule-specification [options]\n"
 "       %s -D chain rulenum [options]\n"
-"       %s -[LS] [chain [rulenum]] [options]\n"
+"       %s -[LS] [chain [rulenum[:[last]]]] [options]\n"
 "       %s -[FZ] [chain] [options]\n"
 "       %s -[NX] chain\n"
 "       %s -E old-chain-name new-chain-name\n"
 "       %s -P chain target [options]\n"
+"       %s --batch [file] (commands from file or stdin, one per line)\n"
 "       %s -h (print this help information)\n\n",
 	       prog_name, prog_vers, prog_name, prog_name,
 	       prog_name, prog_name, prog_name, prog_name,
-	       prog_name, prog_name, prog_name, prog_name);
+	       prog_name, prog_name, prog_name, prog_name,
+	       prog_name);
 
 	printf(
 "Commands:\n"
@@ -246,9 +249,9 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "				Insert in chain as rulenum (default 1=first)\n"
 "  --replace -R chain rulenum\n"
 "				Replace rule rulenum (1 = first) in chain\n"
-"  --list    -L [chain [rulenum]]\n"
+"  --list    -L [chain [rulenum[:[last]]]]\n"
 "				List the rules in a chain or all chains\n"
-"  --list-rules -S [chain [rulenum]]\n"
+"  --list-rules -S [chain [rulenum[:[last]]]]\n"
 "				Print the rules in a chain or all chains\n"
 "  --flush   -F [chain]		Delete all rules in  chain or all chains\n"
 "  --zero    -Z [chain [rulenum]]\n"
@@ -286,6 +289,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "  --table	-t table	table to manipulate (default: `filter')\n"
 "  --verbose	-v		verbose mode\n"
 "  --line-numbers		print line numbers when listing\n"
+"  --json			list (-L, -S) in JSON format\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 "[!] --fragment	-f		match second or further fragments only\n"
 "  --modprobe=<command>		try to insert modules using this command\n"
@@ -405,6 +409,31 @@ parse_rulenumber(const char *rule)
 	return rulenum;
 }
 
+/* FIRST[:[LAST]] for -L and -S; a plain number selects just that rule. */
+static unsigned int
+parse_rulerange(const char *rule, unsigned int *last)
+{
+	unsigned int rulenum;
+	char *end;
+	bool ok;
+
+	ok = xtables_strtoui(rule, &end, &rulenum, 1, INT_MAX);
+	*last = rulenum;
+	if (ok && *end == ':') {
+		*last = UINT_MAX;
+		if (end[1] != '\0')
+			ok = xtables_strtoui(end + 1, NULL, last,
+					     rulenum, UINT_MAX);
+	} else if (ok && *end != '\0') {
+		ok = false;
+	}
+	if (!ok)
+		xtables_error(PARAMETER_PROBLEM,
+			   "Invalid rule range `%s'", rule);
+
+	return rulenum;
+}
+
 static const char *
 parse_target(const char *targetname)
 {
@@ -450,26 +479,23 @@ set_option(unsigned int *options, unsigned int option, uint8_t *invflg,
 static void
 print_num(uint64_t number, unsigned int format)
 {
+	static const char suffix[] = "KMGT";
+	unsigned int i = 0;
+
 	if (format & FMT_KILOMEGAGIGA) {
 		if (number > 99999) {
 			number = (number + 500) / 1000;
-			if (number > 9999) {
+			while (number > 9999 && i < sizeof(suffix) - 2) {
 				number = (number + 500) / 1000;
-				if (number > 9999) {
-					number = (number + 500) / 1000;
-					if (number > 9999) {
-						number = (number + 500) / 1000;
-						printf(FMT("%4lluT ","%lluT "), (unsigned long long)number);
-					}
-					else printf(FMT("%4lluG ","%lluG "), (unsigned long long)number);
-				}
-				else printf(FMT("%4lluM ","%lluM "), (unsigned long long)number);
-			} else
-				printf(FMT("%4lluK ","%lluK "), (unsigned long long)number);
+				i++;
+			}
+			list_u64(number, FMT(4, 0));
+			fputc(suffix[i], stdout);
 		} else
-			printf(FMT("%5llu ","%llu "), (unsigned long long)number);
+			list_u64(number, FMT(5, 0));
 	} else
-		printf(FMT("%8llu ","%llu "), (unsigned long long)number);
+		list_u64(number, FMT(8, 0));
+	fputc(' ', stdout);
 }
 
 
@@ -555,6 +581,7 @@ print_firewall(const struct ipt_entry *fw,
 	const struct xtables_target *target = NULL;
 	const struct ipt_entry_target *t;
 	uint8_t flags;
+	const char *addr;
 	char buf[BUFSIZ];
 
 	if (!iptc_is_chain(targname, handle))
@@ -566,24 +593,30 @@ print_firewall(const struct ipt_entry *fw,
 	t = ipt_get_target((struct ipt_entry *)fw);
 	flags = fw->ip.flags;
 
-	if (format & FMT_LINENUMBERS)
-		printf(FMT("%-4u ", "%u "), num);
+	if (format & FMT_LINENUMBERS) {
+		list_u64(num, FMT(-4, 0));
+		fputc(' ', stdout);
+	}
 
 	if (!(format & FMT_NOCOUNTS)) {
 		print_num(fw->counters.pcnt, format);
 		print_num(fw->counters.bcnt, format);
 	}
 
-	if (!(format & FMT_NOTARGET))
-		printf(FMT("%-9s ", "%s "), targname);
+	if (!(format & FMT_NOTARGET)) {
+		list_field(targname, FMT(-9, 0));
+		fputc(' ', stdout);
+	}
 
 	fputc(fw->ip.invflags & IPT_INV_PROTO ? '!' : ' ', stdout);
 	{
 		const char *pname = proto_to_name(fw->ip.proto, format&FMT_NUMERIC);
 		if (pname)
-			printf(FMT("%-5s", "%s "), pname);
+			list_field(pname, FMT(-5, 0));
 		else
-			printf(FMT("%-5hu", "%hu "), fw->ip.proto);
+			list_u64(fw->ip.proto, FMT(-5, 0));
+		if (format & FMT_NOTABLE)
+			fputc(' ', stdout);
 	}
 
 	if (format & FMT_OPTIONS) {
@@ -608,7 +641,9 @@ print_firewall(const struct ipt_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT(" %-6s ","in %s "), iface);
+		fputs(FMT(" ", "in "), stdout);
+		list_field(iface, FMT(-6, 0));
+		fputc(' ', stdout);
 
 		if (fw->ip.invflags & IPT_INV_VIA_OUT) {
 			iface[0] = '!';
@@ -621,32 +656,42 @@ print_firewall(const struct ipt_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT("%-6s ","out %s "), iface);
+		if (format & FMT_NOTABLE)
+			fputs("out ", stdout);
+		list_field(iface, FMT(-6, 0));
+		fputc(' ', stdout);
 	}
 
 	fputc(fw->ip.invflags & IPT_INV_SRCIP ? '!' : ' ', stdout);
 	if (fw->ip.smsk.s_addr == 0L && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","%s "), "anywhere");
+		addr = "anywhere";
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ipaddr_to_numeric(&fw->ip.src));
 		else
 			strcpy(buf, xtables_ipaddr_to_anyname(&fw->ip.src));
 		strcat(buf, xtables_ipmask_to_numeric(&fw->ip.smsk));
-		printf(FMT("%-19s ","%s "), buf);
+		addr = buf;
 	}
+	list_field(addr, FMT(-19, 0));
+	fputc(' ', stdout);
 
 	fputc(fw->ip.invflags & IPT_INV_DSTIP ? '!' : ' ', stdout);
 	if (fw->ip.dmsk.s_addr == 0L && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","-> %s"), "anywhere");
+		addr = "anywhere";
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ipaddr_to_numeric(&fw->ip.dst));
 		else
 			strcpy(buf, xtables_ipaddr_to_anyname(&fw->ip.dst));
 		strcat(buf, xtables_ipmask_to_numeric(&fw->ip.dmsk));
-		printf(FMT("%-19s ","-> %s"), buf);
+		addr = buf;
 	}
+	if (format & FMT_NOTABLE)
+		fputs("-> ", stdout);
+	list_field(addr, FMT(-19, 0));
+	if (!(format & FMT_NOTABLE))
+		fputc(' ', stdout);
 
 	if (format & FMT_NOTABLE)
 		fputs("  ", stdout);
@@ -680,6 +725,41 @@ print_firewall_line(const struct ipt_entry *fw,
 	print_firewall(fw, t->u.user.name, 0, FMT_PRINT_RULE, h);
 }
 
+/*
+ * Lay out one copy of @fw per source/destination pair, one after the other,
+ * for the batch calls of libiptc. The pairs are in the order in which they
+ * are to end up in the chain, i.e. reversed if each was to be inserted at
+ * the same position in turn.
+ */
+static struct ipt_entry *
+expand_entries(const struct ipt_entry *fw,
+	       unsigned int nsaddrs, const struct in_addr saddrs[],
+	       const struct in_addr smasks[],
+	       unsigned int ndaddrs, const struct in_addr daddrs[],
+	       const struct in_addr dmasks[],
+	       bool reverse, int verbose, struct iptc_handle *handle)
+{
+	unsigned int i, j, k, n = nsaddrs * ndaddrs;
+	struct ipt_entry *entries, *e;
+
+	entries = xtables_malloc(n * fw->next_offset);
+	for (i = 0, k = 0; i < nsaddrs; i++) {
+		for (j = 0; j < ndaddrs; j++, k++) {
+			e = (void *)entries +
+			    (reverse ? n - 1 - k : k) * fw->next_offset;
+			memcpy(e, fw, fw->next_offset);
+			e->ip.src.s_addr = saddrs[i].s_addr;
+			e->ip.smsk.s_addr = smasks[i].s_addr;
+			e->ip.dst.s_addr = daddrs[j].s_addr;
+			e->ip.dmsk.s_addr = dmasks[j].s_addr;
+			if (verbose)
+				print_firewall_line(e, handle);
+		}
+	}
+
+	return entries;
+}
+
 static int
 append_entry(const ipt_chainlabel chain,
 	     struct ipt_entry *fw,
@@ -692,20 +772,15 @@ append_entry(const ipt_chainlabel chain,
 	     int verbose,
 	     struct iptc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
-
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ip.src.s_addr = saddrs[i].s_addr;
-		fw->ip.smsk.s_addr = smasks[i].s_addr;
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ip.dst.s_addr = daddrs[j].s_addr;
-			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= iptc_append_entry(chain, fw, handle);
-		}
-	}
+	struct ipt_entry *entries;
+	int ret;
+
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, false,
+				 verbose, handle);
+	ret = iptc_append_entries(chain, entries,
+				  nsaddrs * ndaddrs, handle);
+	free(entries);
 
 	return ret;
 }
@@ -742,20 +817,15 @@ insert_entry(const ipt_chainlabel chain,
 	     int verbose,
 	     struct iptc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
-
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ip.src.s_addr = saddrs[i].s_addr;
-		fw->ip.smsk.s_addr = smasks[i].s_addr;
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ip.dst.s_addr = daddrs[j].s_addr;
-			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= iptc_insert_entry(chain, fw, rulenum, handle);
-		}
-	}
+	struct ipt_entry *entries;
+	int ret;
+
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, true,
+				 verbose, handle);
+	ret = iptc_insert_entries(chain, entries,
+				  nsaddrs * ndaddrs, rulenum, handle);
+	free(entries);
 
 	return ret;
 }
@@ -808,22 +878,17 @@ delete_entry(const ipt_chainlabel chain,
 	     struct xtables_rule_match *matches,
 	     const struct xtables_target *target)
 {
-	unsigned int i, j;
-	int ret = 1;
+	struct ipt_entry *entries;
+	int ret;
 	unsigned char *mask;
 
 	mask = make_delete_mask(matches, target);
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ip.src.s_addr = saddrs[i].s_addr;
-		fw->ip.smsk.s_addr = smasks[i].s_addr;
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ip.dst.s_addr = daddrs[j].s_addr;
-			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= iptc_delete_entry(chain, fw, mask, handle);
-		}
-	}
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, false,
+				 verbose, handle);
+	ret = iptc_delete_entries(chain, entries,
+				  nsaddrs * ndaddrs, mask, handle);
+	free(entries);
 	free(mask);
 
 	return ret;
@@ -838,22 +903,17 @@ check_entry(const ipt_chainlabel chain, struct ipt_entry *fw,
 	    struct xtables_rule_match *matches,
 	    const struct xtables_target *target)
 {
-	unsigned int i, j;
-	int ret = 1;
+	struct ipt_entry *entries;
+	int ret;
 	unsigned char *mask;
 
 	mask = make_delete_mask(matches, target);
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ip.src.s_addr = saddrs[i].s_addr;
-		fw->ip.smsk.s_addr = smasks[i].s_addr;
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ip.dst.s_addr = daddrs[j].s_addr;
-			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= iptc_check_entry(chain, fw, mask, handle);
-		}
-	}
+	entries = expand_entries(fw, nsaddrs, saddrs, smasks,
+				 ndaddrs, daddrs, dmasks, false,
+				 verbose, handle);
+	ret = iptc_check_entries(chain, entries,
+				 nsaddrs * ndaddrs, mask, handle);
+	free(entries);
 
 	free(mask);
 	return ret;
@@ -931,14 +991,84 @@ delete_chain4(const ipt_chainlabel chain, int verbose,
 	return iptc_delete_chain(chain, handle);
 }
 
+/* Get the names of all addresses to be listed resolving in parallel */
+static void
+prefetch_chain(const char *chain, unsigned int rulenum, unsigned int rulelast,
+	       struct iptc_handle *handle)
+{
+	const struct ipt_entry *i;
+	unsigned int num = 0;
+
+	for (i = iptc_first_rule(chain, handle); i;
+	     i = iptc_next_rule(i, handle)) {
+		if (++num < rulenum)
+			continue;
+		if (num > rulelast)
+			break;
+		if (i->ip.smsk.s_addr != 0)
+			xtables_ipaddr_prefetch(&i->ip.src);
+		if (i->ip.dmsk.s_addr != 0)
+			xtables_ipaddr_prefetch(&i->ip.dst);
+	}
+}
+
+static void
+prefetch_names(const ipt_chainlabel chain, unsigned int rulenum,
+	       unsigned int rulelast, struct iptc_handle *handle)
+{
+	const char *this;
+
+	if (chain) {
+		prefetch_chain(chain, rulenum, rulelast, handle);
+		return;
+	}
+
+	for (this = iptc_first_chain(handle);
+	     this;
+	     this = iptc_next_chain(handle))
+		prefetch_chain(this, rulenum, rulelast, handle);
+}
+
+static void
+list_chain(const char *chain, unsigned int rulenum, unsigned int rulelast,
+	   unsigned int format, struct iptc_handle *handle)
+{
+	const struct ipt_entry *i;
+	unsigned int num = 0;
+
+	if (!rulenum)
+		print_header(format, chain, handle);
+
+	for (i = iptc_first_rule(chain, handle); i;
+	     i = iptc_next_rule(i, handle)) {
+		if (++num < rulenum)
+			continue;
+		if (num > rulelast)
+			break;
+		print_firewall(i, iptc_get_target(i, handle), num, format,
+			       handle);
+	}
+}
+
+/*
+ * List @chain, or all chains if it is NULL. A non-zero @rulenum restricts
+ * the output to rules @rulenum through @rulelast, without chain headers.
+ */
 static int
-list_entries(const ipt_chainlabel chain, int rulenum, int verbose, int numeric,
-	     int expanded, int linenumbers, struct iptc_handle *handle)
+list_entries(const ipt_chainlabel chain, unsigned int rulenum,
+	     unsigned int rulelast, int verbose, int numeric, int expanded,
+	     int linenumbers, struct iptc_handle *handle)
 {
 	int found = 0;
 	unsigned int format;
 	const char *this;
 
+	/* A named chain is looked up directly, not searched for. */
+	if (chain && !iptc_is_chain(chain, handle)) {
+		errno = ENOENT;
+		return 0;
+	}
+
 	format = FMT_OPTIONS;
 	if (!verbose)
 		format |= FMT_NOCOUNTS;
@@ -947,6 +1077,8 @@ list_entries(const ipt_chainlabel chain, int rulenum, int verbose, int numeric,
 
 	if (numeric)
 		format |= FMT_NUMERIC;
+	else
+		prefetch_names(chain, rulenum, rulelast, handle);
 
 	if (!expanded)
 		format |= FMT_KILOMEGAGIGA;
@@ -954,32 +1086,16 @@ list_entries(const ipt_chainlabel chain, int rulenum, int verbose, int numeric,
 	if (linenumbers)
 		format |= FMT_LINENUMBERS;
 
+	if (chain) {
+		list_chain(chain, rulenum, rulelast, format, handle);
+		return 1;
+	}
+
 	for (this = iptc_first_chain(handle);
 	     this;
 	     this = iptc_next_chain(handle)) {
-		const struct ipt_entry *i;
-		unsigned int num;
-
-		if (chain && strcmp(chain, this) != 0)
-			continue;
-
 		if (found) printf("\n");
-
-		if (!rulenum)
-			print_header(format, this, handle);
-		i = iptc_first_rule(this, handle);
-
-		num = 0;
-		while (i) {
-			num++;
-			if (!rulenum || num == rulenum)
-				print_firewall(i,
-					       iptc_get_target(i, handle),
-					       num,
-					       format,
-					       handle);
-			i = iptc_next_rule(i, handle);
-		}
+		list_chain(this, rulenum, rulelast, format, handle);
 		found = 1;
 	}
 
@@ -990,58 +1106,34 @@ list_entries(const ipt_chainlabel chain, int rulenum, int verbose, int numeric,
 static void print_proto(uint16_t proto, int invert)
 {
 	if (proto) {
-		unsigned int i;
-		const char *invertstr = invert ? " !" : "";
-
-		const struct protoent *pent = getprotobynumber(proto);
-		if (pent) {
-			printf("%s -p %s", invertstr, pent->p_name);
-			return;
-		}
-
-		for (i = 0; xtables_chain_protos[i].name != NULL; ++i)
-			if (xtables_chain_protos[i].num == proto) {
-				printf("%s -p %s",
-				       invertstr, xtables_chain_protos[i].name);
-				return;
-			}
+		const char *pname = proto <= UINT8_MAX ?
+				    proto_to_name(proto, 0) : NULL;
 
-		printf("%s -p %u", invertstr, proto);
+		fputs(invert ? " ! -p " : " -p ", stdout);
+		if (pname != NULL)
+			fputs(pname, stdout);
+		else
+			save_u64(proto);
 	}
 }
 
-#define IP_PARTS_NATIVE(n)			\
-(unsigned int)((n)>>24)&0xFF,			\
-(unsigned int)((n)>>16)&0xFF,			\
-(unsigned int)((n)>>8)&0xFF,			\
-(unsigned int)((n)&0xFF)
-
-#define IP_PARTS(n) IP_PARTS_NATIVE(ntohl(n))
-
-/* This assumes that mask is contiguous, and byte-bounded. */
-static void
-print_iface(char letter, const char *iface, const unsigned char *mask,
-	    int invert)
+/* Format a network-order IPv4 address into @buf, returns its length. */
+static unsigned int format_ipv4(char *buf, uint32_t addr)
 {
-	unsigned int i;
-
-	if (mask[0] == 0)
-		return;
-
-	printf("%s -%c ", invert ? " !" : "", letter);
-
-	for (i = 0; i < IFNAMSIZ; i++) {
-		if (mask[i] != 0) {
-			if (iface[i] != '\0')
-				printf("%c", iface[i]);
-		} else {
-			/* we can access iface[i-1] here, because
-			 * a few lines above we make sure that mask[0] != 0 */
-			if (iface[i-1] != '\0')
-				printf("+");
-			break;
-		}
+	const unsigned char *b = (const unsigned char *)&addr;
+	unsigned int i, len = 0;
+
+	for (i = 0; i < 4; ++i) {
+		if (i > 0)
+			buf[len++] = '.';
+		if (b[i] >= 100)
+			buf[len++] = '0' + b[i] / 100;
+		if (b[i] >= 10)
+			buf[len++] = '0' + b[i] / 10 % 10;
+		buf[len++] = '0' + b[i] % 10;
 	}
+	buf[len] = '\0';
+	return len;
 }
 
 static int print_match_save(const struct ipt_entry_match *e,
@@ -1067,34 +1159,45 @@ static int print_match_save(const struct ipt_entry_match *e,
 	return 0;
 }
 
-/* print a given ip including mask if neccessary */
-static void print_ip(const char *prefix, uint32_t ip,
-		     uint32_t mask, int invert)
+/* Format @ip/@mask into @buf as the save format has it, returns its length. */
+static unsigned int format_ipv4_prefix(char *buf, uint32_t ip, uint32_t mask)
 {
 	uint32_t bits, hmask = ntohl(mask);
+	unsigned int len = format_ipv4(buf, ip);
 	int i;
 
-	if (!mask && !ip && !invert)
-		return;
-
-	printf("%s %s %u.%u.%u.%u",
-		invert ? " !" : "",
-		prefix,
-		IP_PARTS(ip));
-
+	buf[len++] = '/';
 	if (mask == 0xFFFFFFFFU) {
-		printf("/32");
-		return;
+		strcpy(buf + len, "32");
+		return len + 2;
 	}
 
 	i    = 32;
 	bits = 0xFFFFFFFEU;
 	while (--i >= 0 && hmask != bits)
 		bits <<= 1;
-	if (i >= 0)
-		printf("/%u", i);
-	else
-		printf("/%u.%u.%u.%u", IP_PARTS(mask));
+	if (i < 0)
+		return len + format_ipv4(buf + len, mask);
+	if (i >= 10)
+		buf[len++] = '0' + i / 10;
+	buf[len++] = '0' + i % 10;
+	buf[len] = '\0';
+	return len;
+}
+
+/* print a given ip including mask if neccessary */
+static void print_ip(const char *prefix, uint32_t ip,
+		     uint32_t mask, int invert)
+{
+	char buf[sizeof("255.255.255.255/255.255.255.255")];
+
+	if (!mask && !ip && !invert)
+		return;
+
+	fputs(invert ? " ! " : " ", stdout);
+	fputs(prefix, stdout);
+	putchar(' ');
+	fwrite(buf, 1, format_ipv4_prefix(buf, ip, mask), stdout);
 }
 
 /* We want this to be readable, so only print out neccessary fields.
@@ -1106,11 +1209,14 @@ void print_rule4(const struct ipt_entry *e,
 	const char *target_name;
 
 	/* print counters for iptables-save */
-	if (counters > 0)
-		printf("[%llu:%llu] ", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters > 0) {
+		save_counters(e->counters.pcnt, e->counters.bcnt);
+		putchar(' ');
+	}
 
 	/* print chain name */
-	printf("-A %s", chain);
+	fputs("-A ", stdout);
+	fputs(chain, stdout);
 
 	/* Print IP part. */
 	print_ip("-s", e->ip.src.s_addr,e->ip.smsk.s_addr,
@@ -1119,17 +1225,16 @@ void print_rule4(const struct ipt_entry *e,
 	print_ip("-d", e->ip.dst.s_addr, e->ip.dmsk.s_addr,
 			e->ip.invflags & IPT_INV_DSTIP);
 
-	print_iface('i', e->ip.iniface, e->ip.iniface_mask,
+	save_iface('i', e->ip.iniface, e->ip.iniface_mask,
 		    e->ip.invflags & IPT_INV_VIA_IN);
 
-	print_iface('o', e->ip.outiface, e->ip.outiface_mask,
+	save_iface('o', e->ip.outiface, e->ip.outiface_mask,
 		    e->ip.invflags & IPT_INV_VIA_OUT);
 
 	print_proto(e->ip.proto, e->ip.invflags & IPT_INV_PROTO);
 
 	if (e->ip.flags & IPT_F_FRAG)
-		printf("%s -f",
-		       e->ip.invflags & IPT_INV_FRAG ? " !" : "");
+		fputs(e->ip.invflags & IPT_INV_FRAG ? " ! -f" : " -f", stdout);
 
 	/* Print matchinfo part */
 	if (e->target_offset) {
@@ -1137,17 +1242,23 @@ void print_rule4(const struct ipt_entry *e,
 	}
 
 	/* print counters for iptables -R */
-	if (counters < 0)
-		printf(" -c %llu %llu", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters < 0) {
+		fputs(" -c ", stdout);
+		save_u64(e->counters.pcnt);
+		putchar(' ');
+		save_u64(e->counters.bcnt);
+	}
 
 	/* Print target name */
 	target_name = iptc_get_target(e, h);
-	if (target_name && (*target_name != '\0'))
+	if (target_name && (*target_name != '\0')) {
 #ifdef IPT_F_GOTO
-		printf(" -%c %s", e->ip.flags & IPT_F_GOTO ? 'g' : 'j', target_name);
+		fputs(e->ip.flags & IPT_F_GOTO ? " -g " : " -j ", stdout);
 #else
-		printf(" -j %s", target_name);
+		fputs(" -j ", stdout);
 #endif
+		fputs(target_name, stdout);
+	}
 
 	/* Print targinfo part */
 	t = ipt_get_target((struct ipt_entry *)e);
@@ -1176,12 +1287,211 @@ void print_rule4(const struct ipt_entry *e,
 			}
 		}
 	}
-	printf("\n");
+	putchar('\n');
+}
+
+static void
+print_chain_decl(const char *chain, int counters, struct iptc_handle *handle)
+{
+	if (iptc_builtin(chain, handle)) {
+		struct ipt_counters count;
+		printf("-P %s %s", chain, iptc_get_policy(chain, &count, handle));
+		if (counters)
+		    printf(" -c %llu %llu", (unsigned long long)count.pcnt, (unsigned long long)count.bcnt);
+		printf("\n");
+	} else {
+		printf("-N %s\n", chain);
+	}
+}
+
+static void
+list_chain_rules(const char *chain, unsigned int rulenum,
+		 unsigned int rulelast, int counters,
+		 struct iptc_handle *handle)
+{
+	const struct ipt_entry *e;
+	unsigned int num = 0;
+
+	for (e = iptc_first_rule(chain, handle); e;
+	     e = iptc_next_rule(e, handle)) {
+		if (++num < rulenum)
+			continue;
+		if (num > rulelast)
+			break;
+		print_rule4(e, handle, chain, counters);
+	}
+}
+
+static void json_ip(const char *key, uint32_t ip, uint32_t mask, int invert)
+{
+	char buf[sizeof("255.255.255.255/255.255.255.255")];
+
+	if (!mask && !ip && !invert)
+		return;
+
+	format_ipv4_prefix(buf, ip, mask);
+	json_key(key);
+	json_str(buf);
+}
+
+static int json_match(const struct ipt_entry_match *m,
+		      const struct ipt_ip *ip)
+{
+	const struct xtables_match *match =
+		xtables_find_match(m->u.user.name, XTF_TRY_LOAD, NULL);
+
+	json_begin('{');
+	json_key("name");
+	json_str(m->u.user.name);
+	if (match && match->save) {
+		json_key("args");
+		json_args_begin();
+		match->save(ip, m);
+		json_args_end();
+	}
+	json_end('}');
+	return 0;
+}
+
+/*
+ * The JSON counterpart of print_rule4(). Options the kernel has not been
+ * given are left out, extension options are kept as the words that
+ * iptables-save would print for them.
+ */
+void json_rule4(const struct ipt_entry *e, struct iptc_handle *h,
+		unsigned int num)
+{
+	static const struct {
+		uint8_t flag;
+		const char *name;
+	} inv[] = {
+		{IPT_INV_SRCIP, "src"},
+		{IPT_INV_DSTIP, "dst"},
+		{IPT_INV_VIA_IN, "in"},
+		{IPT_INV_VIA_OUT, "out"},
+		{IPT_INV_PROTO, "proto"},
+		{IPT_INV_FRAG, "fragment"},
+	};
+	const struct xtables_target *target;
+	const struct ipt_entry_target *t;
+	const char *target_name;
+	unsigned int i;
+
+	json_begin('{');
+	json_key("num");
+	json_u64(num);
+	json_key("packets");
+	json_u64(e->counters.pcnt);
+	json_key("bytes");
+	json_u64(e->counters.bcnt);
+
+	json_ip("src", e->ip.src.s_addr, e->ip.smsk.s_addr,
+		e->ip.invflags & IPT_INV_SRCIP);
+	json_ip("dst", e->ip.dst.s_addr, e->ip.dmsk.s_addr,
+		e->ip.invflags & IPT_INV_DSTIP);
+	json_iface("in", e->ip.iniface, e->ip.iniface_mask);
+	json_iface("out", e->ip.outiface, e->ip.outiface_mask);
+
+	if (e->ip.proto) {
+		const char *pname = proto_to_name(e->ip.proto, 0);
+		char buf[6];
+
+		if (pname == NULL) {
+			snprintf(buf, sizeof(buf), "%u", e->ip.proto);
+			pname = buf;
+		}
+		json_key("proto");
+		json_str(pname);
+	}
+
+	if (e->ip.flags & IPT_F_FRAG) {
+		json_key("fragment");
+		json_bool(true);
+	}
+
+	if (e->ip.invflags) {
+		json_key("invert");
+		json_begin('[');
+		for (i = 0; i < ARRAY_SIZE(inv); ++i)
+			if (e->ip.invflags & inv[i].flag)
+				json_str(inv[i].name);
+		json_end(']');
+	}
+
+	if (e->target_offset > sizeof(*e)) {
+		json_key("matches");
+		json_begin('[');
+		IPT_MATCH_ITERATE(e, json_match, &e->ip);
+		json_end(']');
+	}
+
+	target_name = iptc_get_target(e, h);
+	if (target_name && *target_name != '\0') {
+		json_key("target");
+		json_begin('{');
+		json_key("name");
+		json_str(target_name);
+#ifdef IPT_F_GOTO
+		if (e->ip.flags & IPT_F_GOTO) {
+			json_key("goto");
+			json_bool(true);
+		}
+#endif
+		t = ipt_get_target((struct ipt_entry *)e);
+		target = t->u.user.name[0] == '\0' ? NULL :
+			 xtables_find_target(t->u.user.name, XTF_TRY_LOAD);
+		if (target && target->save) {
+			json_key("args");
+			json_args_begin();
+			target->save(&e->ip, t);
+			json_args_end();
+		}
+		json_end('}');
+	}
+	json_end('}');
+}
+
+/* A chain with rules @first through @last, counting from 1, as JSON. */
+void json_chain4(const char *chain, unsigned int first, unsigned int last,
+		 struct iptc_handle *h)
+{
+	const struct ipt_entry *e;
+	struct ipt_counters count;
+	unsigned int num = 0, refs;
+	const char *pol;
+
+	json_begin('{');
+	json_key("name");
+	json_str(chain);
+	pol = iptc_get_policy(chain, &count, h);
+	if (pol) {
+		json_key("policy");
+		json_str(pol);
+		json_key("packets");
+		json_u64(count.pcnt);
+		json_key("bytes");
+		json_u64(count.bcnt);
+	} else if (iptc_get_references(&refs, chain, h)) {
+		json_key("references");
+		json_u64(refs);
+	}
+
+	json_key("rules");
+	json_begin('[');
+	for (e = iptc_first_rule(chain, h); e; e = iptc_next_rule(e, h)) {
+		if (++num < first)
+			continue;
+		if (num > last)
+			break;
+		json_rule4(e, h, num);
+	}
+	json_end(']');
+	json_end('}');
 }
 
 static int
-list_rules(const ipt_chainlabel chain, int rulenum, int counters,
-	     struct iptc_handle *handle)
+list_rules(const ipt_chainlabel chain, unsigned int rulenum,
+	   unsigned int rulelast, int counters, struct iptc_handle *handle)
 {
 	const char *this = NULL;
 	int found = 0;
@@ -1189,42 +1499,28 @@ list_rules(const ipt_chainlabel chain, int rulenum, int counters,
 	if (counters)
 	    counters = -1;		/* iptables -c format */
 
+	if (chain) {
+		if (!iptc_is_chain(chain, handle)) {
+			errno = ENOENT;
+			return 0;
+		}
+		if (!rulenum)
+			print_chain_decl(chain, counters, handle);
+		list_chain_rules(chain, rulenum, rulelast, counters, handle);
+		return 1;
+	}
+
 	/* Dump out chain names first,
 	 * thereby preventing dependency conflicts */
 	if (!rulenum) for (this = iptc_first_chain(handle);
 	     this;
-	     this = iptc_next_chain(handle)) {
-		if (chain && strcmp(this, chain) != 0)
-			continue;
-
-		if (iptc_builtin(this, handle)) {
-			struct ipt_counters count;
-			printf("-P %s %s", this, iptc_get_policy(this, &count, handle));
-			if (counters)
-			    printf(" -c %llu %llu", (unsigned long long)count.pcnt, (unsigned long long)count.bcnt);
-			printf("\n");
-		} else {
-			printf("-N %s\n", this);
-		}
-	}
+	     this = iptc_next_chain(handle))
+		print_chain_decl(this, counters, handle);
 
 	for (this = iptc_first_chain(handle);
 	     this;
 	     this = iptc_next_chain(handle)) {
-		const struct ipt_entry *e;
-		int num = 0;
-
-		if (chain && strcmp(this, chain) != 0)
-			continue;
-
-		/* Dump out rules */
-		e = iptc_first_rule(this, handle);
-		while(e) {
-			num++;
-			if (!rulenum || num == rulenum)
-			    print_rule4(e, handle, this, counters);
-			e = iptc_next_rule(e, handle);
-		}
+		list_chain_rules(this, rulenum, rulelast, counters, handle);
 		found = 1;
 	}
 
@@ -1232,6 +1528,41 @@ list_rules(const ipt_chainlabel chain, int rulenum, int counters,
 	return found;
 }
 
+/* -L and -S with --json: one table, in the layout of iptables-save --json. */
+static int
+list_json(const char *table, const ipt_chainlabel chain,
+	  unsigned int rulenum, unsigned int rulelast,
+	  struct iptc_handle *handle)
+{
+	const char *this;
+
+	if (chain && !iptc_is_chain(chain, handle)) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	json_begin('{');
+	json_key("tables");
+	json_begin('[');
+	json_begin('{');
+	json_key("name");
+	json_str(table);
+	json_key("chains");
+	json_begin('[');
+	if (chain)
+		json_chain4(chain, rulenum, rulelast, handle);
+	else
+		for (this = iptc_first_chain(handle);
+		     this;
+		     this = iptc_next_chain(handle))
+			json_chain4(this, rulenum, rulelast, handle);
+	json_end(']');
+	json_end('}');
+	json_end(']');
+	json_end('}');
+	return 1;
+}
+
 static struct ipt_entry *
 generate_entry(const struct ipt_entry *fw,
 	       struct xtables_rule_match *matches,
@@ -1318,11 +1649,11 @@ static void command_jump(struct iptables_command_state *cs)
 	if (cs->target->init != NULL)
 		cs->target->init(cs->target->t);
 	if (cs->target->x6_options != NULL)
-		opts = xtables_options_xfrm(iptables_globals.orig_opts, opts,
+		opts = xtables_options_xfrm(xt_params->orig_opts, opts,
 					    cs->target->x6_options,
 					    &cs->target->option_offset);
 	else
-		opts = xtables_merge_options(iptables_globals.orig_opts, opts,
+		opts = xtables_merge_options(xt_params->orig_opts, opts,
 					     cs->target->extra_opts,
 					     &cs->target->option_offset);
 	if (opts == NULL)
@@ -1350,15 +1681,17 @@ static void command_match(struct iptables_command_state *cs)
 		return;
 	/* Merge options for non-cloned matches */
 	if (m->x6_options != NULL)
-		opts = xtables_options_xfrm(iptables_globals.orig_opts, opts,
+		opts = xtables_options_xfrm(xt_params->orig_opts, opts,
 					    m->x6_options, &m->option_offset);
 	else if (m->extra_opts != NULL)
-		opts = xtables_merge_options(iptables_globals.orig_opts, opts,
+		opts = xtables_merge_options(xt_params->orig_opts, opts,
 					     m->extra_opts, &m->option_offset);
 	if (opts == NULL)
 		xtables_error(OTHER_PROBLEM, "can't alloc memory!");
 }
 
+__thread struct iptc_handle **(*iptables_table_handle)(const char *table);
+
 int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handle)
 {
 	struct iptables_command_state cs;
@@ -1371,9 +1704,9 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 	const char *chain = NULL;
 	const char *shostnetworkmask = NULL, *dhostnetworkmask = NULL;
 	const char *policy = NULL, *newname = NULL;
-	unsigned int rulenum = 0, command = 0;
+	unsigned int rulenum = 0, rulelast = UINT_MAX, command = 0;
 	const char *pcnt = NULL, *bcnt = NULL;
-	int ret = 1;
+	int ret = 1, json = 0;
 	struct xtables_match *m;
 	struct xtables_rule_match *matchp;
 	struct xtables_target *t;
@@ -1385,6 +1718,7 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 
 	/* re-set optind to 0 in case do_command4 gets called
 	 * a second time */
+	getopt_lock();
 	optind = 0;
 
 	/* clear mflags in case do_command4 gets called a second time
@@ -1464,7 +1798,8 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 				chain = argv[optind++];
 			if (optind < argc && argv[optind][0] != '-'
 			    && argv[optind][0] != '!')
-				rulenum = parse_rulenumber(argv[optind++]);
+				rulenum = parse_rulerange(argv[optind++],
+							  &rulelast);
 			break;
 
 		case 'S':
@@ -1476,7 +1811,8 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 				chain = argv[optind++];
 			if (optind < argc && argv[optind][0] != '-'
 			    && argv[optind][0] != '!')
-				rulenum = parse_rulenumber(argv[optind++]);
+				rulenum = parse_rulerange(argv[optind++],
+							  &rulelast);
 			break;
 
 		case 'F':
@@ -1498,6 +1834,7 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 			if (optind < argc && argv[optind][0] != '-'
 				&& argv[optind][0] != '!') {
 				rulenum = parse_rulenumber(argv[optind++]);
+				rulelast = rulenum;
 				command = CMD_ZERO_NUM;
 			}
 			break;
@@ -1689,6 +2026,11 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 			xtables_modprobe_program = optarg;
 			break;
 
+		case 'J':
+			json_init();
+			json = 1;
+			break;
+
 		case 'c':
 
 			set_option(&cs.options, OPT_COUNTERS, &cs.fw.ip.invflags,
@@ -1724,8 +2066,10 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 
 		case '6':
 			/* This is not the IPv6 ip6tables */
-			if (line != -1)
+			if (line != -1) {
+				getopt_unlock();
 				return 1; /* success: line ignored */
+			}
 			fprintf(stderr, "This is the IPv4 version of iptables.\n");
 			exit_tryhelp(2);
 
@@ -1743,7 +2087,7 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 			exit_tryhelp(2);
 
 		default:
-			if (command_default(&cs, &iptables_globals) == 1)
+			if (command_default(&cs, xt_params) == 1)
 				/* cf. ip6tables.c */
 				continue;
 			break;
@@ -1768,11 +2112,15 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 	if (optind < argc)
 		xtables_error(PARAMETER_PROBLEM,
 			   "unknown arguments found on commandline");
+	getopt_unlock();
 	if (!command)
 		xtables_error(PARAMETER_PROBLEM, "no command specified");
 	if (cs.invert)
 		xtables_error(PARAMETER_PROBLEM,
 			   "nothing appropriate following !");
+	if (json && !(command & (CMD_LIST | CMD_LIST_RULES)))
+		xtables_error(PARAMETER_PROBLEM,
+			   "--json is only allowed with -L and -S");
 
 	if (command & (CMD_REPLACE | CMD_INSERT | CMD_DELETE | CMD_APPEND | CMD_CHECK)) {
 		if (!(cs.options & OPT_DESTINATION))
@@ -1805,6 +2153,9 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 			   "chain name `%s' too long (must be under %u chars)",
 			   chain, XT_EXTENSION_MAXNAMELEN);
 
+	if (iptables_table_handle != NULL)
+		handle = iptables_table_handle(*table);
+
 	/* only allocate handle if we weren't called with a handle */
 	if (!*handle)
 		*handle = iptc_init(*table);
@@ -1942,13 +2293,18 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 	case CMD_LIST:
 	case CMD_LIST|CMD_ZERO:
 	case CMD_LIST|CMD_ZERO_NUM:
-		ret = list_entries(chain,
-				   rulenum,
-				   cs.options&OPT_VERBOSE,
-				   cs.options&OPT_NUMERIC,
-				   cs.options&OPT_EXPANDED,
-				   cs.options&OPT_LINENUMBERS,
-				   *handle);
+		if (json)
+			ret = list_json(*table, chain, rulenum, rulelast,
+					*handle);
+		else
+			ret = list_entries(chain,
+					   rulenum,
+					   rulelast,
+					   cs.options&OPT_VERBOSE,
+					   cs.options&OPT_NUMERIC,
+					   cs.options&OPT_EXPANDED,
+					   cs.options&OPT_LINENUMBERS,
+					   *handle);
 		if (ret && (command & CMD_ZERO))
 			ret = zero_entries(chain,
 					   cs.options&OPT_VERBOSE, *handle);
@@ -1958,10 +2314,15 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 	case CMD_LIST_RULES:
 	case CMD_LIST_RULES|CMD_ZERO:
 	case CMD_LIST_RULES|CMD_ZERO_NUM:
-		ret = list_rules(chain,
-				   rulenum,
-				   cs.options&OPT_VERBOSE,
-				   *handle);
+		if (json)
+			ret = list_json(*table, chain, rulenum, rulelast,
+					*handle);
+		else
+			ret = list_rules(chain,
+					   rulenum,
+					   rulelast,
+					   cs.options&OPT_VERBOSE,
+					   *handle);
 		if (ret && (command & CMD_ZERO))
 			ret = zero_entries(chain,
 					   cs.options&OPT_VERBOSE, *handle);
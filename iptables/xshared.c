@@ -1,11 +1,15 @@
+#include <errno.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <xtables.h>
 #include "xshared.h"
 
@@ -40,12 +44,29 @@ void print_extension_helps(const struct xtables_target *t,
 const char *
 proto_to_name(uint8_t proto, int nolookup)
 {
+	/*
+	 * getprotobynumber() rescans /etc/protocols on every call, which
+	 * dominates listing and saving of large rulesets. Remember answers.
+	 */
+	static const char *proto_names[UINT8_MAX + 1];
+	static uint8_t proto_looked_up[(UINT8_MAX + 1) / 8];
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	const char *name;
 	unsigned int i;
 
 	if (proto && !nolookup) {
-		struct protoent *pent = getprotobynumber(proto);
-		if (pent)
-			return pent->p_name;
+		pthread_mutex_lock(&lock);
+		if (!(proto_looked_up[proto / 8] & (1 << (proto % 8)))) {
+			struct protoent *pent = getprotobynumber(proto);
+
+			if (pent != NULL)
+				proto_names[proto] = strdup(pent->p_name);
+			proto_looked_up[proto / 8] |= 1 << (proto % 8);
+		}
+		name = proto_names[proto];
+		pthread_mutex_unlock(&lock);
+		if (name != NULL)
+			return name;
 	}
 
 	for (i = 0; xtables_chain_protos[i].name != NULL; ++i)
@@ -55,6 +76,457 @@ proto_to_name(uint8_t proto, int nolookup)
 	return NULL;
 }
 
+/*
+ * Formatting helpers for the save paths (iptables-save, iptables -S).
+ * They run for every rule, so keep printf's format parsing out of them.
+ */
+void save_u64(uint64_t value)
+{
+	char buf[21], *p = &buf[sizeof(buf) - 1];
+
+	*p = '\0';
+	do {
+		*--p = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	fputs(p, stdout);
+}
+
+void save_counters(uint64_t pcnt, uint64_t bcnt)
+{
+	putchar('[');
+	save_u64(pcnt);
+	putchar(':');
+	save_u64(bcnt);
+	putchar(']');
+}
+
+static void list_blanks(size_t n)
+{
+	static const char blanks[] = "                    ";
+
+	while (n > 0) {
+		size_t len = n < sizeof(blanks) - 1 ? n : sizeof(blanks) - 1;
+
+		fwrite(blanks, 1, len, stdout);
+		n -= len;
+	}
+}
+
+/*
+ * The same for the listing path (iptables -L): print @s padded with blanks
+ * to |@width| columns, left-justified if @width is negative, like "%*s".
+ */
+void list_field(const char *s, int width)
+{
+	size_t len = strlen(s);
+
+	if (width < 0) {
+		fwrite(s, 1, len, stdout);
+		if ((size_t)-width > len)
+			list_blanks(-width - len);
+		return;
+	}
+	if ((size_t)width > len)
+		list_blanks(width - len);
+	fwrite(s, 1, len, stdout);
+}
+
+void list_u64(uint64_t value, int width)
+{
+	char buf[21], *p = &buf[sizeof(buf) - 1];
+
+	*p = '\0';
+	do {
+		*--p = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	list_field(p, width);
+}
+
+/* This assumes that mask is contiguous, and byte-bounded. */
+static unsigned int format_iface(char *buf, const char *iface,
+				 const unsigned char *mask)
+{
+	unsigned int i, len = 0;
+
+	for (i = 0; i < IFNAMSIZ; i++) {
+		if (mask[i] != 0) {
+			if (iface[i] != '\0')
+				buf[len++] = iface[i];
+		} else {
+			/* we can access iface[i-1] here, because
+			 * the callers make sure that mask[0] != 0 */
+			if (iface[i-1] != '\0')
+				buf[len++] = '+';
+			break;
+		}
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+void save_iface(char letter, const char *iface, const unsigned char *mask,
+		int invert)
+{
+	char buf[IFNAMSIZ + 2];
+
+	if (mask[0] == 0)
+		return;
+
+	fputs(invert ? " ! -" : " -", stdout);
+	putchar(letter);
+	putchar(' ');
+	fwrite(buf, 1, format_iface(buf, iface, mask), stdout);
+}
+
+/*
+ * Have @fn print items [first, last) of @num on stdout, spread over @jobs
+ * processes including this one. The items are cut into contiguous ranges
+ * of about equal total @weight, which is not used, and may be NULL, when
+ * @jobs is 1 at most. Every forked worker writes its range into a
+ * temporary file, which is copied to stdout in order once this process
+ * has printed the first range, so the output is the same as that of a
+ * single call. Processes rather than threads, because the formatters
+ * print to the one stdout. A range whose worker could not be started is
+ * printed here instead.
+ */
+void save_parallel(unsigned int jobs, unsigned int num,
+		   const unsigned int *weight,
+		   void (*fn)(unsigned int, unsigned int, void *), void *data)
+{
+	unsigned int *bound, k, i;
+	uint64_t total = 0, sum = 0;
+	FILE **out;
+	pid_t *pid;
+	char buf[1 << 16];
+	size_t len;
+	int status;
+
+	if (jobs > num)
+		jobs = num;
+	if (jobs <= 1) {
+		fn(0, num, data);
+		return;
+	}
+
+	bound = calloc(jobs + 1, sizeof(*bound));
+	out   = calloc(jobs, sizeof(*out));
+	pid   = calloc(jobs, sizeof(*pid));
+	if (bound == NULL || out == NULL || pid == NULL)
+		xtables_error(OTHER_PROBLEM, "calloc: %s\n", strerror(errno));
+
+	for (i = 0; i < num; ++i)
+		total += weight[i];
+	for (i = 0, k = 1; i < num && k < jobs; ++i) {
+		sum += weight[i];
+		if (sum * jobs >= total * k)
+			bound[k++] = i + 1;
+	}
+	while (k <= jobs)
+		bound[k++] = num;
+
+	fflush(stdout);
+	for (k = 1; k < jobs; ++k) {
+		pid[k] = -1;
+		if (bound[k] == bound[k+1])
+			continue;
+		out[k] = tmpfile();
+		if (out[k] == NULL)
+			continue;
+		pid[k] = fork();
+		if (pid[k] != 0)
+			continue;
+		if (dup2(fileno(out[k]), STDOUT_FILENO) < 0)
+			_exit(EXIT_FAILURE);
+		fn(bound[k], bound[k+1], data);
+		_exit(fflush(stdout) == 0 && !ferror(stdout) ?
+		      EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	fn(bound[0], bound[1], data);
+	for (k = 1; k < jobs; ++k) {
+		if (pid[k] < 0) {
+			fn(bound[k], bound[k+1], data);
+		} else {
+			if (waitpid(pid[k], &status, 0) < 0 ||
+			    !WIFEXITED(status) ||
+			    WEXITSTATUS(status) != EXIT_SUCCESS)
+				xtables_error(OTHER_PROBLEM,
+					   "Output worker %u failed\n", k);
+			rewind(out[k]);
+			while ((len = fread(buf, 1, sizeof(buf), out[k])) > 0)
+				fwrite(buf, 1, len, stdout);
+		}
+		if (out[k] != NULL)
+			fclose(out[k]);
+	}
+	free(bound);
+	free(out);
+	free(pid);
+}
+
+/*
+ * Streaming JSON output for --json. Values go straight to stdout as they
+ * are produced; the only state is whether the current object or array
+ * already has a member, so that commas land in the right places.
+ */
+static unsigned int json_depth;
+static uint64_t json_more;
+static bool json_keyed;
+
+static void json_sep(void)
+{
+	if (json_keyed) {
+		json_keyed = false;
+		return;
+	}
+	if (json_more & (1ULL << json_depth))
+		putchar(',');
+	json_more |= 1ULL << json_depth;
+}
+
+static void json_putc(unsigned char c)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	if (c == '"' || c == '\\') {
+		putchar('\\');
+		putchar(c);
+	} else if (c < 0x20 || c >= 0x80) {
+		fputs("\\u00", stdout);
+		putchar(hex[c >> 4]);
+		putchar(hex[c & 0xf]);
+	} else {
+		putchar(c);
+	}
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence of more than one byte at @s,
+ * or 0: no overlong forms, surrogates or code points beyond U+10FFFF.
+ */
+static unsigned int json_utf8_len(const unsigned char *s)
+{
+	unsigned int len, i;
+	uint32_t cp;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		len = 2;
+		cp  = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		len = 3;
+		cp  = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		len = 4;
+		cp  = s[0] & 0x07;
+	} else {
+		return 0;
+	}
+	for (i = 1; i < len; ++i) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		cp = cp << 6 | (s[i] & 0x3f);
+	}
+	if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) ||
+	    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+		return 0;
+	return len;
+}
+
+/* Open an object or array, @c being '{' or '['. */
+void json_begin(char c)
+{
+	bool member = json_keyed;
+
+	json_sep();
+	/* Objects in arrays (tables, chains, rules) start a new line. */
+	if (c == '{' && !member && json_depth > 0)
+		putchar('\n');
+	putchar(c);
+	if (++json_depth >= 64)
+		xtables_error(OTHER_PROBLEM, "JSON output nested too deep");
+	json_more &= ~(1ULL << json_depth);
+}
+
+void json_end(char c)
+{
+	--json_depth;
+	putchar(c);
+	if (json_depth == 0)
+		putchar('\n');
+}
+
+void json_key(const char *key)
+{
+	json_str(key);
+	putchar(':');
+	json_keyed = true;
+}
+
+void json_str(const char *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned int len;
+
+	json_sep();
+	putchar('"');
+	/*
+	 * Names and comments are bytes, not necessarily UTF-8. Valid UTF-8
+	 * is kept; any other byte is escaped as the code point of the same
+	 * value, as if it were Latin-1, so the output is always valid JSON.
+	 */
+	while (*p != '\0') {
+		if (*p < 0x80 || (len = json_utf8_len(p)) == 0) {
+			json_putc(*p++);
+		} else {
+			fwrite(p, 1, len, stdout);
+			p += len;
+		}
+	}
+	putchar('"');
+}
+
+void json_u64(uint64_t value)
+{
+	json_sep();
+	save_u64(value);
+}
+
+void json_bool(bool value)
+{
+	json_sep();
+	fputs(value ? "true" : "false", stdout);
+}
+
+void json_iface(const char *key, const char *iface,
+		const unsigned char *mask)
+{
+	char buf[IFNAMSIZ + 2];
+
+	if (mask[0] == 0)
+		return;
+	format_iface(buf, iface, mask);
+	json_key(key);
+	json_str(buf);
+}
+
+/*
+ * Extensions print their options to stdout. Their text is captured by
+ * pointing stdout at a memory stream around the ->save call, and split
+ * into words the way iptables-restore does, so that "args" is the argv
+ * the rule would be restored from. This needs open_memstream() and an
+ * assignable stdout, which Bionic only has from API level 23 on.
+ */
+#if defined(__ANDROID__) && \
+    (!defined(__ANDROID_API__) || __ANDROID_API__ < 23)
+#define JSON_NO_CAPTURE
+#endif
+
+static FILE *json_capture, *json_stdout;
+static char *json_capture_buf;
+static size_t json_capture_size;
+
+/* Called when --json is given. */
+void json_init(void)
+{
+#ifdef JSON_NO_CAPTURE
+	xtables_error(PARAMETER_PROBLEM,
+		      "JSON output is not supported in this build");
+#else
+	if (json_capture != NULL)
+		return;
+	json_capture = open_memstream(&json_capture_buf, &json_capture_size);
+	if (json_capture == NULL)
+		xtables_error(OTHER_PROBLEM, "open_memstream: %s",
+			      strerror(errno));
+#endif
+}
+
+void json_args_begin(void)
+{
+#ifndef JSON_NO_CAPTURE
+	rewind(json_capture);
+	json_stdout = stdout;
+	stdout = json_capture;
+#endif
+}
+
+void json_args_end(void)
+{
+	size_t len;
+	char *buf, **words;
+	int i, n;
+
+#ifndef JSON_NO_CAPTURE
+	fflush(json_capture);
+	stdout = json_stdout;
+#endif
+	len = ftell(json_capture);
+	buf = xtables_malloc(len + 1);
+	memcpy(buf, json_capture_buf, len);
+	buf[len] = '\0';
+	/* Every word takes at least two characters, but the last one */
+	words = xtables_malloc((len / 2 + 1) * sizeof(*words));
+	n = split_words(buf, words, len / 2 + 1);
+
+	json_begin('[');
+	for (i = 0; i < n; ++i)
+		json_str(words[i]);
+	json_end(']');
+	free(words);
+	free(buf);
+}
+
+/*
+ * Split @buf into words in place, the way iptables-restore does: words
+ * are separated by blanks, and "..." quotes, within which \ escapes the
+ * next character; "" is an empty word. Returns the number of words stored
+ * into @argv, or -1 if there are more than @max.
+ */
+int split_words(char *buf, char **argv, int max)
+{
+	bool quote_open = false, escaped = false, in_word = false;
+	char *p, *q = buf;
+	int argc = 0;
+
+	for (p = buf; *p != '\0'; ++p) {
+		bool space = false, quote = false;
+
+		if (escaped) {
+			escaped = false;
+		} else if (quote_open && *p == '\\') {
+			escaped = true;
+			continue;
+		} else if (*p == '"') {
+			/* a closing quote also ends the word */
+			quote_open = !quote_open;
+			quote = true;
+			space = !quote_open;
+		} else if (!quote_open) {
+			space = *p == ' ' || *p == '\t' || *p == '\n';
+		}
+
+		if (space) {
+			if (in_word)
+				*q++ = '\0';
+			in_word = false;
+			continue;
+		}
+		if (!in_word) {
+			if (argc == max)
+				return -1;
+			argv[argc++] = q;
+			in_word = true;
+		}
+		/* an opening quote starts a word, maybe an empty one */
+		if (!quote)
+			*q++ = *p;
+	}
+	*q = '\0';
+	return argc;
+}
+
 static struct xtables_match *
 find_proto(const char *pname, enum xtables_tryload tryload,
 	   int nolookup, struct xtables_rule_match **matches)
@@ -183,6 +655,23 @@ static mainfunc_t subcmd_get(const char *cmd, const struct subcommand *cb)
 	return NULL;
 }
 
+/*
+ * getopt_long keeps its state in optind and optarg, which the extensions'
+ * parse functions use too. Only one thread at a time can be going through
+ * a command line; the rest of a command can run in parallel.
+ */
+static pthread_mutex_t getopt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void getopt_lock(void)
+{
+	pthread_mutex_lock(&getopt_mutex);
+}
+
+void getopt_unlock(void)
+{
+	pthread_mutex_unlock(&getopt_mutex);
+}
+
 int subcmd_main(int argc, char **argv, const struct subcommand *cb)
 {
 	const char *cmd = basename(*argv);
@@ -2,11 +2,13 @@
 #define IPTABLES_XSHARED_H 1
 
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter_ipv6/ip6_tables.h>
+#include <xtables.h>
 
 enum {
 	OPT_NONE        = 0,
@@ -77,11 +79,35 @@ enum {
 extern void print_extension_helps(const struct xtables_target *,
 	const struct xtables_rule_match *);
 extern const char *proto_to_name(uint8_t, int);
+extern void save_u64(uint64_t);
+extern void save_counters(uint64_t, uint64_t);
+extern void save_iface(char, const char *, const unsigned char *, int);
+extern void save_parallel(unsigned int, unsigned int, const unsigned int *,
+	void (*)(unsigned int, unsigned int, void *), void *);
+extern void list_field(const char *, int);
+extern void list_u64(uint64_t, int);
+extern void json_init(void);
+extern void json_begin(char);
+extern void json_end(char);
+extern void json_key(const char *);
+extern void json_str(const char *);
+extern void json_u64(uint64_t);
+extern void json_bool(bool);
+extern void json_iface(const char *, const char *, const unsigned char *);
+extern void json_args_begin(void);
+extern void json_args_end(void);
+extern int split_words(char *, char **, int);
 extern int command_default(struct iptables_command_state *,
 	struct xtables_globals *);
 extern struct xtables_match *load_proto(struct iptables_command_state *);
 extern int subcmd_main(int, char **, const struct subcommand *);
+extern void getopt_lock(void);
+extern void getopt_unlock(void);
 
-extern const struct xtables_afinfo *afinfo;
+/* Family details of the current context, see xtables_set_nfproto */
+static inline const struct xtables_afinfo *xt_afinfo(void)
+{
+	return xtables_ctx->af;
+}
 
 #endif /* IPTABLES_XSHARED_H */
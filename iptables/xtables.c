@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -29,7 +30,9 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <linux/magic.h> /* for PROC_SUPER_MAGIC */
@@ -69,8 +72,6 @@ int line = -1;
 
 void basic_exit_err(enum xtables_exittype status, const char *msg, ...) __attribute__((noreturn, format(printf,2,3)));
 
-struct xtables_globals *xt_params = NULL;
-
 void basic_exit_err(enum xtables_exittype status, const char *msg, ...)
 {
 	va_list args;
@@ -83,46 +84,139 @@ void basic_exit_err(enum xtables_exittype status, const char *msg, ...)
 	exit(status);
 }
 
+/*
+ * Keep track of matches/targets pending full registration: linked lists,
+ * hashed by name so that a lookup only walks the entries of one name.
+ */
+#define XT_PENDING_HSIZE	64
+
+/*
+ * Name index of the fully registered matches/targets, pointing at the
+ * revision chosen for each name. Open addressing; entries are never
+ * removed, since replacing a revision keeps the name.
+ */
+struct xt_name_slot {
+	const char *name;
+	void *ext;
+};
+
+struct xt_name_index {
+	struct xt_name_slot *slot;
+	unsigned int size, used;
+};
+
+/*
+ * getopt_long wants one flat option array, so every merge used to malloc a
+ * fresh copy of it. Keep a single growable buffer instead (@opts_buf) and
+ * reuse it for all extensions and all rules of a run (iptables-restore in
+ * particular).
+ *
+ * Extensions registered so far are kept in the process-wide registry
+ * below; @seen_matches and @seen_targets tell how much of it has been
+ * moved to this context's pending lists. Contexts other than the default
+ * one work on copies of the extensions, listed in @copies.
+ */
+struct xt_context_priv {
+	struct xtables_match *pending_matches[XT_PENDING_HSIZE];
+	struct xtables_target *pending_targets[XT_PENDING_HSIZE];
+	struct xt_name_index match_index, target_index;
+	unsigned int seen_matches, seen_targets;
+	struct option *opts_buf;
+	unsigned int opts_size;
+	void **copies;
+	unsigned int num_copies;
+};
+
+static struct xt_context_priv xt_default_priv;
+static struct xtables_context xt_default_ctx = {.priv = &xt_default_priv};
+__thread struct xtables_context *xtables_ctx = &xt_default_ctx;
+
 void xtables_free_opts(int unused)
 {
 	if (xt_params->opts != xt_params->orig_opts) {
-		free(xt_params->opts);
+		if (xt_params->opts != xtables_ctx->priv->opts_buf)
+			free(xt_params->opts);
 		xt_params->opts = NULL;
 	}
 }
 
+/**
+ * Lay out @orig_opts, a hole of @num_new entries and the extension options
+ * merged so far (from @oldopts) in the shared option buffer. Returns the
+ * buffer, with @slot pointing to the hole, or NULL on allocation failure.
+ */
+struct option *xtables_opts_reserve(struct option *orig_opts,
+				    struct option *oldopts,
+				    unsigned int num_new, struct option **slot)
+{
+	struct xt_context_priv *priv = xtables_ctx->priv;
+	unsigned int num_orig, num_old, need;
+	struct option *buf;
+
+	for (num_orig = 0; orig_opts[num_orig].name != NULL; ++num_orig)
+		;
+	num_old = num_orig;
+	if (oldopts != NULL)
+		for (num_old = 0; oldopts[num_old].name != NULL; ++num_old)
+			;
+	/* Since @oldopts starts with @orig_opts already, skip these entries */
+	num_old -= num_orig;
+	need = num_orig + num_new + num_old + 1;
+
+	if (need > priv->opts_size) {
+		unsigned int size = priv->opts_size != 0 ? priv->opts_size : 64;
+
+		while (size < need)
+			size *= 2;
+		buf = realloc(priv->opts_buf, sizeof(*buf) * size);
+		if (buf == NULL)
+			return NULL;
+		if (oldopts == priv->opts_buf)
+			oldopts = buf;
+		if (xt_params->opts == priv->opts_buf)
+			xt_params->opts = buf;
+		priv->opts_buf  = buf;
+		priv->opts_size = size;
+	}
+	buf = priv->opts_buf;
+
+	if (oldopts == buf) {
+		/* Already in place; only shift the old extension options */
+		memmove(buf + num_orig + num_new, buf + num_orig,
+			sizeof(*buf) * num_old);
+	} else {
+		/* Let the base options -[ADI...] have precedence over everything */
+		memcpy(buf, orig_opts, sizeof(*buf) * num_orig);
+		if (num_old > 0)
+			memcpy(buf + num_orig + num_new, oldopts + num_orig,
+			       sizeof(*buf) * num_old);
+		xtables_free_opts(0);
+	}
+
+	/* Clear trailing entry */
+	memset(buf + need - 1, 0, sizeof(*buf));
+	*slot = buf + num_orig;
+	return buf;
+}
+
 struct option *xtables_merge_options(struct option *orig_opts,
 				     struct option *oldopts,
 				     const struct option *newopts,
 				     unsigned int *option_offset)
 {
-	unsigned int num_oold = 0, num_old = 0, num_new = 0, i;
+	unsigned int num_new, i;
 	struct option *merge, *mp;
 
 	if (newopts == NULL)
 		return oldopts;
 
-	for (num_oold = 0; orig_opts[num_oold].name; num_oold++) ;
-	if (oldopts != NULL)
-		for (num_old = 0; oldopts[num_old].name; num_old++) ;
 	for (num_new = 0; newopts[num_new].name; num_new++) ;
 
-	/*
-	 * Since @oldopts also has @orig_opts already (and does so at the
-	 * start), skip these entries.
-	 */
-	oldopts += num_oold;
-	num_old -= num_oold;
-
-	merge = malloc(sizeof(*mp) * (num_oold + num_old + num_new + 1));
+	merge = xtables_opts_reserve(orig_opts, oldopts, num_new, &mp);
 	if (merge == NULL)
 		return NULL;
 
-	/* Let the base options -[ADI...] have precedence over everything */
-	memcpy(merge, orig_opts, sizeof(*mp) * num_oold);
-	mp = merge + num_oold;
-
-	/* Second, the new options */
+	/* The new options go in front of the old ones */
 	xt_params->option_offset += XT_OPTION_OFFSET_SCALE;
 	*option_offset = xt_params->option_offset;
 	memcpy(mp, newopts, sizeof(*mp) * num_new);
@@ -130,13 +224,6 @@ struct option *xtables_merge_options(struct option *orig_opts,
 	for (i = 0; i < num_new; ++i, ++mp)
 		mp->val += *option_offset;
 
-	/* Third, the old options */
-	memcpy(mp, oldopts, sizeof(*mp) * num_old);
-	mp += num_old;
-	xtables_free_opts(0);
-
-	/* Clear trailing entry */
-	memset(mp, 0, sizeof(*mp));
 	return merge;
 }
 
@@ -160,25 +247,55 @@ static const struct xtables_afinfo afinfo_ipv6 = {
 	.so_rev_target = IP6T_SO_GET_REVISION_TARGET,
 };
 
-const struct xtables_afinfo *afinfo;
-
 /* Search path for Xtables .so files */
 static const char *xtables_libdir;
 
 /* the path to command to load kernel module */
 const char *xtables_modprobe_program;
 
-/* Keep track of matches/targets pending full registration: linked lists. */
-struct xtables_match *xtables_pending_matches;
-struct xtables_target *xtables_pending_targets;
+/*
+ * Every match/target registered so far, in order. Extensions are loaded
+ * and registered once per process, whichever context asked for them, and
+ * each context picks them up from here (see xt_import_registered).
+ * Registration, loading and the revision probes are serialised by
+ * xt_reg_lock, which is recursive since loading registers, and
+ * registering looks up.
+ */
+static struct xtables_match **xt_reg_matches;
+static struct xtables_target **xt_reg_targets;
+static unsigned int xt_reg_num_matches, xt_reg_num_targets;
+static pthread_mutex_t xt_reg_lock;
+static pthread_once_t xt_reg_once = PTHREAD_ONCE_INIT;
+
+/* Serialises the netdb calls that return static data */
+static pthread_mutex_t xt_netdb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void xt_reg_lock_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&xt_reg_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void xt_registry_lock(void)
+{
+	pthread_once(&xt_reg_once, xt_reg_lock_init);
+	pthread_mutex_lock(&xt_reg_lock);
+}
 
-/* Keep track of fully registered external matches/targets: linked lists. */
-struct xtables_match *xtables_matches;
-struct xtables_target *xtables_targets;
+static void xt_registry_unlock(void)
+{
+	pthread_mutex_unlock(&xt_reg_lock);
+}
 
 /* Fully register a match/target which was previously partially registered. */
 static void xtables_fully_register_pending_match(struct xtables_match *me);
 static void xtables_fully_register_pending_target(struct xtables_target *me);
+static void xt_dns_prefetch(const char *name, int family, bool reverse);
+static const char *xt_dns_reverse(const char *num, int family);
 
 void xtables_init(void)
 {
@@ -211,10 +328,10 @@ void xtables_set_nfproto(uint8_t nfproto)
 {
 	switch (nfproto) {
 	case NFPROTO_IPV4:
-		afinfo = &afinfo_ipv4;
+		xtables_ctx->af = &afinfo_ipv4;
 		break;
 	case NFPROTO_IPV6:
-		afinfo = &afinfo_ipv6;
+		xtables_ctx->af = &afinfo_ipv6;
 		break;
 	default:
 		fprintf(stderr, "libxtables: unhandled NFPROTO in %s\n",
@@ -254,6 +371,76 @@ int xtables_init_all(struct xtables_globals *xtp, uint8_t nfproto)
 	return xtables_set_params(xtp);
 }
 
+/**
+ * xtables_context_new - create a context for another thread
+ *
+ * The new context starts out with the parameters and protocol family of
+ * the caller's current context, and with no extensions, which are picked
+ * up again as they are asked for. Threads parsing rules at the same time
+ * need their own xtables_globals too (xtables_set_params), since the
+ * merged options are kept there.
+ *
+ * Returns NULL if out of memory.
+ */
+struct xtables_context *xtables_context_new(void)
+{
+	struct xtables_context *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	ctx->priv = calloc(1, sizeof(*ctx->priv));
+	if (ctx->priv == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->params = xt_params;
+	ctx->af     = xt_afinfo();
+	return ctx;
+}
+
+/**
+ * xtables_context_use - set the calling thread's current context
+ * @ctx:	context from xtables_context_new, or NULL for the default one
+ *
+ * Returns the previous current context.
+ */
+struct xtables_context *xtables_context_use(struct xtables_context *ctx)
+{
+	struct xtables_context *old = xtables_ctx;
+
+	xtables_ctx = (ctx != NULL) ? ctx : &xt_default_ctx;
+	return old;
+}
+
+/**
+ * xtables_context_free - release a context and its copies of extensions
+ *
+ * Rules parsed in @ctx must have been freed before.
+ */
+void xtables_context_free(struct xtables_context *ctx)
+{
+	struct xt_context_priv *priv;
+	unsigned int i;
+
+	if (ctx == NULL || ctx == &xt_default_ctx)
+		return;
+	if (xtables_ctx == ctx)
+		xtables_ctx = &xt_default_ctx;
+
+	priv = ctx->priv;
+	if (ctx->params != NULL && ctx->params->opts == priv->opts_buf)
+		ctx->params->opts = NULL;
+	for (i = 0; i < priv->num_copies; ++i)
+		free(priv->copies[i]);
+	free(priv->copies);
+	free(priv->match_index.slot);
+	free(priv->target_index.slot);
+	free(priv->opts_buf);
+	free(priv);
+	free(ctx);
+}
+
 /**
  * xtables_*alloc - wrappers that exit on failure
  */
@@ -399,12 +586,12 @@ int xtables_load_ko(const char *modprobe, bool quiet)
 	if (loaded)
 		return 0;
 
-	if (proc_file_exists(afinfo->proc_exists)) {
+	if (proc_file_exists(xt_afinfo()->proc_exists)) {
 		loaded = true;
 		return 0;
 	};
 
-	ret = xtables_insmod(afinfo->kmod, modprobe, quiet);
+	ret = xtables_insmod(xt_afinfo()->kmod, modprobe, quiet);
 	if (ret == 0)
 		loaded = true;
 
@@ -472,11 +659,14 @@ bool xtables_strtoui(const char *s, char **end, unsigned int *value,
 int xtables_service_to_port(const char *name, const char *proto)
 {
 	struct servent *service;
+	int port = -1;
 
+	pthread_mutex_lock(&xt_netdb_lock);
 	if ((service = getservbyname(name, proto)) != NULL)
-		return ntohs((unsigned short) service->s_port);
+		port = ntohs((unsigned short) service->s_port);
+	pthread_mutex_unlock(&xt_netdb_lock);
 
-	return -1;
+	return port;
 }
 
 uint16_t xtables_parse_port(const char *port, const char *proto)
@@ -529,7 +719,123 @@ void xtables_parse_interface(const char *arg, char *vianame,
 	}
 }
 
+static unsigned int xt_name_hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name != '\0')
+		h = h * 33 + (unsigned char)*name++;
+	return h;
+}
+
+static void *xt_index_find(const struct xt_name_index *idx, const char *name)
+{
+	unsigned int i, mask = idx->size - 1;
+
+	if (idx->size == 0)
+		return NULL;
+	for (i = xt_name_hash(name) & mask; idx->slot[i].name != NULL;
+	     i = (i + 1) & mask)
+		if (strcmp(idx->slot[i].name, name) == 0)
+			return idx->slot[i].ext;
+	return NULL;
+}
+
+static void xt_index_set(struct xt_name_index *idx, const char *name,
+			 void *ext)
+{
+	unsigned int i, mask;
+
+	if (2 * (idx->used + 1) > idx->size) {
+		struct xt_name_index grown;
+
+		grown.size = idx->size == 0 ? 64 : 2 * idx->size;
+		grown.used = 0;
+		grown.slot = xtables_calloc(grown.size, sizeof(*grown.slot));
+		for (i = 0; i < idx->size; ++i)
+			if (idx->slot[i].name != NULL)
+				xt_index_set(&grown, idx->slot[i].name,
+					     idx->slot[i].ext);
+		free(idx->slot);
+		*idx = grown;
+	}
+
+	mask = idx->size - 1;
+	for (i = xt_name_hash(name) & mask; idx->slot[i].name != NULL;
+	     i = (i + 1) & mask)
+		if (strcmp(idx->slot[i].name, name) == 0)
+			break;
+	if (idx->slot[i].name == NULL)
+		++idx->used;
+	idx->slot[i].name = name;
+	idx->slot[i].ext  = ext;
+}
+
+/*
+ * Extensions linked into the program (--enable-bundle). Rather than running
+ * every _init at startup, they are initialised the first time a rule asks
+ * for them, like a dlopen would, just without touching the filesystem.
+ */
+static const struct xtables_bundle_entry *xt_bundle[2];
+static unsigned int xt_bundle_count[2];
+static bool *xt_bundle_done[2];
+
+void xtables_set_bundle(const struct xtables_bundle_entry *xt,
+			const struct xtables_bundle_entry *af)
+{
+	const struct xtables_bundle_entry *tbl[2] = {xt, af};
+	unsigned int i, n;
+
+	for (i = 0; i < ARRAY_SIZE(tbl); ++i) {
+		if (tbl[i] == NULL)
+			continue;
+		for (n = 0; tbl[i][n].name != NULL; ++n)
+			;
+#ifdef NO_SHARED_LIBS
+		/* Nothing to load lazily from; register right away */
+		while (n-- > 0)
+			tbl[i][n].init();
+#else
+		xt_bundle[i]       = tbl[i];
+		xt_bundle_count[i] = n;
+		xt_bundle_done[i]  = xtables_calloc(n, sizeof(bool));
+#endif
+	}
+}
+
 #ifndef NO_SHARED_LIBS
+static int xt_bundle_cmp(const void *key, const void *entry)
+{
+	return strcmp(key, ((const struct xtables_bundle_entry *)entry)->name);
+}
+
+/* Entries are sorted by name, and libxt_ is searched first, like on disk. */
+static void *load_bundled(const char *name, bool is_target)
+{
+	const struct xtables_bundle_entry *e;
+	unsigned int i;
+	void *ptr;
+
+	for (i = 0; i < ARRAY_SIZE(xt_bundle); ++i) {
+		if (xt_bundle[i] == NULL)
+			continue;
+		e = bsearch(name, xt_bundle[i], xt_bundle_count[i],
+			    sizeof(*e), xt_bundle_cmp);
+		if (e == NULL || xt_bundle_done[i][e - xt_bundle[i]])
+			continue;
+		xt_bundle_done[i][e - xt_bundle[i]] = true;
+		e->init();
+
+		if (is_target)
+			ptr = xtables_find_target(name, XTF_DONT_LOAD);
+		else
+			ptr = xtables_find_match(name, XTF_DONT_LOAD, NULL);
+		if (ptr != NULL)
+			return ptr;
+	}
+	return NULL;
+}
+
 static void *load_extension(const char *search_path, const char *af_prefix,
     const char *name, bool is_target)
 {
@@ -540,6 +846,10 @@ static void *load_extension(const char *search_path, const char *af_prefix,
 	struct stat sb;
 	char path[256];
 
+	ptr = load_bundled(name, is_target);
+	if (ptr != NULL)
+		return ptr;
+
 	do {
 		next = strchr(dir, ':');
 		if (next == NULL)
@@ -583,6 +893,70 @@ static void *load_extension(const char *search_path, const char *af_prefix,
 }
 #endif
 
+/* Copy extension @ext for the current context, which is not the default */
+static void *xt_context_copy(const void *ext, size_t size)
+{
+	struct xt_context_priv *priv = xtables_ctx->priv;
+	void *copy;
+
+	if (priv->num_copies % 16 == 0)
+		priv->copies = xtables_realloc(priv->copies,
+			       sizeof(*priv->copies) * (priv->num_copies + 16));
+	copy = xtables_malloc(size);
+	memcpy(copy, ext, size);
+	priv->copies[priv->num_copies++] = copy;
+	return copy;
+}
+
+/*
+ * Put what was registered since the last call on the current context's
+ * pending lists, leaving out extensions for other families. The default
+ * context takes the registered structures themselves, any other gets
+ * copies with the per-rule state cleared.
+ */
+static void xt_import_registered(void)
+{
+	struct xt_context_priv *priv = xtables_ctx->priv;
+	bool copy = xtables_ctx != &xt_default_ctx;
+	struct xtables_match *m, **mp;
+	struct xtables_target *t, **tp;
+
+	while (priv->seen_matches < xt_reg_num_matches) {
+		m = xt_reg_matches[priv->seen_matches++];
+		if (m->family != xt_afinfo()->family && m->family != AF_UNSPEC)
+			continue;
+		if (copy) {
+			m = xt_context_copy(m, sizeof(*m));
+			m->option_offset = 0;
+			m->m = NULL;
+			m->mflags = 0;
+			m->loaded = 0;
+		}
+		mp = &priv->pending_matches[xt_name_hash(m->name) %
+					    XT_PENDING_HSIZE];
+		m->next = *mp;
+		*mp = m;
+	}
+
+	while (priv->seen_targets < xt_reg_num_targets) {
+		t = xt_reg_targets[priv->seen_targets++];
+		if (t->family != xt_afinfo()->family && t->family != AF_UNSPEC)
+			continue;
+		if (copy) {
+			t = xt_context_copy(t, sizeof(*t));
+			t->option_offset = 0;
+			t->t = NULL;
+			t->tflags = 0;
+			t->used = 0;
+			t->loaded = 0;
+		}
+		tp = &priv->pending_targets[xt_name_hash(t->name) %
+					    XT_PENDING_HSIZE];
+		t->next = *tp;
+		*tp = t;
+	}
+}
+
 struct xtables_match *
 xtables_find_match(const char *name, enum xtables_tryload tryload,
 		   struct xtables_rule_match **matches)
@@ -598,13 +972,19 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 
 	/* This is ugly as hell. Nonetheless, there is no way of changing
 	 * this without hurting backwards compatibility */
-	if ( (strcmp(name,"icmpv6") == 0) ||
+	if (name[0] == 'i' &&
+	    ((strcmp(name,"icmpv6") == 0) ||
 	     (strcmp(name,"ipv6-icmp") == 0) ||
-	     (strcmp(name,"icmp6") == 0) )
+	     (strcmp(name,"icmp6") == 0)))
 		name = icmp6;
 
+	xt_registry_lock();
+	xt_import_registered();
+
 	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_matches; *dptr; ) {
+	dptr = &xtables_ctx->priv->pending_matches[xt_name_hash(name) %
+						   XT_PENDING_HSIZE];
+	while (*dptr) {
 		if (strcmp(name, (*dptr)->name) == 0) {
 			ptr = *dptr;
 			*dptr = (*dptr)->next;
@@ -615,37 +995,35 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 		}
 	}
 
-	for (ptr = xtables_matches; ptr; ptr = ptr->next) {
-		if (strcmp(name, ptr->name) == 0) {
-			struct xtables_match *clone;
+	ptr = xt_index_find(&xtables_ctx->priv->match_index, name);
+	if (ptr != NULL && ptr->m != NULL) {
+		/* Second and subsequent clones */
+		struct xtables_match *clone;
 
-			/* First match of this type: */
-			if (ptr->m == NULL)
-				break;
+		clone = xtables_malloc(sizeof(struct xtables_match));
+		memcpy(clone, ptr, sizeof(struct xtables_match));
+		clone->mflags = 0;
+		/* This is a clone: */
+		clone->next = clone;
 
-			/* Second and subsequent clones */
-			clone = xtables_malloc(sizeof(struct xtables_match));
-			memcpy(clone, ptr, sizeof(struct xtables_match));
-			clone->mflags = 0;
-			/* This is a clone: */
-			clone->next = clone;
-
-			ptr = clone;
-			break;
-		}
+		ptr = clone;
 	}
 
 #ifndef NO_SHARED_LIBS
 	if (!ptr && tryload != XTF_DONT_LOAD && tryload != XTF_DURING_LOAD) {
-		ptr = load_extension(xtables_libdir, afinfo->libprefix,
+		ptr = load_extension(xtables_libdir, xt_afinfo()->libprefix,
 		      name, false);
+		xt_registry_unlock();
 
 		if (ptr == NULL && tryload == XTF_LOAD_MUST_SUCCEED)
 			xt_params->exit_err(PARAMETER_PROBLEM,
 				   "Couldn't load match `%s':%s\n",
 				   name, strerror(errno));
+	} else {
+		xt_registry_unlock();
 	}
 #else
+	xt_registry_unlock();
 	if (ptr && !ptr->loaded) {
 		if (tryload != XTF_DONT_LOAD)
 			ptr->loaded = 1;
@@ -684,15 +1062,29 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 	struct xtables_target *ptr;
 
 	/* Standard target? */
-	if (strcmp(name, "") == 0
-	    || strcmp(name, XTC_LABEL_ACCEPT) == 0
-	    || strcmp(name, XTC_LABEL_DROP) == 0
-	    || strcmp(name, XTC_LABEL_QUEUE) == 0
-	    || strcmp(name, XTC_LABEL_RETURN) == 0)
+	switch (name[0]) {
+	case '\0':
 		name = "standard";
+		break;
+	case 'A':
+	case 'D':
+	case 'Q':
+	case 'R':
+		if (strcmp(name, XTC_LABEL_ACCEPT) == 0
+		    || strcmp(name, XTC_LABEL_DROP) == 0
+		    || strcmp(name, XTC_LABEL_QUEUE) == 0
+		    || strcmp(name, XTC_LABEL_RETURN) == 0)
+			name = "standard";
+		break;
+	}
+
+	xt_registry_lock();
+	xt_import_registered();
 
 	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_targets; *dptr; ) {
+	dptr = &xtables_ctx->priv->pending_targets[xt_name_hash(name) %
+						   XT_PENDING_HSIZE];
+	while (*dptr) {
 		if (strcmp(name, (*dptr)->name) == 0) {
 			ptr = *dptr;
 			*dptr = (*dptr)->next;
@@ -703,22 +1095,23 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 		}
 	}
 
-	for (ptr = xtables_targets; ptr; ptr = ptr->next) {
-		if (strcmp(name, ptr->name) == 0)
-			break;
-	}
+	ptr = xt_index_find(&xtables_ctx->priv->target_index, name);
 
 #ifndef NO_SHARED_LIBS
 	if (!ptr && tryload != XTF_DONT_LOAD && tryload != XTF_DURING_LOAD) {
-		ptr = load_extension(xtables_libdir, afinfo->libprefix,
+		ptr = load_extension(xtables_libdir, xt_afinfo()->libprefix,
 		      name, true);
+		xt_registry_unlock();
 
 		if (ptr == NULL && tryload == XTF_LOAD_MUST_SUCCEED)
 			xt_params->exit_err(PARAMETER_PROBLEM,
 				   "Couldn't load target `%s':%s\n",
 				   name, strerror(errno));
+	} else {
+		xt_registry_unlock();
 	}
 #else
+	xt_registry_unlock();
 	if (ptr && !ptr->loaded) {
 		if (tryload != XTF_DONT_LOAD)
 			ptr->loaded = 1;
@@ -737,13 +1130,164 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 	return ptr;
 }
 
+/*
+ * Revision probes. All of them go through one socket per process, and if
+ * XTABLES_REVISION_CACHE names a file, the revisions found to be supported
+ * are kept there for as long as the kernel release and boot id stay the
+ * same, so that later invocations need not ask the kernel again. Missing
+ * revisions are not kept, since loading a module can still add them.
+ */
+struct xt_revision_probe {
+	char name[XT_EXTENSION_MAXNAMELEN];
+	uint8_t family, revision;
+	char type;		/* 'm'atch or 't'arget */
+	bool supported;
+};
+
+static int rev_probe_fd = -1;
+static uint8_t rev_probe_family;
+static struct xt_revision_probe *rev_cache;
+static unsigned int rev_cache_num;
+static bool rev_cache_loaded;
+static int rev_cache_fd = -1;
+
+static void rev_cache_add(const char *name, uint8_t family,
+			  uint8_t revision, char type, bool supported)
+{
+	struct xt_revision_probe *p;
+
+	p = realloc(rev_cache, (rev_cache_num + 1) * sizeof(*rev_cache));
+	if (p == NULL)
+		return;
+	rev_cache = p;
+	p = &rev_cache[rev_cache_num++];
+	strncpy(p->name, name, sizeof(p->name) - 1);
+	p->name[sizeof(p->name)-1] = '\0';
+	p->family    = family;
+	p->revision  = revision;
+	p->type      = type;
+	p->supported = supported;
+}
+
+/*
+ * Other invocations may read and extend the cache file at the same time.
+ * A new file is therefore written under a temporary name and renamed into
+ * place, and entries are added with one write() each in append mode, so
+ * that readers only see whole lines.
+ */
+static int rev_cache_create(const char *file, const char *key)
+{
+	char tmp[PATH_MAX];
+	size_t len = strlen(key);
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file) >= sizeof(tmp))
+		return -1;
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+	    fcntl(fd, F_SETFL, O_APPEND) < 0 ||
+	    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0 ||
+	    write(fd, key, len) != len || rename(tmp, file) < 0) {
+		unlink(tmp);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Read the cache file, or start a new one if it belongs to another boot. */
+static void rev_cache_load(void)
+{
+	const char *file = getenv("XTABLES_REVISION_CACHE");
+	char key[160], boot_id[64], buf[256], name[XT_EXTENSION_MAXNAMELEN];
+	unsigned int family, revision;
+	struct utsname uts;
+	size_t len;
+	char type;
+	FILE *fp;
+
+	rev_cache_loaded = true;
+	if (file == NULL || *file == '\0' || uname(&uts) < 0)
+		return;
+
+	fp = fopen("/proc/sys/kernel/random/boot_id", "re");
+	if (fp == NULL)
+		return;
+	if (fgets(boot_id, sizeof(boot_id), fp) == NULL) {
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	snprintf(key, sizeof(key), "xtables-revisions 2 %s %s",
+		 uts.release, boot_id);
+
+	fp = fopen(file, "re");
+	if (fp != NULL) {
+		if (fgets(buf, sizeof(buf), fp) != NULL &&
+		    strcmp(buf, key) == 0) {
+			while (fgets(buf, sizeof(buf), fp) != NULL) {
+				/* The last line may still be being written */
+				len = strlen(buf);
+				if (len == 0 || buf[len-1] != '\n')
+					break;
+				if (sscanf(buf, "%u %c %28s %u", &family,
+				    &type, name, &revision) == 4)
+					rev_cache_add(name, family, revision,
+						      type, true);
+			}
+			rev_cache_fd = open(file, O_WRONLY | O_APPEND |
+					    O_CLOEXEC);
+		}
+		fclose(fp);
+	}
+	if (rev_cache_fd < 0) {
+		rev_cache_num = 0;
+		rev_cache_fd = rev_cache_create(file, key);
+	}
+}
+
+static int rev_probe_socket(void)
+{
+	if (rev_probe_fd >= 0 && rev_probe_family == xt_afinfo()->family)
+		return rev_probe_fd;
+	if (rev_probe_fd >= 0)
+		close(rev_probe_fd);
+
+	rev_probe_fd = socket(xt_afinfo()->family, SOCK_RAW, IPPROTO_RAW);
+	if (rev_probe_fd < 0)
+		return -1;
+	rev_probe_family = xt_afinfo()->family;
+
+	if (fcntl(rev_probe_fd, F_SETFD, FD_CLOEXEC) == -1) {
+		fprintf(stderr, "Could not set close on exec: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+
+	xtables_load_ko(xtables_modprobe_program, true);
+	return rev_probe_fd;
+}
+
 static int compatible_revision(const char *name, uint8_t revision, int opt)
 {
 	struct xt_get_revision rev;
 	socklen_t s = sizeof(rev);
-	int max_rev, sockfd;
+	char type = (opt == xt_afinfo()->so_rev_target) ? 't' : 'm';
+	int max_rev, sockfd, supported;
+	unsigned int i;
+
+	if (!rev_cache_loaded)
+		rev_cache_load();
+	for (i = 0; i < rev_cache_num; ++i)
+		if (rev_cache[i].revision == revision &&
+		    rev_cache[i].type == type &&
+		    rev_cache[i].family == xt_afinfo()->family &&
+		    strcmp(rev_cache[i].name, name) == 0)
+			return rev_cache[i].supported;
 
-	sockfd = socket(afinfo->family, SOCK_RAW, IPPROTO_RAW);
+	sockfd = rev_probe_socket();
 	if (sockfd < 0) {
 		if (errno == EPERM) {
 			/* revision 0 is always supported. */
@@ -759,46 +1303,47 @@ static int compatible_revision(const char *name, uint8_t revision, int opt)
 		exit(1);
 	}
 
-	if (fcntl(sockfd, F_SETFD, FD_CLOEXEC) == -1) {
-		fprintf(stderr, "Could not set close on exec: %s\n",
-			strerror(errno));
-		exit(1);
-	}
-
-	xtables_load_ko(xtables_modprobe_program, true);
-
 	strcpy(rev.name, name);
 	rev.revision = revision;
 
-	max_rev = getsockopt(sockfd, afinfo->ipproto, opt, &rev, &s);
+	supported = 1;
+	max_rev = getsockopt(sockfd, xt_afinfo()->ipproto, opt, &rev, &s);
 	if (max_rev < 0) {
 		/* Definitely don't support this? */
 		if (errno == ENOENT || errno == EPROTONOSUPPORT) {
-			close(sockfd);
-			return 0;
+			supported = 0;
 		} else if (errno == ENOPROTOOPT) {
-			close(sockfd);
 			/* Assume only revision 0 support (old kernel) */
-			return (revision == 0);
+			supported = (revision == 0);
 		} else {
 			fprintf(stderr, "getsockopt failed strangely: %s\n",
 				strerror(errno));
 			exit(1);
 		}
 	}
-	close(sockfd);
-	return 1;
-}
 
+	rev_cache_add(name, xt_afinfo()->family, revision, type, supported);
+	if (supported && rev_cache_fd >= 0) {
+		char entry[64];
+		int len = snprintf(entry, sizeof(entry), "%u %c %s %u\n",
+				   xt_afinfo()->family, type, name, revision);
+
+		if (write(rev_cache_fd, entry, len) != len) {
+			close(rev_cache_fd);
+			rev_cache_fd = -1;
+		}
+	}
+	return supported;
+}
 
 static int compatible_match_revision(const char *name, uint8_t revision)
 {
-	return compatible_revision(name, revision, afinfo->so_rev_match);
+	return compatible_revision(name, revision, xt_afinfo()->so_rev_match);
 }
 
 static int compatible_target_revision(const char *name, uint8_t revision)
 {
-	return compatible_revision(name, revision, afinfo->so_rev_target);
+	return compatible_revision(name, revision, xt_afinfo()->so_rev_target);
 }
 
 static void xtables_check_options(const char *name, const struct option *opt)
@@ -845,13 +1390,14 @@ void xtables_register_match(struct xtables_match *me)
 	if (me->extra_opts != NULL)
 		xtables_check_options(me->name, me->extra_opts);
 
-	/* ignore not interested match */
-	if (me->family != afinfo->family && me->family != AF_UNSPEC)
-		return;
-
-	/* place on linked list of matches pending full registration */
-	me->next = xtables_pending_matches;
-	xtables_pending_matches = me;
+	/* contexts take it from here, if interested in its family */
+	xt_registry_lock();
+	if (xt_reg_num_matches % 32 == 0)
+		xt_reg_matches = xtables_realloc(xt_reg_matches,
+				 sizeof(*xt_reg_matches) *
+				 (xt_reg_num_matches + 32));
+	xt_reg_matches[xt_reg_num_matches++] = me;
+	xt_registry_unlock();
 }
 
 static void xtables_fully_register_pending_match(struct xtables_match *me)
@@ -897,6 +1443,7 @@ static void xtables_fully_register_pending_match(struct xtables_match *me)
 	for (i = &xtables_matches; *i; i = &(*i)->next);
 	me->next = NULL;
 	*i = me;
+	xt_index_set(&xtables_ctx->priv->match_index, me->name, me);
 
 	me->m = NULL;
 	me->mflags = 0;
@@ -942,13 +1489,14 @@ void xtables_register_target(struct xtables_target *me)
 	if (me->extra_opts != NULL)
 		xtables_check_options(me->name, me->extra_opts);
 
-	/* ignore not interested target */
-	if (me->family != afinfo->family && me->family != AF_UNSPEC)
-		return;
-
-	/* place on linked list of targets pending full registration */
-	me->next = xtables_pending_targets;
-	xtables_pending_targets = me;
+	/* contexts take it from here, if interested in its family */
+	xt_registry_lock();
+	if (xt_reg_num_targets % 32 == 0)
+		xt_reg_targets = xtables_realloc(xt_reg_targets,
+				 sizeof(*xt_reg_targets) *
+				 (xt_reg_num_targets + 32));
+	xt_reg_targets[xt_reg_num_targets++] = me;
+	xt_registry_unlock();
 }
 
 static void xtables_fully_register_pending_target(struct xtables_target *me)
@@ -995,6 +1543,7 @@ static void xtables_fully_register_pending_target(struct xtables_target *me)
 	/* Prepend to list. */
 	me->next = xtables_targets;
 	xtables_targets = me;
+	xt_index_set(&xtables_ctx->priv->target_index, me->name, me);
 	me->t = NULL;
 	me->tflags = 0;
 }
@@ -1078,34 +1627,66 @@ void xtables_param_act(unsigned int status, const char *p1, ...)
 	va_end(args);
 }
 
+/* Write @val in decimal without leading zeros, return the end of the digits */
+static char *xt_put_dec(char *p, unsigned int val)
+{
+	if (val >= 100) {
+		*p++ = '0' + val / 100;
+		val %= 100;
+		*p++ = '0' + val / 10;
+	} else if (val >= 10) {
+		*p++ = '0' + val / 10;
+	}
+	*p++ = '0' + val % 10;
+	return p;
+}
+
+/*
+ * The conversion functions below return pointers to static storage, as
+ * they always did; it is per thread, so threads do not step on each other.
+ */
 const char *xtables_ipaddr_to_numeric(const struct in_addr *addrp)
 {
-	static char buf[20];
+	static __thread char buf[20];
 	const unsigned char *bytep = (const void *)&addrp->s_addr;
-
-	sprintf(buf, "%u.%u.%u.%u", bytep[0], bytep[1], bytep[2], bytep[3]);
+	char *p;
+
+	/* Called for every address of a listing; avoid going through printf */
+	p = xt_put_dec(buf, bytep[0]);
+	*p++ = '.';
+	p = xt_put_dec(p, bytep[1]);
+	*p++ = '.';
+	p = xt_put_dec(p, bytep[2]);
+	*p++ = '.';
+	p = xt_put_dec(p, bytep[3]);
+	*p = '\0';
 	return buf;
 }
 
 static const char *ipaddr_to_host(const struct in_addr *addr)
 {
-	struct hostent *host;
-
-	host = gethostbyaddr(addr, sizeof(struct in_addr), AF_INET);
-	if (host == NULL)
-		return NULL;
+	return xt_dns_reverse(xtables_ipaddr_to_numeric(addr), AF_INET);
+}
 
-	return host->h_name;
+void xtables_ipaddr_prefetch(const struct in_addr *addr)
+{
+	xt_dns_prefetch(xtables_ipaddr_to_numeric(addr), AF_INET, true);
 }
 
 static const char *ipaddr_to_network(const struct in_addr *addr)
 {
+	static __thread char name[256];
 	struct netent *net;
+	bool found = false;
 
-	if ((net = getnetbyaddr(ntohl(addr->s_addr), AF_INET)) != NULL)
-		return net->n_name;
+	pthread_mutex_lock(&xt_netdb_lock);
+	if ((net = getnetbyaddr(ntohl(addr->s_addr), AF_INET)) != NULL) {
+		snprintf(name, sizeof(name), "%s", net->n_name);
+		found = true;
+	}
+	pthread_mutex_unlock(&xt_netdb_lock);
 
-	return NULL;
+	return found ? name : NULL;
 }
 
 const char *xtables_ipaddr_to_anyname(const struct in_addr *addr)
@@ -1121,7 +1702,7 @@ const char *xtables_ipaddr_to_anyname(const struct in_addr *addr)
 
 const char *xtables_ipmask_to_numeric(const struct in_addr *mask)
 {
-	static char buf[20];
+	static __thread char buf[20];
 	uint32_t maskaddr, bits;
 	int i;
 
@@ -1131,27 +1712,93 @@ const char *xtables_ipmask_to_numeric(const struct in_addr *mask)
 		/* we don't want to see "/32" */
 		return "";
 
-	i = 32;
-	bits = 0xFFFFFFFEL;
-	while (--i >= 0 && maskaddr != bits)
-		bits <<= 1;
-	if (i >= 0)
-		sprintf(buf, "/%d", i);
-	else
-		/* mask was not a decent combination of 1's and 0's */
+	/* a decent combination of 1's and 0's has a single 1->0 transition */
+	bits = ~maskaddr;
+	if ((bits & (bits + 1)) == 0) {
+		for (i = 0; maskaddr != 0; ++i)
+			maskaddr <<= 1;
+		buf[0] = '/';
+		*xt_put_dec(buf + 1, i) = '\0';
+	} else {
 		sprintf(buf, "/%s", xtables_ipaddr_to_numeric(mask));
+	}
 
 	return buf;
 }
 
+/*
+ * Parse a decimal number of at most three digits without a leading zero.
+ * This is what numeric addresses and prefix lengths look like nearly always;
+ * for those, the callers can skip the general (and much slower) strtoumax
+ * route, which also knows about octal, hex, signs and blanks.
+ */
+static const char *xt_get_dec(const char *s, unsigned int *val)
+{
+	unsigned int v;
+
+	if (*s < '0' || *s > '9')
+		return NULL;
+	v = *s++ - '0';
+	if (v != 0 && *s >= '0' && *s <= '9') {
+		v = v * 10 + *s++ - '0';
+		if (*s >= '0' && *s <= '9')
+			v = v * 10 + *s++ - '0';
+	}
+	if (*s >= '0' && *s <= '9')
+		return NULL;
+	*val = v;
+	return s;
+}
+
+/**
+ * Fast path for a complete dotted quad in plain decimal ("192.168.0.1").
+ * Returns false for anything else, which the caller has to handle the
+ * usual way. The resolver is never involved.
+ */
+bool xtables_parse_dotted_quad(const char *s, struct in_addr *addr)
+{
+	unsigned char *addrp = (void *)&addr->s_addr;
+	unsigned char b[4];
+	unsigned int i, v = 0;
+
+	for (i = 0; i < 4; ++i) {
+		if (i > 0 && *s++ != '.')
+			return false;
+		s = xt_get_dec(s, &v);
+		if (s == NULL || v > UINT8_MAX)
+			return false;
+		b[i] = v;
+	}
+	if (*s != '\0')
+		return false;
+	memcpy(addrp, b, sizeof(b));
+	return true;
+}
+
+/**
+ * Parse a prefix length between 0 and @max, as in "/24". Plain decimal
+ * numbers are handled inline, everything else by xtables_strtoui.
+ */
+bool xtables_parse_prefix(const char *s, unsigned int *value, unsigned int max)
+{
+	const char *end = xt_get_dec(s, value);
+
+	if (end != NULL && *end == '\0')
+		return *value <= max;
+	return xtables_strtoui(s, NULL, value, 0, max);
+}
+
 static struct in_addr *__numeric_to_ipaddr(const char *dotted, bool is_mask)
 {
-	static struct in_addr addr;
+	static __thread struct in_addr addr;
 	unsigned char *addrp;
 	unsigned int onebyte;
 	char buf[20], *p, *q;
 	int i;
 
+	if (xtables_parse_dotted_quad(dotted, &addr))
+		return &addr;
+
 	/* copy dotted string, because we need to modify it */
 	strncpy(buf, dotted, sizeof(buf) - 1);
 	buf[sizeof(buf) - 1] = '\0';
@@ -1202,43 +1849,311 @@ struct in_addr *xtables_numeric_to_ipmask(const char *dotted)
 
 static struct in_addr *network_to_ipaddr(const char *name)
 {
-	static struct in_addr addr;
+	static __thread struct in_addr addr;
 	struct netent *net;
+	bool found = false;
 
-	if ((net = getnetbyname(name)) != NULL) {
-		if (net->n_addrtype != AF_INET)
-			return NULL;
+	pthread_mutex_lock(&xt_netdb_lock);
+	if ((net = getnetbyname(name)) != NULL && net->n_addrtype == AF_INET) {
 		addr.s_addr = htonl(net->n_net);
-		return &addr;
+		found = true;
 	}
+	pthread_mutex_unlock(&xt_netdb_lock);
 
-	return NULL;
+	return found ? &addr : NULL;
 }
 
-static struct in_addr *host_to_ipaddr(const char *name, unsigned int *naddr)
+/*
+ * Name lookups. Their results, failures included, are kept for the lifetime
+ * of the process, so that a restore file naming the same host on every line
+ * asks the resolver only once. Lookups that are known to be needed soon
+ * (the hosts of a list such as "-s a,b,c", the addresses of a listing) are
+ * handed to a few worker threads to run concurrently.
+ *
+ * If XTABLES_DNS_TIMEOUT is set, a lookup that has not finished after that
+ * many seconds is given up on: an error for host names, the numeric form
+ * for addresses. Reverse lookups are given up on after XT_DNS_REV_TIMEOUT
+ * by default, as a listing can always fall back to numbers.
+ */
+enum {
+	XT_DNS_HSIZE       = 256,
+	XT_DNS_WORKERS     = 8,
+	XT_DNS_REV_TIMEOUT = 5,
+};
+
+struct xt_dns_entry {
+	struct xt_dns_entry *next, *job_next;
+	struct timeval since;
+	int family;
+	bool reverse, done;
+	unsigned int naddr;
+	void *addr;
+	char name[];
+};
+
+static struct xt_dns_entry *xt_dns_hash[XT_DNS_HSIZE];
+static struct xt_dns_entry *xt_dns_jobs;
+static unsigned int xt_dns_workers;
+static int xt_dns_timeout = -2;
+static pthread_mutex_t xt_dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xt_dns_cond = PTHREAD_COND_INITIALIZER;
+
+static int xt_dns_get_timeout(bool reverse)
+{
+	const char *env;
+
+	if (xt_dns_timeout == -2) {
+		env = getenv("XTABLES_DNS_TIMEOUT");
+		if (env == NULL ||
+		    !xtables_strtoui(env, NULL, (unsigned int *)&xt_dns_timeout,
+				     0, INT_MAX))
+			xt_dns_timeout = -1;
+	}
+	if (xt_dns_timeout < 0 && reverse)
+		return XT_DNS_REV_TIMEOUT;
+	return xt_dns_timeout;
+}
+
+/*
+ * Only getaddrinfo/getnameinfo here, they are safe to call from the
+ * workers. Reverse entries are keyed by the numeric address, and yield
+ * the host name as their single "address".
+ */
+static void *xt_dns_resolve(const struct xt_dns_entry *e, unsigned int *naddr)
 {
-	struct hostent *host;
-	struct in_addr *addr;
+	size_t len = e->family == AF_INET ? sizeof(struct in_addr) :
+	             sizeof(struct in6_addr);
+	struct addrinfo hints, *res, *p;
+	char host[NI_MAXHOST], *addr;
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} sa;
 	unsigned int i;
 
 	*naddr = 0;
-	if ((host = gethostbyname(name)) != NULL) {
-		if (host->h_addrtype != AF_INET ||
-		    host->h_length != sizeof(struct in_addr))
+	if (e->reverse) {
+		memset(&sa, 0, sizeof(sa));
+		if (e->family == AF_INET) {
+			sa.in.sin_family = AF_INET;
+			inet_pton(AF_INET, e->name, &sa.in.sin_addr);
+		} else {
+			sa.in6.sin6_family = AF_INET6;
+			inet_pton(AF_INET6, e->name, &sa.in6.sin6_addr);
+		}
+		if (getnameinfo((const void *)&sa, e->family == AF_INET ?
+		    sizeof(sa.in) : sizeof(sa.in6), host, sizeof(host),
+		    NULL, 0, NI_NAMEREQD) != 0)
 			return NULL;
-
-		while (host->h_addr_list[*naddr] != NULL)
-			++*naddr;
-		addr = xtables_calloc(*naddr, sizeof(struct in_addr));
-		for (i = 0; i < *naddr; i++)
-			memcpy(&addr[i], host->h_addr_list[i],
-			       sizeof(struct in_addr));
+		addr = strdup(host);
+		if (addr != NULL)
+			*naddr = 1;
 		return addr;
 	}
 
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = e->family;
+	hints.ai_socktype = SOCK_RAW;
+
+	if (getaddrinfo(e->name, NULL, &hints, &res) != 0)
+		return NULL;
+	for (p = res; p != NULL; p = p->ai_next)
+		++*naddr;
+	addr = calloc(*naddr, len);
+	if (addr == NULL) {
+		*naddr = 0;
+	} else {
+		for (i = 0, p = res; p != NULL; p = p->ai_next, ++i)
+			if (e->family == AF_INET)
+				memcpy(addr + i * len, &((const struct
+				       sockaddr_in *)p->ai_addr)->sin_addr, len);
+			else
+				memcpy(addr + i * len, &((const struct
+				       sockaddr_in6 *)p->ai_addr)->sin6_addr, len);
+	}
+	freeaddrinfo(res);
+	return addr;
+}
+
+/* Called with xt_dns_lock held */
+static void xt_dns_store(struct xt_dns_entry *e, void *addr,
+			 unsigned int naddr)
+{
+	e->addr  = addr;
+	e->naddr = naddr;
+	e->done  = true;
+	pthread_cond_broadcast(&xt_dns_cond);
+}
+
+static void *xt_dns_worker(void *unused)
+{
+	struct xt_dns_entry *e;
+	unsigned int naddr;
+	void *addr;
+
+	pthread_mutex_lock(&xt_dns_lock);
+	while ((e = xt_dns_jobs) != NULL) {
+		xt_dns_jobs = e->job_next;
+		pthread_mutex_unlock(&xt_dns_lock);
+		addr = xt_dns_resolve(e, &naddr);
+		pthread_mutex_lock(&xt_dns_lock);
+		xt_dns_store(e, addr, naddr);
+	}
+	--xt_dns_workers;
+	pthread_mutex_unlock(&xt_dns_lock);
 	return NULL;
 }
 
+/*
+ * Find the cache entry for @name, or add one and, if @queue, hand it to the
+ * workers. Returns the entry, with @own set if nobody is going to resolve
+ * it but the caller. Called with xt_dns_lock held.
+ */
+static struct xt_dns_entry *xt_dns_get(const char *name, int family,
+				       bool reverse, bool queue, bool *own)
+{
+	struct xt_dns_entry **bucket, *e;
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	*own = false;
+	bucket = &xt_dns_hash[(xt_name_hash(name) + family + reverse) %
+	         XT_DNS_HSIZE];
+	for (e = *bucket; e != NULL; e = e->next)
+		if (e->family == family && e->reverse == reverse &&
+		    strcmp(e->name, name) == 0)
+			return e;
+
+	e = xtables_calloc(1, sizeof(*e) + strlen(name) + 1);
+	gettimeofday(&e->since, NULL);
+	e->family  = family;
+	e->reverse = reverse;
+	strcpy(e->name, name);
+	e->next = *bucket;
+	*bucket = e;
+
+	if (queue && xt_dns_workers < XT_DNS_WORKERS) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&tid, &attr, xt_dns_worker, NULL) == 0)
+			++xt_dns_workers;
+		pthread_attr_destroy(&attr);
+	}
+	if (!queue || xt_dns_workers == 0) {
+		*own = true;
+		return e;
+	}
+	e->job_next = xt_dns_jobs;
+	xt_dns_jobs = e;
+	return e;
+}
+
+/* Resolve an entry the workers will not get to. Called with the lock held. */
+static void xt_dns_resolve_own(struct xt_dns_entry *e)
+{
+	unsigned int naddr;
+	void *addr;
+
+	pthread_mutex_unlock(&xt_dns_lock);
+	addr = xt_dns_resolve(e, &naddr);
+	pthread_mutex_lock(&xt_dns_lock);
+	xt_dns_store(e, addr, naddr);
+}
+
+/* Start looking up a name that will be asked for shortly */
+static void xt_dns_prefetch(const char *name, int family, bool reverse)
+{
+	struct xt_dns_entry *e;
+	bool own;
+
+	pthread_mutex_lock(&xt_dns_lock);
+	e = xt_dns_get(name, family, reverse, true, &own);
+	if (own)
+		xt_dns_resolve_own(e);
+	pthread_mutex_unlock(&xt_dns_lock);
+}
+
+/*
+ * Wait for @e to be resolved, at most @timeout seconds after it was first
+ * asked for. Returns false if it was not. Called with the lock held.
+ */
+static bool xt_dns_wait(struct xt_dns_entry *e, int timeout)
+{
+	struct timespec deadline;
+
+	deadline.tv_sec  = e->since.tv_sec + timeout;
+	deadline.tv_nsec = e->since.tv_usec * 1000;
+	while (!e->done) {
+		if (timeout < 0)
+			pthread_cond_wait(&xt_dns_cond, &xt_dns_lock);
+		else if (pthread_cond_timedwait(&xt_dns_cond, &xt_dns_lock,
+		    &deadline) == ETIMEDOUT)
+			return e->done;
+	}
+	return true;
+}
+
+/*
+ * Returns a copy of the addresses @name resolves to, or NULL with errno set
+ * to ETIMEDOUT if XTABLES_DNS_TIMEOUT ran out first.
+ */
+static void *xt_dns_lookup(const char *name, int family, unsigned int *naddr)
+{
+	size_t len = family == AF_INET ? sizeof(struct in_addr) :
+	             sizeof(struct in6_addr);
+	int timeout = xt_dns_get_timeout(false);
+	struct xt_dns_entry *e;
+	void *addr;
+	bool own;
+
+	/*
+	 * Without a timeout there is no point in a thread switch, the
+	 * caller would only sit and wait for the answer anyway.
+	 */
+	pthread_mutex_lock(&xt_dns_lock);
+	e = xt_dns_get(name, family, false, timeout >= 0, &own);
+	if (own)
+		xt_dns_resolve_own(e);
+	if (!xt_dns_wait(e, timeout)) {
+		pthread_mutex_unlock(&xt_dns_lock);
+		*naddr = 0;
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+	pthread_mutex_unlock(&xt_dns_lock);
+
+	*naddr = e->naddr;
+	if (e->naddr == 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+	addr = xtables_malloc(len * e->naddr);
+	memcpy(addr, e->addr, len * e->naddr);
+	return addr;
+}
+
+/* Returns the host name for the numeric address @num, or NULL */
+static const char *xt_dns_reverse(const char *num, int family)
+{
+	struct xt_dns_entry *e;
+	bool own;
+
+	pthread_mutex_lock(&xt_dns_lock);
+	e = xt_dns_get(num, family, true, true, &own);
+	if (own)
+		xt_dns_resolve_own(e);
+	if (!xt_dns_wait(e, xt_dns_get_timeout(true)))
+		e = NULL;
+	pthread_mutex_unlock(&xt_dns_lock);
+
+	return e != NULL ? e->addr : NULL;
+}
+
+static struct in_addr *host_to_ipaddr(const char *name, unsigned int *naddr)
+{
+	return xt_dns_lookup(name, AF_INET, naddr);
+}
+
 static struct in_addr *
 ipparse_hostnetwork(const char *name, unsigned int *naddrs)
 {
@@ -1251,15 +2166,19 @@ ipparse_hostnetwork(const char *name, unsigned int *naddrs)
 		*naddrs = 1;
 		return addrp;
 	}
+	errno = 0;
 	if ((addrptmp = host_to_ipaddr(name, naddrs)) != NULL)
 		return addrptmp;
 
+	if (errno == ETIMEDOUT)
+		xt_params->exit_err(PARAMETER_PROBLEM,
+			"host/network `%s' lookup timed out", name);
 	xt_params->exit_err(PARAMETER_PROBLEM, "host/network `%s' not found", name);
 }
 
 static struct in_addr *parse_ipmask(const char *mask)
 {
-	static struct in_addr maskaddr;
+	static __thread struct in_addr maskaddr;
 	struct in_addr *addrp;
 	unsigned int bits;
 
@@ -1271,7 +2190,7 @@ static struct in_addr *parse_ipmask(const char *mask)
 	if ((addrp = xtables_numeric_to_ipmask(mask)) != NULL)
 		/* dotted_to_addr already returns a network byte order addr */
 		return addrp;
-	if (!xtables_strtoui(mask, NULL, &bits, 0, 32))
+	if (!xtables_parse_prefix(mask, &bits, 32))
 		xt_params->exit_err(PARAMETER_PROBLEM,
 			   "invalid mask `%s' specified", mask);
 	if (bits != 0) {
@@ -1283,6 +2202,58 @@ static struct in_addr *parse_ipmask(const char *mask)
 	return &maskaddr;
 }
 
+/* Whether @mask, as given after the '/', masks out the whole address */
+static bool ipparse_null_mask(const char *mask, int family)
+{
+	static const struct in6_addr zero_addr;
+	const struct in6_addr *addr6;
+	const struct in_addr *addr;
+	unsigned int bits;
+
+	if (family == AF_INET) {
+		if ((addr = xtables_numeric_to_ipmask(mask)) != NULL)
+			return addr->s_addr == 0;
+	} else if ((addr6 = xtables_numeric_to_ip6addr(mask)) != NULL) {
+		return memcmp(addr6, &zero_addr, sizeof(zero_addr)) == 0;
+	}
+	return xtables_parse_prefix(mask, &bits,
+				    family == AF_INET ? 32 : 128) && bits == 0;
+}
+
+/*
+ * Get the lookups for all hosts of a list going before the first is needed.
+ * Numeric addresses and names under a null mask are never looked up, and
+ * network names are left to ipparse_hostnetwork; asking for one of those
+ * here only costs a lookup that comes back empty.
+ */
+static void ipparse_prefetch(const char *name, int family)
+{
+	const char *loop, *next;
+	char buf[256], *p;
+	size_t len;
+
+	if (strchr(name, ',') == NULL)
+		return;
+	for (loop = name; *loop != '\0'; loop = next) {
+		next = strchr(loop, ',');
+		len  = next != NULL ? next - loop : strlen(loop);
+		next = next != NULL ? next + 1 : loop + len;
+		if (len == 0 || len >= sizeof(buf))
+			continue;
+		memcpy(buf, loop, len);
+		buf[len] = '\0';
+		if ((p = strrchr(buf, '/')) != NULL) {
+			if (ipparse_null_mask(p + 1, family))
+				continue;
+			*p = '\0';
+		}
+		if (family == AF_INET ? xtables_numeric_to_ipaddr(buf) != NULL :
+		    xtables_numeric_to_ip6addr(buf) != NULL)
+			continue;
+		xt_dns_prefetch(buf, family, false);
+	}
+}
+
 void xtables_ipparse_multiple(const char *name, struct in_addr **addrpp,
                               struct in_addr **maskpp, unsigned int *naddrs)
 {
@@ -1300,6 +2271,7 @@ void xtables_ipparse_multiple(const char *name, struct in_addr **addrpp,
 	*maskpp = xtables_malloc(sizeof(struct in_addr) * count);
 
 	loop = name;
+	ipparse_prefetch(name, AF_INET);
 
 	for (i = 0; i < count; ++i) {
 		if (loop == NULL)
@@ -1413,33 +2385,18 @@ const char *xtables_ip6addr_to_numeric(const struct in6_addr *addrp)
 {
 	/* 0000:0000:0000:0000:0000:0000:000.000.000.000
 	 * 0000:0000:0000:0000:0000:0000:0000:0000 */
-	static char buf[50+1];
+	static __thread char buf[50+1];
 	return inet_ntop(AF_INET6, addrp, buf, sizeof(buf));
 }
 
 static const char *ip6addr_to_host(const struct in6_addr *addr)
 {
-	static char hostname[NI_MAXHOST];
-	struct sockaddr_in6 saddr;
-	int err;
-
-	memset(&saddr, 0, sizeof(struct sockaddr_in6));
-	memcpy(&saddr.sin6_addr, addr, sizeof(*addr));
-	saddr.sin6_family = AF_INET6;
-
-	err = getnameinfo((const void *)&saddr, sizeof(struct sockaddr_in6),
-	      hostname, sizeof(hostname) - 1, NULL, 0, 0);
-	if (err != 0) {
-#ifdef DEBUG
-		fprintf(stderr,"IP2Name: %s\n",gai_strerror(err));
-#endif
-		return NULL;
-	}
+	return xt_dns_reverse(xtables_ip6addr_to_numeric(addr), AF_INET6);
+}
 
-#ifdef DEBUG
-	fprintf (stderr, "\naddr2host: %s\n", hostname);
-#endif
-	return hostname;
+void xtables_ip6addr_prefetch(const struct in6_addr *addr)
+{
+	xt_dns_prefetch(xtables_ip6addr_to_numeric(addr), AF_INET6, true);
 }
 
 const char *xtables_ip6addr_to_anyname(const struct in6_addr *addr)
@@ -1478,7 +2435,7 @@ static int ip6addr_prefix_length(const struct in6_addr *k)
 
 const char *xtables_ip6mask_to_numeric(const struct in6_addr *addrp)
 {
-	static char buf[50+2];
+	static __thread char buf[50+2];
 	int l = ip6addr_prefix_length(addrp);
 
 	if (l == -1) {
@@ -1486,13 +2443,14 @@ const char *xtables_ip6mask_to_numeric(const struct in6_addr *addrp)
 		strcat(buf, xtables_ip6addr_to_numeric(addrp));
 		return buf;
 	}
-	sprintf(buf, "/%d", l);
+	buf[0] = '/';
+	*xt_put_dec(buf + 1, l) = '\0';
 	return buf;
 }
 
 struct in6_addr *xtables_numeric_to_ip6addr(const char *num)
 {
-	static struct in6_addr ap;
+	static __thread struct in6_addr ap;
 	int err;
 
 	if ((err = inet_pton(AF_INET6, num, &ap)) == 1)
@@ -1506,42 +2464,7 @@ struct in6_addr *xtables_numeric_to_ip6addr(const char *num)
 static struct in6_addr *
 host_to_ip6addr(const char *name, unsigned int *naddr)
 {
-	struct in6_addr *addr;
-	struct addrinfo hints;
-	struct addrinfo *res, *p;
-	int err;
-	unsigned int i;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_flags    = AI_CANONNAME;
-	hints.ai_family   = AF_INET6;
-	hints.ai_socktype = SOCK_RAW;
-
-	*naddr = 0;
-	if ((err = getaddrinfo(name, NULL, &hints, &res)) != 0) {
-#ifdef DEBUG
-		fprintf(stderr,"Name2IP: %s\n",gai_strerror(err));
-#endif
-		return NULL;
-	} else {
-		/* Find length of address chain */
-		for (p = res; p != NULL; p = p->ai_next)
-			++*naddr;
-#ifdef DEBUG
-		fprintf(stderr, "resolved: len=%d  %s ", res->ai_addrlen,
-		        xtables_ip6addr_to_numeric(&((struct sockaddr_in6 *)res->ai_addr)->sin6_addr));
-#endif
-		/* Copy each element of the address chain */
-		addr = xtables_calloc(*naddr, sizeof(struct in6_addr));
-		for (i = 0, p = res; p != NULL; p = p->ai_next)
-			memcpy(&addr[i++],
-			       &((const struct sockaddr_in6 *)p->ai_addr)->sin6_addr,
-			       sizeof(struct in6_addr));
-		freeaddrinfo(res);
-		return addr;
-	}
-
-	return NULL;
+	return xt_dns_lookup(name, AF_INET6, naddr);
 }
 
 static struct in6_addr *network_to_ip6addr(const char *name)
@@ -1564,15 +2487,19 @@ ip6parse_hostnetwork(const char *name, unsigned int *naddrs)
 		*naddrs = 1;
 		return addrp;
 	}
+	errno = 0;
 	if ((addrp = host_to_ip6addr(name, naddrs)) != NULL)
 		return addrp;
 
+	if (errno == ETIMEDOUT)
+		xt_params->exit_err(PARAMETER_PROBLEM,
+			"host/network `%s' lookup timed out", name);
 	xt_params->exit_err(PARAMETER_PROBLEM, "host/network `%s' not found", name);
 }
 
 static struct in6_addr *parse_ip6mask(char *mask)
 {
-	static struct in6_addr maskaddr;
+	static __thread struct in6_addr maskaddr;
 	struct in6_addr *addrp;
 	unsigned int bits;
 
@@ -1583,14 +2510,15 @@ static struct in6_addr *parse_ip6mask(char *mask)
 	}
 	if ((addrp = xtables_numeric_to_ip6addr(mask)) != NULL)
 		return addrp;
-	if (!xtables_strtoui(mask, NULL, &bits, 0, 128))
+	if (!xtables_parse_prefix(mask, &bits, 128))
 		xt_params->exit_err(PARAMETER_PROBLEM,
 			   "invalid mask `%s' specified", mask);
 	if (bits != 0) {
 		char *p = (void *)&maskaddr;
 		memset(p, 0xff, bits / 8);
-		memset(p + (bits / 8) + 1, 0, (128 - bits) / 8);
-		p[bits/8] = 0xff << (8 - (bits & 7));
+		memset(p + bits / 8, 0, sizeof(maskaddr) - bits / 8);
+		if (bits & 7)
+			p[bits/8] = 0xff << (8 - (bits & 7));
 		return &maskaddr;
 	}
 
@@ -1617,6 +2545,7 @@ xtables_ip6parse_multiple(const char *name, struct in6_addr **addrpp,
 	*maskpp = xtables_malloc(sizeof(struct in6_addr) * count);
 
 	loop = name;
+	ipparse_prefetch(name, AF_INET6);
 
 	for (i = 0; i < count /*NB: count can grow*/; ++i) {
 		if (loop == NULL)
@@ -1805,6 +2734,7 @@ xtables_parse_protocol(const char *s)
 {
 	const struct protoent *pent;
 	unsigned int proto, i;
+	int ret = -1;
 
 	if (xtables_strtoui(s, NULL, &proto, 0, UINT8_MAX))
 		return proto;
@@ -1816,9 +2746,13 @@ xtables_parse_protocol(const char *s)
 	if (strcmp(s, "all") == 0)
 		return 0;
 
+	pthread_mutex_lock(&xt_netdb_lock);
 	pent = getprotobyname(s);
 	if (pent != NULL)
-		return pent->p_proto;
+		ret = pent->p_proto;
+	pthread_mutex_unlock(&xt_netdb_lock);
+	if (ret >= 0)
+		return ret;
 
 	for (i = 0; i < ARRAY_SIZE(xtables_chain_protos); ++i) {
 		if (xtables_chain_protos[i].name == NULL)
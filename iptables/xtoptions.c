@@ -74,35 +74,19 @@ struct option *
 xtables_options_xfrm(struct option *orig_opts, struct option *oldopts,
 		     const struct xt_option_entry *entry, unsigned int *offset)
 {
-	unsigned int num_orig, num_old = 0, num_new, i;
+	unsigned int num_new, i;
 	struct option *merge, *mp;
 
 	if (entry == NULL)
 		return oldopts;
-	for (num_orig = 0; orig_opts[num_orig].name != NULL; ++num_orig)
-		;
-	if (oldopts != NULL)
-		for (num_old = 0; oldopts[num_old].name != NULL; ++num_old)
-			;
 	for (num_new = 0; entry[num_new].name != NULL; ++num_new)
 		;
 
-	/*
-	 * Since @oldopts also has @orig_opts already (and does so at the
-	 * start), skip these entries.
-	 */
-	oldopts += num_orig;
-	num_old -= num_orig;
-
-	merge = malloc(sizeof(*mp) * (num_orig + num_old + num_new + 1));
+	merge = xtables_opts_reserve(orig_opts, oldopts, num_new, &mp);
 	if (merge == NULL)
 		return NULL;
 
-	/* Let the base options -[ADI...] have precedence over everything */
-	memcpy(merge, orig_opts, sizeof(*mp) * num_orig);
-	mp = merge + num_orig;
-
-	/* Second, the new options */
+	/* The new options go in front of the old ones */
 	xt_params->option_offset += XT_OPTION_OFFSET_SCALE;
 	*offset = xt_params->option_offset;
 
@@ -112,14 +96,6 @@ xtables_options_xfrm(struct option *orig_opts, struct option *oldopts,
 		mp->flag         = NULL;
 		mp->val          = entry->id + *offset;
 	}
-
-	/* Third, the old options */
-	memcpy(mp, oldopts, sizeof(*mp) * num_old);
-	mp += num_old;
-	xtables_free_opts(0);
-
-	/* Clear trailing entry */
-	memset(mp, 0, sizeof(*mp));
 	return merge;
 }
 
@@ -513,19 +489,30 @@ static socklen_t xtables_sa_hostlen(unsigned int afproto)
  */
 static void xtopt_parse_host(struct xt_option_call *cb)
 {
-	struct addrinfo hints = {.ai_family = afinfo->family};
+	struct addrinfo hints = {.ai_family = xt_afinfo()->family};
 	unsigned int adcount = 0;
 	struct addrinfo *res, *p;
 	int ret;
 
+	memset(&cb->val.hmask, 0xFF, sizeof(cb->val.hmask));
+	cb->val.hlen = (xt_afinfo()->family == NFPROTO_IPV4) ? 32 : 128;
+
+	/*
+	 * Numeric addresses need not go through getaddrinfo. Only the forms
+	 * for which it would return the very same address are taken here;
+	 * shorthands such as "10.1" and scoped IPv6 addresses are left to it.
+	 */
+	memset(&cb->val.haddr, 0, sizeof(cb->val.haddr));
+	if (xt_afinfo()->family == NFPROTO_IPV4 ?
+	    xtables_parse_dotted_quad(cb->arg, &cb->val.haddr.in) :
+	    inet_pton(AF_INET6, cb->arg, &cb->val.haddr.in6) == 1)
+		goto out;
+
 	ret = getaddrinfo(cb->arg, NULL, &hints, &res);
 	if (ret < 0)
 		xt_params->exit_err(PARAMETER_PROBLEM,
 			"getaddrinfo: %s\n", gai_strerror(ret));
 
-	memset(&cb->val.hmask, 0xFF, sizeof(cb->val.hmask));
-	cb->val.hlen = (afinfo->family == NFPROTO_IPV4) ? 32 : 128;
-
 	for (p = res; p != NULL; p = p->ai_next) {
 		if (adcount == 0) {
 			memset(&cb->val.haddr, 0, sizeof(cb->val.haddr));
@@ -544,6 +531,7 @@ static void xtopt_parse_host(struct xt_option_call *cb)
 	}
 
 	freeaddrinfo(res);
+ out:
 	if (cb->entry->flags & XTOPT_PUT)
 		/* Validation in xtables_option_metavalidate */
 		memcpy(XTOPT_MKPTR(cb), &cb->val.haddr,
@@ -676,8 +664,8 @@ static void xtopt_parse_plen(struct xt_option_call *cb)
 	const struct xt_option_entry *entry = cb->entry;
 	unsigned int prefix_len = 128; /* happiness is a warm gcc */
 
-	cb->val.hlen = (afinfo->family == NFPROTO_IPV4) ? 32 : 128;
-	if (!xtables_strtoui(cb->arg, NULL, &prefix_len, 0, cb->val.hlen))
+	cb->val.hlen = (xt_afinfo()->family == NFPROTO_IPV4) ? 32 : 128;
+	if (!xtables_parse_prefix(cb->arg, &prefix_len, cb->val.hlen))
 		xt_params->exit_err(PARAMETER_PROBLEM,
 			"%s: bad value for option \"--%s\", "
 			"or out of range (%u-%u).\n",
@@ -1056,6 +1044,60 @@ void xtables_option_mfcall(struct xtables_match *m)
 		xtables_options_fcheck(m->name, m->mflags, m->x6_options);
 }
 
+/*
+ * Lookup tables of an lmap: ids are 0..255, so they index an array
+ * directly; names go into a hash table with open addressing. Where the
+ * file has duplicates, the first entry wins, as with a list walk.
+ */
+struct xt_lmap_index {
+	const struct xtables_lmap *by_id[256];
+	const struct xtables_lmap **by_name;
+	unsigned int mask;
+};
+
+static unsigned int xt_lmap_hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name != '\0')
+		h = h * 33 + (unsigned char)*name++;
+	return h;
+}
+
+static struct xt_lmap_index *xt_lmap_index(const struct xtables_lmap *head)
+{
+	const struct xtables_lmap *e;
+	struct xt_lmap_index *idx;
+	unsigned int n = 0, size = 16, i;
+
+	for (e = head; e != NULL; e = e->next)
+		++n;
+	while (size < 2 * n)
+		size *= 2;
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return NULL;
+	idx->by_name = calloc(size, sizeof(*idx->by_name));
+	if (idx->by_name == NULL) {
+		free(idx);
+		return NULL;
+	}
+	idx->mask = size - 1;
+
+	for (e = head; e != NULL; e = e->next) {
+		if (idx->by_id[e->id] == NULL)
+			idx->by_id[e->id] = e;
+		for (i = xt_lmap_hash(e->name) & idx->mask;
+		     idx->by_name[i] != NULL; i = (i + 1) & idx->mask)
+			if (strcmp(idx->by_name[i]->name, e->name) == 0)
+				break;
+		if (idx->by_name[i] == NULL)
+			idx->by_name[i] = e;
+	}
+	return idx;
+}
+
 struct xtables_lmap *xtables_lmap_init(const char *file)
 {
 	struct xtables_lmap *lmap_head = NULL, *lmap_prev = NULL, *lmap_this;
@@ -1111,7 +1153,8 @@ struct xtables_lmap *xtables_lmap_init(const char *file)
 			free(lmap_this);
 			goto out;
 		}
-		lmap_this->next = NULL;
+		lmap_this->next  = NULL;
+		lmap_this->index = NULL;
 
 		if (lmap_prev != NULL)
 			lmap_prev->next = lmap_this;
@@ -1121,8 +1164,17 @@ struct xtables_lmap *xtables_lmap_init(const char *file)
 	}
 
 	fclose(fp);
+	if (lmap_head != NULL) {
+		lmap_head->index = xt_lmap_index(lmap_head);
+		if (lmap_head->index == NULL) {
+			perror("malloc");
+			xtables_lmap_free(lmap_head);
+			return NULL;
+		}
+	}
 	return lmap_head;
  out:
+	fclose(fp);
 	xtables_lmap_free(lmap_head);
 	return NULL;
 }
@@ -1131,6 +1183,10 @@ void xtables_lmap_free(struct xtables_lmap *head)
 {
 	struct xtables_lmap *next;
 
+	if (head != NULL && head->index != NULL) {
+		free(head->index->by_name);
+		free(head->index);
+	}
 	for (; head != NULL; head = next) {
 		next = head->next;
 		free(head->name);
@@ -1140,16 +1196,36 @@ void xtables_lmap_free(struct xtables_lmap *head)
 
 int xtables_lmap_name2id(const struct xtables_lmap *head, const char *name)
 {
-	for (; head != NULL; head = head->next)
-		if (strcmp(head->name, name) == 0)
-			return head->id;
+	const struct xt_lmap_index *idx;
+	unsigned int i;
+
+	if (head == NULL)
+		return -1;
+	idx = head->index;
+	if (idx == NULL) {
+		/* A list built by hand, not by xtables_lmap_init */
+		for (; head != NULL; head = head->next)
+			if (strcmp(head->name, name) == 0)
+				return head->id;
+		return -1;
+	}
+	for (i = xt_lmap_hash(name) & idx->mask; idx->by_name[i] != NULL;
+	     i = (i + 1) & idx->mask)
+		if (strcmp(idx->by_name[i]->name, name) == 0)
+			return idx->by_name[i]->id;
 	return -1;
 }
 
 const char *xtables_lmap_id2name(const struct xtables_lmap *head, int id)
 {
-	for (; head != NULL; head = head->next)
-		if (head->id == id)
-			return head->name;
-	return NULL;
+	if (head != NULL && head->index == NULL) {
+		for (; head != NULL; head = head->next)
+			if (head->id == id)
+				return head->name;
+		return NULL;
+	}
+	if (head == NULL || id < 0 || id > UINT8_MAX ||
+	    head->index->by_id[id] == NULL)
+		return NULL;
+	return head->index->by_id[id]->name;
 }
@@ -0,0 +1,932 @@
+/*
+ * ipq_peer_test.c
+ *
+ * Load test for libipq that needs no ip_queue in the kernel.
+ *
+ * The program plays both ends of a queue. Its own definitions of socket(),
+ * bind() and the send and receive calls take precedence over the C
+ * library's, so when libipq opens a NETLINK_FIREWALL socket it gets one
+ * end of an AF_UNIX datagram socketpair instead. Two peer threads on the
+ * other end stand in for the kernel: one queues synthetic IPQM_PACKET
+ * messages at a given rate and size, the other checks every IPQM_VERDICT
+ * that comes back. Messages keep their netlink framing, and received
+ * datagrams appear to come from netlink pid 0, so libipq itself runs
+ * unmodified through ipq_create_handle, ipq_set_mode, ipq_read and
+ * ipq_set_verdict.
+ *
+ * The application side checks each packet and picks a verdict from the
+ * packet id; every fifth packet is accepted with a modified payload. How
+ * it gets the packets is chosen with -m:
+ *
+ *	read		one at a time with ipq_read
+ *	batch		many per call with ipq_read_batch
+ *	dispatch	through ipq_dispatch, with -w worker threads; a list
+ *			such as -w 1,2,4 runs once for each count
+ *	pool		many per call with ipq_read_pool, into buffers it
+ *			keeps until it gives them back
+ *
+ * With -k, the application holds that many packets back before giving
+ * their verdicts, as an inspector looking at several packets at once
+ * would. Except in the pool mode, it has to copy them to do so.
+ *
+ * The peer reports throughput, the time from queueing a packet to
+ * receiving its verdict, and the system calls, allocations and copies
+ * made per packet.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE 1	/* recvmmsg, sendmmsg */
+#undef _FORTIFY_SOURCE	/* keep recvfrom() a plain call */
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#include <libipq/libipq.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
+
+/* glibc passes socket addresses as a transparent union under _GNU_SOURCE */
+#if defined(__USE_GNU) && defined(__GNUC__) && !defined(__cplusplus)
+#define SOCKADDR(a)	((a).__sockaddr__)
+#else
+#define SOCKADDR(a)	(a)
+#endif
+
+#define PEER_TIMEOUT	5	/* seconds without a verdict before giving up */
+#define MAX_SWEEP	16	/* worker counts in one -w list */
+
+static int queue_fd = -1;	/* libipq's end of the socketpair */
+static int peer_fd = -1;	/* the stand-in kernel's end */
+static unsigned long recv_calls, send_calls;
+static unsigned long alloc_calls, alloc_bytes, copied_bytes;
+static unsigned long run_allocs, run_alloc_bytes;	/* by the mode alone */
+
+struct peer {
+	unsigned long count;		/* packets to queue */
+	size_t size;			/* payload bytes per packet */
+	unsigned long rate;		/* packets per second, 0 for no limit */
+	unsigned int workers;		/* for the dispatch mode */
+	unsigned int keep;		/* packets held back by the application */
+
+	pthread_t sender, receiver;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int mode_set;			/* IPQM_MODE seen */
+	int done;			/* receiver finished */
+	uint64_t *stamp;		/* send time, then latency, per id */
+	unsigned char *seen;
+	uint64_t start, end;
+	unsigned long verdicts;
+	unsigned long bad_verdicts;	/* found by the peer */
+	unsigned long bad_packets;	/* found by the application */
+	const char *error;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/****************************************************************************
+ *
+ * Socket calls. libipq's NETLINK_FIREWALL socket becomes one end of a
+ * socketpair; every other descriptor goes straight to the kernel.
+ *
+ ****************************************************************************/
+
+static void peer_name(struct sockaddr *addr, socklen_t *len)
+{
+	struct sockaddr_nl *nl = (struct sockaddr_nl *)addr;
+
+	if (nl == NULL || len == NULL || *len < sizeof(*nl))
+		return;
+	memset(nl, 0, sizeof(*nl));
+	nl->nl_family = AF_NETLINK;
+	*len = sizeof(*nl);
+}
+
+int socket(int domain, int type, int protocol)
+{
+	int sv[2], size = 4 << 20;
+
+	if (domain != PF_NETLINK ||
+	    (protocol != NETLINK_FIREWALL && protocol != NETLINK_IP6_FW))
+		return syscall(SYS_socket, domain, type, protocol);
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0)
+		return -1;
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	queue_fd = sv[0];
+	peer_fd = sv[1];
+	return queue_fd;
+}
+
+int bind(int fd, __CONST_SOCKADDR_ARG addr, socklen_t len)
+{
+	if (fd == queue_fd)
+		return 0;
+	return syscall(SYS_bind, fd, SOCKADDR(addr), len);
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+               __CONST_SOCKADDR_ARG addr, socklen_t alen)
+{
+	if (fd != queue_fd)
+		return syscall(SYS_sendto, fd, buf, len, flags,
+		               SOCKADDR(addr), alen);
+	__atomic_fetch_add(&send_calls, 1, __ATOMIC_RELAXED);
+	return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	struct msghdr m;
+
+	if (fd != queue_fd)
+		return syscall(SYS_sendmsg, fd, msg, flags);
+	__atomic_fetch_add(&send_calls, 1, __ATOMIC_RELAXED);
+	m = *msg;
+	m.msg_name = NULL;
+	m.msg_namelen = 0;
+	return syscall(SYS_sendmsg, fd, &m, flags);
+}
+
+int sendmmsg(int fd, struct mmsghdr *vec, unsigned int n, int flags)
+{
+	struct mmsghdr m[64];
+	unsigned int i, k, sent = 0;
+	int ret;
+
+	if (fd != queue_fd)
+		return syscall(SYS_sendmmsg, fd, vec, n, flags);
+	__atomic_fetch_add(&send_calls, 1, __ATOMIC_RELAXED);
+	while (sent < n) {
+		k = n - sent < 64 ? n - sent : 64;
+		for (i = 0; i < k; ++i) {
+			m[i] = vec[sent + i];
+			m[i].msg_hdr.msg_name = NULL;
+			m[i].msg_hdr.msg_namelen = 0;
+		}
+		ret = syscall(SYS_sendmmsg, fd, m, k, flags);
+		if (ret < 0)
+			return sent > 0 ? (int)sent : -1;
+		for (i = 0; i < (unsigned int)ret; ++i)
+			vec[sent + i].msg_len = m[i].msg_len;
+		sent += ret;
+		if ((unsigned int)ret < k)
+			break;
+	}
+	return sent;
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags,
+                 __SOCKADDR_ARG addr, socklen_t *alen)
+{
+	ssize_t ret;
+
+	if (fd != queue_fd)
+		return syscall(SYS_recvfrom, fd, buf, len, flags,
+		               SOCKADDR(addr), alen);
+	__atomic_fetch_add(&recv_calls, 1, __ATOMIC_RELAXED);
+	ret = syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+	if (ret >= 0)
+		peer_name(SOCKADDR(addr), alen);
+	return ret;
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	ssize_t ret;
+
+	if (fd != queue_fd)
+		return syscall(SYS_recvmsg, fd, msg, flags);
+	__atomic_fetch_add(&recv_calls, 1, __ATOMIC_RELAXED);
+	ret = syscall(SYS_recvmsg, fd, msg, flags);
+	if (ret >= 0) {
+		msg->msg_namelen = sizeof(struct sockaddr_nl);
+		peer_name(msg->msg_name, &msg->msg_namelen);
+	}
+	return ret;
+}
+
+int recvmmsg(int fd, struct mmsghdr *vec, unsigned int n, int flags,
+             struct timespec *timeout)
+{
+	int i, ret;
+
+	if (fd != queue_fd)
+		return syscall(SYS_recvmmsg, fd, vec, n, flags, timeout);
+	__atomic_fetch_add(&recv_calls, 1, __ATOMIC_RELAXED);
+	ret = syscall(SYS_recvmmsg, fd, vec, n, flags, timeout);
+	for (i = 0; i < ret; ++i) {
+		vec[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_nl);
+		peer_name(vec[i].msg_hdr.msg_name, &vec[i].msg_hdr.msg_namelen);
+	}
+	return ret;
+}
+
+/****************************************************************************
+ *
+ * Memory allocation, counted to compare the modes. glibc lets a program
+ * replace malloc and friends and still reach its own under other names;
+ * elsewhere allocations are not counted.
+ *
+ ****************************************************************************/
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static void alloc_count(size_t size)
+{
+	__atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	alloc_count(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count(nmemb * size);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count(size);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+/****************************************************************************
+ *
+ * The peer: queues packets and checks verdicts
+ *
+ ****************************************************************************/
+
+static unsigned int expected_verdict(unsigned long id)
+{
+	return id % 3 ? NF_ACCEPT : NF_DROP;
+}
+
+/* Every fifth packet gets its first bytes inverted by the application */
+static size_t expected_mangle(unsigned long id, size_t size)
+{
+	if (id % 5 != 0)
+		return 0;
+	return size < 8 ? size : 8;
+}
+
+static void *peer_send(void *arg)
+{
+	struct peer *p = arg;
+	size_t len = NLMSG_SPACE(sizeof(ipq_packet_msg_t) + p->size);
+	struct nlmsghdr *nlh;
+	ipq_packet_msg_t *m;
+	uint64_t next;
+	unsigned long i;
+
+	nlh = calloc(1, len);
+	if (nlh == NULL) {
+		p->error = "out of memory";
+		return NULL;
+	}
+	nlh->nlmsg_len = len;
+	nlh->nlmsg_type = IPQM_PACKET;
+	m = NLMSG_DATA(nlh);
+	m->hook = NF_INET_LOCAL_IN;
+	strcpy(m->indev_name, "eth0");
+	m->hw_protocol = htons(0x0800);
+	m->data_len = p->size;
+
+	/* The kernel only queues once a mode has been set */
+	pthread_mutex_lock(&p->lock);
+	while (!p->mode_set && p->error == NULL)
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+
+	p->start = now_ns();
+	for (i = 0; i < p->count && p->error == NULL; ++i) {
+		if (p->rate != 0) {
+			next = p->start + i * 1000000000ULL / p->rate;
+			if (now_ns() < next) {
+				struct timespec ts = {
+					.tv_sec  = next / 1000000000ULL,
+					.tv_nsec = next % 1000000000ULL,
+				};
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				                &ts, NULL);
+			}
+		}
+		m->packet_id = i;
+		m->mark = i;
+		memset(m->payload, i & 0xff, p->size);
+		p->stamp[i] = now_ns();
+		if (send(peer_fd, nlh, len, 0) < 0) {
+			p->error = "cannot queue packet";
+			break;
+		}
+	}
+	free(nlh);
+	return NULL;
+}
+
+static void peer_verdict(struct peer *p, struct nlmsghdr *nlh, uint64_t t)
+{
+	ipq_verdict_msg_t *v = &((ipq_peer_msg_t *)NLMSG_DATA(nlh))->msg.verdict;
+	size_t mangle, i;
+
+	if (nlh->nlmsg_len < NLMSG_HDRLEN + sizeof(ipq_peer_msg_t) ||
+	    v->id >= p->count || p->seen[v->id]) {
+		++p->bad_verdicts;
+		return;
+	}
+	p->seen[v->id] = 1;
+	p->stamp[v->id] = t - p->stamp[v->id];
+	++p->verdicts;
+
+	mangle = expected_mangle(v->id, p->size);
+	if (v->value != expected_verdict(v->id) || v->data_len != mangle ||
+	    nlh->nlmsg_len != NLMSG_HDRLEN + sizeof(ipq_peer_msg_t) + mangle) {
+		++p->bad_verdicts;
+		return;
+	}
+	for (i = 0; i < mangle; ++i)
+		if (v->payload[i] != (unsigned char)~v->id) {
+			++p->bad_verdicts;
+			return;
+		}
+}
+
+static void *peer_recv(void *arg)
+{
+	struct peer *p = arg;
+	/* IPQM_MODE claims one header more than it holds: leave room */
+	size_t size = 2 * NLMSG_SPACE(sizeof(ipq_peer_msg_t)) + p->size;
+	struct timeval tv = { .tv_sec = PEER_TIMEOUT };
+	struct nlmsghdr *nlh;
+	ipq_mode_msg_t *mode;
+	unsigned char *buf;
+	ssize_t len;
+	uint64_t t;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		p->error = "out of memory";
+		return NULL;
+	}
+	setsockopt(peer_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (p->verdicts < p->count && p->error == NULL) {
+		len = recv(peer_fd, buf, size, 0);
+		if (len < 0) {
+			p->error = "no verdict within the timeout";
+			break;
+		}
+		t = now_ns();
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			switch (nlh->nlmsg_type) {
+			case IPQM_VERDICT:
+				peer_verdict(p, nlh, t);
+				break;
+			case IPQM_MODE:
+				mode = &((ipq_peer_msg_t *)NLMSG_DATA(nlh))->msg.mode;
+				pthread_mutex_lock(&p->lock);
+				if (mode->value != IPQ_COPY_PACKET ||
+				    mode->range < p->size)
+					p->error = "unexpected queue mode";
+				p->mode_set = 1;
+				pthread_cond_broadcast(&p->cond);
+				pthread_mutex_unlock(&p->lock);
+				break;
+			default:
+				++p->bad_verdicts;
+				break;
+			}
+		}
+	}
+	p->end = now_ns();
+	/* Wake the sender if no mode ever came, and the dispatch mode */
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	free(buf);
+	return NULL;
+}
+
+static int peer_start(struct peer *p)
+{
+	p->stamp = calloc(p->count, sizeof(*p->stamp));
+	p->seen = calloc(p->count, 1);
+	if (p->stamp == NULL || p->seen == NULL)
+		return -1;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (pthread_create(&p->receiver, NULL, peer_recv, p) != 0)
+		return -1;
+	if (pthread_create(&p->sender, NULL, peer_send, p) != 0) {
+		p->error = "cannot start sender";
+		pthread_join(p->receiver, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+static void peer_stop(struct peer *p)
+{
+	pthread_join(p->sender, NULL);
+	pthread_join(p->receiver, NULL);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+}
+
+/****************************************************************************
+ *
+ * The application side
+ *
+ ****************************************************************************/
+
+/* Check a queued packet and pick its verdict, as a filter would */
+static unsigned int app_verdict(struct peer *p, ipq_packet_msg_t *m,
+                                size_t *data_len)
+{
+	size_t mangle;
+
+	if (m->data_len != p->size || m->mark != m->packet_id ||
+	    (p->size > 0 &&
+	     (m->payload[0] != (m->packet_id & 0xff) ||
+	      m->payload[p->size - 1] != (m->packet_id & 0xff))))
+		__atomic_fetch_add(&p->bad_packets, 1, __ATOMIC_RELAXED);
+
+	mangle = expected_mangle(m->packet_id, p->size);
+	memset(m->payload, ~m->packet_id & 0xff, mangle);
+	*data_len = mangle;
+	return expected_verdict(m->packet_id);
+}
+
+/*
+ * The packets the application holds back with -k, oldest first. Packets
+ * read into a pool are held where they are; the others have to be copied
+ * before the next read overwrites them.
+ */
+struct app {
+	const struct ipq_handle *h;
+	struct peer *p;
+	struct ipq_pool *pool;		/* for the pool mode */
+	unsigned char **held;
+	unsigned int first, nheld;
+};
+
+static int app_init(struct app *a, const struct ipq_handle *h,
+                    struct peer *p, struct ipq_pool *pool)
+{
+	memset(a, 0, sizeof(*a));
+	a->h = h;
+	a->p = p;
+	a->pool = pool;
+	a->held = calloc(p->keep + 1, sizeof(*a->held));
+	return a->held != NULL ? 0 : -1;
+}
+
+/* Give the verdict for a packet and drop it */
+static int app_done(struct app *a, unsigned char *buf, int owned)
+{
+	ipq_packet_msg_t *m = ipq_get_packet(buf);
+	unsigned int verdict;
+	size_t data_len;
+	int ret;
+
+	verdict = app_verdict(a->p, m, &data_len);
+	ret = ipq_set_verdict(a->h, m->packet_id, verdict, data_len,
+	                      m->payload);
+	if (ret < 0)
+		ipq_perror("ipq_set_verdict");
+	if (a->pool != NULL)
+		ipq_pool_release(a->pool, buf);
+	else if (owned)
+		free(buf);
+	return ret;
+}
+
+static int app_done_oldest(struct app *a)
+{
+	unsigned char *buf = a->held[a->first];
+
+	a->first = (a->first + 1) % a->p->keep;
+	--a->nheld;
+	return app_done(a, buf, 1);
+}
+
+static int app_packet(struct app *a, unsigned char *buf)
+{
+	size_t len = ((struct nlmsghdr *)buf)->nlmsg_len;
+	unsigned char *copy;
+
+	if (a->p->keep == 0)
+		return app_done(a, buf, 0);
+	if (a->nheld == a->p->keep && app_done_oldest(a) < 0)
+		return -1;
+	if (a->pool == NULL) {
+		copy = malloc(len);
+		if (copy == NULL)
+			return -1;
+		memcpy(copy, buf, len);
+		copied_bytes += len;
+		buf = copy;
+	}
+	a->held[(a->first + a->nheld++) % a->p->keep] = buf;
+	return 0;
+}
+
+/* Give the verdicts still held back, unless @ret says the run failed */
+static int app_finish(struct app *a, int ret)
+{
+	while (a->nheld > 0) {
+		if (ret < 0) {
+			if (a->pool == NULL)
+				free(a->held[a->first]);
+			a->first = (a->first + 1) % a->p->keep;
+			--a->nheld;
+		} else if (app_done_oldest(a) < 0) {
+			ret = -1;
+		}
+	}
+	free(a->held);
+	return ret < 0 ? -1 : 0;
+}
+
+static int app_message(struct app *a, unsigned char *buf)
+{
+	switch (ipq_message_type(buf)) {
+	case NLMSG_ERROR:
+		fprintf(stderr, "Received error message %d\n",
+		        ipq_get_msgerr(buf));
+		return -1;
+	case IPQM_PACKET:
+		return app_packet(a, buf) < 0 ? -1 : 1;
+	}
+	return 0;
+}
+
+static int run_read(struct ipq_handle *h, struct peer *p)
+{
+	size_t size = NLMSG_SPACE(sizeof(ipq_packet_msg_t) + p->size);
+	unsigned long n = 0;
+	unsigned char *buf;
+	struct app a;
+	int ret = 0;
+
+	buf = malloc(size);
+	if (buf == NULL || app_init(&a, h, p, NULL) < 0) {
+		free(buf);
+		return -1;
+	}
+	while (n < p->count) {
+		if (ipq_read(h, buf, size, PEER_TIMEOUT * 1000000) <= 0) {
+			ipq_perror("ipq_read");
+			ret = -1;
+			break;
+		}
+		ret = app_message(&a, buf);
+		if (ret < 0)
+			break;
+		n += ret;
+	}
+	ret = app_finish(&a, ret);
+	free(buf);
+	return ret;
+}
+
+#define APP_BATCH	64	/* messages per ipq_read_batch or ipq_read_pool */
+
+static int run_batch(struct ipq_handle *h, struct peer *p)
+{
+	size_t size = NLMSG_SPACE(sizeof(ipq_packet_msg_t) + p->size);
+	unsigned long n = 0;
+	struct ipq_batch *b;
+	unsigned char *buf;
+	struct app a;
+	int ret = 0;
+
+	b = ipq_batch_create(APP_BATCH, size);
+	if (b == NULL || app_init(&a, h, p, NULL) < 0) {
+		if (b != NULL)
+			ipq_batch_destroy(b);
+		return -1;
+	}
+	while (n < p->count) {
+		if (ipq_read_batch(h, b, PEER_TIMEOUT * 1000000) <= 0) {
+			ipq_perror("ipq_read_batch");
+			ret = -1;
+			break;
+		}
+		while ((buf = ipq_batch_next(b)) != NULL) {
+			ret = app_message(&a, buf);
+			if (ret < 0)
+				break;
+			n += ret;
+		}
+		if (ret < 0)
+			break;
+	}
+	ret = app_finish(&a, ret);
+	ipq_batch_destroy(b);
+	return ret;
+}
+
+static int run_pool(struct ipq_handle *h, struct peer *p)
+{
+	size_t size = NLMSG_SPACE(sizeof(ipq_packet_msg_t) + p->size);
+	unsigned char *bufs[APP_BATCH];
+	struct ipq_pool *pool;
+	unsigned long n = 0;
+	struct app a;
+	ssize_t got, i;
+	int ret = 0;
+
+	/* Room for the packets held back, and for one more read */
+	pool = ipq_pool_create(p->keep + APP_BATCH, size);
+	if (pool == NULL || app_init(&a, h, p, pool) < 0) {
+		if (pool != NULL)
+			ipq_pool_destroy(pool);
+		return -1;
+	}
+	while (n < p->count) {
+		got = ipq_read_pool(h, pool, bufs, APP_BATCH,
+		                    PEER_TIMEOUT * 1000000);
+		if (got <= 0) {
+			ipq_perror("ipq_read_pool");
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < got; ++i) {
+			ret = app_message(&a, bufs[i]);
+			if (ret < 0)
+				break;
+			if (ret == 0)
+				ipq_pool_release(pool, bufs[i]);
+			n += ret;
+		}
+		if (ret < 0)
+			break;
+	}
+	ret = app_finish(&a, ret);
+	ipq_pool_destroy(pool);
+	return ret;
+}
+
+static unsigned int app_dispatch_fn(ipq_packet_msg_t *m, size_t *data_len,
+                                     void *data)
+{
+	return app_verdict(data, m, data_len);
+}
+
+static int run_dispatch(struct ipq_handle *h, struct peer *p)
+{
+	size_t size = NLMSG_SPACE(sizeof(ipq_packet_msg_t) + p->size);
+	struct ipq_dispatch *d;
+
+	d = ipq_dispatch_create(h, p->workers, size, app_dispatch_fn, p);
+	if (d == NULL) {
+		ipq_perror("ipq_dispatch_create");
+		return -1;
+	}
+	/* The peer tells when it has all verdicts, or gave up waiting */
+	pthread_mutex_lock(&p->lock);
+	while (!p->done)
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	if (ipq_dispatch_destroy(d) < 0) {
+		ipq_perror("ipq_dispatch");
+		return -1;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Driver
+ *
+ ****************************************************************************/
+
+struct mode {
+	const char *name;
+	int (*run)(struct ipq_handle *h, struct peer *p);
+};
+
+static const struct mode modes[] = {
+	{ "read",     run_read },
+	{ "batch",    run_batch },
+	{ "dispatch", run_dispatch },
+	{ "pool",     run_pool },
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *v, unsigned long n, double q)
+{
+	return v[(unsigned long)(q * (n - 1))] / 1000.0;
+}
+
+static int report(const char *name, struct peer *p)
+{
+	double secs = p->end > p->start ? (p->end - p->start) / 1e9 : 0;
+
+	printf("%s: %lu packets of %zu bytes in %.3f s, %.0f packets/s\n",
+	       name, p->count, p->size, secs,
+	       secs > 0 ? p->verdicts / secs : 0);
+	if (p->verdicts == p->count) {
+		qsort(p->stamp, p->count, sizeof(*p->stamp), cmp_u64);
+		printf("  latency usec: p50 %.1f  p90 %.1f  p99 %.1f  "
+		       "max %.1f\n",
+		       percentile(p->stamp, p->count, 0.50),
+		       percentile(p->stamp, p->count, 0.90),
+		       percentile(p->stamp, p->count, 0.99),
+		       p->stamp[p->count - 1] / 1000.0);
+	}
+	printf("  per packet: %.3f receive calls, %.3f send calls\n",
+	       (double)recv_calls / p->count, (double)send_calls / p->count);
+#ifdef __GLIBC__
+	printf("  per packet: %.3f allocations of %.1f bytes, "
+	       "%.1f bytes copied\n",
+	       (double)run_allocs / p->count,
+	       (double)run_alloc_bytes / p->count,
+	       (double)copied_bytes / p->count);
+#else
+	printf("  per packet: %.1f bytes copied\n",
+	       (double)copied_bytes / p->count);
+#endif
+
+	if (p->error != NULL)
+		printf("  FAILED: %s\n", p->error);
+	if (p->verdicts != p->count)
+		printf("  FAILED: %lu of %lu verdicts received\n",
+		       p->verdicts, p->count);
+	if (p->bad_verdicts != 0)
+		printf("  FAILED: %lu wrong verdicts\n", p->bad_verdicts);
+	if (p->bad_packets != 0)
+		printf("  FAILED: %lu packets arrived damaged\n",
+		       p->bad_packets);
+	return p->error != NULL || p->verdicts != p->count ||
+	       p->bad_verdicts != 0 || p->bad_packets != 0;
+}
+
+static int run(const struct mode *mode, struct peer *p)
+{
+	struct ipq_handle *h;
+	char name[64];
+	int ret;
+
+	recv_calls = send_calls = 0;
+	h = ipq_create_handle(0, NFPROTO_IPV4);
+	if (h == NULL) {
+		ipq_perror("ipq_create_handle");
+		return 1;
+	}
+	if (peer_start(p) < 0) {
+		fprintf(stderr, "Cannot start the peer\n");
+		return 1;
+	}
+	if (ipq_set_mode(h, IPQ_COPY_PACKET, p->size) < 0) {
+		ipq_perror("ipq_set_mode");
+		p->error = "cannot set mode";
+	} else {
+		/* Count what the mode does, not the set-up of the test */
+		alloc_calls = alloc_bytes = copied_bytes = 0;
+		if (mode->run(h, p) < 0 && p->error == NULL)
+			p->error = "application side failed";
+		run_allocs = alloc_calls;
+		run_alloc_bytes = alloc_bytes;
+	}
+	/* Closing libipq's end first unblocks a sender stuck on a full queue */
+	ipq_destroy_handle(h);
+	peer_stop(p);
+	close(peer_fd);
+
+	if (mode->run == run_dispatch)
+		snprintf(name, sizeof(name), "%s -w %u", mode->name,
+		         p->workers);
+	else
+		snprintf(name, sizeof(name), "%s", mode->name);
+	ret = report(name, p);
+	free(p->stamp);
+	free(p->seen);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+"Usage: %s [-m mode] [-w workers,...] [-k packets] [-n packets] [-s size]\n"
+"       [-r rate]\n"
+"  -m mode     how the application reads:", prog);
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+		fprintf(stderr, " %s", modes[i].name);
+	fprintf(stderr, " (default %s)\n"
+"  -w workers  worker threads of the dispatch mode, or a list of counts\n"
+"              to compare (default 1)\n"
+"  -k packets  packets the application holds before their verdicts\n"
+"              (default 0; not for the dispatch mode)\n"
+"  -n packets  packets to queue (default 100000)\n"
+"  -s size     payload bytes per packet (default 64)\n"
+"  -r rate     packets per second, 0 for as fast as possible (default)\n",
+	        modes[0].name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct mode *mode = &modes[0];
+	unsigned int i, workers[MAX_SWEEP] = { 1 }, nworkers = 1;
+	struct peer p, q;
+	char *end;
+	int c, ret;
+
+	memset(&p, 0, sizeof(p));
+	p.count = 100000;
+	p.size = 64;
+
+	while ((c = getopt(argc, argv, "m:w:k:n:s:r:")) != -1) {
+		switch (c) {
+		case 'm':
+			for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+				if (strcmp(optarg, modes[i].name) == 0)
+					break;
+			if (i == sizeof(modes) / sizeof(modes[0]))
+				usage(argv[0]);
+			mode = &modes[i];
+			break;
+		case 'w':
+			end = optarg;
+			for (nworkers = 0; *end != '\0'; ++nworkers) {
+				if (nworkers == MAX_SWEEP)
+					usage(argv[0]);
+				workers[nworkers] = strtoul(end, &end, 0);
+				if (workers[nworkers] == 0 ||
+				    (*end != ',' && *end != '\0'))
+					usage(argv[0]);
+				if (*end == ',')
+					++end;
+			}
+			if (nworkers == 0)
+				usage(argv[0]);
+			break;
+		case 'k':
+			p.keep = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			p.count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			p.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			p.rate = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || p.count == 0 || p.size > 65535 ||
+	    p.keep > 65536 || (p.keep != 0 && mode->run == run_dispatch))
+		usage(argv[0]);
+
+	/* Only the dispatch mode has workers to compare */
+	if (mode->run != run_dispatch)
+		nworkers = 1;
+	ret = 0;
+	for (i = 0; i < nworkers; ++i) {
+		q = p;
+		q.workers = workers[i];
+		ret |= run(mode, &q);
+	}
+	return ret;
+}
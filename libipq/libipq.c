@@ -24,12 +24,19 @@
  *
  */
 
+#define _GNU_SOURCE 1	/* recvmmsg, sendmmsg, ppoll */
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <libipq/libipq.h>
 #include <netinet/in.h>
@@ -58,9 +65,10 @@ enum {
 	IPQ_ERR_SUPP,
 	IPQ_ERR_RECVBUF,
 	IPQ_ERR_TIMEOUT,
-        IPQ_ERR_PROTOCOL
+        IPQ_ERR_PROTOCOL,
+	IPQ_ERR_POOL
 };
-#define IPQ_MAXERR IPQ_ERR_PROTOCOL
+#define IPQ_MAXERR IPQ_ERR_POOL
 
 struct ipq_errmap_t {
 	int errcode;
@@ -82,10 +90,12 @@ struct ipq_errmap_t {
 	{ IPQ_ERR_SUPP, "Operation not supported" },
 	{ IPQ_ERR_RECVBUF, "Receive buffer size invalid" },
 	{ IPQ_ERR_TIMEOUT, "Timeout"},
-	{ IPQ_ERR_PROTOCOL, "Invalid protocol specified" }
+	{ IPQ_ERR_PROTOCOL, "Invalid protocol specified" },
+	{ IPQ_ERR_POOL, "No free receive buffer" }
 };
 
-static int ipq_errno = IPQ_ERR_NONE;
+/* Per thread, so that handles can be used from several threads */
+static __thread int ipq_errno = IPQ_ERR_NONE;
 
 static ssize_t ipq_netlink_sendto(const struct ipq_handle *h,
                                   const void *msg, size_t len);
@@ -100,13 +110,233 @@ static ssize_t ipq_netlink_sendmsg(const struct ipq_handle *h,
 
 static char *ipq_strerror(int errcode);
 
+/* One verdict message; @iov points into the message itself */
+struct ipq_vmsg {
+	struct nlmsghdr nlh;
+	ipq_peer_msg_t pm;
+	struct iovec iov[3];
+};
+
+/*
+ * Room for up to @count datagrams of @bufsize bytes each, filled by one
+ * ipq_read_batch and walked message by message with ipq_batch_next.
+ * @received is the number of datagrams the last read returned, @cur the
+ * one being walked, @next its current message and @remain the bytes of
+ * the datagram from @next on. @err is an error met after some datagrams
+ * had been received, reported by the next read.
+ */
+struct ipq_batch {
+	unsigned int count;
+	size_t bufsize;
+	unsigned char *bufs;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct sockaddr_nl *peers;
+	unsigned int received, cur;
+	struct nlmsghdr *next;
+	int remain;
+	int err;
+};
+
+/*
+ * Up to @count verdicts waiting to be sent with one sendmmsg. Entries
+ * before @first have already been sent by a flush that failed part way,
+ * @queued is the number of entries in use and @since the time the oldest
+ * of them was queued. @usec is the time threshold, 0 for none.
+ */
+struct ipq_verdict_batch {
+	const struct ipq_handle *h;
+	unsigned int count;
+	unsigned int first, queued;
+	int usec;
+	struct timeval since;
+	struct ipq_vmsg *vmsgs;
+	struct mmsghdr *msgs;
+};
+
+/*
+ * @count page-aligned buffers of @bufsize bytes in one mapping of @size
+ * bytes. @free is a stack of the indexes of the @nfree buffers not handed
+ * out, and @out flags the buffers handed out, both protected by @lock.
+ * @b receives into the buffers taken for a read.
+ */
+struct ipq_pool {
+	unsigned int count;
+	size_t bufsize;
+	unsigned char *mem;
+	size_t size;
+	pthread_mutex_t lock;
+	unsigned int *free;
+	unsigned int nfree;
+	unsigned char *out;
+	struct ipq_batch b;
+};
+
+/* A handle watched by an ipq_loop */
+struct ipq_loop_entry {
+	struct ipq_loop_entry *next;
+	const struct ipq_handle *h;
+	ipq_msg_fn fn;
+	void *data;
+};
+
+#define IPQ_LOOP_EVENTS	16
+#define IPQ_LOOP_BATCH	64
+
+struct ipq_loop {
+	int fd;
+	struct ipq_batch *b;
+	struct ipq_loop_entry *entries;
+};
+
+/*
+ * Statistics of a handle, kept once ipq_stats_enable has been called.
+ * Counters are updated atomically, as a handle may be read and written
+ * from different threads. @slots remember when recent packets were
+ * received, by packet id, for the latency histogram; a packet whose slot
+ * has been reused by another one is not sampled. @dump is written to
+ * every @interval seconds, @last_dump being the time of the last one.
+ * Once allocated, the statistics stay until the handle is destroyed.
+ */
+#define IPQ_STATS_SLOTS	4096
+
+struct ipq_stats_slot {
+	unsigned long id;
+	u_int64_t ns;
+};
+
+struct ipq_stats_priv {
+	struct ipq_stats st;
+	FILE *dump;
+	unsigned int interval;
+	u_int64_t last_dump;
+	struct ipq_stats_slot slots[IPQ_STATS_SLOTS];
+};
+
+static u_int64_t ipq_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void ipq_stat_add(u_int64_t *counter, u_int64_t value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+#define IPQ_STAT(h, field, value) \
+	do { \
+		if ((h)->stats != NULL) \
+			ipq_stat_add(&(h)->stats->st.field, (value)); \
+	} while (0)
+
+static struct ipq_stats_slot *ipq_stats_slot(struct ipq_stats_priv *sp,
+                                             unsigned long id)
+{
+	unsigned long hash = id ^ (id >> 12) ^ (id >> 24);
+
+	return &sp->slots[hash % IPQ_STATS_SLOTS];
+}
+
+/*
+ * Histogram bucket of @usec: exact below 4, then four buckets for each
+ * power of two, so that a bucket is at most 25% wide.
+ */
+static unsigned int ipq_stats_bucket(u_int64_t usec)
+{
+	unsigned int msb, idx;
+
+	if (usec < 4)
+		return usec;
+	msb = 63 - __builtin_clzll(usec);
+	idx = 4 * (msb - 1) + ((usec >> (msb - 2)) & 3);
+	return idx < IPQ_STATS_BUCKETS ? idx : IPQ_STATS_BUCKETS - 1;
+}
+
+/* Smallest value of bucket @idx */
+static u_int64_t ipq_stats_bucket_low(unsigned int idx)
+{
+	if (idx < 4)
+		return idx;
+	return (u_int64_t)(4 + idx % 4) << (idx / 4 - 1);
+}
+
+static void ipq_stats_tick(const struct ipq_handle *h, u_int64_t now);
+
+/* Account for a datagram of @len bytes received into @buf */
+static void ipq_stats_recv(const struct ipq_handle *h,
+                           const unsigned char *buf, int len, u_int64_t now)
+{
+	struct ipq_stats_priv *sp = h->stats;
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+	struct ipq_stats_slot *slot;
+	unsigned long id;
+
+	ipq_stat_add(&sp->st.rx_bytes, len);
+	for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_type != IPQM_PACKET)
+			continue;
+		ipq_stat_add(&sp->st.packets, 1);
+		id = ((const ipq_packet_msg_t *)NLMSG_DATA(nlh))->packet_id;
+		slot = ipq_stats_slot(sp, id);
+		__atomic_store_n(&slot->ns, now, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->id, id, __ATOMIC_RELEASE);
+	}
+	ipq_stats_tick(h, now);
+}
+
+/* Account for the verdict on packet @id, @len bytes sent */
+static void ipq_stats_verdict(const struct ipq_handle *h, unsigned long id,
+                              size_t len, u_int64_t now)
+{
+	struct ipq_stats_priv *sp = h->stats;
+	struct ipq_stats_slot *slot = ipq_stats_slot(sp, id);
+	unsigned long seen = id;
+	u_int64_t since;
+
+	ipq_stat_add(&sp->st.verdicts, 1);
+	ipq_stat_add(&sp->st.tx_bytes, len);
+	since = __atomic_load_n(&slot->ns, __ATOMIC_RELAXED);
+	if (id == 0 || !__atomic_compare_exchange_n(&slot->id, &seen, 0, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	if (now > since)
+		ipq_stat_add(&sp->st.latency[ipq_stats_bucket((now - since) /
+		             1000)], 1);
+}
+
+/* Dump the statistics if @interval seconds have passed */
+static void ipq_stats_tick(const struct ipq_handle *h, u_int64_t now)
+{
+	struct ipq_stats_priv *sp = h->stats;
+	u_int64_t last = __atomic_load_n(&sp->last_dump, __ATOMIC_RELAXED);
+	unsigned int interval;
+	FILE *dump;
+
+	/* ipq_stats_enable may change them under us */
+	interval = __atomic_load_n(&sp->interval, __ATOMIC_RELAXED);
+	dump     = __atomic_load_n(&sp->dump, __ATOMIC_RELAXED);
+
+	if (dump == NULL || interval == 0 ||
+	    now - last < interval * 1000000000ULL)
+		return;
+	if (__atomic_compare_exchange_n(&sp->last_dump, &last, now, 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		ipq_dump_stats(h, dump);
+}
+
 static ssize_t ipq_netlink_sendto(const struct ipq_handle *h,
                                   const void *msg, size_t len)
 {
 	int status = sendto(h->fd, msg, len, 0,
 	                    (struct sockaddr *)&h->peer, sizeof(h->peer));
-	if (status < 0)
+	IPQ_STAT(h, send_calls, 1);
+	if (status < 0) {
 		ipq_errno = IPQ_ERR_SEND;
+		IPQ_STAT(h, send_errors, 1);
+	}
 	return status;
 }
 
@@ -115,11 +345,54 @@ static ssize_t ipq_netlink_sendmsg(const struct ipq_handle *h,
                                    unsigned int flags)
 {
 	int status = sendmsg(h->fd, msg, flags);
-	if (status < 0)
+	IPQ_STAT(h, send_calls, 1);
+	if (status < 0) {
 		ipq_errno = IPQ_ERR_SEND;
+		IPQ_STAT(h, send_errors, 1);
+	}
 	return status;
 }
 
+/*
+ * Wait for data for at most @timeout microseconds, or not at all if it is
+ * negative. Returns 1 if there is data, 0 on timeout or signal and -1 on
+ * error.
+ */
+static int ipq_netlink_wait(const struct ipq_handle *h, int timeout)
+{
+	int ret;
+	struct timespec ts;
+	struct pollfd pfd;
+
+	if (timeout < 0) {
+		/* non-block non-timeout */
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+	} else {
+		ts.tv_sec = timeout / 1000000;
+		ts.tv_nsec = (timeout % 1000000) * 1000;
+	}
+
+	pfd.fd = h->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	ret = ppoll(&pfd, 1, &ts, NULL);
+	if (ret < 0) {
+		if (errno == EINTR) {
+			return 0;
+		} else {
+			ipq_errno = IPQ_ERR_RECV;
+			return -1;
+		}
+	}
+	if (ret == 0) {
+		ipq_errno = IPQ_ERR_TIMEOUT;
+		IPQ_STAT(h, timeouts, 1);
+		return 0;
+	}
+	return 1;
+}
+
 static ssize_t ipq_netlink_recvfrom(const struct ipq_handle *h,
                                     unsigned char *buf, size_t len,
                                     int timeout)
@@ -135,39 +408,16 @@ static ssize_t ipq_netlink_recvfrom(const struct ipq_handle *h,
 	addrlen = sizeof(h->peer);
 
 	if (timeout != 0) {
-		int ret;
-		struct timeval tv;
-		fd_set read_fds;
-		
-		if (timeout < 0) {
-			/* non-block non-timeout */
-			tv.tv_sec = 0;
-			tv.tv_usec = 0;
-		} else {
-			tv.tv_sec = timeout / 1000000;
-			tv.tv_usec = timeout % 1000000;
-		}
-
-		FD_ZERO(&read_fds);
-		FD_SET(h->fd, &read_fds);
-		ret = select(h->fd+1, &read_fds, NULL, NULL, &tv);
-		if (ret < 0) {
-			if (errno == EINTR) {
-				return 0;
-			} else {
-				ipq_errno = IPQ_ERR_RECV;
-				return -1;
-			}
-		}
-		if (!FD_ISSET(h->fd, &read_fds)) {
-			ipq_errno = IPQ_ERR_TIMEOUT;
-			return 0;
-		}
+		status = ipq_netlink_wait(h, timeout);
+		if (status <= 0)
+			return status;
 	}
 	status = recvfrom(h->fd, buf, len, 0,
 	                      (struct sockaddr *)&h->peer, &addrlen);
+	IPQ_STAT(h, recv_calls, 1);
 	if (status < 0) {
 		ipq_errno = IPQ_ERR_RECV;
+		IPQ_STAT(h, recv_errors, 1);
 		return status;
 	}
 	if (addrlen != sizeof(h->peer)) {
@@ -185,11 +435,634 @@ static ssize_t ipq_netlink_recvfrom(const struct ipq_handle *h,
 	nlh = (struct nlmsghdr *)buf;
 	if (nlh->nlmsg_flags & MSG_TRUNC || nlh->nlmsg_len > status) {
 		ipq_errno = IPQ_ERR_RTRUNC;
+		IPQ_STAT(h, truncated, 1);
+		return -1;
+	}
+	if (h->stats != NULL)
+		ipq_stats_recv(h, buf, status, ipq_now());
+	return status;
+}
+
+/* Same checks as ipq_netlink_recvfrom, for one datagram of a batch */
+static int ipq_batch_check(const struct mmsghdr *m)
+{
+	const struct sockaddr_nl *peer = m->msg_hdr.msg_name;
+	const struct nlmsghdr *nlh = m->msg_hdr.msg_iov->iov_base;
+
+	if (m->msg_hdr.msg_namelen != sizeof(*peer) || peer->nl_pid != 0)
+		return IPQ_ERR_RECV;
+	if (m->msg_len == 0)
+		return IPQ_ERR_NLEOF;
+	if (m->msg_hdr.msg_flags & MSG_TRUNC ||
+	    nlh->nlmsg_flags & MSG_TRUNC || nlh->nlmsg_len > m->msg_len)
+		return IPQ_ERR_RTRUNC;
+	return IPQ_ERR_NONE;
+}
+
+static int ipq_netlink_recvmmsg(const struct ipq_handle *h,
+                                struct ipq_batch *b, int timeout, int flags)
+{
+	unsigned int i;
+	int status;
+	u_int64_t now;
+
+	if (timeout != 0) {
+		status = ipq_netlink_wait(h, timeout);
+		if (status <= 0)
+			return status;
+	}
+	for (i = 0; i < b->count; ++i) {
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->peers[i]);
+		b->msgs[i].msg_hdr.msg_flags   = 0;
+	}
+
+	/*
+	 * MSG_WAITFORONE blocks for the first datagram only, then takes
+	 * what is queued; MSG_DONTWAIT does not block at all.
+	 */
+	status = recvmmsg(h->fd, b->msgs, b->count, flags, NULL);
+	if (status < 0 && errno == ENOSYS) {
+		status = recvmsg(h->fd, &b->msgs[0].msg_hdr,
+		                 flags & MSG_DONTWAIT);
+		if (status >= 0) {
+			b->msgs[0].msg_len = status;
+			status = 1;
+		}
+	}
+	IPQ_STAT(h, recv_calls, 1);
+	if (status < 0) {
+		ipq_errno = IPQ_ERR_RECV;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			IPQ_STAT(h, recv_errors, 1);
+		return status;
+	}
+
+	now = h->stats != NULL ? ipq_now() : 0;
+	for (i = 0; i < status; ++i) {
+		struct mmsghdr *m = &b->msgs[i];
+		int err = ipq_batch_check(m);
+
+		if (err == IPQ_ERR_NONE) {
+			if (h->stats != NULL)
+				ipq_stats_recv(h, m->msg_hdr.msg_iov->iov_base,
+				               m->msg_len, now);
+			continue;
+		}
+		if (err == IPQ_ERR_RTRUNC)
+			IPQ_STAT(h, truncated, 1);
+		if (i == 0) {
+			ipq_errno = err;
+			return -1;
+		}
+		/* Hand out what came before; fail the next read */
+		b->err = err;
+		status = i;
+		break;
+	}
+	return status;
+}
+
+/*
+ * Fill in @v as the verdict for packet @id. Returns the number of iovecs
+ * used, the payload @buf (if any) being referenced rather than copied.
+ */
+static unsigned int ipq_verdict_build(const struct ipq_handle *h,
+                                      struct ipq_vmsg *v, ipq_id_t id,
+                                      unsigned int verdict, size_t data_len,
+                                      unsigned char *buf)
+{
+	unsigned int nvecs = 2;
+	size_t tlen;
+
+	memset(&v->nlh, 0, sizeof(v->nlh));
+	v->nlh.nlmsg_flags = NLM_F_REQUEST;
+	v->nlh.nlmsg_type = IPQM_VERDICT;
+	v->nlh.nlmsg_pid = h->local.nl_pid;
+	memset(&v->pm, 0, sizeof(v->pm));
+	v->pm.msg.verdict.value = verdict;
+	v->pm.msg.verdict.id = id;
+	v->pm.msg.verdict.data_len = data_len;
+	v->iov[0].iov_base = &v->nlh;
+	v->iov[0].iov_len = sizeof(v->nlh);
+	v->iov[1].iov_base = &v->pm;
+	v->iov[1].iov_len = sizeof(v->pm);
+	tlen = sizeof(v->nlh) + sizeof(v->pm);
+	if (data_len && buf) {
+		v->iov[2].iov_base = buf;
+		v->iov[2].iov_len = data_len;
+		tlen += data_len;
+		nvecs++;
+	}
+	v->nlh.nlmsg_len = tlen;
+	return nvecs;
+}
+
+/*
+ * Send the queued verdicts of @vb. ip_queue only looks at the first
+ * message of a datagram, so each verdict goes out as a datagram of its
+ * own, but all of them in one system call.
+ */
+static int ipq_netlink_sendmmsg(struct ipq_verdict_batch *vb)
+{
+	const struct ipq_handle *h = vb->h;
+	int sent = 0, status, i;
+	struct ipq_vmsg *v;
+	u_int64_t now;
+
+	while (vb->first < vb->queued) {
+		status = sendmmsg(h->fd, &vb->msgs[vb->first],
+		                  vb->queued - vb->first, 0);
+		if (status < 0 && errno == ENOSYS) {
+			status = sendmsg(h->fd, &vb->msgs[vb->first].msg_hdr, 0);
+			if (status >= 0)
+				status = 1;
+		}
+		IPQ_STAT(h, send_calls, 1);
+		if (status < 0) {
+			ipq_errno = IPQ_ERR_SEND;
+			IPQ_STAT(h, send_errors, 1);
+			return status;
+		}
+		if (h->stats != NULL) {
+			now = ipq_now();
+			for (i = 0; i < status; ++i) {
+				v = &vb->vmsgs[vb->first + i];
+				ipq_stats_verdict(h, v->pm.msg.verdict.id,
+				                  v->nlh.nlmsg_len, now);
+			}
+		}
+		vb->first += status;
+		sent += status;
+	}
+	vb->first = vb->queued = 0;
+	return sent;
+}
+
+/* Whether the oldest queued verdict has waited for @vb->usec or more */
+static int ipq_verdict_batch_due(const struct ipq_verdict_batch *vb)
+{
+	struct timeval now;
+	long long waited;
+
+	if (vb->queued == 0 || vb->usec == 0)
+		return 0;
+	gettimeofday(&now, NULL);
+	waited = (now.tv_sec - vb->since.tv_sec) * 1000000LL +
+	         now.tv_usec - vb->since.tv_usec;
+	return waited >= vb->usec;
+}
+
+/* ipq_read_batch, with the recvmmsg @flags given */
+static ssize_t ipq_batch_fill(const struct ipq_handle *h, struct ipq_batch *b,
+                              int timeout, int flags)
+{
+	int status;
+
+	b->received = b->cur = 0;
+	b->next = NULL;
+	if (b->err != IPQ_ERR_NONE) {
+		/* Not from a system call; leave no stale errno behind */
+		ipq_errno = b->err;
+		b->err = IPQ_ERR_NONE;
+		errno = 0;
 		return -1;
 	}
+	status = ipq_netlink_recvmmsg(h, b, timeout, flags);
+	if (status > 0)
+		b->received = status;
 	return status;
 }
 
+/*
+ * Dispatcher: a reader thread receives batches into one of
+ * IPQ_DISPATCH_SLOTS slots and spreads the packets over the workers'
+ * queues, idle workers stealing from the others. Workers push their
+ * verdicts onto a lock-free ring, which a writer thread drains into a
+ * verdict batch. A slot is reused once all its verdicts have been sent,
+ * as they may refer to payloads in its buffers.
+ */
+#define IPQ_DISPATCH_SLOTS	4
+#define IPQ_DISPATCH_BATCH	64
+#define IPQ_DISPATCH_RING	4096
+#define IPQ_DISPATCH_POLL	100000	/* usec */
+
+struct ipq_dslot;
+
+struct ipq_ditem {
+	struct ipq_ditem *next;
+	ipq_packet_msg_t *m;
+	struct ipq_dslot *slot;
+	unsigned int verdict;
+	size_t data_len;
+};
+
+/* @busy is the number of items whose verdict has not been sent yet */
+struct ipq_dslot {
+	struct ipq_batch *b;
+	struct ipq_ditem *items;
+	unsigned int size;
+	unsigned int busy;
+};
+
+struct ipq_dworker {
+	struct ipq_dispatch *d;
+	unsigned int idx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct ipq_ditem *head, *tail;
+};
+
+/* Bounded MPSC ring, cells carrying a sequence number each */
+struct ipq_dcell {
+	unsigned long seq;
+	struct ipq_ditem *item;
+};
+
+struct ipq_dring {
+	struct ipq_dcell *cells;
+	unsigned long mask;
+	unsigned long head;
+	unsigned long tail;
+};
+
+/*
+ * @lock protects the slots' @busy counts, @err and @sys_errno. @pending
+ * is the number of items in the workers' queues, @wsleep is set while
+ * the writer waits for the ring. @stop asks the reader to quit, then
+ * @drain tells the workers and @wdrain the writer to finish what is left.
+ */
+struct ipq_dispatch {
+	const struct ipq_handle *h;
+	ipq_dispatch_fn fn;
+	void *data;
+	struct ipq_dslot slots[IPQ_DISPATCH_SLOTS];
+	unsigned int nworkers, started, next_worker;
+	struct ipq_dworker *workers;
+	struct ipq_dring ring;
+	struct ipq_verdict_batch *vb;
+	struct ipq_ditem **sent;
+	pthread_t reader, writer;
+	int reader_started, writer_started;
+	pthread_mutex_t lock;
+	pthread_cond_t slot_cond, stop_cond;
+	pthread_mutex_t work_lock;
+	pthread_cond_t work_cond;
+	pthread_mutex_t wlock;
+	pthread_cond_t wcond;
+	unsigned int pending;
+	int wsleep, stop, drain, wdrain;
+	int err, sys_errno;
+};
+
+static int ipq_dring_push(struct ipq_dring *r, struct ipq_ditem *it)
+{
+	unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	struct ipq_dcell *c;
+	long diff;
+
+	for (;;) {
+		c = &r->cells[pos & r->mask];
+		diff = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+			    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+	c->item = it;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int ipq_dring_empty(struct ipq_dring *r)
+{
+	struct ipq_dcell *c = &r->cells[r->tail & r->mask];
+
+	return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != r->tail + 1;
+}
+
+/* Single consumer: the writer */
+static struct ipq_ditem *ipq_dring_pop(struct ipq_dring *r)
+{
+	struct ipq_dcell *c = &r->cells[r->tail & r->mask];
+	struct ipq_ditem *it;
+
+	if ((long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) -
+	    (r->tail + 1)) < 0)
+		return NULL;
+	it = c->item;
+	__atomic_store_n(&c->seq, r->tail + r->mask + 1, __ATOMIC_RELEASE);
+	++r->tail;
+	return it;
+}
+
+static int ipq_dispatch_stopping(struct ipq_dispatch *d)
+{
+	return __atomic_load_n(&d->stop, __ATOMIC_ACQUIRE);
+}
+
+/* Record the first error of any thread, and stop the reader */
+static void ipq_dispatch_fail(struct ipq_dispatch *d, int err, int sys_errno)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->err == IPQ_ERR_NONE) {
+		d->err = err;
+		d->sys_errno = sys_errno;
+	}
+	__atomic_store_n(&d->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&d->slot_cond);
+	pthread_cond_broadcast(&d->stop_cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void ipq_dispatch_wake_writer(struct ipq_dispatch *d)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&d->wsleep, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&d->wlock);
+		pthread_cond_signal(&d->wcond);
+		pthread_mutex_unlock(&d->wlock);
+	}
+}
+
+/* Take the oldest item of worker @w's queue */
+static struct ipq_ditem *ipq_dworker_pop(struct ipq_dworker *w)
+{
+	struct ipq_ditem *it;
+
+	pthread_mutex_lock(&w->lock);
+	it = w->head;
+	if (it != NULL) {
+		w->head = it->next;
+		if (w->head == NULL)
+			w->tail = NULL;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return it;
+}
+
+/* Own queue first, then steal from the others */
+static struct ipq_ditem *ipq_dworker_take(struct ipq_dworker *w)
+{
+	struct ipq_dispatch *d = w->d;
+	struct ipq_ditem *it;
+	unsigned int i;
+
+	if (__atomic_load_n(&d->pending, __ATOMIC_ACQUIRE) == 0)
+		return NULL;
+	for (i = 0; i < d->nworkers; ++i) {
+		it = ipq_dworker_pop(&d->workers[(w->idx + i) % d->nworkers]);
+		if (it != NULL) {
+			__atomic_sub_fetch(&d->pending, 1, __ATOMIC_RELEASE);
+			return it;
+		}
+	}
+	return NULL;
+}
+
+static void *ipq_dworker_run(void *arg)
+{
+	struct ipq_dworker *w = arg;
+	struct ipq_dispatch *d = w->d;
+	struct ipq_ditem *it;
+	int done;
+
+	for (;;) {
+		it = ipq_dworker_take(w);
+		if (it != NULL) {
+			it->data_len = 0;
+			it->verdict = d->fn(it->m, &it->data_len, d->data);
+			if (it->data_len > it->m->data_len)
+				it->data_len = it->m->data_len;
+			while (!ipq_dring_push(&d->ring, it)) {
+				ipq_dispatch_wake_writer(d);
+				sched_yield();
+			}
+			ipq_dispatch_wake_writer(d);
+			continue;
+		}
+		pthread_mutex_lock(&d->work_lock);
+		while (__atomic_load_n(&d->pending, __ATOMIC_ACQUIRE) == 0 &&
+		       !d->drain)
+			pthread_cond_wait(&d->work_cond, &d->work_lock);
+		done = __atomic_load_n(&d->pending, __ATOMIC_ACQUIRE) == 0 &&
+		       d->drain;
+		pthread_mutex_unlock(&d->work_lock);
+		if (done)
+			break;
+	}
+	return NULL;
+}
+
+/* Send the queued verdicts and release their slots, even on failure */
+static void ipq_dwriter_flush(struct ipq_dispatch *d)
+{
+	unsigned int i, n = d->vb->queued;
+	int failed, wake = 0;
+
+	if (n == 0)
+		return;
+	pthread_mutex_lock(&d->lock);
+	failed = d->err != IPQ_ERR_NONE;
+	pthread_mutex_unlock(&d->lock);
+	if (!failed && ipq_netlink_sendmmsg(d->vb) < 0)
+		ipq_dispatch_fail(d, ipq_errno, errno);
+	d->vb->first = d->vb->queued = 0;
+
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < n; ++i)
+		if (--d->sent[i]->slot->busy == 0)
+			wake = 1;
+	if (wake)
+		pthread_cond_signal(&d->slot_cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void *ipq_dwriter_run(void *arg)
+{
+	struct ipq_dispatch *d = arg;
+	struct ipq_ditem *it;
+	int done;
+
+	for (;;) {
+		while ((it = ipq_dring_pop(&d->ring)) != NULL) {
+			if (d->vb->queued == d->vb->count)
+				ipq_dwriter_flush(d);
+			d->sent[d->vb->queued] = it;
+			ipq_verdict_batch_add(d->vb, it->m->packet_id,
+			                      it->verdict, it->data_len,
+			                      it->data_len ? it->m->payload : NULL);
+		}
+		ipq_dwriter_flush(d);
+
+		pthread_mutex_lock(&d->wlock);
+		__atomic_store_n(&d->wsleep, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		done = d->wdrain;
+		if (!done && ipq_dring_empty(&d->ring))
+			pthread_cond_wait(&d->wcond, &d->wlock);
+		__atomic_store_n(&d->wsleep, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&d->wlock);
+		if (done && ipq_dring_empty(&d->ring))
+			break;
+	}
+	return NULL;
+}
+
+/* Hand the packets of a freshly read slot to the workers */
+static int ipq_dreader_spread(struct ipq_dispatch *d, struct ipq_dslot *s)
+{
+	unsigned int n = 0, i, chunk;
+	unsigned char *buf;
+	struct ipq_dworker *w;
+
+	while ((buf = ipq_batch_next(s->b)) != NULL) {
+		if (ipq_message_type(buf) == NLMSG_ERROR) {
+			ipq_dispatch_fail(d, IPQ_ERR_NLRECV,
+			                  ipq_get_msgerr(buf));
+			break;
+		}
+		if (ipq_message_type(buf) != IPQM_PACKET)
+			continue;
+		if (n == s->size) {
+			struct ipq_ditem *items;
+
+			items = realloc(s->items, 2 * (n + 32) * sizeof(*items));
+			if (items == NULL) {
+				ipq_dispatch_fail(d, IPQ_ERR_BUFFER, ENOMEM);
+				break;
+			}
+			s->items = items;
+			s->size  = 2 * (n + 32);
+		}
+		s->items[n].m    = ipq_get_packet(buf);
+		s->items[n].slot = s;
+		++n;
+	}
+	if (n == 0)
+		return 0;
+
+	/* Count them first, so that @pending never drops below zero */
+	s->busy = n;
+	__atomic_add_fetch(&d->pending, n, __ATOMIC_RELEASE);
+	chunk = (n + d->nworkers - 1) / d->nworkers;
+	for (i = 0; i < n; i += chunk) {
+		unsigned int j, end = i + chunk < n ? i + chunk : n;
+
+		for (j = i; j < end - 1; ++j)
+			s->items[j].next = &s->items[j+1];
+		s->items[end-1].next = NULL;
+
+		w = &d->workers[d->next_worker++ % d->nworkers];
+		pthread_mutex_lock(&w->lock);
+		if (w->tail != NULL)
+			w->tail->next = &s->items[i];
+		else
+			w->head = &s->items[i];
+		w->tail = &s->items[end-1];
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	pthread_mutex_lock(&d->work_lock);
+	pthread_cond_broadcast(&d->work_cond);
+	pthread_mutex_unlock(&d->work_lock);
+	return n;
+}
+
+static void *ipq_dreader_run(void *arg)
+{
+	struct ipq_dispatch *d = arg;
+	struct ipq_dslot *s;
+	unsigned int k = 0;
+	ssize_t status;
+
+	while (!ipq_dispatch_stopping(d)) {
+		s = &d->slots[k];
+		pthread_mutex_lock(&d->lock);
+		while (s->busy != 0 && !ipq_dispatch_stopping(d))
+			pthread_cond_wait(&d->slot_cond, &d->lock);
+		pthread_mutex_unlock(&d->lock);
+		if (ipq_dispatch_stopping(d))
+			break;
+
+		status = ipq_read_batch(d->h, s->b, IPQ_DISPATCH_POLL);
+		if (status < 0) {
+			ipq_dispatch_fail(d, ipq_errno, errno);
+			break;
+		}
+		if (status > 0 && ipq_dreader_spread(d, s) > 0)
+			k = (k + 1) % IPQ_DISPATCH_SLOTS;
+	}
+	return NULL;
+}
+
+/* Stop and join whatever threads were started, reader first */
+static void ipq_dispatch_shutdown(struct ipq_dispatch *d)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&d->lock);
+	__atomic_store_n(&d->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&d->slot_cond);
+	pthread_cond_broadcast(&d->stop_cond);
+	pthread_mutex_unlock(&d->lock);
+	if (d->reader_started)
+		pthread_join(d->reader, NULL);
+
+	pthread_mutex_lock(&d->work_lock);
+	d->drain = 1;
+	pthread_cond_broadcast(&d->work_cond);
+	pthread_mutex_unlock(&d->work_lock);
+	for (i = 0; i < d->started; ++i)
+		pthread_join(d->workers[i].thread, NULL);
+
+	pthread_mutex_lock(&d->wlock);
+	d->wdrain = 1;
+	pthread_cond_signal(&d->wcond);
+	pthread_mutex_unlock(&d->wlock);
+	if (d->writer_started)
+		pthread_join(d->writer, NULL);
+}
+
+static void ipq_dispatch_free(struct ipq_dispatch *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < IPQ_DISPATCH_SLOTS; ++i) {
+		ipq_batch_destroy(d->slots[i].b);
+		free(d->slots[i].items);
+	}
+	if (d->workers != NULL)
+		for (i = 0; i < d->nworkers; ++i)
+			pthread_mutex_destroy(&d->workers[i].lock);
+	free(d->workers);
+	free(d->ring.cells);
+	free(d->sent);
+	ipq_verdict_batch_destroy(d->vb);
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->slot_cond);
+	pthread_cond_destroy(&d->stop_cond);
+	pthread_mutex_destroy(&d->work_lock);
+	pthread_cond_destroy(&d->work_cond);
+	pthread_mutex_destroy(&d->wlock);
+	pthread_cond_destroy(&d->wcond);
+	free(d);
+}
+
+/* Pass the error a dispatcher stopped on to the calling thread */
+static int ipq_dispatch_status(struct ipq_dispatch *d)
+{
+	if (d->err == IPQ_ERR_NONE)
+		return 0;
+	ipq_errno = d->err;
+	errno = d->sys_errno;
+	return -1;
+}
+
 static char *ipq_strerror(int errcode)
 {
 	if (errcode < 0 || errcode > IPQ_MAXERR)
@@ -261,11 +1134,113 @@ int ipq_destroy_handle(struct ipq_handle *h)
 {
 	if (h) {
 		close(h->fd);
+		free(h->stats);
 		free(h);
 	}
 	return 0;
 }
 
+/*
+ * Start keeping statistics on @h, or clear them. If @dump is given, they
+ * are written to it about every @interval seconds while packets arrive.
+ * Statistics already kept are cleared in place, as other threads may be
+ * updating them.
+ */
+int ipq_stats_enable(struct ipq_handle *h, FILE *dump, unsigned int interval)
+{
+	struct ipq_stats_priv *sp = h->stats;
+	u_int64_t *counter, *end;
+	unsigned int i;
+
+	if (sp != NULL) {
+		end = (u_int64_t *)(&sp->st + 1);
+		for (counter = (u_int64_t *)&sp->st; counter < end; ++counter)
+			__atomic_store_n(counter, 0, __ATOMIC_RELAXED);
+		for (i = 0; i < IPQ_STATS_SLOTS; ++i)
+			__atomic_store_n(&sp->slots[i].id, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&sp->dump, dump, __ATOMIC_RELAXED);
+		__atomic_store_n(&sp->interval, interval, __ATOMIC_RELAXED);
+		__atomic_store_n(&sp->last_dump, ipq_now(), __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	sp = calloc(1, sizeof(*sp));
+	if (sp == NULL) {
+		ipq_errno = IPQ_ERR_BUFFER;
+		return -1;
+	}
+	sp->dump      = dump;
+	sp->interval  = interval;
+	sp->last_dump = ipq_now();
+	h->stats = sp;
+	return 0;
+}
+
+int ipq_get_stats(const struct ipq_handle *h, struct ipq_stats *st)
+{
+	const u_int64_t *from, *end;
+	u_int64_t *to;
+
+	if (h->stats == NULL) {
+		ipq_errno = IPQ_ERR_SUPP;
+		return -1;
+	}
+	from = (const u_int64_t *)&h->stats->st;
+	end  = (const u_int64_t *)(&h->stats->st + 1);
+	for (to = (u_int64_t *)st; from < end; ++from, ++to)
+		*to = __atomic_load_n(from, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Latency below which @permille of the samples in @st fall, in usec */
+static u_int64_t ipq_stats_quantile(const struct ipq_stats *st,
+                                    u_int64_t total, unsigned int permille)
+{
+	u_int64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < IPQ_STATS_BUCKETS; ++i) {
+		seen += st->latency[i];
+		if (seen * 1000 >= total * permille)
+			return ipq_stats_bucket_low(i + 1);
+	}
+	return ipq_stats_bucket_low(IPQ_STATS_BUCKETS - 1);
+}
+
+void ipq_dump_stats(const struct ipq_handle *h, FILE *f)
+{
+	struct ipq_stats st;
+	u_int64_t total = 0;
+	unsigned int i;
+
+	if (ipq_get_stats(h, &st) < 0)
+		return;
+	fprintf(f, "ipq: %llu packets, %llu verdicts, %llu/%llu bytes in/out, "
+	        "%llu/%llu recv/send calls, %llu/%llu recv/send errors, "
+	        "%llu truncated, %llu timeouts\n",
+	        (unsigned long long)st.packets,
+	        (unsigned long long)st.verdicts,
+	        (unsigned long long)st.rx_bytes,
+	        (unsigned long long)st.tx_bytes,
+	        (unsigned long long)st.recv_calls,
+	        (unsigned long long)st.send_calls,
+	        (unsigned long long)st.recv_errors,
+	        (unsigned long long)st.send_errors,
+	        (unsigned long long)st.truncated,
+	        (unsigned long long)st.timeouts);
+	for (i = 0; i < IPQ_STATS_BUCKETS; ++i)
+		total += st.latency[i];
+	if (total == 0)
+		return;
+	fprintf(f, "ipq: latency usec p50 <%llu p90 <%llu p99 <%llu "
+	        "p99.9 <%llu\n",
+	        (unsigned long long)ipq_stats_quantile(&st, total, 500),
+	        (unsigned long long)ipq_stats_quantile(&st, total, 900),
+	        (unsigned long long)ipq_stats_quantile(&st, total, 990),
+	        (unsigned long long)ipq_stats_quantile(&st, total, 999));
+	fflush(f);
+}
+
 int ipq_set_mode(const struct ipq_handle *h,
                  uint8_t mode, size_t range)
 {
@@ -294,6 +1269,378 @@ ssize_t ipq_read(const struct ipq_handle *h,
 	return ipq_netlink_recvfrom(h, buf, len, timeout);
 }
 
+/*
+ * Create a batch of @count receive buffers, @bufsize bytes each.
+ */
+struct ipq_batch *ipq_batch_create(unsigned int count, size_t bufsize)
+{
+	struct ipq_batch *b;
+	unsigned int i;
+
+	bufsize = NLMSG_ALIGN(bufsize);
+	if (count == 0 || bufsize < sizeof(struct nlmsgerr)) {
+		ipq_errno = IPQ_ERR_RECVBUF;
+		return NULL;
+	}
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		goto err;
+	b->count   = count;
+	b->bufsize = bufsize;
+	b->bufs    = malloc(count * bufsize);
+	b->msgs    = calloc(count, sizeof(*b->msgs));
+	b->iov     = calloc(count, sizeof(*b->iov));
+	b->peers   = calloc(count, sizeof(*b->peers));
+	if (b->bufs == NULL || b->msgs == NULL || b->iov == NULL ||
+	    b->peers == NULL)
+		goto err;
+
+	for (i = 0; i < count; ++i) {
+		b->iov[i].iov_base = b->bufs + i * bufsize;
+		b->iov[i].iov_len  = bufsize;
+		b->msgs[i].msg_hdr.msg_name   = &b->peers[i];
+		b->msgs[i].msg_hdr.msg_iov    = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	return b;
+ err:
+	ipq_batch_destroy(b);
+	ipq_errno = IPQ_ERR_BUFFER;
+	return NULL;
+}
+
+void ipq_batch_destroy(struct ipq_batch *b)
+{
+	if (b == NULL)
+		return;
+	free(b->bufs);
+	free(b->msgs);
+	free(b->iov);
+	free(b->peers);
+	free(b);
+}
+
+/*
+ * Receive as many datagrams as are queued, up to the size of the batch,
+ * in one system call. Returns the number of datagrams, or as ipq_read.
+ * Messages left over from the previous read are dropped.
+ */
+ssize_t ipq_read_batch(const struct ipq_handle *h, struct ipq_batch *b,
+                       int timeout)
+{
+	return ipq_batch_fill(h, b, timeout, MSG_WAITFORONE);
+}
+
+/*
+ * Receive without blocking until nothing is left on the socket, calling
+ * @fn for each message. Returns the number of messages, or -1 on failure
+ * or when @fn returns a negative value.
+ */
+int ipq_drain(const struct ipq_handle *h, struct ipq_batch *b,
+              ipq_msg_fn fn, void *data)
+{
+	unsigned char *buf;
+	int status, n = 0;
+
+	for (;;) {
+		status = ipq_batch_fill(h, b, 0, MSG_DONTWAIT);
+		if (status < 0)
+			return ipq_errno == IPQ_ERR_RECV &&
+			       (errno == EAGAIN || errno == EWOULDBLOCK) ? n : -1;
+		while ((buf = ipq_batch_next(b)) != NULL) {
+			if (fn(h, buf, data) < 0)
+				return -1;
+			++n;
+		}
+	}
+}
+
+int ipq_get_fd(const struct ipq_handle *h)
+{
+	return h->fd;
+}
+
+/*
+ * Create an epoll loop for several handles, with a batch of buffers of
+ * @bufsize bytes shared by all of them.
+ */
+struct ipq_loop *ipq_loop_create(size_t bufsize)
+{
+	struct ipq_loop *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		ipq_errno = IPQ_ERR_BUFFER;
+		return NULL;
+	}
+	l->b = ipq_batch_create(IPQ_LOOP_BATCH, bufsize);
+	if (l->b == NULL) {
+		free(l);
+		return NULL;
+	}
+	l->fd = epoll_create(IPQ_LOOP_EVENTS);
+	if (l->fd < 0) {
+		ipq_errno = IPQ_ERR_SOCKET;
+		ipq_batch_destroy(l->b);
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+void ipq_loop_destroy(struct ipq_loop *l)
+{
+	struct ipq_loop_entry *e, *next;
+
+	if (l == NULL)
+		return;
+	for (e = l->entries; e != NULL; e = next) {
+		next = e->next;
+		free(e);
+	}
+	close(l->fd);
+	ipq_batch_destroy(l->b);
+	free(l);
+}
+
+/* The epoll descriptor, to be watched by an outer event loop */
+int ipq_loop_get_fd(const struct ipq_loop *l)
+{
+	return l->fd;
+}
+
+/* Have @fn called for every message received on @h */
+int ipq_loop_add(struct ipq_loop *l, const struct ipq_handle *h,
+                 ipq_msg_fn fn, void *data)
+{
+	struct ipq_loop_entry *e;
+	struct epoll_event ev;
+
+	e = malloc(sizeof(*e));
+	if (e == NULL) {
+		ipq_errno = IPQ_ERR_BUFFER;
+		return -1;
+	}
+	e->h    = h;
+	e->fn   = fn;
+	e->data = data;
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = e;
+	if (epoll_ctl(l->fd, EPOLL_CTL_ADD, h->fd, &ev) < 0) {
+		ipq_errno = IPQ_ERR_IMPL;
+		free(e);
+		return -1;
+	}
+	e->next = l->entries;
+	l->entries = e;
+	return 0;
+}
+
+int ipq_loop_del(struct ipq_loop *l, const struct ipq_handle *h)
+{
+	struct ipq_loop_entry **p, *e;
+
+	for (p = &l->entries; *p != NULL; p = &(*p)->next)
+		if ((*p)->h == h)
+			break;
+	e = *p;
+	if (e == NULL) {
+		ipq_errno = IPQ_ERR_IMPL;
+		return -1;
+	}
+	epoll_ctl(l->fd, EPOLL_CTL_DEL, h->fd, NULL);
+	*p = e->next;
+	free(e);
+	return 0;
+}
+
+/*
+ * Wait for at most @timeout microseconds (or not at all if it is
+ * negative, or forever if it is 0, as for ipq_read) and drain every handle
+ * that became readable. Returns the number of messages handled, 0 on
+ * timeout, or -1 on failure.
+ */
+int ipq_loop_run(struct ipq_loop *l, int timeout)
+{
+	struct epoll_event ev[IPQ_LOOP_EVENTS];
+	struct ipq_loop_entry *e;
+	int i, n, status, total = 0;
+
+	if (timeout < 0)
+		timeout = 0;
+	else if (timeout == 0)
+		timeout = -1;
+	else
+		timeout = (timeout + 999) / 1000;
+
+	n = epoll_wait(l->fd, ev, IPQ_LOOP_EVENTS, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		ipq_errno = IPQ_ERR_RECV;
+		return -1;
+	}
+	if (n == 0) {
+		ipq_errno = IPQ_ERR_TIMEOUT;
+		for (e = l->entries; e != NULL; e = e->next)
+			IPQ_STAT(e->h, timeouts, 1);
+	}
+	for (i = 0; i < n; ++i) {
+		e = ev[i].data.ptr;
+		status = ipq_drain(e->h, l->b, e->fn, e->data);
+		if (status < 0)
+			return -1;
+		total += status;
+	}
+	return total;
+}
+
+/*
+ * Return the next message of the batch, to be used like an ipq_read buffer,
+ * or NULL when all have been seen. A datagram may hold several messages.
+ */
+unsigned char *ipq_batch_next(struct ipq_batch *b)
+{
+	while (b->cur < b->received) {
+		if (b->next == NULL) {
+			b->next   = b->msgs[b->cur].msg_hdr.msg_iov->iov_base;
+			b->remain = b->msgs[b->cur].msg_len;
+		} else {
+			b->next = NLMSG_NEXT(b->next, b->remain);
+		}
+		if (NLMSG_OK(b->next, b->remain))
+			return (unsigned char *)b->next;
+		++b->cur;
+		b->next = NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Create a pool of @count receive buffers of at least @bufsize bytes
+ * each, rounded up to whole pages.
+ */
+struct ipq_pool *ipq_pool_create(unsigned int count, size_t bufsize)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct ipq_pool *p;
+	unsigned int i;
+
+	if (count == 0 || bufsize < sizeof(struct nlmsgerr)) {
+		ipq_errno = IPQ_ERR_RECVBUF;
+		return NULL;
+	}
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		goto err;
+	pthread_mutex_init(&p->lock, NULL);
+	p->count   = count;
+	p->bufsize = (bufsize + page - 1) & ~(page - 1);
+	p->size    = count * p->bufsize;
+	p->mem     = mmap(NULL, p->size, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p->mem == MAP_FAILED) {
+		p->mem = NULL;
+		goto err;
+	}
+	p->free    = calloc(count, sizeof(*p->free));
+	p->out     = calloc(count, sizeof(*p->out));
+	p->b.msgs  = calloc(count, sizeof(*p->b.msgs));
+	p->b.iov   = calloc(count, sizeof(*p->b.iov));
+	p->b.peers = calloc(count, sizeof(*p->b.peers));
+	if (p->free == NULL || p->out == NULL || p->b.msgs == NULL ||
+	    p->b.iov == NULL || p->b.peers == NULL)
+		goto err;
+
+	for (i = 0; i < count; ++i) {
+		p->free[i] = count - 1 - i;
+		p->b.iov[i].iov_len = p->bufsize;
+		p->b.msgs[i].msg_hdr.msg_name   = &p->b.peers[i];
+		p->b.msgs[i].msg_hdr.msg_iov    = &p->b.iov[i];
+		p->b.msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	p->nfree = count;
+	p->b.bufsize = p->bufsize;
+	return p;
+ err:
+	ipq_pool_destroy(p);
+	ipq_errno = IPQ_ERR_BUFFER;
+	return NULL;
+}
+
+/* Buffers still handed out become invalid */
+void ipq_pool_destroy(struct ipq_pool *p)
+{
+	if (p == NULL)
+		return;
+	if (p->mem != NULL)
+		munmap(p->mem, p->size);
+	free(p->free);
+	free(p->out);
+	free(p->b.msgs);
+	free(p->b.iov);
+	free(p->b.peers);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+/*
+ * Receive up to @n datagrams, as ipq_read_batch does, straight into free
+ * buffers of the pool, and store them in @bufs. They belong to the caller
+ * until given back with ipq_pool_release. Returns the number of buffers
+ * filled, or as ipq_read. Only one thread may read from a pool at a time.
+ */
+ssize_t ipq_read_pool(const struct ipq_handle *h, struct ipq_pool *p,
+                      unsigned char **bufs, unsigned int n, int timeout)
+{
+	unsigned int i, idx;
+	ssize_t status;
+
+	pthread_mutex_lock(&p->lock);
+	if (n > p->nfree)
+		n = p->nfree;
+	for (i = 0; i < n; ++i) {
+		idx = p->free[--p->nfree];
+		p->out[idx] = 1;
+		p->b.iov[i].iov_base = p->mem + idx * p->bufsize;
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (n == 0) {
+		ipq_errno = IPQ_ERR_POOL;
+		return -1;
+	}
+
+	p->b.count = n;
+	status = ipq_batch_fill(h, &p->b, timeout, MSG_WAITFORONE);
+	for (i = 0; i < n; ++i) {
+		if (status > 0 && i < (size_t)status)
+			bufs[i] = p->b.iov[i].iov_base;
+		else
+			ipq_pool_release(p, p->b.iov[i].iov_base);
+	}
+	return status;
+}
+
+/*
+ * Give a buffer obtained from ipq_read_pool back to the pool. Buffers
+ * not handed out, including ones already released, are ignored.
+ */
+void ipq_pool_release(struct ipq_pool *p, unsigned char *buf)
+{
+	unsigned int idx;
+
+	if (buf < p->mem || buf >= p->mem + p->size)
+		return;
+	idx = (buf - p->mem) / p->bufsize;
+	pthread_mutex_lock(&p->lock);
+	if (p->out[idx]) {
+		p->out[idx] = 0;
+		p->free[p->nfree++] = idx;
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
 int ipq_message_type(const unsigned char *buf)
 {
 	return ((struct nlmsghdr*)buf)->nlmsg_type;
@@ -317,42 +1664,225 @@ int ipq_set_verdict(const struct ipq_handle *h,
                     size_t data_len,
                     unsigned char *buf)
 {
-	unsigned char nvecs;
-	size_t tlen;
-	struct nlmsghdr nlh;
-	ipq_peer_msg_t pm;
-	struct iovec iov[3];
+	struct ipq_vmsg v;
 	struct msghdr msg;
+	int status;
 
-	memset(&nlh, 0, sizeof(nlh));
-	nlh.nlmsg_flags = NLM_F_REQUEST;
-	nlh.nlmsg_type = IPQM_VERDICT;
-	nlh.nlmsg_pid = h->local.nl_pid;
-	memset(&pm, 0, sizeof(pm));
-	pm.msg.verdict.value = verdict;
-	pm.msg.verdict.id = id;
-	pm.msg.verdict.data_len = data_len;
-	iov[0].iov_base = &nlh;
-	iov[0].iov_len = sizeof(nlh);
-	iov[1].iov_base = &pm;
-	iov[1].iov_len = sizeof(pm);
-	tlen = sizeof(nlh) + sizeof(pm);
-	nvecs = 2;
-	if (data_len && buf) {
-		iov[2].iov_base = buf;
-		iov[2].iov_len = data_len;
-		tlen += data_len;
-		nvecs++;
-	}
 	msg.msg_name = (void *)&h->peer;
 	msg.msg_namelen = sizeof(h->peer);
-	msg.msg_iov = iov;
-	msg.msg_iovlen = nvecs;
+	msg.msg_iov = v.iov;
+	msg.msg_iovlen = ipq_verdict_build(h, &v, id, verdict, data_len, buf);
 	msg.msg_control = NULL;
 	msg.msg_controllen = 0;
 	msg.msg_flags = 0;
-	nlh.nlmsg_len = tlen;
-	return ipq_netlink_sendmsg(h, &msg, 0);
+	status = ipq_netlink_sendmsg(h, &msg, 0);
+	if (status >= 0 && h->stats != NULL)
+		ipq_stats_verdict(h, id, v.nlh.nlmsg_len, ipq_now());
+	return status;
+}
+
+/*
+ * Create a batch of up to @count verdicts for @h. Queued verdicts are
+ * also sent once the oldest has waited @usec microseconds, unless it is 0.
+ */
+struct ipq_verdict_batch *ipq_verdict_batch_create(const struct ipq_handle *h,
+                                                   unsigned int count,
+                                                   int usec)
+{
+	struct ipq_verdict_batch *vb;
+	unsigned int i;
+
+	if (count == 0 || usec < 0) {
+		ipq_errno = IPQ_ERR_IMPL;
+		return NULL;
+	}
+	vb = calloc(1, sizeof(*vb));
+	if (vb == NULL)
+		goto err;
+	vb->h     = h;
+	vb->count = count;
+	vb->usec  = usec;
+	vb->vmsgs = calloc(count, sizeof(*vb->vmsgs));
+	vb->msgs  = calloc(count, sizeof(*vb->msgs));
+	if (vb->vmsgs == NULL || vb->msgs == NULL)
+		goto err;
+
+	for (i = 0; i < count; ++i) {
+		vb->msgs[i].msg_hdr.msg_name    = (void *)&h->peer;
+		vb->msgs[i].msg_hdr.msg_namelen = sizeof(h->peer);
+		vb->msgs[i].msg_hdr.msg_iov     = vb->vmsgs[i].iov;
+	}
+	return vb;
+ err:
+	if (vb != NULL) {
+		free(vb->vmsgs);
+		free(vb->msgs);
+		free(vb);
+	}
+	ipq_errno = IPQ_ERR_BUFFER;
+	return NULL;
+}
+
+/*
+ * Send what is still queued and free the batch. Returns as
+ * ipq_verdict_batch_flush.
+ */
+int ipq_verdict_batch_destroy(struct ipq_verdict_batch *vb)
+{
+	int status;
+
+	if (vb == NULL)
+		return 0;
+	status = ipq_netlink_sendmmsg(vb);
+	free(vb->vmsgs);
+	free(vb->msgs);
+	free(vb);
+	return status;
+}
+
+/*
+ * Queue a verdict, as ipq_set_verdict would send it. @buf is not copied
+ * and must stay valid until the verdict has been sent. If the batch is
+ * full, or its oldest verdict is due, the batch is flushed first; if that
+ * fails, -1 is returned and the verdict is not queued. Otherwise returns
+ * the number of verdicts sent, which may be 0.
+ */
+int ipq_verdict_batch_add(struct ipq_verdict_batch *vb, ipq_id_t id,
+                          unsigned int verdict, size_t data_len,
+                          unsigned char *buf)
+{
+	int sent = 0;
+	struct mmsghdr *m;
+
+	if (vb->queued == vb->count || ipq_verdict_batch_due(vb)) {
+		sent = ipq_netlink_sendmmsg(vb);
+		if (sent < 0)
+			return sent;
+	}
+	if (vb->queued == 0 && vb->usec != 0)
+		gettimeofday(&vb->since, NULL);
+	m = &vb->msgs[vb->queued];
+	m->msg_hdr.msg_iovlen = ipq_verdict_build(vb->h,
+	                        &vb->vmsgs[vb->queued], id, verdict,
+	                        data_len, buf);
+	++vb->queued;
+	return sent;
+}
+
+/*
+ * Send all queued verdicts. Returns the number sent, or -1 on failure;
+ * verdicts not sent stay queued and are tried again by the next flush.
+ */
+int ipq_verdict_batch_flush(struct ipq_verdict_batch *vb)
+{
+	return ipq_netlink_sendmmsg(vb);
+}
+
+/*
+ * Start a reader, a writer and @workers worker threads which call @fn for
+ * every packet received on @h, and send the verdict it returns. Packets
+ * are received into buffers of @bufsize bytes, as for ipq_read.
+ */
+struct ipq_dispatch *ipq_dispatch_create(const struct ipq_handle *h,
+                                         unsigned int workers, size_t bufsize,
+                                         ipq_dispatch_fn fn, void *data)
+{
+	struct ipq_dispatch *d;
+	unsigned long i;
+
+	if (workers == 0 || fn == NULL) {
+		ipq_errno = IPQ_ERR_IMPL;
+		return NULL;
+	}
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		ipq_errno = IPQ_ERR_BUFFER;
+		return NULL;
+	}
+	d->h    = h;
+	d->fn   = fn;
+	d->data = data;
+	d->nworkers = workers;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->slot_cond, NULL);
+	pthread_cond_init(&d->stop_cond, NULL);
+	pthread_mutex_init(&d->work_lock, NULL);
+	pthread_cond_init(&d->work_cond, NULL);
+	pthread_mutex_init(&d->wlock, NULL);
+	pthread_cond_init(&d->wcond, NULL);
+
+	for (i = 0; i < IPQ_DISPATCH_SLOTS; ++i) {
+		d->slots[i].b = ipq_batch_create(IPQ_DISPATCH_BATCH, bufsize);
+		if (d->slots[i].b == NULL)
+			goto err;
+	}
+	d->vb = ipq_verdict_batch_create(h, IPQ_DISPATCH_BATCH, 0);
+	if (d->vb == NULL)
+		goto err;
+	d->sent       = calloc(IPQ_DISPATCH_BATCH, sizeof(*d->sent));
+	d->ring.cells = calloc(IPQ_DISPATCH_RING, sizeof(*d->ring.cells));
+	d->workers    = calloc(workers, sizeof(*d->workers));
+	if (d->sent == NULL || d->ring.cells == NULL || d->workers == NULL) {
+		ipq_errno = IPQ_ERR_BUFFER;
+		goto err;
+	}
+	d->ring.mask = IPQ_DISPATCH_RING - 1;
+	for (i = 0; i < IPQ_DISPATCH_RING; ++i)
+		d->ring.cells[i].seq = i;
+	for (i = 0; i < workers; ++i) {
+		d->workers[i].d   = d;
+		d->workers[i].idx = i;
+		pthread_mutex_init(&d->workers[i].lock, NULL);
+	}
+
+	if (pthread_create(&d->writer, NULL, ipq_dwriter_run, d) != 0)
+		goto err_thread;
+	d->writer_started = 1;
+	for (; d->started < workers; ++d->started)
+		if (pthread_create(&d->workers[d->started].thread, NULL,
+		    ipq_dworker_run, &d->workers[d->started]) != 0)
+			goto err_thread;
+	if (pthread_create(&d->reader, NULL, ipq_dreader_run, d) != 0)
+		goto err_thread;
+	d->reader_started = 1;
+	return d;
+
+ err_thread:
+	ipq_errno = IPQ_ERR_IMPL;
+	ipq_dispatch_shutdown(d);
+ err:
+	ipq_dispatch_free(d);
+	return NULL;
+}
+
+/*
+ * Wait until the dispatcher stops because of an error, which is then
+ * reported as if by the failing call.
+ */
+int ipq_dispatch_wait(struct ipq_dispatch *d)
+{
+	pthread_mutex_lock(&d->lock);
+	while (d->err == IPQ_ERR_NONE)
+		pthread_cond_wait(&d->stop_cond, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+	return ipq_dispatch_status(d);
+}
+
+/*
+ * Stop receiving, let the workers finish the packets already received,
+ * send their verdicts and free the dispatcher. Returns -1 if it had
+ * stopped because of an error, and 0 otherwise.
+ */
+int ipq_dispatch_destroy(struct ipq_dispatch *d)
+{
+	int status;
+
+	if (d == NULL)
+		return 0;
+	ipq_dispatch_shutdown(d);
+	status = ipq_dispatch_status(d);
+	ipq_dispatch_free(d);
+	return status;
 }
 
 /* Not implemented yet */
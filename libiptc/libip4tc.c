@@ -52,6 +52,8 @@ typedef unsigned int socklen_t;
 
 #define STRUCT_TC_HANDLE	struct iptc_handle
 #define xtc_handle		iptc_handle
+#define STRUCT_TC_SNAPSHOT	struct iptc_snapshot
+#define xtc_snapshot		iptc_snapshot
 
 #define ENTRY_ITERATE		IPT_ENTRY_ITERATE
 #define TABLE_MAXNAMELEN	IPT_TABLE_MAXNAMELEN
@@ -79,6 +81,10 @@ typedef unsigned int socklen_t;
 #define TC_CHECK_ENTRY		iptc_check_entry
 #define TC_DELETE_ENTRY		iptc_delete_entry
 #define TC_DELETE_NUM_ENTRY	iptc_delete_num_entry
+#define TC_INSERT_ENTRIES	iptc_insert_entries
+#define TC_APPEND_ENTRIES	iptc_append_entries
+#define TC_CHECK_ENTRIES	iptc_check_entries
+#define TC_DELETE_ENTRIES	iptc_delete_entries
 #define TC_FLUSH_ENTRIES	iptc_flush_entries
 #define TC_ZERO_ENTRIES		iptc_zero_entries
 #define TC_READ_COUNTER		iptc_read_counter
@@ -92,6 +98,12 @@ typedef unsigned int socklen_t;
 #define TC_GET_RAW_SOCKET	iptc_get_raw_socket
 #define TC_INIT			iptc_init
 #define TC_FREE			iptc_free
+#define TC_WALK_COUNTERS	iptc_walk_counters
+#define TC_COUNTER_FN		iptc_counter_fn
+#define TC_SNAPSHOT		iptc_snapshot
+#define TC_SNAPSHOT_COMMITTED	iptc_snapshot_committed
+#define TC_RESTORE_SNAPSHOT	iptc_restore_snapshot
+#define TC_FREE_SNAPSHOT	iptc_free_snapshot
 #define TC_COMMIT		iptc_commit
 #define TC_STRERROR		iptc_strerror
 #define TC_NUM_RULES		iptc_num_rules
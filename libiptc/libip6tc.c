@@ -47,6 +47,8 @@ typedef unsigned int socklen_t;
 
 #define STRUCT_TC_HANDLE	struct ip6tc_handle
 #define xtc_handle		ip6tc_handle
+#define STRUCT_TC_SNAPSHOT	struct ip6tc_snapshot
+#define xtc_snapshot		ip6tc_snapshot
 
 #define ENTRY_ITERATE		IP6T_ENTRY_ITERATE
 #define TABLE_MAXNAMELEN	IP6T_TABLE_MAXNAMELEN
@@ -74,6 +76,10 @@ typedef unsigned int socklen_t;
 #define TC_CHECK_ENTRY		ip6tc_check_entry
 #define TC_DELETE_ENTRY		ip6tc_delete_entry
 #define TC_DELETE_NUM_ENTRY	ip6tc_delete_num_entry
+#define TC_INSERT_ENTRIES	ip6tc_insert_entries
+#define TC_APPEND_ENTRIES	ip6tc_append_entries
+#define TC_CHECK_ENTRIES	ip6tc_check_entries
+#define TC_DELETE_ENTRIES	ip6tc_delete_entries
 #define TC_FLUSH_ENTRIES	ip6tc_flush_entries
 #define TC_ZERO_ENTRIES		ip6tc_zero_entries
 #define TC_ZERO_COUNTER		ip6tc_zero_counter
@@ -87,6 +93,12 @@ typedef unsigned int socklen_t;
 #define TC_GET_RAW_SOCKET	ip6tc_get_raw_socket
 #define TC_INIT			ip6tc_init
 #define TC_FREE			ip6tc_free
+#define TC_WALK_COUNTERS	ip6tc_walk_counters
+#define TC_COUNTER_FN		ip6tc_counter_fn
+#define TC_SNAPSHOT		ip6tc_snapshot
+#define TC_SNAPSHOT_COMMITTED	ip6tc_snapshot_committed
+#define TC_RESTORE_SNAPSHOT	ip6tc_restore_snapshot
+#define TC_FREE_SNAPSHOT	ip6tc_free_snapshot
 #define TC_COMMIT		ip6tc_commit
 #define TC_STRERROR		ip6tc_strerror
 #define TC_NUM_RULES		ip6tc_num_rules
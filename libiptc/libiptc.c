@@ -53,7 +53,8 @@
 #define debug(x, args...)
 #endif
 
-static void *iptc_fn = NULL;
+/* for TC_STRERROR; per thread, as are the handles */
+static __thread void *iptc_fn;
 
 static const char *hooknames[] = {
 	[HOOK_PRE_ROUTING]	= "PREROUTING",
@@ -152,6 +153,9 @@ STRUCT_TC_HANDLE
 
 	STRUCT_GETINFO info;
 	STRUCT_GET_ENTRIES *entries;
+
+	int replaced;			/* Has TC_COMMIT replaced the table? */
+	STRUCT_GETINFO committed;	/* Table as TC_COMMIT left it */
 };
 
 enum bsearch_type {
@@ -1380,6 +1384,99 @@ error:
 	return NULL;
 }
 
+/* Walk the counters of every rule of a table directly from the kernel
+ * blob, without building the chain and rule cache. The policy of a
+ * built-in chain is passed as rule number 0. A non-zero return from
+ * the callback stops the walk. */
+int
+TC_WALK_COUNTERS(const char *tablename, TC_COUNTER_FN fn, void *data)
+{
+	STRUCT_GETINFO info;
+	STRUCT_GET_ENTRIES *entries = NULL;
+	STRUCT_ENTRY *e, *prev = NULL;
+	const char *chain = NULL;
+	unsigned int offset, rulenum = 0, builtin = 0, i;
+	socklen_t s;
+	int sockfd, ret = 0;
+
+	iptc_fn = TC_WALK_COUNTERS;
+
+	if (strlen(tablename) >= TABLE_MAXNAMELEN) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	sockfd = socket(TC_AF, SOCK_RAW, IPPROTO_RAW);
+	if (sockfd < 0)
+		return 0;
+
+retry:
+	s = sizeof(info);
+	strcpy(info.name, tablename);
+	if (getsockopt(sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+		goto out;
+
+	free(entries);
+	entries = malloc(sizeof(STRUCT_GET_ENTRIES) + info.size);
+	if (entries == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	strcpy(entries->name, info.name);
+	entries->size = info.size;
+
+	s = sizeof(STRUCT_GET_ENTRIES) + info.size;
+	if (getsockopt(sockfd, TC_IPPROTO, SO_GET_ENTRIES, entries, &s) < 0) {
+		/* A different process changed the ruleset size, retry */
+		if (errno == EAGAIN)
+			goto retry;
+		goto out;
+	}
+
+	for (offset = 0; offset < entries->size; offset += e->next_offset) {
+		unsigned int hook = 0;
+		bool error_node;
+
+		e = (void *)entries->entrytable + offset;
+		error_node = strcmp(GET_TARGET(e)->u.user.name,
+				    ERROR_TARGET) == 0;
+		if (!error_node)
+			for (i = 0; i < NUMHOOKS; i++)
+				if ((info.valid_hooks & (1 << i)) &&
+				    info.hook_entry[i] == offset) {
+					hook = i + 1;
+					break;
+				}
+
+		if (error_node || hook) {
+			/* The last entry of the previous chain is its
+			 * policy (built-in) or its RETURN (user-defined). */
+			if (prev != NULL && builtin &&
+			    fn(chain, 0, &prev->counters, data))
+				goto done;
+			prev = NULL;
+			rulenum = 0;
+			builtin = hook;
+			if (error_node) {
+				chain = (const char *)GET_TARGET(e)->data;
+				continue;
+			}
+			chain = hooknames[hook-1];
+		}
+
+		if (prev != NULL && fn(chain, rulenum, &prev->counters, data))
+			goto done;
+		prev = e;
+		++rulenum;
+	}
+done:
+	ret = 1;
+out:
+	free(entries);
+	close(sockfd);
+	return ret;
+}
+
 void
 TC_FREE(struct xtc_handle *h)
 {
@@ -1737,6 +1834,77 @@ iptcc_map_target(struct xtc_handle *const handle,
 	return 1;
 }
 
+/* Map the target of @r (copied from @e) like that of @prev (copied from
+ * @prev_e) if both rules came with the same target, which saves looking
+ * up the same chain or label over and over in a batch. */
+static int
+iptcc_map_target_like(struct xtc_handle *const handle, struct rule_head *r,
+		      const STRUCT_ENTRY *e, struct rule_head *prev,
+		      const STRUCT_ENTRY *prev_e)
+{
+	unsigned int size = e->next_offset - e->target_offset;
+
+	if (prev == NULL
+	    || prev_e->next_offset - prev_e->target_offset != size
+	    || memcmp((const char *)e + e->target_offset,
+		      (const char *)prev_e + prev_e->target_offset, size) != 0)
+		return iptcc_map_target(handle, r);
+
+	memcpy(GET_TARGET(r->entry), GET_TARGET(prev->entry), size);
+	r->type = prev->type;
+	r->jump = prev->jump;
+	if (r->type == IPTCC_R_JUMP)
+		r->jump->references++;
+	return 1;
+}
+
+/* Add the `n' entries laid out one after another at `e' to chain `c',
+ * in front of `prev'.  Either all of them are added or none. */
+static int
+iptcc_add_rules(struct xtc_handle *handle, struct chain_head *c,
+		const STRUCT_ENTRY *e, unsigned int n, struct list_head *prev)
+{
+	const STRUCT_ENTRY *prev_e = NULL;
+	struct rule_head *r, *last = NULL, *tmp;
+	unsigned int i;
+	LIST_HEAD(batch);
+
+	for (i = 0; i < n; i++) {
+		if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+			errno = ENOMEM;
+			goto fail;
+		}
+
+		memcpy(r->entry, e, e->next_offset);
+		r->counter_map.maptype = COUNTER_MAP_SET;
+
+		if (!iptcc_map_target_like(handle, r, e, last, prev_e)) {
+			free(r);
+			goto fail;
+		}
+
+		list_add_tail(&r->list, &batch);
+		last = r;
+		prev_e = e;
+		e = (const void *)e + e->next_offset;
+	}
+
+	list_splice(&batch, prev->prev);
+	c->num_rules += n;
+
+	set_changed(handle);
+
+	return 1;
+
+fail:
+	list_for_each_entry_safe(r, tmp, &batch, list) {
+		if (r->type == IPTCC_R_JUMP && r->jump)
+			r->jump->references--;
+		free(r);
+	}
+	return 0;
+}
+
 /* Insert the entry `fw' in chain `chain' into position `rulenum'. */
 int
 TC_INSERT_ENTRY(const IPT_CHAINLABEL chain,
@@ -1886,6 +2054,64 @@ TC_APPEND_ENTRY(const IPT_CHAINLABEL chain,
 	return 1;
 }
 
+/* Insert the `n' entries laid out one after another at `e' in chain
+   `chain', the first at position `rulenum'. */
+int
+TC_INSERT_ENTRIES(const IPT_CHAINLABEL chain,
+		  const STRUCT_ENTRY *e,
+		  unsigned int n,
+		  unsigned int rulenum,
+		  struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct rule_head *r;
+	struct list_head *prev;
+
+	iptc_fn = TC_INSERT_ENTRIES;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	if (rulenum > c->num_rules) {
+		errno = E2BIG;
+		return 0;
+	}
+
+	if (rulenum == c->num_rules) {
+		prev = &c->rules;
+	} else if (rulenum + 1 <= c->num_rules/2) {
+		r = iptcc_get_rule_num(c, rulenum + 1);
+		prev = &r->list;
+	} else {
+		r = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
+		prev = &r->list;
+	}
+
+	return iptcc_add_rules(handle, c, e, n, prev);
+}
+
+/* Append the `n' entries laid out one after another at `e' to chain
+   `chain'. */
+int
+TC_APPEND_ENTRIES(const IPT_CHAINLABEL chain,
+		  const STRUCT_ENTRY *e,
+		  unsigned int n,
+		  struct xtc_handle *handle)
+{
+	struct chain_head *c;
+
+	iptc_fn = TC_APPEND_ENTRIES;
+	if (!(c = iptcc_find_label(chain, handle))) {
+		DEBUGP("unable to find chain `%s'\n", chain);
+		errno = ENOENT;
+		return 0;
+	}
+
+	return iptcc_add_rules(handle, c, e, n, &c->rules);
+}
+
 static inline int
 match_different(const STRUCT_ENTRY_MATCH *a,
 		const unsigned char *a_elems,
@@ -1955,77 +2181,98 @@ is_same(const STRUCT_ENTRY *a,
 	unsigned char *matchmask);
 
 
-/* find the first rule in `chain' which matches `fw' and remove it unless dry_run is set */
-static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
-			unsigned char *matchmask, struct xtc_handle *handle,
-			bool dry_run)
+/* for each of the `n' entries at `origfw', find the first rule in `chain'
+ * which matches it and remove it unless dry_run is set */
+static int delete_entries(const IPT_CHAINLABEL chain,
+			  const STRUCT_ENTRY *origfw, unsigned int n,
+			  unsigned char *matchmask, struct xtc_handle *handle,
+			  bool dry_run)
 {
+	const STRUCT_ENTRY *prev_e = NULL;
 	struct chain_head *c;
-	struct rule_head *r, *i;
+	struct rule_head *r, *i, *last = NULL;
+	unsigned int k;
+	int found, ret = 1;
 
-	iptc_fn = TC_DELETE_ENTRY;
+	if (n == 1)
+		iptc_fn = TC_DELETE_ENTRY;
+	else
+		iptc_fn = TC_DELETE_ENTRIES;
 	if (!(c = iptcc_find_label(chain, handle))) {
 		errno = ENOENT;
 		return 0;
 	}
 
-	/* Create a rule_head from origfw. */
-	r = iptcc_alloc_rule(c, origfw->next_offset);
-	if (!r) {
-		errno = ENOMEM;
-		return 0;
-	}
+	for (k = 0; k < n; k++) {
+		/* Create a rule_head from origfw. */
+		r = iptcc_alloc_rule(c, origfw->next_offset);
+		if (!r) {
+			free(last);
+			errno = ENOMEM;
+			return 0;
+		}
 
-	memcpy(r->entry, origfw, origfw->next_offset);
-	r->counter_map.maptype = COUNTER_MAP_NOMAP;
-	if (!iptcc_map_target(handle, r)) {
-		DEBUGP("unable to map target of rule for chain `%s'\n", chain);
-		free(r);
-		return 0;
-	} else {
-		/* iptcc_map_target increment target chain references
-		 * since this is a fake rule only used for matching
-		 * the chain references count is decremented again.
-		 */
-		if (r->type == IPTCC_R_JUMP
-		    && r->jump)
-			r->jump->references--;
-	}
+		memcpy(r->entry, origfw, origfw->next_offset);
+		r->counter_map.maptype = COUNTER_MAP_NOMAP;
+		if (!iptcc_map_target_like(handle, r, origfw, last, prev_e)) {
+			DEBUGP("unable to map target of rule for chain `%s'\n", chain);
+			free(last);
+			free(r);
+			return 0;
+		} else {
+			/* iptcc_map_target increment target chain references
+			 * since this is a fake rule only used for matching
+			 * the chain references count is decremented again.
+			 */
+			if (r->type == IPTCC_R_JUMP
+			    && r->jump)
+				r->jump->references--;
+		}
 
-	list_for_each_entry(i, &c->rules, list) {
-		unsigned char *mask;
+		found = 0;
+		list_for_each_entry(i, &c->rules, list) {
+			unsigned char *mask;
 
-		mask = is_same(r->entry, i->entry, matchmask);
-		if (!mask)
-			continue;
+			mask = is_same(r->entry, i->entry, matchmask);
+			if (!mask)
+				continue;
 
-		if (!target_same(r, i, mask))
-			continue;
+			if (!target_same(r, i, mask))
+				continue;
 
-		/* if we are just doing a dry run, we simply skip the rest */
-		if (dry_run)
-			return 1;
+			found = 1;
 
-		/* If we are about to delete the rule that is the
-		 * current iterator, move rule iterator back.  next
-		 * pointer will then point to real next node */
-		if (i == handle->rule_iterator_cur) {
-			handle->rule_iterator_cur =
-				list_entry(handle->rule_iterator_cur->list.prev,
-					   struct rule_head, list);
-		}
+			/* if we are just doing a dry run, we simply skip the rest */
+			if (dry_run)
+				break;
 
-		c->num_rules--;
-		iptcc_delete_rule(i);
+			/* If we are about to delete the rule that is the
+			 * current iterator, move rule iterator back.  next
+			 * pointer will then point to real next node */
+			if (i == handle->rule_iterator_cur) {
+				handle->rule_iterator_cur =
+					list_entry(handle->rule_iterator_cur->list.prev,
+						   struct rule_head, list);
+			}
 
-		set_changed(handle);
-		free(r);
-		return 1;
+			c->num_rules--;
+			iptcc_delete_rule(i);
+
+			set_changed(handle);
+			break;
+		}
+		ret &= found;
+
+		free(last);
+		last = r;
+		prev_e = origfw;
+		origfw = (const void *)origfw + origfw->next_offset;
 	}
 
-	free(r);
-	errno = ENOENT;
-	return 0;
+	free(last);
+	if (!ret)
+		errno = ENOENT;
+	return ret;
 }
 
 /* check whether a specified rule is present */
@@ -2033,14 +2280,31 @@ int TC_CHECK_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
 		   unsigned char *matchmask, struct xtc_handle *handle)
 {
 	/* do a dry-run delete to find out whether a matching rule exists */
-	return delete_entry(chain, origfw, matchmask, handle, true);
+	return delete_entries(chain, origfw, 1, matchmask, handle, true);
+}
+
+/* check whether rules matching each of the `n' entries are present */
+int TC_CHECK_ENTRIES(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
+		     unsigned int n, unsigned char *matchmask,
+		     struct xtc_handle *handle)
+{
+	return delete_entries(chain, origfw, n, matchmask, handle, true);
 }
 
 /* Delete the first rule in `chain' which matches `fw'. */
 int TC_DELETE_ENTRY(const IPT_CHAINLABEL chain,	const STRUCT_ENTRY *origfw,
 		    unsigned char *matchmask, struct xtc_handle *handle)
 {
-	return delete_entry(chain, origfw, matchmask, handle, false);
+	return delete_entries(chain, origfw, 1, matchmask, handle, false);
+}
+
+/* Delete, for each of the `n' entries at `origfw', the first rule in
+   `chain' which matches it. */
+int TC_DELETE_ENTRIES(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
+		      unsigned int n, unsigned char *matchmask,
+		      struct xtc_handle *handle)
+{
+	return delete_entries(chain, origfw, n, matchmask, handle, false);
 }
 
 /* Delete the rule in position `rulenum' in `chain'. */
@@ -2601,6 +2865,15 @@ TC_COMMIT(struct xtc_handle *handle)
 	if (ret < 0)
 		goto out_free_newcounters;
 
+	handle->replaced = 1;
+	handle->committed = handle->info;
+	handle->committed.num_entries = repl->num_entries;
+	handle->committed.size = repl->size;
+	memcpy(handle->committed.hook_entry, repl->hook_entry,
+	       sizeof(handle->committed.hook_entry));
+	memcpy(handle->committed.underflow, repl->underflow,
+	       sizeof(handle->committed.underflow));
+
 	/* Put counters back. */
 	strcpy(newcounters->name, handle->info.name);
 	newcounters->num_counters = new_number;
@@ -2694,6 +2967,158 @@ out_zero:
 	return 0;
 }
 
+/* A copy of the table blob as it was read by TC_INIT, which can be put
+ * back into the kernel after later commits, e.g. to undo a restore. */
+struct xtc_snapshot {
+	STRUCT_COUNTERS_INFO *counters;
+	int replaced;			/* see TC_SNAPSHOT_COMMITTED */
+	STRUCT_GETINFO committed;
+	STRUCT_REPLACE repl;	/* followed by repl.size bytes of entries */
+};
+
+static inline int
+snapshot_counter(STRUCT_ENTRY *e, STRUCT_COUNTERS_INFO *ci, unsigned int *i)
+{
+	ci->counters[(*i)++] = e->counters;
+	return 0;
+}
+
+STRUCT_TC_SNAPSHOT *
+TC_SNAPSHOT(struct xtc_handle *const handle)
+{
+	STRUCT_TC_SNAPSHOT *snap;
+	unsigned int i = 0;
+
+	iptc_fn = TC_SNAPSHOT;
+
+	snap = malloc(sizeof(*snap) + handle->info.size);
+	if (snap == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	snap->counters = malloc(sizeof(STRUCT_COUNTERS_INFO) +
+				sizeof(STRUCT_COUNTERS) *
+				handle->info.num_entries);
+	if (snap->counters == NULL) {
+		free(snap);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	snap->replaced = 0;
+	memset(&snap->repl, 0, sizeof(snap->repl));
+	strcpy(snap->repl.name, handle->info.name);
+	snap->repl.valid_hooks = handle->info.valid_hooks;
+	snap->repl.num_entries = handle->info.num_entries;
+	snap->repl.size = handle->info.size;
+	memcpy(snap->repl.hook_entry, handle->info.hook_entry,
+	       sizeof(snap->repl.hook_entry));
+	memcpy(snap->repl.underflow, handle->info.underflow,
+	       sizeof(snap->repl.underflow));
+	memcpy(snap->repl.entries, handle->entries->entrytable,
+	       handle->info.size);
+
+	strcpy(snap->counters->name, handle->info.name);
+	snap->counters->num_counters = handle->info.num_entries;
+	ENTRY_ITERATE(snap->repl.entries, snap->repl.size,
+		      snapshot_counter, snap->counters, &i);
+	return snap;
+}
+
+/* Remember what TC_COMMIT of the handle the snapshot was taken from put
+ * into the kernel, so that TC_RESTORE_SNAPSHOT only undoes that. */
+void
+TC_SNAPSHOT_COMMITTED(STRUCT_TC_SNAPSHOT *const snap,
+		      struct xtc_handle *const handle)
+{
+	iptc_fn = TC_SNAPSHOT_COMMITTED;
+	snap->replaced = handle->replaced;
+	snap->committed = handle->committed;
+}
+
+/* Replace the table with the snapshot, then add back the counters it
+ * had when the snapshot was taken.  Nothing is done if the commit never
+ * replaced the table.  The kernel keeps no generation number, so a table
+ * that no longer has the size, entry count and hook offsets the commit
+ * gave it is taken to have been changed by someone else, and is left
+ * alone (EBUSY). */
+int
+TC_RESTORE_SNAPSHOT(STRUCT_TC_SNAPSHOT *const snap)
+{
+	STRUCT_GETINFO info;
+	unsigned int i;
+	socklen_t s;
+	int sockfd, ret = 0;
+
+	iptc_fn = TC_RESTORE_SNAPSHOT;
+
+	if (!snap->replaced)
+		return 1;
+
+	sockfd = socket(TC_AF, SOCK_RAW, IPPROTO_RAW);
+	if (sockfd < 0)
+		return 0;
+
+retry:
+	/* The kernel hands back the counters of the table being replaced,
+	 * so it needs to know how many entries that one has. */
+	s = sizeof(info);
+	strcpy(info.name, snap->repl.name);
+	if (getsockopt(sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+		goto out;
+
+	if (info.valid_hooks != snap->committed.valid_hooks ||
+	    info.num_entries != snap->committed.num_entries ||
+	    info.size != snap->committed.size)
+		goto changed;
+	for (i = 0; i < NUMHOOKS; i++)
+		if ((info.valid_hooks & (1 << i)) &&
+		    (info.hook_entry[i] != snap->committed.hook_entry[i] ||
+		     info.underflow[i] != snap->committed.underflow[i]))
+			goto changed;
+
+	snap->repl.num_counters = info.num_entries;
+	snap->repl.counters = malloc(sizeof(STRUCT_COUNTERS) *
+				     info.num_entries);
+	if (snap->repl.counters == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_REPLACE, &snap->repl,
+		       sizeof(snap->repl) + snap->repl.size) < 0) {
+		free(snap->repl.counters);
+		snap->repl.counters = NULL;
+		/* Table changed between GET_INFO and REPLACE */
+		if (errno == EAGAIN)
+			goto retry;
+		goto out;
+	}
+	free(snap->repl.counters);
+	snap->repl.counters = NULL;
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS, snap->counters,
+		       sizeof(STRUCT_COUNTERS_INFO) + sizeof(STRUCT_COUNTERS) *
+		       snap->counters->num_counters) < 0)
+		goto out;
+
+	ret = 1;
+out:
+	close(sockfd);
+	return ret;
+changed:
+	errno = EBUSY;
+	goto out;
+}
+
+void
+TC_FREE_SNAPSHOT(STRUCT_TC_SNAPSHOT *snap)
+{
+	iptc_fn = TC_FREE_SNAPSHOT;
+	free(snap->counters);
+	free(snap);
+}
+
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *
 TC_STRERROR(int err)
@@ -2708,6 +3133,16 @@ TC_STRERROR(int err)
 	    { TC_INIT, EINVAL, "Module is wrong version" },
 	    { TC_INIT, ENOENT,
 		    "Table does not exist (do you need to insmod?)" },
+	    { TC_RESTORE_SNAPSHOT, EPERM,
+	      "Permission denied (you must be root)" },
+	    { TC_RESTORE_SNAPSHOT, ENOENT,
+		    "Table does not exist (do you need to insmod?)" },
+	    { TC_RESTORE_SNAPSHOT, EBUSY,
+	      "Table was changed by someone else after the commit" },
+	    { TC_WALK_COUNTERS, EPERM,
+	      "Permission denied (you must be root)" },
+	    { TC_WALK_COUNTERS, ENOENT,
+		    "Table does not exist (do you need to insmod?)" },
 	    { TC_DELETE_CHAIN, ENOTEMPTY, "Chain is not empty" },
 	    { TC_DELETE_CHAIN, EINVAL, "Can't delete built-in chain" },
 	    { TC_DELETE_CHAIN, EMLINK,
@@ -2720,9 +3155,14 @@ TC_STRERROR(int err)
 	    { TC_ZERO_COUNTER, E2BIG, "Index of counter too big" },
 	    { TC_INSERT_ENTRY, ELOOP, "Loop found in table" },
 	    { TC_INSERT_ENTRY, EINVAL, "Target problem" },
+	    { TC_INSERT_ENTRIES, E2BIG, "Index of insertion too big" },
+	    { TC_INSERT_ENTRIES, EINVAL, "Target problem" },
+	    { TC_APPEND_ENTRIES, EINVAL, "Target problem" },
 	    /* ENOENT for DELETE probably means no matching rule */
 	    { TC_DELETE_ENTRY, ENOENT,
 	      "Bad rule (does a matching rule exist in that chain?)" },
+	    { TC_DELETE_ENTRIES, ENOENT,
+	      "Bad rule (does a matching rule exist in that chain?)" },
 	    { TC_SET_POLICY, ENOENT,
 	      "Bad built-in chain name" },
 	    { TC_SET_POLICY, EINVAL,
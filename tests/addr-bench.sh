@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Time the parsing and numeric formatting of IPv4 and IPv6 addresses
+# with prefix lengths, as given to -s/-d and listed with -n:
+#
+#	addr-bench.sh [-n COUNT] BUILD [BUILD...]
+#
+# addr_bench.c is compiled against the libxtables of each BUILD, which
+# must have been configured without --enable-static, and goes through
+# COUNT generated addresses of each family. The formatted text of all
+# BUILDs must be identical, as told by its checksum.
+
+. "$(dirname "$0")/common.sh"
+
+count=2000000
+while getopts n: opt; do
+	case $opt in
+	n) count=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n COUNT] BUILD [BUILD...]" >&2
+	exit 2
+fi
+
+bin=$(mktemp "${TMPDIR:-/tmp}/addr_bench.XXXXXX") || exit 1
+trap 'rm -f "$bin"' EXIT
+
+ret=0
+for build in "$@"; do
+	if ! xt_cc "$build" "$bin" addr_bench.c; then
+		echo "$build: cannot build addr_bench" >&2
+		ret=1
+		continue
+	fi
+	for family in 4 6; do
+		out=$(xt_run "$build" "$bin" -$family -n "$count") ||
+			{ ret=1; continue; }
+		# The first BUILD gives the checksum of each family
+		sum=${out%%:*}
+		eval ref=\$ref$family
+		if [ -z "$ref" ]; then
+			eval ref$family=\$sum
+			same=
+		elif [ "$sum" = "$ref" ]; then
+			same=", same output"
+		else
+			same=", OUTPUT DIFFERS"
+			ret=1
+		fi
+		echo "$build: IPv$family, ${out#*: }$same"
+	done
+done
+exit $ret
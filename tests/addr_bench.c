@@ -0,0 +1,182 @@
+/*
+ * addr_bench.c - time address parsing and formatting, for addr-bench.sh
+ *
+ * Generates COUNT pseudo-random numeric IPv4 or IPv6 addresses with
+ * prefix lengths, as in "-s 10.1.2.3/24", parses each of them with
+ * xtables_ipparse_any or xtables_ip6parse_any, and formats the results
+ * back with xtables_ip{,6}addr_to_numeric and xtables_ip{,6}mask_to_numeric,
+ * as a listing with -n does:
+ *
+ *	addr_bench [-4|-6] [-n COUNT]
+ *
+ * The checksum printed is over the formatted text; it must not change
+ * from one build to another. Only functions that every libxtables has
+ * are used, so that the program builds against the libxtables of any
+ * build to be compared.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <xtables.h>
+
+static struct xtables_globals addr_globals = {
+	.program_name    = "addr_bench",
+	.program_version = "0",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* FNV-1a over @s, continued from @h */
+static unsigned int hash_str(unsigned int h, const char *s)
+{
+	while (*s != '\0')
+		h = (h ^ (unsigned char)*s++) * 16777619;
+	return h;
+}
+
+/* A 32-bit LCG is plenty to spread addresses over all octets */
+static unsigned int rnd(void)
+{
+	static unsigned int state = 1;
+
+	state = state * 1103515245 + 12345;
+	return state;
+}
+
+static void gen4(char *buf, size_t size)
+{
+	unsigned int a = rnd(), b = rnd();
+
+	snprintf(buf, size, "%u.%u.%u.%u/%u", (a >> 24) & 0xff,
+	         (a >> 16) & 0xff, (b >> 24) & 0xff, (b >> 16) & 0xff,
+	         1 + (b >> 8) % 32);
+}
+
+static void gen6(char *buf, size_t size)
+{
+	unsigned int a = rnd(), b = rnd(), c = rnd();
+
+	/* Both compressed and full forms */
+	if (a & 0x100)
+		snprintf(buf, size, "2001:db8:%x:%x::%x/%u", a >> 16,
+		         b >> 16, c >> 16, 1 + (c >> 8) % 128);
+	else
+		snprintf(buf, size, "fe80:%x:%x:%x:%x:%x:%x:%x/%u", a >> 16,
+		         (a >> 4) & 0xfff, b >> 16, b & 0xffff, c >> 16,
+		         c & 0xffff, (a ^ b) & 0xffff, 1 + (c >> 8) % 128);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long count = 2000000, i;
+	unsigned int naddrs, sum = 2166136261U;
+	uint8_t nfproto = NFPROTO_IPV4;
+	double start, parse, format;
+	char (*in)[64];
+	void *addrs;
+	int c;
+
+	while ((c = getopt(argc, argv, "46n:")) != -1) {
+		switch (c) {
+		case '4':
+			break;
+		case '6':
+			nfproto = NFPROTO_IPV6;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-4|-6] [-n count]\n",
+			        argv[0]);
+			return 2;
+		}
+	}
+
+	if (xtables_init_all(&addr_globals, nfproto) < 0)
+		return 1;
+	in = malloc(count * sizeof(*in));
+	if (in == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	for (i = 0; i < count; ++i)
+		if (nfproto == NFPROTO_IPV4)
+			gen4(in[i], sizeof(in[i]));
+		else
+			gen6(in[i], sizeof(in[i]));
+
+	if (nfproto == NFPROTO_IPV4) {
+		struct in_addr *a, *m;
+
+		a = malloc(count * sizeof(*a));
+		m = malloc(count * sizeof(*m));
+		if (a == NULL || m == NULL) {
+			perror("malloc");
+			return 1;
+		}
+		start = now();
+		for (i = 0; i < count; ++i) {
+			struct in_addr *p;
+
+			xtables_ipparse_any(in[i], &p, &m[i], &naddrs);
+			a[i] = *p;
+			free(p);
+		}
+		parse = now() - start;
+
+		start = now();
+		for (i = 0; i < count; ++i) {
+			sum = hash_str(sum, xtables_ipaddr_to_numeric(&a[i]));
+			sum = hash_str(sum, xtables_ipmask_to_numeric(&m[i]));
+		}
+		format = now() - start;
+		addrs = a;
+		free(m);
+	} else {
+		struct in6_addr *a, *m;
+
+		a = malloc(count * sizeof(*a));
+		m = malloc(count * sizeof(*m));
+		if (a == NULL || m == NULL) {
+			perror("malloc");
+			return 1;
+		}
+		start = now();
+		for (i = 0; i < count; ++i) {
+			struct in6_addr *p;
+
+			xtables_ip6parse_any(in[i], &p, &m[i], &naddrs);
+			a[i] = *p;
+			free(p);
+		}
+		parse = now() - start;
+
+		start = now();
+		for (i = 0; i < count; ++i) {
+			sum = hash_str(sum, xtables_ip6addr_to_numeric(&a[i]));
+			sum = hash_str(sum, xtables_ip6mask_to_numeric(&m[i]));
+		}
+		format = now() - start;
+		addrs = a;
+		free(m);
+	}
+
+	printf("checksum %08x: %lu addresses, parsed %.0f/s, formatted %.0f/s\n",
+	       sum, count, count / parse, count / format);
+	free(addrs);
+	free(in);
+	return 0;
+}
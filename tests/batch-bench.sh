@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Time a run of iptables commands given to iptables --batch against the
+# same commands run one iptables call each, on synthetic filter tables
+# served by sockopt_shim:
+#
+#	batch-bench.sh [-n COMMANDS] [-s "RULES..."] [-r RUNS] BUILD [BUILD...]
+#
+# For each table size in RULES (default 10000 and 100000 rules), the
+# table is loaded with the first BUILD's iptables-restore; each BUILD
+# then runs COMMANDS commands, half of them -A and half -D of the same
+# rules, so that the table ends as it began. The fastest of RUNS runs is
+# reported. A BUILD without --batch is reported as such.
+
+. "$(dirname "$0")/common.sh"
+
+commands=1000
+sizes="10000 100000"
+runs=1
+while getopts n:s:r: opt; do
+	case $opt in
+	n) commands=$OPTARG ;;
+	s) sizes=$OPTARG ;;
+	r) runs=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n COMMANDS] [-s \"RULES...\"] [-r RUNS] BUILD [BUILD...]" >&2
+	exit 2
+fi
+
+xt_shim_init "$1"
+cmds=$XT_SHIM_DIR/cmds
+awk -v n="$commands" 'BEGIN {
+	for (op = 0; op < 2; op++)
+		for (i = 0; i < n / 2; i++)
+			printf "%s bench0 -s 192.168.%d.%d -j ACCEPT\n",
+			       op ? "-D" : "-A", int(i / 256) % 256, i % 256
+}' >"$cmds"
+
+# separate BUILD: one iptables call per line of $cmds
+separate()
+{
+	while read -r args; do
+		xt "$1" iptables $args || return 1
+	done <"$cmds"
+}
+
+ret=0
+for rules in $sizes; do
+	xt_rules "$rules" | xt "$1" iptables-restore -c || exit 1
+	xt "$1" iptables-save -t filter | grep -v '^#' >"$XT_SHIM_DIR/ref"
+	for build in "$@"; do
+		if ! xt "$build" iptables --batch "$cmds" 2>/dev/null; then
+			echo "$build: $rules rules: --batch unsupported"
+		else
+			ms=$(xt_time "$runs" xt "$build" iptables --batch "$cmds")
+			echo "$build: $rules rules: $commands commands," \
+			     "--batch: $ms ms"
+		fi
+		ms=$(xt_time "$runs" separate "$build")
+		echo "$build: $rules rules: $commands commands," \
+		     "separate calls: $ms ms"
+		xt "$build" iptables-save -t filter | grep -v '^#' \
+			>"$XT_SHIM_DIR/out"
+		if ! cmp -s "$XT_SHIM_DIR/out" "$XT_SHIM_DIR/ref"; then
+			echo "$build: $rules rules: TABLE CHANGED" >&2
+			ret=1
+		fi
+	done
+done
+exit $ret
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Check iptables --batch and ip6tables --batch on tables served by
+# sockopt_shim:
+#
+#	batch.sh [BUILD]
+#
+# BUILD defaults to the parent directory, as when run by "make check".
+# Lines for the filter and mangle tables are mixed; what comes before a
+# COMMIT line must stay when a later line fails, and what comes after it
+# must be rolled back, whether the line fails in the kernel or in the
+# parser.
+
+. "$(dirname "$0")/common.sh"
+
+build=$(cd "${1:-..}" && pwd) || exit 2
+xt_shim_init "$build"
+
+ret=0
+# check NAME GOT EXPECTED
+check()
+{
+	if [ "$2" != "$3" ]; then
+		printf '%s: got\n%s\nexpected\n%s\n' "$1" "$2" "$3" >&2
+		ret=1
+	fi
+}
+
+# rules PROG: the rules of chain bench and of mangle PREROUTING
+rules()
+{
+	xt "$build" $1 -S bench
+	xt "$build" $1 -t mangle -S PREROUTING
+}
+
+for prog in iptables ip6tables; do
+	in=$XT_SHIM_DIR/batch
+	printf '%s\n' "# set up" "-N bench" \
+		"-A bench -m comment --comment -tag -j ACCEPT" \
+		"$prog -t mangle -A PREROUTING -j ACCEPT" >"$in"
+	printf '%s' "-A bench -m comment --comment \"rule 1\"" >>"$in"
+	xt "$build" $prog --batch "$in" || ret=1
+	committed=$(rules $prog)
+	check "$prog --batch" "$committed" "-N bench
+-A bench -m comment --comment -tag -j ACCEPT
+-A bench -m comment --comment \"rule 1\"
+-P PREROUTING ACCEPT
+-A PREROUTING -j ACCEPT"
+
+	printf '%s\n' "-A bench -j ACCEPT" "-t mangle -A PREROUTING -j DROP" \
+		"COMMIT" "-A bench -j DROP" "-t mangle -F" \
+		"-D bench -j RETURN" "-A bench -j RETURN" >"$in"
+	xt "$build" $prog --batch "$in" 2>"$XT_SHIM_DIR/err" && ret=1
+	check "$prog --batch, failing line" \
+		"$(grep '^Error' "$XT_SHIM_DIR/err")" \
+		"Error occurred at line: 6"
+	committed="-N bench
+-A bench -m comment --comment -tag -j ACCEPT
+-A bench -m comment --comment \"rule 1\"
+-A bench -j ACCEPT
+-P PREROUTING ACCEPT
+-A PREROUTING -j ACCEPT
+-A PREROUTING -j DROP"
+	check "$prog --batch, failing line" "$(rules $prog)" "$committed"
+
+	printf '%s\n' "-t mangle -F" "COMMIT" "-A bench -j DROP" \
+		"-t mangle -A PREROUTING --no-such-option" >"$in"
+	xt "$build" $prog --batch "$in" 2>/dev/null && ret=1
+	check "$prog --batch, bad option" "$(rules $prog)" \
+		"$(echo "$committed" | grep -v '^-A PREROUTING')"
+	echo "$prog --batch: checked"
+done
+exit $ret
@@ -0,0 +1,115 @@
+# Helpers for the scripts in this directory; sourced, not run.
+#
+# The scripts take build directories, i.e. where configure was run, and
+# use the stand-ins built in the first one by "make check".
+
+# xt BUILD PROGRAM ARGS...: run an iptables program of BUILD, in the
+# environment given by $XT_ENV and with the stand-ins in $XT_PRELOAD
+xt()
+{
+	xt_build=$1
+	shift
+	if [ -x "$xt_build/iptables/.libs/xtables-multi" ]; then
+		env $XT_ENV ${XT_PRELOAD:+LD_PRELOAD=$XT_PRELOAD} \
+		    LD_LIBRARY_PATH="$xt_build/iptables/.libs:$xt_build/libiptc/.libs" \
+		    XTABLES_LIBDIR="$xt_build/extensions" \
+		    "$xt_build/iptables/.libs/xtables-multi" "$@"
+	else
+		env $XT_ENV ${XT_PRELOAD:+LD_PRELOAD=$XT_PRELOAD} \
+		    XTABLES_LIBDIR="$xt_build/extensions" \
+		    "$xt_build/iptables/xtables-multi" "$@"
+	fi
+}
+
+# xt_stand_in BUILD NAME: path of stand-in NAME built in BUILD
+xt_stand_in()
+{
+	if [ ! -f "$1/tests/.libs/$2.so" ]; then
+		echo "$1/tests/.libs/$2.so not found;" \
+		     "run \"make check\" in $1 first" >&2
+		exit 77
+	fi
+	echo "$1/tests/.libs/$2.so"
+}
+
+# xt_shim_init BUILD: from now on, serve tables from an empty scratch
+# directory through sockopt_shim instead of the kernel
+xt_shim_init()
+{
+	xt_shim=$(xt_stand_in "$1" sockopt_shim) || exit $?
+	XT_SHIM_DIR=$(mktemp -d "${TMPDIR:-/tmp}/xt_shim.XXXXXX") || exit 1
+	trap 'rm -rf "$XT_SHIM_DIR"' EXIT
+	XT_PRELOAD=$xt_shim
+	XT_ENV="XT_SHIM_DIR=$XT_SHIM_DIR"
+}
+
+# xt_resolver_init BUILD: after xt_shim_init, also answer name lookups
+# from the hosts file $XT_SHIM_DIR/hosts through resolver_shim
+xt_resolver_init()
+{
+	xt_resolver=$(xt_stand_in "$1" resolver_shim) || exit $?
+	: >"$XT_SHIM_DIR/hosts"
+	XT_PRELOAD=$XT_PRELOAD:$xt_resolver
+	XT_ENV="$XT_ENV XT_HOSTS=$XT_SHIM_DIR/hosts"
+}
+
+# xt_rules COUNT [CHAINS]: iptables-restore -c input for a filter table
+# with COUNT rules spread evenly over CHAINS chains bench0, bench1, ...
+xt_rules()
+{
+	awk -v n="$1" -v chains="${2:-1}" 'BEGIN {
+		print "*filter"
+		for (c = 0; c < chains; c++)
+			print ":bench" c " - [0:0]"
+		for (c = 0; c < chains; c++)
+			print "-A INPUT -j bench" c
+		for (i = 0; i < n; i++)
+			printf "[%d:%d] -A bench%d -s 10.%d.%d.0/24 -i eth%d " \
+			       "-p tcp -m tcp --dport %d " \
+			       "-m comment --comment \"rule %d\" -j ACCEPT\n",
+			       i, i * 1500, int(i * chains / n),
+			       int(i / 256) % 256, i % 256,
+			       i % 4, i % 65535 + 1, i
+		print "COMMIT"
+	}'
+}
+
+# xt_cc BUILD PROGRAM SOURCE: compile SOURCE, in this directory, against
+# the headers and shared libxtables of BUILD into PROGRAM; run it with
+# xt_run. Some extensions rely on iptables for libm and kernel_version.
+xt_cc()
+{
+	xt_srcdir=$(sed -n 's/^abs_top_srcdir = //p' "$1/Makefile")
+	${CC:-cc} -O2 -I"$1/include" -I"$xt_srcdir/include" -rdynamic \
+	    -o "$2" "$(dirname "$0")/$3" -L"$1/iptables/.libs" -lxtables \
+	    -Wl,--no-as-needed -lm
+}
+
+# xt_run BUILD PROGRAM ARGS...: run a PROGRAM built by xt_cc, as xt does
+xt_run()
+{
+	xt_build=$1
+	shift
+	env $XT_ENV ${XT_PRELOAD:+LD_PRELOAD=$XT_PRELOAD} \
+	    LD_LIBRARY_PATH="$xt_build/iptables/.libs" \
+	    XTABLES_LIBDIR="$xt_build/extensions" "$@"
+}
+
+# xt_time RUNS COMMAND...: the fastest of RUNS runs of COMMAND, in ms
+xt_time()
+{
+	xt_runs=$1
+	shift
+	xt_best=
+	while [ "$xt_runs" -gt 0 ]; do
+		xt_start=$(date +%s%N)
+		"$@" >/dev/null 2>&1
+		xt_end=$(date +%s%N)
+		xt_ms=$(( (xt_end - xt_start) / 1000000 ))
+		if [ -z "$xt_best" ] || [ "$xt_ms" -lt "$xt_best" ]; then
+			xt_best=$xt_ms
+		fi
+		xt_runs=$((xt_runs - 1))
+	done
+	echo "$xt_best"
+}
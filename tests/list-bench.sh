@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Time iptables -L on a large synthetic filter table served by
+# sockopt_shim, for a whole table, a named chain and a rule range:
+#
+#	list-bench.sh [-n RULES] [-c CHAINS] [-r RUNS] BUILD [BUILD...]
+#
+# The table is loaded once with the first BUILD's iptables-restore, and
+# every listing is then timed RUNS times by each BUILD; the fastest run
+# is reported. The listings of all BUILDs must be identical. A BUILD
+# that does not take rule ranges is reported as such.
+
+. "$(dirname "$0")/common.sh"
+
+rules=100000
+chains=10
+runs=5
+while getopts n:c:r: opt; do
+	case $opt in
+	n) rules=$OPTARG ;;
+	c) chains=$OPTARG ;;
+	r) runs=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n RULES] [-c CHAINS] [-r RUNS] BUILD [BUILD...]" >&2
+	exit 2
+fi
+
+xt_shim_init "$1"
+xt_rules "$rules" "$chains" | xt "$1" iptables-restore -c || exit 1
+
+# Rules 1000-1099 of the last chain
+chain=bench$((chains - 1))
+range=1000:1099
+
+ret=0
+for build in "$@"; do
+	for args in "-L -n -v -x" "-L $chain -n -v" "-L $chain $range -n -v"; do
+		if ! xt "$build" iptables $args >"$XT_SHIM_DIR/out" 2>/dev/null
+		then
+			echo "$build: $args: unsupported"
+			continue
+		fi
+		ms=$(xt_time "$runs" xt "$build" iptables $args)
+		# The first BUILD gives the reference listing of each command
+		ref=$XT_SHIM_DIR/ref$(echo "$args" | cksum | cut -d' ' -f1)
+		if [ ! -f "$ref" ]; then
+			mv "$XT_SHIM_DIR/out" "$ref"
+			same=
+		elif cmp -s "$XT_SHIM_DIR/out" "$ref"; then
+			same=", same output"
+		else
+			same=", OUTPUT DIFFERS"
+			ret=1
+		fi
+		echo "$build: $args: $ms ms$same"
+	done
+done
+exit $ret
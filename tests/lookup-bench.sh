@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Time extension lookups by name with every shipped extension
+# registered, in IPv4 and IPv6:
+#
+#	lookup-bench.sh [-n ROUNDS] BUILD [BUILD...]
+#
+# lookup_bench.c is compiled against the libxtables of each BUILD, which
+# must have been configured without --enable-static; it registers the
+# extensions of that BUILD, under sockopt_shim, and looks each of them up
+# ROUNDS times. The numbers of matches and targets found must be the same
+# for all BUILDs.
+
+. "$(dirname "$0")/common.sh"
+
+rounds=20000
+while getopts n: opt; do
+	case $opt in
+	n) rounds=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n ROUNDS] BUILD [BUILD...]" >&2
+	exit 2
+fi
+
+xt_shim_init "$1"
+bin=$XT_SHIM_DIR/lookup_bench
+
+ret=0
+for build in "$@"; do
+	if ! xt_cc "$build" "$bin" lookup_bench.c; then
+		echo "$build: cannot build lookup_bench" >&2
+		ret=1
+		continue
+	fi
+	for family in 4 6; do
+		out=$(xt_run "$build" "$bin" -$family -n "$rounds") ||
+			{ ret=1; continue; }
+		# The first BUILD gives the extensions each family must find
+		found=${out%%:*}
+		eval ref=\$ref$family
+		if [ -z "$ref" ]; then
+			eval ref$family=\$found
+			same=
+		elif [ "$found" = "$ref" ]; then
+			same=", same extensions"
+		else
+			same=", EXTENSIONS DIFFER"
+			ret=1
+		fi
+		echo "$build: IPv$family, $out$same"
+	done
+done
+exit $ret
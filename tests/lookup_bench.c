@@ -0,0 +1,145 @@
+/*
+ * lookup_bench.c - time extension lookups by name, for lookup-bench.sh
+ *
+ * Registers every extension in $XTABLES_LIBDIR for one family, then
+ * looks up each match and target found there by name, over and over, as
+ * the parser does for every -m and -j, and names that are not there:
+ *
+ *	lookup_bench [-4|-6] [-n ROUNDS]
+ *
+ * Loading the extensions probes revisions, so run it under sockopt_shim
+ * or as root. Only functions that every libxtables has are used, so that
+ * the program builds against the libxtables of any build to be compared.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <xtables.h>
+
+#define MAX_NAMES	512
+
+/* From iptables, for the parsers of libipt_DNAT and libipt_SNAT */
+int kernel_version;
+
+void get_kernel_version(void)
+{
+}
+
+static struct xtables_globals lookup_globals = {
+	.program_name    = "lookup_bench",
+	.program_version = "0",
+};
+
+static char *matches[MAX_NAMES], *targets[MAX_NAMES], *misses[MAX_NAMES];
+static unsigned int nmatches, ntargets, nmisses;
+
+/* Register the extension of library file @file, if it is one of ours */
+static void load(const char *file, const char *prefix)
+{
+	size_t plen = strlen(prefix), len = strlen(file);
+	char name[XT_EXTENSION_MAXNAMELEN];
+
+	if (strncmp(file, prefix, plen) != 0 || len < plen + 3 ||
+	    strcmp(file + len - 3, ".so") != 0 ||
+	    len - plen - 3 >= sizeof(name) - 1 || nmisses == MAX_NAMES)
+		return;
+	memcpy(name, file + plen, len - plen - 3);
+	name[len - plen - 3] = '\0';
+
+	/* Trying the wrong kind first would complain of a missing one */
+	if (!isupper(name[0]) && strcmp(name, "standard") != 0 &&
+	    xtables_find_match(name, XTF_TRY_LOAD, NULL) != NULL)
+		matches[nmatches++] = strdup(name);
+	else if (xtables_find_target(name, XTF_TRY_LOAD) != NULL)
+		targets[ntargets++] = strdup(name);
+	else if (isupper(name[0]) &&
+	    xtables_find_match(name, XTF_TRY_LOAD, NULL) != NULL)
+		matches[nmatches++] = strdup(name);
+	/* A name no extension has, alike in length and hash spread */
+	strcat(name, "_");
+	misses[nmisses++] = strdup(name);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *libdir, *prefix = "libipt_";
+	unsigned long rounds = 20000, r, n;
+	uint8_t nfproto = NFPROTO_IPV4;
+	struct dirent *de;
+	unsigned int i;
+	double start, hits, miss;
+	DIR *dir;
+	int c;
+
+	while ((c = getopt(argc, argv, "46n:")) != -1) {
+		switch (c) {
+		case '4':
+			break;
+		case '6':
+			nfproto = NFPROTO_IPV6;
+			prefix  = "libip6t_";
+			break;
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-4|-6] [-n rounds]\n",
+			        argv[0]);
+			return 2;
+		}
+	}
+
+	if (xtables_init_all(&lookup_globals, nfproto) < 0)
+		return 1;
+	libdir = getenv("XTABLES_LIBDIR");
+	dir = libdir != NULL ? opendir(libdir) : NULL;
+	if (dir == NULL) {
+		fprintf(stderr, "%s: cannot read $XTABLES_LIBDIR\n", argv[0]);
+		return 1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		load(de->d_name, "libxt_");
+		load(de->d_name, prefix);
+	}
+	closedir(dir);
+	if (nmatches + ntargets == 0) {
+		fprintf(stderr, "%s: no extensions in %s\n", argv[0], libdir);
+		return 1;
+	}
+
+	start = now();
+	for (r = 0; r < rounds; ++r) {
+		for (i = 0; i < nmatches; ++i)
+			xtables_find_match(matches[i], XTF_DONT_LOAD, NULL);
+		for (i = 0; i < ntargets; ++i)
+			xtables_find_target(targets[i], XTF_DONT_LOAD);
+	}
+	hits = now() - start;
+
+	start = now();
+	for (r = 0; r < rounds; ++r)
+		for (i = 0; i < nmisses; ++i)
+			xtables_find_match(misses[i], XTF_DONT_LOAD, NULL);
+	miss = now() - start;
+
+	n = rounds * (nmatches + ntargets);
+	printf("%u matches, %u targets: %.0f lookups/s, %.0f misses/s\n",
+	       nmatches, ntargets, n / hits, rounds * nmisses / miss);
+	return 0;
+}
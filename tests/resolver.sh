@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Count the name lookups of iptables and ip6tables on tables served by
+# sockopt_shim, with names answered by resolver_shim:
+#
+#	resolver.sh [-n RULES] [-d DELAY] [BUILD [BUILD...]]
+#
+# BUILD defaults to the parent directory, as when run by "make check".
+# Numeric addresses and names under a null mask must not be looked up.
+# Then each BUILD lists RULES rules without -n, with every lookup taking
+# DELAY ms, and the time taken is printed.
+
+. "$(dirname "$0")/common.sh"
+
+rules=20
+delay=50
+while getopts n:d: opt; do
+	case $opt in
+	n) rules=$OPTARG ;;
+	d) delay=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] && set -- ..
+build=$(cd "$1" && pwd) || exit 2
+
+xt_shim_init "$build"
+xt_resolver_init "$build"
+cat >"$XT_SHIM_DIR/hosts" <<EOF
+192.0.2.1	host1
+192.0.2.2	host2
+192.0.2.3	host3
+192.0.2.4	host4
+2001:db8::1	host1
+2001:db8::2	host2
+2001:db8::3	host3
+2001:db8::4	host4
+EOF
+
+# lookups BUILD PROGRAM ARGS...: lookups made by one run of PROGRAM
+lookups()
+{
+	lookups_env=$XT_ENV
+	XT_ENV="$XT_ENV XT_RESOLVER_STATS=1"
+	xt "$@" 2>&1 >/dev/null |
+	sed -n 's/^resolver_shim: \(.*\) lookups$/\1/p'
+	XT_ENV=$lookups_env
+}
+
+ret=0
+check()
+{
+	echo "$1: $2"
+	if [ "$2" != "$3" ]; then
+		echo "expected $3" >&2
+		ret=1
+	fi
+}
+
+check "iptables -A" "$(lookups "$build" iptables -A INPUT \
+	-s host1,10.0.0.1,host2/24,host3/0.0.0.0,host4/0 -j ACCEPT)" \
+	"2 forward, 0 reverse"
+check "iptables -S" "$(xt "$build" iptables -S INPUT | sed 's/ -s / /;s/ -j .*//' |
+	tr '\n' ' ')" \
+	"-P INPUT ACCEPT -A INPUT 192.0.2.1/32 -A INPUT 10.0.0.1/32 -A INPUT 192.0.2.0/24 -A INPUT -A INPUT "
+check "ip6tables -A" "$(lookups "$build" ip6tables -A INPUT \
+	-s host1,2001:db8::9,host2/64,host3/::,host4/0 -j ACCEPT)" \
+	"2 forward, 0 reverse"
+check "ip6tables -S" "$(xt "$build" ip6tables -S INPUT | sed 's/ -s / /;s/ -j .*//' |
+	tr '\n' ' ')" \
+	"-P INPUT ACCEPT -A INPUT 2001:db8::1/128 -A INPUT 2001:db8::9/128 -A INPUT 2001:db8::/64 -A INPUT -A INPUT "
+
+xt_rules "$rules" | xt "$build" iptables-restore -c || exit 1
+XT_ENV="$XT_ENV XT_RESOLVER_DELAY=$delay"
+for b in "$@"; do
+	ms=$(xt_time 1 xt "$b" iptables -L)
+	echo "$b: -L of $rules rules, $delay ms per lookup: $ms ms"
+done
+exit $ret
@@ -0,0 +1,283 @@
+/*
+ * resolver_shim.c - stand-in for the name resolver, for tests
+ *
+ * Preloaded together with sockopt_shim, this answers getaddrinfo(),
+ * getnameinfo() and their older IPv4 counterparts gethostbyname() and
+ * gethostbyaddr() from the hosts file named by $XT_HOSTS ("address name..."
+ * per line, as in /etc/hosts) instead of the system resolver, so that
+ * name handling can be tested without a network:
+ *
+ *	XT_HOSTS=hosts XT_RESOLVER_DELAY=200 \
+ *	LD_PRELOAD=.libs/resolver_shim.so iptables -A INPUT -s a,b -j ACCEPT
+ *
+ * Every lookup takes $XT_RESOLVER_DELAY milliseconds, like a slow name
+ * server would; lookups from several threads overlap. Names that are not
+ * in the file are not found. $XT_RESOLVER_STATS makes the shim print on
+ * exit how many lookups were made.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+static unsigned long n_forward, n_reverse;
+static long delay_ms;
+
+static void resolver_stats(void)
+{
+	fprintf(stderr, "resolver_shim: %lu forward, %lu reverse lookups\n",
+	        n_forward, n_reverse);
+}
+
+static void __attribute__((constructor)) resolver_init(void)
+{
+	if (getenv("XT_RESOLVER_DELAY") != NULL)
+		delay_ms = strtol(getenv("XT_RESOLVER_DELAY"), NULL, 0);
+	if (getenv("XT_RESOLVER_STATS") != NULL)
+		atexit(resolver_stats);
+}
+
+static void resolver_wait(void)
+{
+	struct timespec ts = {
+		.tv_sec  = delay_ms / 1000,
+		.tv_nsec = delay_ms % 1000 * 1000000,
+	};
+
+	if (delay_ms > 0)
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+}
+
+/*
+ * Call @fn for every address and name pair of the hosts file, until it
+ * returns non-zero. Returns that value, or 0.
+ */
+static int hosts_walk(int (*fn)(int, const void *, const char *, void *),
+		      void *data)
+{
+	const char *file = getenv("XT_HOSTS");
+	char buf[512], *addr, *name, *save;
+	unsigned char bin[sizeof(struct in6_addr)];
+	int family, ret = 0;
+	FILE *fp;
+
+	if (file == NULL || (fp = fopen(file, "re")) == NULL)
+		return 0;
+	while (ret == 0 && fgets(buf, sizeof(buf), fp) != NULL) {
+		addr = strtok_r(buf, " \t\n", &save);
+		if (addr == NULL || *addr == '#')
+			continue;
+		if (inet_pton(AF_INET, addr, bin) == 1)
+			family = AF_INET;
+		else if (inet_pton(AF_INET6, addr, bin) == 1)
+			family = AF_INET6;
+		else
+			continue;
+		while (ret == 0 &&
+		       (name = strtok_r(NULL, " \t\n", &save)) != NULL)
+			ret = fn(family, bin, name, data);
+	}
+	fclose(fp);
+	return ret;
+}
+
+struct forward {
+	const char *name;
+	int family;
+	struct addrinfo *head, **tail;
+};
+
+/* One allocation per result, freed by freeaddrinfo() below */
+struct result {
+	struct addrinfo ai;
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} sa;
+};
+
+static int forward_match(int family, const void *bin, const char *name,
+			 void *data)
+{
+	struct forward *f = data;
+	struct result *r;
+
+	if (strcmp(name, f->name) != 0 ||
+	    (f->family != AF_UNSPEC && f->family != family))
+		return 0;
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return 1;
+	r->ai.ai_family = family;
+	r->ai.ai_socktype = SOCK_RAW;
+	r->ai.ai_addr = (struct sockaddr *)&r->sa;
+	if (family == AF_INET) {
+		r->sa.in.sin_family = AF_INET;
+		memcpy(&r->sa.in.sin_addr, bin, sizeof(struct in_addr));
+		r->ai.ai_addrlen = sizeof(r->sa.in);
+	} else {
+		r->sa.in6.sin6_family = AF_INET6;
+		memcpy(&r->sa.in6.sin6_addr, bin, sizeof(struct in6_addr));
+		r->ai.ai_addrlen = sizeof(r->sa.in6);
+	}
+	*f->tail = &r->ai;
+	f->tail = &r->ai.ai_next;
+	return 0;
+}
+
+int getaddrinfo(const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct forward f = {
+		.name   = node,
+		.family = hints != NULL ? hints->ai_family : AF_UNSPEC,
+	};
+
+	__atomic_fetch_add(&n_forward, 1, __ATOMIC_RELAXED);
+	resolver_wait();
+	if (node == NULL)
+		return EAI_NONAME;
+	f.tail = &f.head;
+	hosts_walk(forward_match, &f);
+	if (f.head == NULL)
+		return EAI_NONAME;
+	*res = f.head;
+	return 0;
+}
+
+void freeaddrinfo(struct addrinfo *res)
+{
+	struct addrinfo *next;
+
+	for (; res != NULL; res = next) {
+		next = res->ai_next;
+		free(res);
+	}
+}
+
+struct reverse {
+	int family;
+	const void *bin;
+	char *host;
+	size_t hostlen;
+};
+
+static int reverse_match(int family, const void *bin, const char *name,
+			 void *data)
+{
+	struct reverse *r = data;
+
+	if (family != r->family || memcmp(bin, r->bin, family == AF_INET ?
+	    sizeof(struct in_addr) : sizeof(struct in6_addr)) != 0)
+		return 0;
+	snprintf(r->host, r->hostlen, "%s", name);
+	return 1;
+}
+
+int getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host,
+		socklen_t hostlen, char *serv, socklen_t servlen, int flags)
+{
+	struct reverse r = {
+		.family  = sa->sa_family,
+		.host    = host,
+		.hostlen = hostlen,
+	};
+
+	__atomic_fetch_add(&n_reverse, 1, __ATOMIC_RELAXED);
+	resolver_wait();
+	if (sa->sa_family == AF_INET)
+		r.bin = &((const struct sockaddr_in *)sa)->sin_addr;
+	else if (sa->sa_family == AF_INET6)
+		r.bin = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+	else
+		return EAI_FAMILY;
+	if (host == NULL || hosts_walk(reverse_match, &r))
+		return 0;
+	if (flags & NI_NAMEREQD)
+		return EAI_NONAME;
+	inet_ntop(sa->sa_family, r.bin, host, hostlen);
+	return 0;
+}
+
+/* gethostbyname() and gethostbyaddr() share one static result, as in libc */
+static struct {
+	struct hostent he;
+	char name[256];
+	char *aliases[1];
+	char *list[17];
+	struct in_addr addr[16];
+} host;
+
+static int host_match(int family, const void *bin, const char *name,
+		      void *data)
+{
+	const char *want = data;
+	unsigned int n;
+
+	if (family != AF_INET || strcmp(name, want) != 0)
+		return 0;
+	for (n = 0; host.list[n] != NULL; ++n)
+		;
+	if (n == sizeof(host.addr) / sizeof(*host.addr))
+		return 1;
+	memcpy(&host.addr[n], bin, sizeof(host.addr[n]));
+	host.list[n] = (char *)&host.addr[n];
+	return 0;
+}
+
+static struct hostent *host_result(void)
+{
+	host.he.h_name      = host.name;
+	host.he.h_aliases   = host.aliases;
+	host.he.h_addrtype  = AF_INET;
+	host.he.h_length    = sizeof(struct in_addr);
+	host.he.h_addr_list = host.list;
+	return &host.he;
+}
+
+struct hostent *gethostbyname(const char *name)
+{
+	__atomic_fetch_add(&n_forward, 1, __ATOMIC_RELAXED);
+	resolver_wait();
+	memset(&host, 0, sizeof(host));
+	hosts_walk(host_match, (void *)name);
+	if (host.list[0] == NULL) {
+		h_errno = HOST_NOT_FOUND;
+		return NULL;
+	}
+	snprintf(host.name, sizeof(host.name), "%s", name);
+	return host_result();
+}
+
+struct hostent *gethostbyaddr(const void *addr, socklen_t len, int type)
+{
+	struct reverse r = {
+		.family  = type,
+		.bin     = addr,
+		.host    = host.name,
+		.hostlen = sizeof(host.name),
+	};
+
+	__atomic_fetch_add(&n_reverse, 1, __ATOMIC_RELAXED);
+	resolver_wait();
+	memset(&host, 0, sizeof(host));
+	if (type != AF_INET || len != sizeof(struct in_addr) ||
+	    !hosts_walk(reverse_match, &r)) {
+		h_errno = HOST_NOT_FOUND;
+		return NULL;
+	}
+	memcpy(&host.addr[0], addr, sizeof(host.addr[0]));
+	host.list[0] = (char *)&host.addr[0];
+	return host_result();
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Time iptables-restore --test on a large synthetic filter table, i.e.
+# the parsing of the rules, with the kernel replaced by sockopt_shim:
+#
+#	restore-bench.sh [-n RULES] [-c CHAINS] [-e MATCHES] [-r RUNS]
+#		BUILD [BUILD...]
+#
+# MATCHES, e.g. "-m mark --mark 1 -m length --length 64", are added to
+# every rule, for more extensions per rule. Each BUILD parses the same
+# RULES rules RUNS times; the fastest run is reported, in ms and in rules
+# per second.
+
+. "$(dirname "$0")/common.sh"
+
+rules=100000
+chains=10
+extra=
+runs=5
+while getopts n:c:e:r: opt; do
+	case $opt in
+	n) rules=$OPTARG ;;
+	c) chains=$OPTARG ;;
+	e) extra=$OPTARG ;;
+	r) runs=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n RULES] [-c CHAINS] [-e MATCHES] [-r RUNS]" \
+	     "BUILD [BUILD...]" >&2
+	exit 2
+fi
+
+xt_shim_init "$1"
+in=$XT_SHIM_DIR/rules
+xt_rules "$rules" "$chains" | awk -v extra="$extra" '
+	extra != "" && / -j ACCEPT$/ { sub(/ -j ACCEPT$/, " " extra " -j ACCEPT") }
+	{ print }' >"$in"
+
+# restore BUILD: parse $in without committing it
+restore()
+{
+	xt "$1" iptables-restore -c --test <"$in"
+}
+
+ret=0
+for build in "$@"; do
+	if ! restore "$build"; then
+		echo "$build: iptables-restore --test failed" >&2
+		ret=1
+		continue
+	fi
+	ms=$(xt_time "$runs" restore "$build")
+	echo "$build: $rules rules in $ms ms," \
+	     "$((rules * 1000 / (ms > 0 ? ms : 1))) rules/s"
+done
+exit $ret
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Check that iptables-restore and ip6tables-restore read back what the
+# save tools write for quoted arguments, on tables served by sockopt_shim:
+#
+#	restore-quotes.sh [BUILD]
+#
+# BUILD defaults to the parent directory, as when run by "make check".
+# The rules hold blanks and \" escapes within quotes, and empty "" words;
+# the input ends without a newline. Restoring it and saving the result
+# must give the input back, twice over.
+
+. "$(dirname "$0")/common.sh"
+
+build=$(cd "${1:-..}" && pwd) || exit 2
+xt_shim_init "$build"
+
+ret=0
+for family in 4 6; do
+	if [ $family = 4 ]; then
+		prog=iptables addr=10.0.0.1/32
+	else
+		prog=ip6tables addr=2001:db8::1/128
+	fi
+	in=$XT_SHIM_DIR/in$family
+	printf '%s\n' "*filter" \
+		":INPUT ACCEPT [0:0]" ":FORWARD ACCEPT [0:0]" \
+		":OUTPUT ACCEPT [0:0]" \
+		"-A INPUT -s $addr -m comment --comment \"rule 0\" -j ACCEPT" \
+		"-A INPUT -m comment --comment \"say \\\"hi\\\"\" -j LOG --log-prefix \"a b \"" \
+		"-A INPUT -m comment --comment \"\"" \
+		"-A INPUT -m string --string \"\" --algo bm --to 65535" >"$in"
+	printf 'COMMIT' >>"$in"
+
+	for pass in 1 2; do
+		xt "$build" $prog-restore <"$in" || exit 1
+		xt "$build" $prog-save -t filter | grep -v '^#' \
+			>"$XT_SHIM_DIR/out" || exit 1
+		if [ "$(cat "$in")" != "$(cat "$XT_SHIM_DIR/out")" ]; then
+			echo "$prog-restore, pass $pass: rules differ" >&2
+			diff "$in" "$XT_SHIM_DIR/out" >&2
+			ret=1
+		fi
+		in=$XT_SHIM_DIR/out$family
+		mv "$XT_SHIM_DIR/out" "$in"
+	done
+	echo "$prog-restore: checked"
+done
+exit $ret
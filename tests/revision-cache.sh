@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Count the socket calls and revision probes of an iptables command with
+# and without XTABLES_REVISION_CACHE, on tables served by sockopt_shim:
+#
+#	revision-cache.sh [BUILD]
+#
+# BUILD defaults to the parent directory, as when run by "make check".
+# A warm cache must answer every probe; revisions the kernel lacks must
+# not be cached; and a cache file written by several invocations at once
+# must only hold whole entries.
+
+. "$(dirname "$0")/common.sh"
+
+build=$(cd "${1:-..}" && pwd) || exit 2
+xt_shim_init "$build"
+cache=$XT_SHIM_DIR/revisions
+
+# probes [ENV...]: socket calls and revision probes of the test command
+probes()
+{
+	probes_env=$XT_ENV
+	XT_ENV="$XT_ENV $* XT_SHIM_STATS=1"
+	xt "$build" iptables -A INPUT -p tcp -m multiport --dports 1,2 \
+		-m conntrack --ctstate NEW -m limit --limit 1/s \
+		-m comment --comment x -j REJECT 2>&1 >/dev/null |
+	sed -n 's/^sockopt_shim: \([0-9]*\) socket, .*(\([0-9]*\) revision.*/\1 socket, \2 revision probes/p'
+	XT_ENV=$probes_env
+}
+
+ret=0
+check()
+{
+	echo "$1: $2"
+	case $2 in
+	$3) ;;
+	*) echo "expected $3" >&2; ret=1 ;;
+	esac
+}
+
+check "no cache  " "$(probes)" "*"
+check "cold cache" "$(probes XTABLES_REVISION_CACHE="$cache")" "*"
+check "warm cache" "$(probes XTABLES_REVISION_CACHE="$cache")" \
+	"* 0 revision probes"
+
+# Only revision 0 exists: the probes for higher ones are not cached
+rm -f "$cache"
+probes XT_SHIM_MAX_REVISION=0 XTABLES_REVISION_CACHE="$cache" >/dev/null
+check "rev 0 only, warm cache" \
+	"$(probes XT_SHIM_MAX_REVISION=0 XTABLES_REVISION_CACHE="$cache")" "*"
+if awk 'NR > 1 && $4 != 0 { exit 1 }' "$cache"; then :; else
+	echo "unsupported revisions were cached" >&2
+	ret=1
+fi
+
+rm -f "$cache"
+for i in 1 2 3 4 5 6 7 8; do
+	probes XTABLES_REVISION_CACHE="$cache" >/dev/null &
+done
+wait
+if awk 'NR == 1 { if ($1 != "xtables-revisions") exit 1; next }
+	NF != 4 { exit 1 }' "$cache"; then :; else
+	echo "malformed cache after concurrent updates" >&2
+	ret=1
+fi
+exit $ret
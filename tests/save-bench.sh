@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Time iptables-save -c on a large synthetic filter table. The kernel is
+# replaced by sockopt_shim, so neither root nor netfilter is needed:
+#
+#	save-bench.sh [-n RULES] [-r RUNS] BUILD [BUILD...]
+#
+# The table is loaded once with the first BUILD's iptables-restore, and
+# the captured blob is then saved RUNS times by each BUILD; the fastest
+# run is reported. The outputs of all BUILDs must be identical apart
+# from the "Generated by" comments.
+
+. "$(dirname "$0")/common.sh"
+
+rules=200000
+runs=5
+while getopts n:r: opt; do
+	case $opt in
+	n) rules=$OPTARG ;;
+	r) runs=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n RULES] [-r RUNS] BUILD [BUILD...]" >&2
+	exit 2
+fi
+
+xt_shim_init "$1"
+xt_rules "$rules" | xt "$1" iptables-restore -c || exit 1
+
+ret=0
+for build in "$@"; do
+	xt "$build" iptables-save -c -t filter | grep -v '^#' \
+		>"$XT_SHIM_DIR/out" || exit 1
+	ms=$(xt_time "$runs" xt "$build" iptables-save -c -t filter)
+	if [ "$build" = "$1" ]; then
+		mv "$XT_SHIM_DIR/out" "$XT_SHIM_DIR/first"
+		same=
+	elif cmp -s "$XT_SHIM_DIR/out" "$XT_SHIM_DIR/first"; then
+		same=", same output"
+	else
+		same=", OUTPUT DIFFERS"
+		ret=1
+	fi
+	echo "$build: $rules rules saved in $ms ms$same"
+done
+exit $ret
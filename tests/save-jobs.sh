@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Check that iptables-save --jobs gives the same output as a single
+# process, on a synthetic filter table served by sockopt_shim:
+#
+#	save-jobs.sh [-n RULES] [-c CHAINS] [-r RUNS] [BUILD [JOBS...]]
+#
+# BUILD defaults to the parent directory, as when run by "make check";
+# JOBS defaults to 2 4 8. The time of the fastest of RUNS saves is
+# printed for each number of jobs.
+
+. "$(dirname "$0")/common.sh"
+
+rules=20000
+chains=50
+runs=3
+while getopts n:c:r: opt; do
+	case $opt in
+	n) rules=$OPTARG ;;
+	c) chains=$OPTARG ;;
+	r) runs=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+build=$(cd "${1:-..}" && pwd) || exit 2
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- 2 4 8
+
+xt_shim_init "$build"
+xt_rules "$rules" "$chains" | xt "$build" iptables-restore -c || exit 1
+
+# save NAME ARGS...: iptables-save output without the dated comments
+save()
+{
+	save_out=$XT_SHIM_DIR/$1
+	shift
+	xt "$build" iptables-save "$@" | grep -v '^#' >"$save_out"
+}
+
+ret=0
+for filter in "" "--chain bench1* --rules 2:" "--rules 3"; do
+	save ref -c $filter || exit 1
+	for jobs in 1 "$@"; do
+		save out -c $filter --jobs "$jobs" || exit 1
+		if ! cmp -s "$XT_SHIM_DIR/ref" "$XT_SHIM_DIR/out"; then
+			echo "--jobs $jobs $filter: OUTPUT DIFFERS" >&2
+			ret=1
+		fi
+	done
+done
+
+for jobs in 1 "$@"; do
+	ms=$(xt_time "$runs" xt "$build" iptables-save -c --jobs "$jobs")
+	echo "--jobs $jobs: $rules rules in $chains chains saved in $ms ms"
+done
+exit $ret
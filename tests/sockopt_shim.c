@@ -0,0 +1,487 @@
+/*
+ * sockopt_shim.c - stand-in for the kernel side of iptables, for tests
+ *
+ * Preloaded into iptables, ip6tables and their save and restore tools,
+ * this serves the {ip,ip6}tables sockopts from files instead of the
+ * kernel, so that large rulesets can be loaded, saved and listed without
+ * root and without touching the running firewall:
+ *
+ *	XT_SHIM_DIR=/tmp/tables LD_PRELOAD=.libs/sockopt_shim.so \
+ *		iptables-restore < big.rules
+ *
+ * Each table is a file "ipv4-<table>" or "ipv6-<table>" in $XT_SHIM_DIR
+ * holding the getinfo header followed by the entries, as the kernel
+ * would hand them out; a table without a file starts out empty with
+ * ACCEPT policies. SO_SET_REPLACE and SO_SET_ADD_COUNTERS rewrite the
+ * file. Revision probes succeed up to revision $XT_SHIM_MAX_REVISION, or
+ * for every revision if that is not set. /proc/net/ip{,6}_tables_names
+ * lists the tables present in the directory.
+ *
+ * Without $XT_SHIM_DIR everything goes to the kernel. In both cases,
+ * $XT_SHIM_STATS makes the shim print on exit how many socket and
+ * sockopt calls the program made.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE 1
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+
+#define MAX_FD	1024
+
+static int (*real_socket)(int, int, int);
+static int (*real_close)(int);
+static int (*real_getsockopt)(int, int, int, void *, socklen_t *);
+static int (*real_setsockopt)(int, int, int, const void *, socklen_t);
+static FILE *(*real_fopen)(const char *, const char *);
+
+static const char *shim_dir;
+static long max_revision = LONG_MAX;
+static unsigned char fd_family[MAX_FD];	/* emulated descriptors */
+static unsigned long n_socket, n_getsockopt, n_setsockopt, n_revision;
+
+static void shim_stats(void)
+{
+	fprintf(stderr, "sockopt_shim: %lu socket, %lu getsockopt "
+	        "(%lu revision probes), %lu setsockopt\n",
+	        n_socket, n_getsockopt, n_revision, n_setsockopt);
+}
+
+static void __attribute__((constructor)) shim_init(void)
+{
+	real_socket     = dlsym(RTLD_NEXT, "socket");
+	real_close      = dlsym(RTLD_NEXT, "close");
+	real_getsockopt = dlsym(RTLD_NEXT, "getsockopt");
+	real_setsockopt = dlsym(RTLD_NEXT, "setsockopt");
+	real_fopen      = dlsym(RTLD_NEXT, "fopen");
+	shim_dir = getenv("XT_SHIM_DIR");
+	if (getenv("XT_SHIM_MAX_REVISION") != NULL)
+		max_revision = strtol(getenv("XT_SHIM_MAX_REVISION"), NULL, 0);
+	if (getenv("XT_SHIM_STATS") != NULL)
+		atexit(shim_stats);
+}
+
+/*
+ * Tables
+ */
+
+/* The ERROR node ending a table, as libiptc writes it */
+struct error_target {
+	struct xt_entry_target target;
+	char errorname[XT_FUNCTION_MAXNAMELEN];
+};
+
+struct table {
+	struct ipt_getinfo info;	/* same layout as ip6t_getinfo */
+	unsigned char *entries;
+};
+
+static const struct {
+	const char *name;
+	unsigned int hooks;
+} builtin[] = {
+	{ "filter",   1 << NF_INET_LOCAL_IN | 1 << NF_INET_FORWARD |
+	              1 << NF_INET_LOCAL_OUT },
+	{ "mangle",   (1 << NF_INET_NUMHOOKS) - 1 },
+	{ "raw",      1 << NF_INET_PRE_ROUTING | 1 << NF_INET_LOCAL_OUT },
+	{ "nat",      1 << NF_INET_PRE_ROUTING | 1 << NF_INET_LOCAL_IN |
+	              1 << NF_INET_LOCAL_OUT | 1 << NF_INET_POST_ROUTING },
+	{ "security", 1 << NF_INET_LOCAL_IN | 1 << NF_INET_FORWARD |
+	              1 << NF_INET_LOCAL_OUT },
+};
+
+static size_t entry_size(int family)
+{
+	return family == AF_INET6 ? sizeof(struct ip6t_entry)
+	                          : sizeof(struct ipt_entry);
+}
+
+static struct xt_counters *entry_counters(int family, unsigned char *e)
+{
+	if (family == AF_INET6)
+		return &((struct ip6t_entry *)e)->counters;
+	return &((struct ipt_entry *)e)->counters;
+}
+
+/* Fields common to ipt_entry and ip6t_entry, found by family */
+static void entry_set(int family, unsigned char *e, unsigned int target,
+                      unsigned int next)
+{
+	if (family == AF_INET6) {
+		((struct ip6t_entry *)e)->target_offset = target;
+		((struct ip6t_entry *)e)->next_offset = next;
+	} else {
+		((struct ipt_entry *)e)->target_offset = target;
+		((struct ipt_entry *)e)->next_offset = next;
+	}
+}
+
+static unsigned int entry_next(int family, const unsigned char *e)
+{
+	if (family == AF_INET6)
+		return ((const struct ip6t_entry *)e)->next_offset;
+	return ((const struct ipt_entry *)e)->next_offset;
+}
+
+/* A table as the kernel sets it up: ACCEPT policies and nothing else */
+static int table_empty(int family, const char *name, struct table *t)
+{
+	size_t es = entry_size(family);
+	size_t std = es + XT_ALIGN(sizeof(struct xt_standard_target));
+	size_t err = es + XT_ALIGN(sizeof(struct error_target));
+	struct xt_standard_target *st;
+	struct error_target *et;
+	unsigned int i, h, off = 0;
+
+	for (i = 0; i < sizeof(builtin) / sizeof(builtin[0]); ++i)
+		if (strcmp(builtin[i].name, name) == 0)
+			break;
+	if (i == sizeof(builtin) / sizeof(builtin[0])) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	memset(&t->info, 0, sizeof(t->info));
+	strcpy(t->info.name, name);
+	t->info.valid_hooks = builtin[i].hooks;
+	t->info.num_entries = __builtin_popcount(builtin[i].hooks) + 1;
+	t->info.size = (t->info.num_entries - 1) * std + err;
+	t->entries = calloc(1, t->info.size);
+	if (t->entries == NULL)
+		return -1;
+
+	for (h = 0; h < NF_INET_NUMHOOKS; ++h) {
+		if (!(builtin[i].hooks & 1 << h))
+			continue;
+		t->info.hook_entry[h] = t->info.underflow[h] = off;
+		entry_set(family, t->entries + off, es, std);
+		st = (void *)(t->entries + off + es);
+		st->target.u.user.target_size =
+			XT_ALIGN(sizeof(struct xt_standard_target));
+		st->verdict = -NF_ACCEPT - 1;
+		off += std;
+	}
+	entry_set(family, t->entries + off, es, err);
+	et = (void *)(t->entries + off + es);
+	et->target.u.user.target_size = XT_ALIGN(sizeof(struct error_target));
+	strcpy(et->target.u.user.name, XT_ERROR_TARGET);
+	strcpy(et->errorname, XT_ERROR_TARGET);
+	return 0;
+}
+
+static void table_path(char *path, size_t len, int family, const char *name)
+{
+	snprintf(path, len, "%s/%s-%s", shim_dir,
+	         family == AF_INET6 ? "ipv6" : "ipv4", name);
+}
+
+static int table_load(int family, const char *name, struct table *t)
+{
+	char path[4096];
+	FILE *fp;
+
+	table_path(path, sizeof(path), family, name);
+	fp = real_fopen(path, "r");
+	if (fp == NULL)
+		return table_empty(family, name, t);
+	t->entries = NULL;
+	if (fread(&t->info, sizeof(t->info), 1, fp) != 1 ||
+	    (t->entries = malloc(t->info.size)) == NULL ||
+	    fread(t->entries, 1, t->info.size, fp) != t->info.size) {
+		free(t->entries);
+		fclose(fp);
+		errno = EIO;
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* Written aside and renamed, so that concurrent readers see either table */
+static int table_store(int family, const struct table *t)
+{
+	char path[4096], tmp[4096 + 16];
+	FILE *fp;
+
+	table_path(path, sizeof(path), family, t->info.name);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fp = real_fopen(tmp, "w");
+	if (fp == NULL)
+		return -1;
+	if (fwrite(&t->info, sizeof(t->info), 1, fp) != 1 ||
+	    fwrite(t->entries, 1, t->info.size, fp) != t->info.size) {
+		fclose(fp);
+		unlink(tmp);
+		errno = EIO;
+		return -1;
+	}
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sockopts
+ */
+
+static int shim_get_info(int family, void *val, socklen_t *len)
+{
+	struct ipt_getinfo *info = val;
+	struct table t;
+
+	if (*len != sizeof(*info)) {
+		errno = EINVAL;
+		return -1;
+	}
+	info->name[sizeof(info->name) - 1] = '\0';
+	if (table_load(family, info->name, &t) < 0)
+		return -1;
+	*info = t.info;
+	free(t.entries);
+	return 0;
+}
+
+static int shim_get_entries(int family, void *val, socklen_t *len)
+{
+	struct ipt_get_entries *ge = val;
+	struct table t;
+
+	if (*len < sizeof(*ge) || *len != sizeof(*ge) + ge->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	ge->name[sizeof(ge->name) - 1] = '\0';
+	if (table_load(family, ge->name, &t) < 0)
+		return -1;
+	if (ge->size != t.info.size) {
+		free(t.entries);
+		errno = EAGAIN;
+		return -1;
+	}
+	memcpy(ge->entrytable, t.entries, t.info.size);
+	free(t.entries);
+	return 0;
+}
+
+static int shim_replace(int family, const void *val, socklen_t len)
+{
+	const struct ipt_replace *r = val;
+	struct table old, t;
+	unsigned int i, off;
+	int ret;
+
+	if (len < sizeof(*r) || len != sizeof(*r) + r->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (table_load(family, r->name, &old) < 0)
+		return -1;
+	if (r->valid_hooks != old.info.valid_hooks) {
+		free(old.entries);
+		errno = EINVAL;
+		return -1;
+	}
+	if (r->num_counters != old.info.num_entries) {
+		free(old.entries);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* Hand back the old counters, and start the new ones at zero */
+	for (i = 0, off = 0; i < old.info.num_entries; ++i) {
+		r->counters[i] = *entry_counters(family, old.entries + off);
+		off += entry_next(family, old.entries + off);
+	}
+	free(old.entries);
+
+	memset(&t.info, 0, sizeof(t.info));
+	memcpy(t.info.name, r->name, sizeof(t.info.name));
+	t.info.valid_hooks = r->valid_hooks;
+	memcpy(t.info.hook_entry, r->hook_entry, sizeof(t.info.hook_entry));
+	memcpy(t.info.underflow, r->underflow, sizeof(t.info.underflow));
+	t.info.num_entries = r->num_entries;
+	t.info.size = r->size;
+	t.entries = malloc(r->size);
+	if (t.entries == NULL)
+		return -1;
+	memcpy(t.entries, r->entries, r->size);
+	for (i = 0, off = 0; i < t.info.num_entries && off < t.info.size; ++i) {
+		memset(entry_counters(family, t.entries + off), 0,
+		       sizeof(struct xt_counters));
+		off += entry_next(family, t.entries + off);
+	}
+	ret = table_store(family, &t);
+	free(t.entries);
+	return ret;
+}
+
+static int shim_add_counters(int family, const void *val, socklen_t len)
+{
+	const struct xt_counters_info *ci = val;
+	struct xt_counters *c;
+	struct table t;
+	unsigned int i, off;
+	int ret;
+
+	if (len < sizeof(*ci) ||
+	    len != sizeof(*ci) + ci->num_counters * sizeof(ci->counters[0])) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (table_load(family, ci->name, &t) < 0)
+		return -1;
+	if (ci->num_counters != t.info.num_entries) {
+		free(t.entries);
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0, off = 0; i < t.info.num_entries; ++i) {
+		c = entry_counters(family, t.entries + off);
+		c->pcnt += ci->counters[i].pcnt;
+		c->bcnt += ci->counters[i].bcnt;
+		off += entry_next(family, t.entries + off);
+	}
+	ret = table_store(family, &t);
+	free(t.entries);
+	return ret;
+}
+
+/*
+ * Interposed calls
+ */
+
+int socket(int domain, int type, int protocol)
+{
+	int fd;
+
+	__atomic_fetch_add(&n_socket, 1, __ATOMIC_RELAXED);
+	if (shim_dir == NULL || (domain != AF_INET && domain != AF_INET6) ||
+	    (type & 0xf) != SOCK_RAW || protocol != IPPROTO_RAW)
+		return real_socket(domain, type, protocol);
+
+	fd = real_socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd >= 0 && fd < MAX_FD)
+		fd_family[fd] = domain;
+	return fd;
+}
+
+int close(int fd)
+{
+	if (fd >= 0 && fd < MAX_FD)
+		fd_family[fd] = 0;
+	return real_close(fd);
+}
+
+static int is_revision(int level, int name)
+{
+	if (level == IPPROTO_IPV6)
+		return name == IP6T_SO_GET_REVISION_MATCH ||
+		       name == IP6T_SO_GET_REVISION_TARGET;
+	return level == IPPROTO_IP && (name == IPT_SO_GET_REVISION_MATCH ||
+	                               name == IPT_SO_GET_REVISION_TARGET);
+}
+
+int getsockopt(int fd, int level, int name, void *val, socklen_t *len)
+{
+	int family = fd >= 0 && fd < MAX_FD ? fd_family[fd] : 0;
+
+	__atomic_fetch_add(&n_getsockopt, 1, __ATOMIC_RELAXED);
+	if (is_revision(level, name)) {
+		__atomic_fetch_add(&n_revision, 1, __ATOMIC_RELAXED);
+		if (family == 0)
+			return real_getsockopt(fd, level, name, val, len);
+		if (((struct xt_get_revision *)val)->revision > max_revision) {
+			errno = EPROTONOSUPPORT;
+			return -1;
+		}
+		return 0;
+	}
+	if (family == 0)
+		return real_getsockopt(fd, level, name, val, len);
+
+	/* The IPv6 numbers are the same for these */
+	switch (name) {
+	case IPT_SO_GET_INFO:
+		return shim_get_info(family, val, len);
+	case IPT_SO_GET_ENTRIES:
+		return shim_get_entries(family, val, len);
+	}
+	errno = ENOPROTOOPT;
+	return -1;
+}
+
+int setsockopt(int fd, int level, int name, const void *val, socklen_t len)
+{
+	int family = fd >= 0 && fd < MAX_FD ? fd_family[fd] : 0;
+
+	__atomic_fetch_add(&n_setsockopt, 1, __ATOMIC_RELAXED);
+	if (family == 0)
+		return real_setsockopt(fd, level, name, val, len);
+
+	switch (name) {
+	case IPT_SO_SET_REPLACE:
+		return shim_replace(family, val, len);
+	case IPT_SO_SET_ADD_COUNTERS:
+		return shim_add_counters(family, val, len);
+	}
+	errno = ENOPROTOOPT;
+	return -1;
+}
+
+/* The table names of one family, for /proc/net/ip{,6}_tables_names */
+static FILE *shim_names(const char *prefix)
+{
+	size_t plen = strlen(prefix), size = 0;
+	char *buf = NULL;
+	struct dirent *d;
+	FILE *fp;
+	DIR *dir;
+
+	fp = open_memstream(&buf, &size);
+	if (fp == NULL)
+		return NULL;
+	dir = opendir(shim_dir);
+	while (dir != NULL && (d = readdir(dir)) != NULL)
+		if (strncmp(d->d_name, prefix, plen) == 0 &&
+		    strchr(d->d_name + plen, '.') == NULL)
+			fprintf(fp, "%s\n", d->d_name + plen);
+	if (dir != NULL)
+		closedir(dir);
+	fclose(fp);
+
+	if (size == 0) {
+		free(buf);
+		return real_fopen("/dev/null", "r");
+	}
+	fp = fmemopen(buf, size, "r");
+	if (fp == NULL)
+		free(buf);
+	return fp;
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+	if (shim_dir != NULL) {
+		if (strcmp(path, "/proc/net/ip_tables_names") == 0)
+			return shim_names("ipv4-");
+		if (strcmp(path, "/proc/net/ip6_tables_names") == 0)
+			return shim_names("ipv6-");
+	}
+	return real_fopen(path, mode);
+}
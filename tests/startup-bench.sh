@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Time short iptables invocations, where start-up and extension loading
+# dominate, e.g. to compare a --enable-bundle build with a dlopen one:
+#
+#	startup-bench.sh [-n CALLS] BUILD [BUILD...]
+#
+# Each BUILD runs every command CALLS times against an empty filter
+# table served by sockopt_shim; the average time per call is printed.
+
+. "$(dirname "$0")/common.sh"
+
+calls=200
+while getopts n: opt; do
+	case $opt in
+	n) calls=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n CALLS] BUILD [BUILD...]" >&2
+	exit 2
+fi
+
+xt_shim_init "$1"
+
+# per_call BUILD ARGS...: average time of CALLS runs of iptables ARGS, in us
+per_call()
+{
+	per_call_build=$1
+	shift
+	per_call_start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$calls" ]; do
+		xt "$per_call_build" "$@" >/dev/null 2>&1
+		i=$((i + 1))
+	done
+	per_call_end=$(date +%s%N)
+	echo $(( (per_call_end - per_call_start) / 1000 / calls ))
+}
+
+for build in "$@"; do
+	rm -f "$XT_SHIM_DIR"/ipv4-*
+	list=$(per_call "$build" iptables -S)
+	tcp=$(per_call "$build" iptables -C INPUT -p tcp --dport 22 -j ACCEPT)
+	many=$(per_call "$build" iptables -C INPUT -p tcp \
+		-m multiport --dports 1,2 -m conntrack --ctstate NEW \
+		-m limit --limit 1/s -m comment --comment x -j REJECT)
+	echo "$build: -S $list us, -p tcp $tcp us, 5 extensions $many us"
+done
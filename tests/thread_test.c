@@ -0,0 +1,252 @@
+/*
+ * thread_test.c - parse and print rules from several threads at once
+ *
+ * Each thread takes an xtables context of its own and, round after
+ * round, appends a set of rules with do_command4() to a filter table
+ * handle of its own, prints them back with print_rule4(), and formats
+ * addresses with the xtables_ip{,6}addr_to_numeric and mask helpers.
+ * What every thread prints must be what a single thread prints alone:
+ *
+ *	XT_SHIM_DIR=... LD_PRELOAD=.libs/sockopt_shim.so thread_test [THREADS [ROUNDS]]
+ *
+ * threads.sh runs it that way. Printing goes to one stdout, so each rule
+ * is printed under the stdout lock with the number of its thread in
+ * front, to be sorted out afterwards; the parsing and the formatting
+ * threads do in the meantime are not serialised.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <xtables.h>
+#include <iptables.h>
+#include <libiptc/libiptc.h>
+
+static const char *const rules[][20] = {
+	{"-A", "INPUT", "-s", "10.0.0.1/32", "-p", "tcp", "--dport", "22",
+	 "-j", "ACCEPT"},
+	{"-A", "INPUT", "!", "-d", "192.168.0.0/16", "-i", "eth0",
+	 "-m", "comment", "--comment", "a b", "-j", "DROP"},
+	{"-A", "INPUT", "-p", "udp", "-m", "multiport", "--dports", "53,67:68",
+	 "-m", "conntrack", "--ctstate", "NEW", "-j", "LOG",
+	 "--log-prefix", "new "},
+	{"-A", "INPUT", "-m", "mark", "--mark", "0x1/0xff", "-m", "limit",
+	 "--limit", "5/sec", "-j", "REJECT", "--reject-with",
+	 "icmp-host-prohibited"},
+	{"-A", "INPUT", "-s", "172.16.0.0/12", "-i", "eth+", "-m", "iprange",
+	 "--dst-range", "1.1.1.1-1.1.1.9", "-j", "RETURN"},
+};
+
+#define NRULES	(sizeof(rules) / sizeof(rules[0]))
+
+struct worker {
+	pthread_t thread;
+	unsigned int id, rounds;
+	struct xtables_context *ctx;
+	unsigned int failed;
+};
+
+/* Check the address formatters on addresses derived from @n */
+static unsigned int check_formatters(unsigned int id, unsigned int n)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct in6_addr a6, m6;
+	struct in_addr a, m;
+	unsigned int bad = 0;
+
+	a.s_addr = htonl(0x0a000000 | (n * 2654435761U >> 8));
+	m.s_addr = htonl(~0U << (n % 32));
+	inet_ntop(AF_INET, &a, buf, sizeof(buf));
+	bad += strcmp(xtables_ipaddr_to_numeric(&a), buf) != 0;
+	/* A host mask is left out */
+	if (n % 32 == 0)
+		*buf = '\0';
+	else
+		snprintf(buf, sizeof(buf), "/%u", 32 - n % 32);
+	bad += strcmp(xtables_ipmask_to_numeric(&m), buf) != 0;
+
+	memset(&a6, 0, sizeof(a6));
+	a6.s6_addr[0]  = 0x20;
+	a6.s6_addr[1]  = 0x01;
+	a6.s6_addr[14] = n >> 8;
+	a6.s6_addr[15] = n;
+	memset(&m6, 0xff, 8);
+	memset(&m6.s6_addr[8], 0, 8);
+	inet_ntop(AF_INET6, &a6, buf, sizeof(buf));
+	bad += strcmp(xtables_ip6addr_to_numeric(&a6), buf) != 0;
+	bad += strcmp(xtables_ip6mask_to_numeric(&m6), "/64") != 0;
+	if (bad)
+		fprintf(stderr, "thread %u: %u addresses misformatted\n",
+		        id, bad);
+	return bad;
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	struct xtables_globals globals = iptables_globals;
+	const struct ipt_entry *e;
+	struct iptc_handle *h;
+	unsigned int r, i, n;
+	char words[20][32], *argv[21], *table;
+
+	xtables_context_use(w->ctx);
+	xtables_set_params(&globals);
+
+	for (r = 0; r < w->rounds; ++r) {
+		h = iptc_init("filter");
+		if (h == NULL) {
+			fprintf(stderr, "thread %u: iptc_init: %s\n",
+			        w->id, iptc_strerror(errno));
+			++w->failed;
+			break;
+		}
+		for (i = 0; i < NRULES; ++i) {
+			/* do_command4 may write to its arguments */
+			argv[0] = "iptables";
+			for (n = 0; rules[i][n] != NULL; ++n) {
+				strcpy(words[n], rules[i][n]);
+				argv[n + 1] = words[n];
+			}
+			argv[n + 1] = NULL;
+			table = "filter";
+			if (!do_command4(n + 1, argv, &table, &h)) {
+				fprintf(stderr, "thread %u: rule %u: %s\n",
+				        w->id, i, iptc_strerror(errno));
+				++w->failed;
+			}
+			w->failed += check_formatters(w->id, r * NRULES + i);
+		}
+
+		flockfile(stdout);
+		for (e = iptc_first_rule("INPUT", h); e != NULL;
+		     e = iptc_next_rule(e, h)) {
+			printf("%u ", w->id);
+			print_rule4(e, h, "INPUT", 0);
+		}
+		funlockfile(stdout);
+		iptc_free(h);
+	}
+	return NULL;
+}
+
+/* The output of the thread numbered @id, taken out of @out */
+static char *thread_output(const char *out, unsigned int id)
+{
+	size_t size = strlen(out) + 1, len = 0;
+	char prefix[16], *text;
+	const char *p, *nl;
+	int plen;
+
+	text = malloc(size);
+	if (text == NULL)
+		return NULL;
+	plen = snprintf(prefix, sizeof(prefix), "%u ", id);
+	for (p = out; *p != '\0'; p = nl + 1) {
+		nl = strchr(p, '\n');
+		if (nl == NULL)
+			break;
+		if (strncmp(p, prefix, plen) != 0)
+			continue;
+		memcpy(text + len, p + plen, nl + 1 - p - plen);
+		len += nl + 1 - p - plen;
+	}
+	text[len] = '\0';
+	return text;
+}
+
+/* Run @count workers of @rounds rounds each, and return what they print */
+static char *run_workers(struct worker *w, unsigned int count,
+                         unsigned int rounds, unsigned int *failed)
+{
+	FILE *stdout_saved = stdout;
+	size_t size;
+	char *out;
+	unsigned int i;
+
+	stdout = open_memstream(&out, &size);
+	if (stdout == NULL) {
+		stdout = stdout_saved;
+		perror("open_memstream");
+		exit(1);
+	}
+	for (i = 0; i < count; ++i) {
+		w[i].id     = i;
+		w[i].rounds = rounds;
+		w[i].failed = 0;
+		w[i].ctx    = xtables_context_new();
+		if (w[i].ctx == NULL ||
+		    pthread_create(&w[i].thread, NULL, run, &w[i]) != 0) {
+			perror("thread_test");
+			exit(1);
+		}
+	}
+	for (i = 0; i < count; ++i) {
+		pthread_join(w[i].thread, NULL);
+		xtables_context_free(w[i].ctx);
+		*failed += w[i].failed;
+	}
+	fclose(stdout);
+	stdout = stdout_saved;
+	return out;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int threads = 4, rounds = 50, failed = 0, i;
+	char *serial, *parallel, *ref, *text;
+	struct worker *w;
+
+	if (argc > 1)
+		threads = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		rounds = strtoul(argv[2], NULL, 0);
+	if (threads == 0 || rounds == 0) {
+		fprintf(stderr, "Usage: %s [threads [rounds]]\n", argv[0]);
+		return 2;
+	}
+
+	iptables_globals.program_name = "thread_test";
+	if (xtables_init_all(&iptables_globals, NFPROTO_IPV4) < 0)
+		return 1;
+#if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+	init_extensions();
+	init_extensions4();
+#elif defined(XTABLES_BUNDLE)
+	xtables_set_bundle(xtables_bundle, xtables_bundle4);
+#endif
+
+	w = calloc(threads, sizeof(*w));
+	if (w == NULL)
+		return 1;
+	serial   = run_workers(w, 1, rounds, &failed);
+	parallel = run_workers(w, threads, rounds, &failed);
+
+	ref = thread_output(serial, 0);
+	if (ref == NULL || *ref == '\0') {
+		fprintf(stderr, "thread_test: no rules printed\n");
+		return 1;
+	}
+	for (i = 0; i < threads; ++i) {
+		text = thread_output(parallel, i);
+		if (text == NULL || strcmp(text, ref) != 0) {
+			fprintf(stderr, "thread %u of %u printed other rules:\n%s",
+			        i, threads, text != NULL ? text : "");
+			++failed;
+		}
+		free(text);
+	}
+	printf("%u threads, %u rounds of %zu rules: %s\n", threads, rounds,
+	       NRULES, failed ? "FAILED" : "same as one thread");
+	free(ref);
+	free(serial);
+	free(parallel);
+	free(w);
+	return failed != 0;
+}
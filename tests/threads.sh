@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Check that rules parsed and printed by several threads at once come out
+# as from a single thread, on tables served by sockopt_shim:
+#
+#	threads.sh [-t THREADS] [-n ROUNDS] [BUILD]
+#
+# BUILD defaults to the parent directory, as when run by "make check",
+# and must hold thread_test, built there by "make check".
+
+. "$(dirname "$0")/common.sh"
+
+threads=4
+rounds=50
+while getopts t:n: opt; do
+	case $opt in
+	t) threads=$OPTARG ;;
+	n) rounds=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+build=$(cd "${1:-..}" && pwd) || exit 2
+xt_shim_init "$build"
+
+env $XT_ENV LD_PRELOAD=$XT_PRELOAD XTABLES_LIBDIR="$build/extensions" \
+    "$build/tests/thread_test" "$threads" "$rounds"